@@ -1,12 +1,16 @@
 
+#include <fcntl.h>
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <vector>
 
+#include "hostplatform.h"
 #include "runslice.h"
 
 // Just enough ACPI-CA headers to define the tables
@@ -18,9 +22,13 @@ static const char* ACPI_OEM_ID = "SLICER";
 static const char* ACPI_OEM_TABLE_ID = "SLICE   ";
 static const char* ASL_COMPILER_ID = "SLDR";
 
+// End of the buffer that build_acpi() is building tables in.
+static const char* tables_end;
+
 template<typename T>
 static inline T* alloc(uintptr_t& loadaddr_phys, char*& loadaddr_virt)
 {
+    assert(loadaddr_virt + sizeof(T) <= tables_end);
     T* t = reinterpret_cast<T*>(loadaddr_virt);
     memset(t, 0, sizeof(T));
     loadaddr_virt += sizeof(T);
@@ -82,7 +90,7 @@ static uintptr_t emit_fadt(
 static uintptr_t emit_madt(
     uintptr_t& loadaddr_phys,
     char*& loadaddr_virt,
-    const std::vector<uint32_t>& apic_ids)
+    const Options& options)
 {
     constexpr uint32_t APIC_DEFAULT_ADDRESS = 0xfee00000;
 
@@ -93,7 +101,7 @@ static uintptr_t emit_madt(
     madt->Flags = 0; // 8259 PICs not present
 
     uint32_t uid = 0;
-    for (uint32_t apic_id : apic_ids) {
+    for (uint32_t apic_id : options.apic_ids) {
         acpi_madt_local_x2apic* lapic = alloc<acpi_madt_local_x2apic>(loadaddr_phys, loadaddr_virt);
         lapic->Header.Type = ACPI_MADT_TYPE_LOCAL_X2APIC;
         lapic->Header.Length = sizeof(*lapic);
@@ -102,37 +110,64 @@ static uintptr_t emit_madt(
         lapic->LapicFlags = ACPI_MADT_ENABLED;
     }
 
+    // Spare CPUs are disabled until hot-added, but the guest must know they may appear.
+    uid = HOTPLUG_CPU_UID_BASE;
+    for (uint32_t apic_id : options.spare_apic_ids) {
+        acpi_madt_local_x2apic* lapic = alloc<acpi_madt_local_x2apic>(loadaddr_phys, loadaddr_virt);
+        lapic->Header.Type = ACPI_MADT_TYPE_LOCAL_X2APIC;
+        lapic->Header.Length = sizeof(*lapic);
+        lapic->LocalApicId = apic_id;
+        lapic->Uid = uid++;
+        lapic->LapicFlags = ACPI_MADT_ONLINE_CAPABLE;
+    }
+
+    // The IOAPIC carrying the hotplug GED's interrupt.
+    if (options.hotplug_ioapic) {
+        acpi_madt_io_apic* ioapic = alloc<acpi_madt_io_apic>(loadaddr_phys, loadaddr_virt);
+        ioapic->Header.Type = ACPI_MADT_TYPE_IO_APIC;
+        ioapic->Header.Length = sizeof(*ioapic);
+        ioapic->Address = options.hotplug_ioapic;
+        ioapic->GlobalIrqBase = 0;
+    }
+
     fill_header(&madt->Header, ACPI_SIG_MADT, loadaddr_virt - reinterpret_cast<char*>(madt), 5);
 
     return madt_pa;
 }
 
+static uintptr_t emit_ssdt(
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt,
+    const std::vector<uint8_t>& aml)
+{
+    uintptr_t ssdt_pa = loadaddr_phys;
+    ACPI_TABLE_HEADER* ssdt = alloc<ACPI_TABLE_HEADER>(loadaddr_phys, loadaddr_virt);
+
+    assert(loadaddr_virt + aml.size() <= tables_end);
+    memcpy(loadaddr_virt, aml.data(), aml.size());
+    loadaddr_phys += aml.size();
+    loadaddr_virt += aml.size();
+
+    fill_header(ssdt, ACPI_SIG_SSDT, sizeof(*ssdt) + aml.size(), 2);
+
+    return ssdt_pa;
+}
+
 static uintptr_t emit_mcfg(
     uintptr_t& loadaddr_phys,
     char*& loadaddr_virt,
     uintptr_t& mmconfig_base)
 {
-    std::ifstream mcfg_file("/sys/firmware/acpi/tables/MCFG", std::ios::binary | std::ios::in);
-    if (!mcfg_file.is_open()) {
-        perror("Failed to open host MCFG file");
-        return 0;
-    }
-
-    mcfg_file.seekg(0, std::ios::end);
-    std::vector<char> mcfg_data(mcfg_file.tellg());
-    mcfg_file.seekg(0, std::ios::beg);
-    if (!mcfg_file.read(mcfg_data.data(), mcfg_data.size())) {
-        perror("Failed to read host MCFG file");
+    const HostPlatform* platform = host_platform();
+    if (platform == nullptr)
         return 0;
-    }
 
-    const acpi_table_mcfg* const mcfg = reinterpret_cast<acpi_table_mcfg*>(mcfg_data.data());
+    // Already validated when the snapshot was taken.
+    const PlatformView<uint8_t> mcfg_data = platform->mcfg();
+    const acpi_table_mcfg* const mcfg = reinterpret_cast<const acpi_table_mcfg*>(mcfg_data.begin());
 
     if (mcfg_data.size() < sizeof(*mcfg) ||
-        0 != memcmp(mcfg->Header.Signature, ACPI_SIG_MCFG, sizeof(mcfg->Header.Signature)) ||
-        mcfg->Header.Length != mcfg_data.size() ||
-        (mcfg_data.size() - sizeof(*mcfg)) % sizeof(acpi_mcfg_allocation) != 0 ||
-        0 != acpi_checksum(mcfg, mcfg_data.size()))
+        (mcfg_data.size() - sizeof(*mcfg)) % sizeof(acpi_mcfg_allocation) != 0)
     {
         fprintf(stderr, "Invalid host MCFG file\n");
         return 0;
@@ -156,7 +191,8 @@ static uintptr_t emit_mcfg(
 
     uintptr_t mcfg_pa = loadaddr_phys;
 
-    memcpy(loadaddr_virt, mcfg_data.data(), mcfg_data.size());
+    assert(loadaddr_virt + mcfg_data.size() <= tables_end);
+    memcpy(loadaddr_virt, mcfg_data.begin(), mcfg_data.size());
 
     loadaddr_phys += mcfg_data.size();
     loadaddr_virt += mcfg_data.size();
@@ -164,30 +200,157 @@ static uintptr_t emit_mcfg(
     return mcfg_pa;
 }
 
-uintptr_t build_acpi(
-    const Options& options,
+// Far memory is proximity domain 1, with no CPUs; everything else is domain 0.
+static uintptr_t emit_srat(
     uintptr_t& loadaddr_phys,
     char*& loadaddr_virt,
-    uintptr_t& mmconfig_base)
+    const Options& options)
+{
+    uintptr_t srat_pa = loadaddr_phys;
+    acpi_table_srat* srat = alloc<acpi_table_srat>(loadaddr_phys, loadaddr_virt);
+    srat->TableRevision = 1;
+
+    for (const auto* ids : { &options.apic_ids, &options.spare_apic_ids }) {
+        for (uint32_t apic_id : *ids) {
+            acpi_srat_x2apic_cpu_affinity* cpu = alloc<acpi_srat_x2apic_cpu_affinity>(loadaddr_phys, loadaddr_virt);
+            cpu->Header.Type = ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY;
+            cpu->Header.Length = sizeof(*cpu);
+            cpu->ProximityDomain = 0;
+            cpu->ApicId = apic_id;
+            cpu->Flags = ACPI_SRAT_CPU_ENABLED;
+        }
+    }
+
+    auto add_memory = [&](uint64_t base, uint64_t size, uint32_t pxm) {
+        acpi_srat_mem_affinity* mem = alloc<acpi_srat_mem_affinity>(loadaddr_phys, loadaddr_virt);
+        mem->Header.Type = ACPI_SRAT_TYPE_MEMORY_AFFINITY;
+        mem->Header.Length = sizeof(*mem);
+        mem->ProximityDomain = pxm;
+        mem->BaseAddress = base;
+        mem->Length = size;
+        mem->Flags = ACPI_SRAT_MEM_ENABLED;
+    };
+
+    // Linux gives up on NUMA unless all of its memory is covered, including the first 1MiB.
+    add_memory(0, 0x100000, 0);
+    add_memory(options.rambase, options.ramsize, 0);
+    for (const auto& [base, size] : options.far_mem)
+        add_memory(base, size, 1);
+
+    fill_header(&srat->Header, ACPI_SIG_SRAT, loadaddr_virt - reinterpret_cast<char*>(srat), 3);
+
+    return srat_pa;
+}
+
+static uintptr_t emit_slit(
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt,
+    const FarMemoryTopology& topology)
+{
+    uintptr_t slit_pa = loadaddr_phys;
+    acpi_table_slit* slit = alloc<acpi_table_slit>(loadaddr_phys, loadaddr_virt);
+
+    // The first entry is included in the size of the struct.
+    static_assert(sizeof(slit->Entry) == 1);
+    alloc<uint8_t[3]>(loadaddr_phys, loadaddr_virt);
+    slit->LocalityCount = 2;
+    slit->Entry[0] = slit->Entry[3] = 10;
+    slit->Entry[1] = slit->Entry[2] = topology.distance;
+
+    fill_header(&slit->Header, ACPI_SIG_SLIT, loadaddr_virt - reinterpret_cast<char*>(slit), 1);
+
+    return slit_pa;
+}
+
+// The host's latency and bandwidth figures, from the slice's CPUs to both domains.
+static uintptr_t emit_hmat(
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt,
+    const FarMemoryTopology& topology)
+{
+    uintptr_t hmat_pa = loadaddr_phys;
+    acpi_table_hmat* hmat = alloc<acpi_table_hmat>(loadaddr_phys, loadaddr_virt);
+
+    for (uint32_t pxm : { 0, 1 }) {
+        acpi_hmat_proximity_domain* domain = alloc<acpi_hmat_proximity_domain>(loadaddr_phys, loadaddr_virt);
+        domain->Header.Type = ACPI_HMAT_TYPE_ADDRESS_RANGE;
+        domain->Header.Length = sizeof(*domain);
+        domain->Flags = pxm == 0 ? ACPI_HMAT_INITIATOR_PD_VALID : 0;
+        domain->InitiatorPD = 0;
+        domain->MemoryPD = pxm;
+    }
+
+    for (const HmatLocality& figure : topology.hmat) {
+        acpi_hmat_locality* locality = alloc<acpi_hmat_locality>(loadaddr_phys, loadaddr_virt);
+        locality->Header.Type = ACPI_HMAT_TYPE_LOCALITY;
+        locality->Flags = ACPI_HMAT_MEMORY;
+        locality->DataType = figure.data_type;
+        locality->NumberOfInitiatorPDs = 1;
+        locality->NumberOfTargetPDs = 2;
+        locality->EntryBaseUnit = figure.base_unit;
+
+        // initiator 0; targets 0 and 1; then an entry for each target
+        uint32_t* domains = alloc<uint32_t[3]>(loadaddr_phys, loadaddr_virt)[0];
+        domains[0] = 0;
+        domains[1] = 0;
+        domains[2] = 1;
+        uint16_t* entries = alloc<uint16_t[2]>(loadaddr_phys, loadaddr_virt)[0];
+        entries[0] = figure.local;
+        entries[1] = figure.far;
+        locality->Header.Length = loadaddr_virt - reinterpret_cast<char*>(locality);
+    }
+
+    fill_header(&hmat->Header, ACPI_SIG_HMAT, loadaddr_virt - reinterpret_cast<char*>(hmat), 2);
+
+    return hmat_pa;
+}
+
+// Build the ACPI tables, as they will appear at base_pa in slice RAM, in tables. They are built
+// off to the side, so that the caller can check where they fit before copying them in.
+uintptr_t build_acpi(
+    const Options& options,
+    uintptr_t base_pa,
+    std::vector<char>& tables,
+    uintptr_t& mmconfig_base,
+    const PreloadedAcpi& preloaded)
 {
-    uintptr_t dsdt_pa = 0;
+    uintptr_t dsdt_pa = preloaded.dsdt;
 
-    if (options.dsdt_path != nullptr)
+    size_t dsdt_size = 0;
+    std::ifstream dsdt_file;
+    if (dsdt_pa == 0 && options.dsdt_path != nullptr)
     {
-        std::ifstream dsdt_file(options.dsdt_path, std::ios::binary | std::ios::in);
+        dsdt_file.open(options.dsdt_path, std::ios::binary | std::ios::in);
         if (!dsdt_file.is_open()) {
             perror("Failed to open DSDT AML file");
             return 0;
         }
 
         dsdt_file.seekg(0, std::ios::end);
-        size_t dsdt_size = dsdt_file.tellg();
+        dsdt_size = dsdt_file.tellg();
+    }
+
+    const std::vector<uint8_t> hotplug_ssdt = options.hotplug_ioapic ? hotplug_aml(options) : std::vector<uint8_t>();
+    const std::vector<uint8_t> dataset_ssdt = options.datasets.empty() ? std::vector<uint8_t>() : dataset_aml(options);
 
-        if (!read_to_devmem(dsdt_file, 0, loadaddr_virt, dsdt_size)) {
+    // Far more than the other tables need: they are a few hundred bytes, plus a few dozen for each
+    // CPU and memory range.
+    const size_t cpus = options.apic_ids.size() + options.spare_apic_ids.size();
+    tables.assign(dsdt_size + hotplug_ssdt.size() + dataset_ssdt.size() + 0x10000 + 0x100 * (cpus + options.far_mem.size()), 0);
+    tables_end = tables.data() + tables.size();
+    uintptr_t loadaddr_phys = base_pa;
+    char* loadaddr_virt = tables.data();
+
+    if (dsdt_size != 0)
+    {
+        Sha256 dsdt_hash;
+        if (!read_to_devmem(options.dsdt_path, 0, loadaddr_virt, dsdt_size, &dsdt_hash)) {
             perror("Failed to read DSDT AML file");
             return 0;
         }
 
+        record_measurement("dsdt", options.dsdt_path, dsdt_hash.finish());
+
         dsdt_pa = loadaddr_phys;
 
         loadaddr_virt += dsdt_size;
@@ -195,12 +358,30 @@ uintptr_t build_acpi(
     }
 
     uintptr_t fadt_pa = emit_fadt(loadaddr_phys, loadaddr_virt, dsdt_pa);
-    uintptr_t madt_pa = emit_madt(loadaddr_phys, loadaddr_virt, options.apic_ids);
+    uintptr_t madt_pa = emit_madt(loadaddr_phys, loadaddr_virt, options);
     uintptr_t mcfg_pa = emit_mcfg(loadaddr_phys, loadaddr_virt, mmconfig_base);
     if (mcfg_pa == 0) {
         return 0;
     }
 
+    uintptr_t ssdt_pa = 0, dataset_ssdt_pa = 0;
+    if (options.hotplug_ioapic)
+        ssdt_pa = emit_ssdt(loadaddr_phys, loadaddr_virt, hotplug_ssdt);
+    if (!options.datasets.empty())
+        dataset_ssdt_pa = emit_ssdt(loadaddr_phys, loadaddr_virt, dataset_ssdt);
+
+    uintptr_t srat_pa = 0, slit_pa = 0, hmat_pa = 0;
+    if (!options.far_mem.empty()) {
+        FarMemoryTopology topology;
+        if (!get_far_memory_topology(options, topology))
+            return 0;
+
+        srat_pa = emit_srat(loadaddr_phys, loadaddr_virt, options);
+        slit_pa = emit_slit(loadaddr_phys, loadaddr_virt, topology);
+        if (!topology.hmat.empty())
+            hmat_pa = emit_hmat(loadaddr_phys, loadaddr_virt, topology);
+    }
+
     // Emit XSDT
     uintptr_t xsdt_pa = loadaddr_phys;
     acpi_table_xsdt* xsdt = alloc<acpi_table_xsdt>(loadaddr_phys, loadaddr_virt);
@@ -216,6 +397,18 @@ uintptr_t build_acpi(
     alloc<uint64_t>(loadaddr_phys, loadaddr_virt);
     xsdt->TableOffsetEntry[i++] = mcfg_pa;
 
+    for (uintptr_t pa : { ssdt_pa, dataset_ssdt_pa, srat_pa, slit_pa, hmat_pa }) {
+        if (pa != 0) {
+            alloc<uint64_t>(loadaddr_phys, loadaddr_virt);
+            xsdt->TableOffsetEntry[i++] = pa;
+        }
+    }
+
+    for (uintptr_t pa : preloaded.ssdts) {
+        alloc<uint64_t>(loadaddr_phys, loadaddr_virt);
+        xsdt->TableOffsetEntry[i++] = pa;
+    }
+
     fill_header(&xsdt->Header, ACPI_SIG_XSDT, loadaddr_virt - reinterpret_cast<char*>(xsdt), 1);
 
     // Emit RSDP
@@ -229,33 +422,66 @@ uintptr_t build_acpi(
     rsdp->XsdtPhysicalAddress = xsdt_pa;
     rsdp->ExtendedChecksum = acpi_checksum(rsdp, sizeof(*rsdp));
 
+    tables.resize(loadaddr_virt - tables.data());
+    tables_end = nullptr;
     return rsdp_pa;
 }
 
-bool acpi_get_host_apic_ids(
-    std::vector<uint32_t>& apic_ids)
+// Read and validate one of the host's ACPI tables, e.g. "APIC" for the MADT.
+bool acpi_read_host_table(const char* signature, std::vector<uint8_t>& data)
 {
-    std::ifstream madt_file("/sys/firmware/acpi/tables/APIC", std::ios::binary | std::ios::in);
-    if (!madt_file.is_open()) {
-        perror("Failed to open host MADT file");
+    const std::string path = host_path(std::string("/sys/firmware/acpi/tables/") + signature);
+    std::ifstream file(path, std::ios::binary | std::ios::in);
+    if (!file.is_open()) {
+        fprintf(stderr, "Failed to open host %s file: %s\n", signature, strerror(errno));
         return false;
     }
 
-    madt_file.seekg(0, std::ios::end);
-    std::vector<char> madt_data(madt_file.tellg());
-    madt_file.seekg(0, std::ios::beg);
-    if (!madt_file.read(madt_data.data(), madt_data.size())) {
-        perror("Failed to read host MADT file");
+    file.seekg(0, std::ios::end);
+    data.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+    if (!file.read(reinterpret_cast<char*>(data.data()), data.size())) {
+        fprintf(stderr, "Failed to read host %s file\n", signature);
         return false;
     }
 
-    const acpi_table_madt* const madt = reinterpret_cast<acpi_table_madt*>(madt_data.data());
+    const ACPI_TABLE_HEADER* const header = reinterpret_cast<const ACPI_TABLE_HEADER*>(data.data());
 
-    if (madt_data.size() < sizeof(*madt) ||
-        0 != memcmp(madt->Header.Signature, ACPI_SIG_MADT, sizeof(madt->Header.Signature)) ||
-        madt->Header.Length != madt_data.size() ||
-        0 != acpi_checksum(madt, madt_data.size()))
+    if (data.size() < sizeof(*header) ||
+        0 != memcmp(header->Signature, signature, sizeof(header->Signature)) ||
+        header->Length != data.size() ||
+        0 != acpi_checksum(header, data.size()))
     {
+        fprintf(stderr, "Invalid host %s file\n", signature);
+        return false;
+    }
+
+    return true;
+}
+
+// Read just the length and checksum of a host table, to tell whether it has changed.
+bool acpi_read_host_table_id(const char* signature, uint32_t& length, uint8_t& checksum)
+{
+    const std::string path = host_path(std::string("/sys/firmware/acpi/tables/") + signature);
+    AutoFd fd = open(path.c_str(), O_RDONLY);
+    ACPI_TABLE_HEADER header;
+    if (fd < 0 || read(fd, &header, sizeof(header)) != sizeof(header))
+        return false;
+
+    length = header.Length;
+    checksum = header.Checksum;
+    return true;
+}
+
+// Parse the enabled CPUs' APIC IDs, in MADT order, from a (validated) host MADT.
+bool acpi_get_host_apic_ids(
+    const std::vector<uint8_t>& madt_data,
+    std::vector<uint32_t>& apic_ids)
+{
+    const acpi_table_madt* const madt = reinterpret_cast<const acpi_table_madt*>(madt_data.data());
+    const char* const madt_end = reinterpret_cast<const char*>(madt_data.data()) + madt_data.size();
+
+    if (madt_data.size() < sizeof(*madt)) {
         fprintf(stderr, "Invalid host MADT file\n");
         return false;
     }
@@ -264,9 +490,9 @@ bool acpi_get_host_apic_ids(
 
     for (
         const ACPI_SUBTABLE_HEADER* entry = reinterpret_cast<const ACPI_SUBTABLE_HEADER*>(madt + 1);
-        reinterpret_cast<const char*>(entry) <= madt_data.data() + madt_data.size()
-            && reinterpret_cast<const char*>(entry) + sizeof(*entry) <= madt_data.data() + madt_data.size()
-            && reinterpret_cast<const char*>(entry) + entry->Length <= madt_data.data() + madt_data.size();
+        reinterpret_cast<const char*>(entry) <= madt_end
+            && reinterpret_cast<const char*>(entry) + sizeof(*entry) <= madt_end
+            && reinterpret_cast<const char*>(entry) + entry->Length <= madt_end;
         entry = reinterpret_cast<const ACPI_SUBTABLE_HEADER*>(reinterpret_cast<const char*>(entry) + entry->Length))
     {
         switch (entry->Type)
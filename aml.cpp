@@ -0,0 +1,270 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "aml.h"
+
+static constexpr uint8_t AML_ZERO_OP = 0x00;
+static constexpr uint8_t AML_ONE_OP = 0x01;
+static constexpr uint8_t AML_NAME_OP = 0x08;
+static constexpr uint8_t AML_BYTE_PREFIX = 0x0a;
+static constexpr uint8_t AML_WORD_PREFIX = 0x0b;
+static constexpr uint8_t AML_DWORD_PREFIX = 0x0c;
+static constexpr uint8_t AML_STRING_PREFIX = 0x0d;
+static constexpr uint8_t AML_QWORD_PREFIX = 0x0e;
+static constexpr uint8_t AML_SCOPE_OP = 0x10;
+static constexpr uint8_t AML_BUFFER_OP = 0x11;
+static constexpr uint8_t AML_METHOD_OP = 0x14;
+static constexpr uint8_t AML_ROOT_CHAR = 0x5c;
+static constexpr uint8_t AML_EXT_OP_PREFIX = 0x5b;
+static constexpr uint8_t AML_EXT_REGION_OP = 0x80;
+static constexpr uint8_t AML_EXT_FIELD_OP = 0x81;
+static constexpr uint8_t AML_EXT_DEVICE_OP = 0x82;
+static constexpr uint8_t AML_LOCAL0_OP = 0x60;
+static constexpr uint8_t AML_ARG0_OP = 0x68;
+static constexpr uint8_t AML_STORE_OP = 0x70;
+static constexpr uint8_t AML_ADD_OP = 0x72;
+static constexpr uint8_t AML_SUBTRACT_OP = 0x74;
+static constexpr uint8_t AML_AND_OP = 0x7b;
+static constexpr uint8_t AML_NOTIFY_OP = 0x86;
+static constexpr uint8_t AML_CREATE_DWORD_FIELD_OP = 0x8a;
+static constexpr uint8_t AML_CREATE_QWORD_FIELD_OP = 0x8f;
+static constexpr uint8_t AML_IF_OP = 0xa0;
+static constexpr uint8_t AML_RETURN_OP = 0xa4;
+
+static void append(Aml& out, const Aml& in)
+{
+    out.insert(out.end(), in.begin(), in.end());
+}
+
+// Encode a PkgLength. For packages, the encoded length includes the PkgLength bytes themselves;
+// for field elements, it is just the number of bits.
+static Aml pkg_length(size_t length, bool includes_self)
+{
+    size_t bytes = 1;
+    if (includes_self) {
+        while (bytes < 4 && length + bytes > (bytes == 1 ? 0x3f : (1ul << (4 + 8 * (bytes - 1))) - 1))
+            bytes++;
+        length += bytes;
+    } else {
+        while (bytes < 4 && length > (bytes == 1 ? 0x3f : (1ul << (4 + 8 * (bytes - 1))) - 1))
+            bytes++;
+    }
+    assert(length < (1ul << 28));
+
+    if (bytes == 1)
+        return { static_cast<uint8_t>(length) };
+
+    Aml out = { static_cast<uint8_t>(((bytes - 1) << 6) | (length & 0xf)) };
+    for (size_t i = 1; i < bytes; i++)
+        out.push_back(static_cast<uint8_t>(length >> (4 + 8 * (i - 1))));
+
+    return out;
+}
+
+// Wrap the given contents (everything following the PkgLength) in a package.
+static Aml package(const Aml& opcode, const Aml& contents)
+{
+    Aml out = opcode;
+    append(out, pkg_length(contents.size(), true));
+    append(out, contents);
+    return out;
+}
+
+static Aml concat(const std::vector<Aml>& terms)
+{
+    Aml out;
+    for (const Aml& term : terms)
+        append(out, term);
+    return out;
+}
+
+static Aml name_seg(const std::string& name)
+{
+    assert(name.size() == 4);
+    return Aml(name.begin(), name.end());
+}
+
+Aml aml_name(const std::string& name)
+{
+    if (!name.empty() && name[0] == '\\') {
+        Aml out = { AML_ROOT_CHAR };
+        append(out, name_seg(name.substr(1)));
+        return out;
+    }
+
+    return name_seg(name);
+}
+
+Aml aml_int(uint64_t value)
+{
+    Aml out;
+    if (value == 0)
+        return { AML_ZERO_OP };
+    else if (value == 1)
+        return { AML_ONE_OP };
+    else if (value <= UINT8_MAX)
+        out = { AML_BYTE_PREFIX };
+    else if (value <= UINT16_MAX)
+        out = { AML_WORD_PREFIX };
+    else if (value <= UINT32_MAX)
+        out = { AML_DWORD_PREFIX };
+    else
+        out = { AML_QWORD_PREFIX };
+
+    const size_t size = out[0] == AML_BYTE_PREFIX ? 1 : out[0] == AML_WORD_PREFIX ? 2 : out[0] == AML_DWORD_PREFIX ? 4 : 8;
+    for (size_t i = 0; i < size; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+
+    return out;
+}
+
+Aml aml_string(const char* str)
+{
+    const size_t length = strlen(str);
+    Aml out(1 + length + 1, 0);
+    out[0] = AML_STRING_PREFIX;
+    memcpy(&out[1], str, length);
+    return out;
+}
+
+// Compressed EISA ID, e.g. "PNP0C80": three letters of 5 bits each, then four hex digits,
+// stored big-endian.
+Aml aml_eisaid(const char* id)
+{
+    assert(strlen(id) == 7);
+    const uint32_t value = (id[0] - 0x40) << 26 | (id[1] - 0x40) << 21 | (id[2] - 0x40) << 16
+        | strtoul(id + 3, nullptr, 16);
+    return aml_int(__builtin_bswap32(value));
+}
+
+Aml aml_buffer(const std::vector<uint8_t>& bytes)
+{
+    Aml contents = aml_int(bytes.size());
+    append(contents, bytes);
+    return package({ AML_BUFFER_OP }, contents);
+}
+
+Aml aml_local(unsigned n)
+{
+    assert(n < 8);
+    return { static_cast<uint8_t>(AML_LOCAL0_OP + n) };
+}
+
+Aml aml_arg(unsigned n)
+{
+    assert(n < 7);
+    return { static_cast<uint8_t>(AML_ARG0_OP + n) };
+}
+
+Aml aml_scope(const std::string& name, const std::vector<Aml>& terms)
+{
+    Aml contents = aml_name(name);
+    append(contents, concat(terms));
+    return package({ AML_SCOPE_OP }, contents);
+}
+
+Aml aml_device(const std::string& name, const std::vector<Aml>& terms)
+{
+    Aml contents = aml_name(name);
+    append(contents, concat(terms));
+    return package({ AML_EXT_OP_PREFIX, AML_EXT_DEVICE_OP }, contents);
+}
+
+Aml aml_name_decl(const std::string& name, const Aml& value)
+{
+    Aml out = { AML_NAME_OP };
+    append(out, aml_name(name));
+    append(out, value);
+    return out;
+}
+
+Aml aml_method(const std::string& name, unsigned args, bool serialized, const std::vector<Aml>& terms)
+{
+    assert(args < 8);
+    Aml contents = aml_name(name);
+    contents.push_back(static_cast<uint8_t>(args | (serialized ? 0x8 : 0)));
+    append(contents, concat(terms));
+    return package({ AML_METHOD_OP }, contents);
+}
+
+Aml aml_operation_region(const std::string& name, uint8_t space, uint64_t offset, uint64_t length)
+{
+    Aml out = { AML_EXT_OP_PREFIX, AML_EXT_REGION_OP };
+    append(out, aml_name(name));
+    out.push_back(space);
+    append(out, aml_int(offset));
+    append(out, aml_int(length));
+    return out;
+}
+
+Aml aml_field(const std::string& region, uint8_t flags, const std::vector<std::pair<std::string, unsigned>>& fields)
+{
+    Aml contents = aml_name(region);
+    contents.push_back(flags);
+    for (const auto& [name, bits] : fields) {
+        if (name.empty())
+            contents.push_back(0); // ReservedField
+        else
+            append(contents, name_seg(name));
+        append(contents, pkg_length(bits, false));
+    }
+
+    return package({ AML_EXT_OP_PREFIX, AML_EXT_FIELD_OP }, contents);
+}
+
+static Aml create_field(uint8_t opcode, const Aml& buffer, unsigned offset, const std::string& name)
+{
+    Aml out = { opcode };
+    append(out, buffer);
+    append(out, aml_int(offset));
+    append(out, aml_name(name));
+    return out;
+}
+
+Aml aml_create_dword_field(const Aml& buffer, unsigned offset, const std::string& name)
+{
+    return create_field(AML_CREATE_DWORD_FIELD_OP, buffer, offset, name);
+}
+
+Aml aml_create_qword_field(const Aml& buffer, unsigned offset, const std::string& name)
+{
+    return create_field(AML_CREATE_QWORD_FIELD_OP, buffer, offset, name);
+}
+
+Aml aml_store(const Aml& value, const Aml& target)
+{
+    return concat({ { AML_STORE_OP }, value, target });
+}
+
+Aml aml_add(const Aml& a, const Aml& b, const Aml& target)
+{
+    return concat({ { AML_ADD_OP }, a, b, target });
+}
+
+Aml aml_subtract(const Aml& a, const Aml& b, const Aml& target)
+{
+    return concat({ { AML_SUBTRACT_OP }, a, b, target });
+}
+
+Aml aml_and(const Aml& a, const Aml& b, const Aml& target)
+{
+    return concat({ { AML_AND_OP }, a, b, target });
+}
+
+Aml aml_if(const Aml& predicate, const std::vector<Aml>& terms)
+{
+    Aml contents = predicate;
+    append(contents, concat(terms));
+    return package({ AML_IF_OP }, contents);
+}
+
+Aml aml_notify(const Aml& object, const Aml& value)
+{
+    return concat({ { AML_NOTIFY_OP }, object, value });
+}
+
+Aml aml_return(const Aml& value)
+{
+    return concat({ { AML_RETURN_OP }, value });
+}
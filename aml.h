@@ -0,0 +1,45 @@
+#ifndef AML_H
+#define AML_H 1
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Just enough of an AML encoder to generate the hotplug SSDT at launch. Each function returns
+// the encoding of one term; terms are combined by passing lists of them to the enclosing scope,
+// device, method or If. Names are single 4-character NameSegs, optionally prefixed with '\'.
+typedef std::vector<uint8_t> Aml;
+
+// Data
+Aml aml_int(uint64_t value);
+Aml aml_string(const char* str);
+Aml aml_eisaid(const char* id);
+Aml aml_buffer(const std::vector<uint8_t>& bytes);
+Aml aml_name(const std::string& name);
+Aml aml_local(unsigned n);
+Aml aml_arg(unsigned n);
+
+// Named objects
+Aml aml_scope(const std::string& name, const std::vector<Aml>& terms);
+Aml aml_device(const std::string& name, const std::vector<Aml>& terms);
+Aml aml_name_decl(const std::string& name, const Aml& value);
+Aml aml_method(const std::string& name, unsigned args, bool serialized, const std::vector<Aml>& terms);
+
+// Operation regions and fields. A field entry with an empty name is reserved (skipped) space.
+constexpr uint8_t AML_SYSTEM_MEMORY = 0;
+constexpr uint8_t AML_DWORD_ACC = 3;
+Aml aml_operation_region(const std::string& name, uint8_t space, uint64_t offset, uint64_t length);
+Aml aml_field(const std::string& region, uint8_t flags, const std::vector<std::pair<std::string, unsigned>>& fields);
+Aml aml_create_dword_field(const Aml& buffer, unsigned offset, const std::string& name);
+Aml aml_create_qword_field(const Aml& buffer, unsigned offset, const std::string& name);
+
+// Statements and expressions. Omitted targets are the NullName.
+Aml aml_store(const Aml& value, const Aml& target);
+Aml aml_add(const Aml& a, const Aml& b, const Aml& target = Aml{0});
+Aml aml_subtract(const Aml& a, const Aml& b, const Aml& target = Aml{0});
+Aml aml_and(const Aml& a, const Aml& b, const Aml& target = Aml{0});
+Aml aml_if(const Aml& predicate, const std::vector<Aml>& terms);
+Aml aml_notify(const Aml& object, const Aml& value);
+Aml aml_return(const Aml& value);
+
+#endif
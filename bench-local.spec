@@ -0,0 +1,34 @@
+# Stand-in spec for checking slicebench itself on any Linux machine: each "configuration" is just
+# a local agent, and the workloads need only a shell.
+#   builddir/slicebench run bench-local.spec -o /tmp/local.results
+
+cpus 2
+mem 1
+vf 0
+repeat 3
+warmup 1
+timeout 60
+boot_timeout 10
+
+config native
+    launch exec {self} agent -listen 127.0.0.1:7071
+    agent 127.0.0.1:7071
+
+config vm
+    launch exec taskset -c 0 {self} agent -listen 127.0.0.1:7072
+    agent 127.0.0.1:7072
+
+config slice
+    launch exec {self} agent -listen 127.0.0.1:7073
+    agent 127.0.0.1:7073
+
+workload shell
+    run awk 'BEGIN { srand(); printf "ops: %d\nlatency: %.1f us\n", 1000 + rand() * 100, 10 + rand() }'
+    metric ops ops: ([0-9.]+)
+    metric latency_us latency: ([0-9.]+) us
+
+workload membw
+    probe membw 64M {cpus}
+
+workload memlat
+    probe memlat 16M
@@ -0,0 +1,59 @@
+# Native vs VM vs slice comparison for slicebench run (see README). Every configuration gets the
+# same CPUs, memory and VF, and runs the same workloads. Guests run "slicebench agent" from the
+# image (see slicebench-agent.service), started by the cloud-init seed in bench-seed.
+
+cpus 8
+mem 16
+vf 0
+repeat 5
+warmup 1
+timeout 600
+boot_timeout 600
+
+# the guest's (or, natively, the host's) address on its NIC VF, and a peer running netserver
+# and iperf3 -s on the same network
+set guest 192.168.37.10
+set peer 192.168.37.1
+set nvme /dev/nvme0n1
+
+# the agents run any command they are sent, so they only serve a host that has this token, which
+# mkimage.sh also installs in the image: create it with e.g.
+#   head -c 32 /dev/urandom | base64 > bench.token && chmod 600 bench.token
+token bench.token
+
+config native
+    launch ./setup_native_eval.sh && exec numactl -N 1 -C 12-$((12 + {cpus} - 1)) -m 1 {self} agent -listen {guest}:7070 -token bench.token
+    agent {guest}:7070
+
+config vm
+    launch exec ./runvm.sh -c {cpus} -m {mem} -v {vf} -p 1024
+    agent {guest}:7070
+    shutdown poweroff
+
+config slice
+    launch ./runslice.sh -c {cpus} -m {mem} -v {vf} -S bench-seed
+    agent {guest}:7070
+    shutdown poweroff
+
+workload fio-randread
+    run fio --name=randread --filename={nvme} --readonly --direct=1 --ioengine=io_uring --rw=randread --bs=4k --iodepth=32 --numjobs={cpus} --group_reporting --runtime=30 --time_based --output-format=json
+    metric iops "iops" : ([0-9.]+)
+    metric clat_mean_ns "clat_ns" : \{[^}]*"mean" : ([0-9.]+)
+
+workload fio-seqread
+    run fio --name=seqread --filename={nvme} --readonly --direct=1 --ioengine=io_uring --rw=read --bs=128k --iodepth=16 --runtime=30 --time_based --output-format=json
+    metric bw_kbps "bw" : ([0-9]+)
+
+workload tcp-stream
+    run iperf3 -c {peer} -t 30 -P {cpus} -f m
+    metric mbps ([0-9.]+) Mbits/sec.*receiver
+
+workload tcp-rr
+    run netperf -H {peer} -t TCP_RR -l 30 -P 0
+    metric trans_per_s ([0-9.]+)\s*$
+
+workload membw
+    probe membw 4G {cpus}
+
+workload memlat
+    probe memlat 1G
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+
+#include "slicebench.h"
+
+std::string trim(const std::string& s)
+{
+    const size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return "";
+    return s.substr(start, s.find_last_not_of(" \t\r\n") - start + 1);
+}
+
+static bool parse_unsigned(const std::string& s, unsigned& value)
+{
+    char* end;
+    const unsigned long v = strtoul(s.c_str(), &end, 0);
+    if (s.empty() || *end != '\0' || v > UINT32_MAX)
+        return false;
+    value = v;
+    return true;
+}
+
+// Read the token that authenticates slicebench run to its agents: the first line of a file,
+// which must not be empty.
+bool read_token(const std::string& path, std::string& token)
+{
+    std::ifstream file(path);
+    std::string line;
+    if (!file.is_open() || !std::getline(file, line) || (token = trim(line)).empty())
+        return false;
+    return true;
+}
+
+bool read_spec(const char* path, Spec& spec)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        perror("Failed to open spec");
+        return false;
+    }
+
+    unsigned lineno = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        lineno++;
+        spec.lines.push_back(line);
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        const size_t space = line.find_first_of(" \t");
+        const std::string key = line.substr(0, space);
+        const std::string rest = space == std::string::npos ? "" : trim(line.substr(space));
+
+        auto error = [&](const char* msg) {
+            fprintf(stderr, "Error: %s:%u: %s\n", path, lineno, msg);
+            return false;
+        };
+
+        if (rest.empty())
+            return error("missing argument");
+
+        if (key == "cpus" || key == "mem" || key == "vf" || key == "repeat" || key == "warmup"
+            || key == "timeout" || key == "boot_timeout") {
+            unsigned& value = key == "cpus" ? spec.cpus : key == "mem" ? spec.mem_gb : key == "vf" ? spec.vf
+                : key == "repeat" ? spec.repeat : key == "warmup" ? spec.warmup
+                : key == "timeout" ? spec.timeout : spec.boot_timeout;
+            if (!parse_unsigned(rest, value))
+                return error("invalid number");
+        } else if (key == "token") {
+            if (!read_token(rest, spec.token))
+                return error("failed to read token file");
+        } else if (key == "set") {
+            const size_t value = rest.find_first_of(" \t");
+            if (value == std::string::npos)
+                return error("expected a name and value");
+            spec.vars[rest.substr(0, value)] = trim(rest.substr(value));
+        } else if (key == "config") {
+            spec.configs.push_back({ rest, "", "", "", "" });
+        } else if (key == "launch" || key == "agent" || key == "shutdown" || key == "stop") {
+            if (spec.configs.empty())
+                return error("expected config first");
+            BenchConfig& config = spec.configs.back();
+            (key == "launch" ? config.launch : key == "agent" ? config.agent
+                : key == "shutdown" ? config.shutdown : config.stop) = rest;
+        } else if (key == "workload") {
+            spec.workloads.push_back({ rest, "", "", {} });
+        } else if (key == "run" || key == "probe" || key == "metric") {
+            if (spec.workloads.empty())
+                return error("expected workload first");
+            Workload& workload = spec.workloads.back();
+            if (key == "run") {
+                workload.run = rest;
+            } else if (key == "probe") {
+                workload.probe = rest;
+            } else {
+                const size_t pattern = rest.find_first_of(" \t");
+                if (pattern == std::string::npos)
+                    return error("expected a metric name and pattern");
+                BenchMetric metric{ rest.substr(0, pattern), trim(rest.substr(pattern)), std::regex() };
+                try {
+                    metric.regex = std::regex(metric.pattern);
+                } catch (const std::regex_error& e) {
+                    return error(e.what());
+                }
+                if (metric.regex.mark_count() < 1)
+                    return error("metric pattern needs a capture group");
+                workload.metrics.push_back(std::move(metric));
+            }
+        } else {
+            return error("unrecognised keyword");
+        }
+    }
+
+    if (spec.configs.empty() || spec.workloads.empty() || spec.repeat == 0) {
+        fprintf(stderr, "Error: %s needs at least one config and workload\n", path);
+        return false;
+    }
+
+    for (const BenchConfig& config : spec.configs) {
+        if (config.launch.empty() || config.agent.empty()) {
+            fprintf(stderr, "Error: config %s needs launch and agent\n", config.name.c_str());
+            return false;
+        }
+    }
+
+    for (const Workload& workload : spec.workloads) {
+        if (workload.run.empty() == workload.probe.empty()) {
+            fprintf(stderr, "Error: workload %s needs one of run or probe\n", workload.name.c_str());
+            return false;
+        }
+        if (!workload.run.empty() && workload.metrics.empty()) {
+            fprintf(stderr, "Error: workload %s has no metrics\n", workload.name.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Substitute {name} for the spec's parameters and variables; other braces are left alone.
+std::string expand(const Spec& spec, const BenchConfig& config, const std::string& command)
+{
+    std::map<std::string, std::string> vars = spec.vars;
+    vars["cpus"] = std::to_string(spec.cpus);
+    vars["mem"] = std::to_string(spec.mem_gb);
+    vars["vf"] = std::to_string(spec.vf);
+    vars["config"] = config.name;
+    std::error_code err;
+    vars["self"] = std::filesystem::read_symlink("/proc/self/exe", err).string();
+
+    std::string result;
+    for (size_t i = 0; i < command.size();) {
+        const size_t close = command[i] == '{' ? command.find('}', i) : std::string::npos;
+        const auto var = close == std::string::npos ? vars.end() : vars.find(command.substr(i + 1, close - i - 1));
+        if (var != vars.end()) {
+            result += var->second;
+            i = close + 1;
+        } else {
+            result += command[i++];
+        }
+    }
+    return result;
+}
+
+//
+// Results.
+//
+
+// Two-sided 95% critical values of Student's t distribution, by degrees of freedom.
+double t_critical(size_t df)
+{
+    static constexpr double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    return df == 0 ? NAN : df <= std::size(table) ? table[df - 1] : 1.960;
+}
+
+Summary summarise(std::vector<double> values, size_t errors)
+{
+    Summary s = {};
+    s.n = values.size();
+    s.errors = errors;
+    if (values.empty())
+        return s;
+
+    std::sort(values.begin(), values.end());
+    s.mean = std::accumulate(values.begin(), values.end(), 0.0) / s.n;
+    double squares = 0;
+    for (double v : values)
+        squares += (v - s.mean) * (v - s.mean);
+    s.sd = s.n > 1 ? std::sqrt(squares / (s.n - 1)) : 0;
+    s.ci95 = s.n > 1 ? t_critical(s.n - 1) * s.sd / std::sqrt(s.n) : NAN;
+    s.median = s.n % 2 ? values[s.n / 2] : (values[s.n / 2 - 1] + values[s.n / 2]) / 2;
+    s.min = values.front();
+    s.max = values.back();
+    return s;
+}
+
+// Gather the results and errors in one or more results files. Returns false if any could not be
+// read.
+bool read_results(const std::vector<std::string>& paths, BenchResults& results)
+{
+    auto add_config = [&](const std::string& config) {
+        if (std::find(results.configs.begin(), results.configs.end(), config) == results.configs.end())
+            results.configs.push_back(config);
+    };
+
+    bool ok = true;
+    for (const std::string& path : paths) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            fprintf(stderr, "Error: failed to open %s\n", path.c_str());
+            ok = false;
+            continue;
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream in(line);
+            std::string kind, config, workload, metric;
+            unsigned run;
+            double value;
+            in >> kind;
+            if (kind == "result" && in >> config >> workload >> metric >> run >> value) {
+                add_config(config);
+                const auto key = std::make_pair(workload, metric);
+                if (std::find(results.keys.begin(), results.keys.end(), key) == results.keys.end())
+                    results.keys.push_back(key);
+                results.values[key][config].push_back(value);
+            } else if (kind == "error" && in >> config >> workload) {
+                add_config(config);
+                results.errors[{ config, workload }]++;
+            }
+        }
+    }
+
+    return ok;
+}
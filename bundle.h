@@ -0,0 +1,80 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H 1
+
+#include <cstddef>
+#include <cstdint>
+
+#include "linuxboot.h"
+
+// A slice boot bundle packs everything needed to boot a Linux slice into one file, prepared
+// ahead of time by slicebundle, so that runslice can load it in a single sequential pass with
+// no parsing. The file starts with a one-page header; each section follows, starting on a page
+// boundary and padded to one, in the order they are to be read.
+//
+// The layout in slice memory is fixed by slicebundle, relative to the kernel's load address:
+//
+//   0                    protected-mode kernel
+//   boot_area_offset     boot_params, DSDT, SSDTs, then (at launch) the remaining ACPI tables
+//                        and the command line
+//   initrd load_offset   initrd, directly after the boot area
+//
+// The setup sectors aren't loaded, but are measured with the kernel, so the kernel's digest
+// matches that of the original bzImage.
+
+constexpr char BUNDLE_MAGIC[8] = { 'S', 'L', 'B', 'U', 'N', 'D', 'L', 'E' };
+constexpr uint32_t BUNDLE_VERSION = 1;
+constexpr size_t BUNDLE_ALIGN = 0x1000;
+constexpr size_t BUNDLE_MAX_SECTIONS = 16;
+constexpr size_t BUNDLE_CMDLINE_SIZE = 2048;    // COMMAND_LINE_SIZE on x86
+constexpr uint64_t BUNDLE_NOT_LOADED = UINT64_MAX;
+
+// Space left in the boot area for the ACPI tables and command line built at launch.
+constexpr size_t BUNDLE_BOOT_SLACK = 0x10000;
+
+enum BundleSectionType : uint32_t
+{
+    BUNDLE_SETUP = 1,   // bzImage setup sectors
+    BUNDLE_KERNEL,      // protected-mode kernel; sha256 covers the setup sectors too
+    BUNDLE_DSDT,
+    BUNDLE_SSDT,
+    BUNDLE_INITRD,
+};
+
+struct bundle_section
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t file_offset;
+    uint64_t size;              // of the data, excluding padding
+    uint64_t load_offset;       // relative to the kernel, or BUNDLE_NOT_LOADED
+    uint8_t sha256[32];
+};
+
+struct bundle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t boot_area_offset;
+    uint64_t boot_area_size;
+    char kernel_version[64];            // as in `uname -r`, for generated initrds
+    char cmdline[BUNDLE_CMDLINE_SIZE];  // base command line; runslice appends -cmdline
+    setup_header setup;                 // validated copy of the kernel's setup header
+    bundle_section sections[BUNDLE_MAX_SECTIONS];
+};
+
+static_assert(sizeof(bundle_header) <= BUNDLE_ALIGN);
+
+static inline const char* bundle_section_name(uint32_t type)
+{
+    switch (type) {
+    case BUNDLE_SETUP: return "setup";
+    case BUNDLE_KERNEL: return "kernel";
+    case BUNDLE_DSDT: return "dsdt";
+    case BUNDLE_SSDT: return "ssdt";
+    case BUNDLE_INITRD: return "initrd";
+    default: return "unknown";
+    }
+}
+
+#endif
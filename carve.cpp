@@ -0,0 +1,284 @@
+#include <sched.h>
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "hostplatform.h"
+#include "runslice.h"
+
+// Take slice CPUs and memory from a running host (-carve), and give them back once the slice is
+// gone (-release), through the kernel's CPU and memory hotplug interfaces. This lets the host boot
+// with all of its resources, rather than being limited with maxcpus= and mem=.
+
+static std::string cpu_online_path(uint32_t cpu)
+{
+    return "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/online";
+}
+
+static std::string memory_block_path(uint64_t block)
+{
+    return "/sys/devices/system/memory/memory" + std::to_string(block);
+}
+
+static bool set_cpu_online(uint32_t cpu, bool online, bool& changed)
+{
+    changed = false;
+
+    uint64_t state;
+    if (!read_host_file(cpu_online_path(cpu), state)) {
+        // No online file: either missing, or (like CPU 0) not hot-pluggable.
+        fprintf(stderr, "Error: host CPU %u cannot be taken offline or onlined\n", cpu);
+        return false;
+    }
+
+    if ((state != 0) == online)
+        return true;
+
+    if (!write_host_file(cpu_online_path(cpu), online ? "1" : "0"))
+        return false;
+
+    changed = true;
+    return true;
+}
+
+static bool get_memory_block_size(uint64_t& block_size)
+{
+    // In hex, without a 0x prefix.
+    std::string str;
+    if (!read_host_file("/sys/devices/system/memory/block_size_bytes", str)
+        || (block_size = strtoull(str.c_str(), nullptr, 16)) == 0)
+    {
+        fprintf(stderr, "Error: failed to read host memory block size\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Offlining a block migrates any pages in use elsewhere first, which fails if they are unmovable;
+// blocks onlined as movable (see online_memory_block()) can always be offlined.
+static bool offline_memory_block(uint64_t block, bool& changed)
+{
+    changed = false;
+
+    uint64_t state;
+    if (!read_host_file(memory_block_path(block) + "/online", state))
+        return true;    // not present in the host (e.g. beyond mem=)
+
+    if (state == 0)
+        return true;
+
+    if (!write_host_file(memory_block_path(block) + "/online", "0")) {
+        fprintf(stderr, "Error: failed to offline host memory block %" PRIu64 "\n", block);
+        return false;
+    }
+
+    changed = true;
+    return true;
+}
+
+static bool online_memory_block(uint64_t block, bool& changed)
+{
+    const std::string dir = memory_block_path(block);
+    changed = false;
+
+    uint64_t state;
+    if (!read_host_file(dir + "/online", state) || state != 0)
+        return true;
+
+    changed = true;
+    // Prefer ZONE_MOVABLE, so that the block can be carved out again.
+    std::string zones;
+    if (read_host_file(dir + "/valid_zones", zones) && zones.find("Movable") != std::string::npos)
+        return write_host_file(dir + "/state", "online_movable");
+
+    return write_host_file(dir + "/online", "1");
+}
+
+// Check that the host is not using any of a range as RAM. Offlining a memory block leaves it
+// listed as System RAM in /proc/iomem (which only shows real addresses to root), so where a range
+// overlaps that, check instead that each memory block there is offline.
+bool check_not_host_ram(uint64_t base, uint64_t size)
+{
+    std::ifstream iomem(host_path("/proc/iomem"));
+    if (!iomem.is_open()) {
+        perror("Failed to open /proc/iomem");
+        return false;
+    }
+
+    uint64_t block_size = 0;
+    std::string line;
+    while (std::getline(iomem, line)) {
+        if (line.empty() || line[0] == ' ' || line.find(": System RAM") == std::string::npos)
+            continue;
+
+        char* end;
+        const uint64_t start = strtoull(line.c_str(), &end, 16);
+        const uint64_t last = strtoull(end + 1, nullptr, 16);
+        if (start > base + size - 1 || base > last)
+            continue;
+
+        if (block_size == 0 && !get_memory_block_size(block_size))
+            return false;
+
+        const uint64_t first_block = std::max(start, base) / block_size;
+        const uint64_t last_block = std::min(last, base + size - 1) / block_size;
+        for (uint64_t block = first_block; block <= last_block; block++) {
+            uint64_t online;
+            if (!read_host_file(memory_block_path(block) + "/online", online) || online != 0) {
+                fprintf(stderr, "Error: 0x%" PRIx64 "-0x%" PRIx64 " is still host RAM (memory block %" PRIu64
+                        " is online or cannot be offlined)\n", base, base + size - 1, block);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Offline the given host CPUs (by Linux CPU number) and memory ranges. On failure, anything
+// already offlined is returned to the host.
+bool carve_host_resources(const std::vector<uint32_t>& cpus, const std::vector<std::pair<uint64_t, uint64_t>>& mem)
+{
+    uint64_t block_size;
+    if (!mem.empty() && !get_memory_block_size(block_size))
+        return false;
+
+    // We are pinned to our host CPU (see pin_host_cpu()), and use its local APIC and MSRs.
+    for (uint32_t cpu : cpus) {
+        if (static_cast<int>(cpu) == sched_getcpu()) {
+            fprintf(stderr, "Error: runslice is running on host CPU %u, so it cannot be carved; run runslice "
+                    "on another CPU (e.g. with taskset)\n", cpu);
+            return false;
+        }
+    }
+
+    std::vector<uint32_t> offlined_cpus;
+    std::vector<uint64_t> offlined_blocks;
+    bool ok = true;
+
+    for (const auto& [base, size] : mem) {
+        if (base % block_size != 0 || size % block_size != 0) {
+            fprintf(stderr, "Error: carved memory must be aligned to the host's %" PRIu64 " MiB blocks\n",
+                    block_size >> 20);
+            ok = false;
+            break;
+        }
+
+        for (uint64_t block = base / block_size; ok && block < (base + size) / block_size; block++) {
+            bool changed;
+            ok = offline_memory_block(block, changed);
+            if (changed)
+                offlined_blocks.push_back(block);
+        }
+
+        if (!ok || !check_not_host_ram(base, size)) {
+            ok = false;
+            break;
+        }
+    }
+
+    for (uint32_t cpu : cpus) {
+        bool changed;
+        if (!ok || !set_cpu_online(cpu, false, changed)) {
+            ok = false;
+            break;
+        }
+        if (changed)
+            offlined_cpus.push_back(cpu);
+    }
+
+    if (!ok) {
+        bool changed;
+        for (uint32_t cpu : offlined_cpus)
+            set_cpu_online(cpu, true, changed);
+        for (uint64_t block : offlined_blocks)
+            online_memory_block(block, changed);
+        return false;
+    }
+
+    printf("Carved %zu CPUs and %zu memory blocks from the host\n", offlined_cpus.size(), offlined_blocks.size());
+    return true;
+}
+
+// Drop CPUs that are now offline (e.g. carved) from a set the worker pool may use.
+void remove_offline_cpus(cpu_set_t& cpus)
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        uint64_t state;
+        if (CPU_ISSET(cpu, &cpus) && read_host_file(cpu_online_path(cpu), state) && state == 0)
+            CPU_CLR(cpu, &cpus);
+    }
+}
+
+// Return the CPUs and memory of a slice that has been shut down to the host, as recorded in its
+// launch (and any grow) records. The slice must no longer be running: onlining its CPUs resets
+// them, and its memory is reused by the host.
+bool release_slice(const Options& options)
+{
+    std::vector<std::pair<std::string, std::string>> record;
+    if (!read_launch_record(options.log_path, options.rambase, record, true))
+        return false;
+
+    std::vector<uint32_t> apic_ids;
+    std::vector<std::pair<uint64_t, uint64_t>> mem;
+    uint64_t ramsize = 0;
+    for (const auto& [key, value] : record) {
+        if (key == "ramsize") {
+            ramsize = strtoull(value.c_str(), nullptr, 0);
+        } else if (key == "mem" || key == "farmem") {
+            uint64_t base, size;
+            if (sscanf(value.c_str(), "%" SCNx64 " %" SCNx64, &base, &size) == 2)
+                mem.push_back({ base, size });
+        } else if (key == "apic_ids" || key == "spare_apic_ids") {
+            // grow records repeat spare IDs
+            const char* p = value.c_str();
+            char* end;
+            for (;;) {
+                const uint32_t id = strtoul(p, &end, 0);
+                if (end == p)
+                    break;
+                if (std::find(apic_ids.begin(), apic_ids.end(), id) == apic_ids.end())
+                    apic_ids.push_back(id);
+                p = end;
+            }
+        }
+    }
+    mem.insert(mem.begin(), { options.rambase, ramsize });
+
+    uint64_t block_size;
+    const HostPlatform* platform = host_platform();
+    if (platform == nullptr || !get_memory_block_size(block_size))
+        return false;
+
+    bool ok = true;
+    unsigned onlined_blocks = 0, onlined_cpus = 0;
+    for (const auto& [base, size] : mem) {
+        for (uint64_t block = base / block_size; block < (base + size + block_size - 1) / block_size; block++) {
+            bool changed;
+            ok &= online_memory_block(block, changed);
+            onlined_blocks += changed;
+        }
+    }
+
+    const PlatformView<uint32_t> host_ids = platform->cpu_apic_ids();
+    for (uint32_t apic_id : apic_ids) {
+        auto it = std::find(host_ids.begin(), host_ids.end(), apic_id);
+        if (it == host_ids.end()) {
+            fprintf(stderr, "Error: APIC ID %u is not a host CPU\n", apic_id);
+            ok = false;
+            continue;
+        }
+
+        bool changed;
+        ok &= set_cpu_online(it - host_ids.begin(), true, changed);
+        onlined_cpus += changed;
+    }
+
+    printf("Returned %u CPUs and %u memory blocks to the host\n", onlined_cpus, onlined_blocks);
+
+    // So that -park may reuse the slice's CPUs.
+    return ok && append_release_log(options, options.log_path);
+}
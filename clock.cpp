@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "runslice.h"
+#include "sliceclock.h"
+
+// The host side of the shared clock page (see sliceclock.h). runslice -clockd publishes it and
+// keeps it up to date; slices launched with -clock are told where it is.
+
+static constexpr unsigned CLOCK_UPDATE_INTERVAL_MS = 1000;
+static constexpr unsigned CLOCK_SAMPLES = 8;
+
+// Find the shift and 32.32 multiplier for converting ticks at tsc_hz to ns, as Linux's
+// kvm_get_time_scale() does.
+static void get_time_scale(uint64_t tsc_hz, uint32_t& mul, int8_t& shift)
+{
+    constexpr uint64_t NSEC_PER_SEC = 1000000000;
+    uint64_t scaled = NSEC_PER_SEC;
+    uint64_t tps64 = tsc_hz;
+    int32_t s = 0;
+
+    while (tps64 > scaled * 2 || (tps64 & 0xffffffff00000000ull)) {
+        tps64 >>= 1;
+        s--;
+    }
+
+    uint32_t tps32 = static_cast<uint32_t>(tps64);
+    while (tps32 <= scaled || (scaled & 0xffffffff00000000ull)) {
+        if ((scaled & 0xffffffff00000000ull) || (tps32 & 0x80000000))
+            scaled >>= 1;
+        else
+            tps32 <<= 1;
+        s++;
+    }
+
+    mul = static_cast<uint32_t>((scaled << 32) / tps32);
+    shift = s;
+}
+
+static uint64_t timespec_ns(const timespec& ts)
+{
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Read a clock and the TSC as close together as we can: of several tries, keep the one with the
+// shortest TSC interval around the clock read, and take its midpoint.
+static void sample_clock(clockid_t clock, uint64_t& tsc, uint64_t& ns)
+{
+    uint64_t best = UINT64_MAX;
+    for (unsigned i = 0; i < CLOCK_SAMPLES; i++) {
+        timespec ts;
+        _mm_lfence();
+        const uint64_t before = __rdtsc();
+        clock_gettime(clock, &ts);
+        _mm_lfence();
+        const uint64_t after = __rdtsc();
+        if (after - before < best) {
+            best = after - before;
+            tsc = before + (after - before) / 2;
+            ns = timespec_ns(ts);
+        }
+    }
+}
+
+static bool tsc_is_invariant()
+{
+    uint32_t max_leaf, a, b, c, d;
+    cpuid(0x80000000, 0, max_leaf, b, c, d);
+    if (max_leaf < 0x80000007)
+        return false;
+    cpuid(0x80000007, 0, a, b, c, d);
+    return d & (1 << 8);
+}
+
+static std::atomic<bool> clock_stopping{false};
+
+// Publish the clock page at options.clock_page, and update it until killed. The TSC rate is
+// measured against CLOCK_MONOTONIC, which follows NTP's frequency corrections but never steps,
+// over the whole time the daemon has run; each update then rebases on a fresh CLOCK_REALTIME
+// sample.
+bool run_clock_daemon(const Options& options)
+{
+    AutoFd devmem = open("/dev/mem", O_RDWR);
+    if (devmem < 0) {
+        perror("Error: Failed to open /dev/mem");
+        return false;
+    }
+
+    void* page = mmap(nullptr, SLICE_CLOCK_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, options.clock_page);
+    if (page == MAP_FAILED) {
+        perror("Error: Failed to map clock page");
+        return false;
+    }
+    volatile slice_clock* const clock = static_cast<volatile slice_clock*>(page);
+
+    const bool stable = tsc_is_invariant();
+    if (!stable)
+        fprintf(stderr, "Warning: the host TSC is not invariant, so slice clocks may drift\n");
+
+    // Start with the rate over a short interval, refined at each update.
+    uint64_t start_tsc, start_ns, tsc, ns;
+    sample_clock(CLOCK_MONOTONIC, start_tsc, start_ns);
+    const timespec calibrate = { 0, 100000000 };
+    nanosleep(&calibrate, nullptr);
+
+    // Carry on from any previous daemon's sequence count, in case slices are reading the page.
+    if (memcmp(page, SLICE_CLOCK_MAGIC, sizeof(SLICE_CLOCK_MAGIC)) != 0 || (clock->seq & 1)) {
+        memset(page, 0, SLICE_CLOCK_PAGE_SIZE);
+        memcpy(page, SLICE_CLOCK_MAGIC, sizeof(SLICE_CLOCK_MAGIC));
+    }
+    clock->version = SLICE_CLOCK_VERSION;
+
+    signal(SIGINT, [](int) { clock_stopping = true; });
+    signal(SIGTERM, [](int) { clock_stopping = true; });
+
+    printf("Publishing the slice clock page at 0x%" PRIx64 "\n", options.clock_page);
+    bool first = true;
+    while (!clock_stopping) {
+        sample_clock(CLOCK_MONOTONIC, tsc, ns);
+        const uint64_t tsc_hz = static_cast<uint64_t>((tsc - start_tsc) * 1e9 / (ns - start_ns) + 0.5);
+        uint32_t mul;
+        int8_t shift;
+        get_time_scale(tsc_hz, mul, shift);
+
+        uint64_t realtime_tsc, realtime_ns;
+        sample_clock(CLOCK_REALTIME, realtime_tsc, realtime_ns);
+
+        const uint32_t seq = clock->seq;
+        clock->seq = seq + 1;
+        std::atomic_thread_fence(std::memory_order_release);
+        clock->tsc_timestamp = realtime_tsc;
+        clock->realtime_ns = realtime_ns;
+        clock->tsc_to_ns_mul = mul;
+        clock->tsc_shift = shift;
+        clock->flags = stable ? SLICE_CLOCK_TSC_STABLE : 0;
+        clock->tsc_hz = tsc_hz;
+        std::atomic_thread_fence(std::memory_order_release);
+        clock->seq = seq + 2;
+
+        if (first) {
+            printf("TSC at %.3f MHz\n", tsc_hz / 1e6);
+            fflush(stdout);
+            first = false;
+        }
+
+        const timespec interval = { CLOCK_UPDATE_INTERVAL_MS / 1000, (CLOCK_UPDATE_INTERVAL_MS % 1000) * 1000000l };
+        nanosleep(&interval, nullptr);
+    }
+
+    // Readers give up on a page of another version.
+    clock->version = 0;
+    munmap(page, SLICE_CLOCK_PAGE_SIZE);
+    return true;
+}
+
+// Warn if nothing is keeping the clock page up to date, which is harmless for the launch.
+void check_clock_page(const AutoFd& devmem, uint64_t address)
+{
+    void* page = mmap(nullptr, SLICE_CLOCK_PAGE_SIZE, PROT_READ, MAP_SHARED, devmem, address);
+    if (page == MAP_FAILED) {
+        perror("Warning: Failed to map clock page");
+        return;
+    }
+
+    const volatile slice_clock* const clock = static_cast<const volatile slice_clock*>(page);
+    uint64_t slice_ns, tsc, host_ns;
+    sample_clock(CLOCK_REALTIME, tsc, host_ns);
+    if (memcmp(page, SLICE_CLOCK_MAGIC, sizeof(SLICE_CLOCK_MAGIC)) != 0 || !slice_clock_read(clock, slice_ns)
+        || static_cast<int64_t>(tsc - clock->tsc_timestamp) > static_cast<int64_t>(10 * clock->tsc_hz)) {
+        fprintf(stderr, "Warning: the clock page at 0x%" PRIx64 " is not being updated (is runslice -clockd running?)\n",
+                address);
+    } else {
+        const double offset_us = (static_cast<double>(slice_ns) - static_cast<double>(host_ns)) / 1000;
+        if (offset_us > 1000 || offset_us < -1000)
+            fprintf(stderr, "Warning: the clock page is %.0f us off the host's clock\n", offset_us);
+    }
+
+    munmap(page, SLICE_CLOCK_PAGE_SIZE);
+}
@@ -0,0 +1,56 @@
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "cpio.h"
+
+void CpioWriter::add_entry(const std::string& path, uint32_t mode, const void* data, size_t size)
+{
+    // All numeric fields are 8 hex digits: magic, ino, mode, uid, gid, nlink, mtime, filesize,
+    // devmajor, devminor, rdevmajor, rdevminor, namesize, check.
+    char header[111];
+    snprintf(header, sizeof(header), "070701%08X%08X%08X%08X%08X%08X%08zX%08X%08X%08X%08X%08zX%08X",
+             m_ino++, mode, 0, 0, S_ISDIR(mode) ? 2 : 1, 0, size, 0, 0, 0, 0, path.size() + 1, 0);
+
+    m_buf.insert(m_buf.end(), header, header + 110);
+    m_buf.insert(m_buf.end(), path.c_str(), path.c_str() + path.size() + 1);
+    m_buf.resize((m_buf.size() + 3) & ~3, 0);
+
+    const char* bytes = static_cast<const char*>(data);
+    m_buf.insert(m_buf.end(), bytes, bytes + size);
+    m_buf.resize((m_buf.size() + 3) & ~3, 0);
+}
+
+void CpioWriter::add_directory(const std::string& path, uint32_t mode)
+{
+    m_dirs.push_back(path);
+    add_entry(path, S_IFDIR | mode, nullptr, 0);
+}
+
+void CpioWriter::add_parents(const std::string& path)
+{
+    for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        const std::string dir = path.substr(0, pos);
+        if (!dir.empty() && std::find(m_dirs.begin(), m_dirs.end(), dir) == m_dirs.end())
+            add_directory(dir);
+    }
+}
+
+void CpioWriter::add_file(const std::string& path, const void* data, size_t size, uint32_t mode)
+{
+    add_parents(path);
+    add_entry(path, S_IFREG | mode, data, size);
+}
+
+void CpioWriter::add_symlink(const std::string& path, const std::string& target)
+{
+    add_parents(path);
+    add_entry(path, S_IFLNK | 0777, target.c_str(), target.size());
+}
+
+const std::vector<char>& CpioWriter::finish()
+{
+    add_entry("TRAILER!!!", 0, nullptr, 0);
+    return m_buf;
+}
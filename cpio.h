@@ -0,0 +1,31 @@
+#ifndef CPIO_H
+#define CPIO_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writer for "newc" cpio archives, as unpacked into the initramfs by the kernel. The finished
+// archive is padded to a multiple of 4 bytes, so that it may be concatenated with others.
+class CpioWriter
+{
+public:
+    void add_directory(const std::string& path, uint32_t mode = 0755);
+    void add_file(const std::string& path, const void* data, size_t size, uint32_t mode = 0644);
+    void add_symlink(const std::string& path, const std::string& target);
+
+    // Add a directory and all its parents, unless already present.
+    void add_parents(const std::string& path);
+
+    const std::vector<char>& finish();
+
+private:
+    std::vector<char> m_buf;
+    std::vector<std::string> m_dirs;
+    uint32_t m_ino = 1;
+
+    void add_entry(const std::string& path, uint32_t mode, const void* data, size_t size);
+};
+
+#endif
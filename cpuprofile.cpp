@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "runslice.h"
+
+// Core-scoped MSRs tuned by CPU profiles. These are Intel-specific; on other CPUs they fail the
+// host read check below.
+static constexpr uint32_t MSR_IA32_MISC_ENABLE = 0x1a0;
+static constexpr uint64_t MISC_ENABLE_TURBO_DISABLE = 1ull << 38;
+
+static constexpr uint32_t MSR_MISC_FEATURE_CONTROL = 0x1a4;
+static constexpr uint64_t PREFETCH_L2_STREAMER_DISABLE = 1 << 0;
+static constexpr uint64_t PREFETCH_L2_ADJACENT_DISABLE = 1 << 1;
+static constexpr uint64_t PREFETCH_DCU_NEXT_LINE_DISABLE = 1 << 2;
+static constexpr uint64_t PREFETCH_DCU_IP_DISABLE = 1 << 3;
+static constexpr uint64_t PREFETCH_DISABLE_MASK = 0xf;
+
+static constexpr uint32_t MSR_IA32_ENERGY_PERF_BIAS = 0x1b0;
+static constexpr uint64_t ENERGY_PERF_BIAS_MASK = 0xf;
+
+static constexpr uint32_t MSR_IA32_PM_ENABLE = 0x770;
+static constexpr uint32_t MSR_IA32_HWP_REQUEST = 0x774;
+static constexpr unsigned HWP_REQUEST_EPP_SHIFT = 24;
+static constexpr uint64_t HWP_REQUEST_EPP_MASK = 0xffull << HWP_REQUEST_EPP_SHIFT;
+
+struct CpuProfile
+{
+    const char* name;
+    const char* description;
+    bool turbo;
+    uint64_t prefetch_disable;  // MSR_MISC_FEATURE_CONTROL bits
+    uint8_t energy_perf_bias;   // 0 (performance) - 15 (energy saving)
+    uint8_t hwp_epp;            // 0 (performance) - 255 (energy saving)
+};
+
+static const CpuProfile cpu_profiles[] = {
+    { "latency", "turbo, all prefetchers, maximum performance bias",
+      true, 0, 0, 0 },
+    { "throughput", "turbo, all prefetchers, balanced performance bias",
+      true, 0, 6, 0x80 },
+    { "streaming", "no turbo (steady frequency), all prefetchers, maximum performance bias",
+      false, 0, 0, 0 },
+    { "random", "turbo, no L2 streamer or adjacent-line prefetch, maximum performance bias",
+      true, PREFETCH_L2_STREAMER_DISABLE | PREFETCH_L2_ADJACENT_DISABLE, 0, 0 },
+    { "powersave", "no turbo, all prefetchers, maximum energy-saving bias",
+      false, 0, 15, 0xff },
+};
+
+// Parse "-msr ADDR=VALUE[/MASK]". Only the bits in MASK (default: all) are changed.
+bool parse_msr_write(const char* str, MsrWrite& write)
+{
+    char* end;
+    write.msr = strtoul(str, &end, 0);
+    if (end == str || *end != '=')
+        return false;
+
+    str = end + 1;
+    const uint64_t value = strtoull(str, &end, 0);
+    if (end == str)
+        return false;
+
+    uint64_t mask = UINT64_MAX;
+    if (*end == '/') {
+        str = end + 1;
+        mask = strtoull(str, &end, 0);
+        if (end == str)
+            return false;
+    }
+
+    write.clear = mask;
+    write.set = value & mask;
+    return *end == '\0';
+}
+
+// Expand the named profile (if any) into MSR writes, ahead of any given explicitly, and check
+// that the host CPU implements every MSR we are going to write. The slice CPUs are offline, so
+// we can't check them directly, but the host's CPU is the same model.
+bool resolve_cpu_profile(Options& options)
+{
+    std::vector<MsrWrite> writes;
+
+    if (options.cpu_profile) {
+        const CpuProfile* profile = nullptr;
+        for (const CpuProfile& p : cpu_profiles) {
+            if (strcmp(p.name, options.cpu_profile) == 0)
+                profile = &p;
+        }
+
+        if (profile == nullptr) {
+            fprintf(stderr, "Error: unknown CPU profile '%s'\n", options.cpu_profile);
+            return false;
+        }
+
+        printf("CPU profile %s: %s\n", profile->name, profile->description);
+
+        writes.push_back({ MSR_IA32_MISC_ENABLE, MISC_ENABLE_TURBO_DISABLE, profile->turbo ? 0 : MISC_ENABLE_TURBO_DISABLE });
+        writes.push_back({ MSR_MISC_FEATURE_CONTROL, PREFETCH_DISABLE_MASK, profile->prefetch_disable });
+        writes.push_back({ MSR_IA32_ENERGY_PERF_BIAS, ENERGY_PERF_BIAS_MASK, profile->energy_perf_bias });
+
+        // HWP MSRs fault unless HWP was enabled (package-wide) by the host's cpufreq driver.
+        uint64_t pm_enable;
+        if (read_host_msr(MSR_IA32_PM_ENABLE, pm_enable) && (pm_enable & 1)) {
+            writes.push_back({ MSR_IA32_HWP_REQUEST, HWP_REQUEST_EPP_MASK,
+                               static_cast<uint64_t>(profile->hwp_epp) << HWP_REQUEST_EPP_SHIFT });
+        } else {
+            printf("HWP is not enabled; profile %s will not set the energy-performance preference\n", profile->name);
+        }
+    }
+
+    writes.insert(writes.end(), options.msr_writes.begin(), options.msr_writes.end());
+    if (writes.size() > MAX_MSR_WRITES) {
+        fprintf(stderr, "Error: too many MSR writes (at most %zu are supported)\n", MAX_MSR_WRITES);
+        return false;
+    }
+
+    for (const MsrWrite& write : writes) {
+        uint64_t value;
+        if (!read_host_msr(write.msr, value)) {
+            fprintf(stderr, "Error: MSR 0x%x is not implemented by this CPU (or msr.ko is not loaded)\n", write.msr);
+            return false;
+        }
+    }
+
+    options.msr_writes = std::move(writes);
+    return true;
+}
@@ -0,0 +1,417 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "kdump.h"
+#include "linuxboot.h"
+#include "runslice.h"
+#include "threadpool.h"
+
+// Post-mortem dumps of a slice's memory (-dump), for crash. Slice memory survives until the next
+// launch clears it, so a slice that has died can be dumped from /dev/mem, using the layout from
+// its launch record. The dump is either an ELF core (like /proc/vmcore) or makedumpfile's
+// compressed kdump format. Either way, zero pages take no space: they are holes in a (sparse)
+// ELF core, and share one copy in a kdump file.
+
+static constexpr uint64_t DUMP_PAGE_SIZE = 0x1000;
+static constexpr size_t DUMP_CHUNK_SIZE = 0x100000;
+static constexpr uint32_t NT_SLICE_LAUNCH_RECORD = 0x534c0001;
+static constexpr uint64_t START_KERNEL_MAP = 0xffffffff80000000;  // x86-64 kernel text mapping
+
+struct SliceDumpLayout
+{
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;  // page-aligned, sorted and disjoint
+    unsigned cpus = 0;
+    std::string hostname;
+    uint64_t text_base = 0, text_size = 0, phys_base = 0;
+    std::string record;         // the launch record, as text, for the dump's notes
+};
+
+// A unit of work: part of one range, at page index first_page of the whole dump.
+struct DumpChunk
+{
+    const char* data;
+    uint64_t size;
+    uint64_t first_page;
+};
+
+static bool read_dump_layout(const Options& options, SliceDumpLayout& layout)
+{
+    std::vector<std::pair<std::string, std::string>> record;
+    if (!read_launch_record(options.log_path, options.rambase, record, true))
+        return false;
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    bool have_map = false;
+    for (const auto& [key, value] : record) {
+        layout.record += key + " " + value + "\n";
+
+        char* end;
+        if (key == "ramsize" && !options.dump_ram_only) {
+            ranges.push_back({ options.rambase, strtoull(value.c_str(), nullptr, 0) });
+        } else if (key == "e820") {
+            const uint64_t base = strtoull(value.c_str(), &end, 0);
+            const uint64_t size = strtoull(end, &end, 0);
+            have_map = true;
+            if (strtoul(end, nullptr, 0) == E820_TYPE_RAM)
+                ranges.push_back({ base, size });
+        } else if (key == "mem" || key == "farmem") {
+            const uint64_t base = strtoull(value.c_str(), &end, 0);
+            ranges.push_back({ base, strtoull(end, nullptr, 0) });
+        } else if (key == "apic_ids") {
+            // once at launch, then for each grow
+            for (const char* p = value.c_str();; p = end) {
+                strtoul(p, &end, 0);
+                if (end == p)
+                    break;
+                layout.cpus++;
+            }
+        } else if (key == "hostname") {
+            layout.hostname = value;
+        } else if (key == "kernel_text") {
+            layout.text_base = strtoull(value.c_str(), &end, 0);
+            layout.text_size = strtoull(end, nullptr, 0);
+        } else if (key == "phys_base") {
+            layout.phys_base = strtoull(value.c_str(), nullptr, 0);
+        }
+    }
+    if (options.dump_ram_only && !have_map) {
+        fprintf(stderr, "Error: the launch record has no memory map, so cannot be filtered to RAM\n");
+        return false;
+    }
+
+    // Round out to pages, then merge overlapping ranges.
+    for (auto& [base, size] : ranges) {
+        const uint64_t end = ALIGN_UP(base + size, DUMP_PAGE_SIZE);
+        base &= ~(DUMP_PAGE_SIZE - 1);
+        size = end - base;
+    }
+    std::sort(ranges.begin(), ranges.end());
+    for (const auto& [base, size] : ranges) {
+        if (size == 0)
+            continue;
+        if (!layout.ranges.empty() && base <= layout.ranges.back().first + layout.ranges.back().second) {
+            auto& last = layout.ranges.back();
+            last.second = std::max(last.first + last.second, base + size) - last.first;
+        } else {
+            layout.ranges.push_back({ base, size });
+        }
+    }
+
+    if (layout.ranges.empty()) {
+        fprintf(stderr, "Error: the launch record has no memory to dump\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_zero_page(const char* p)
+{
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(p);
+    uint64_t acc = 0;
+    for (size_t i = 0; i < DUMP_PAGE_SIZE / sizeof(uint64_t); i++)
+        acc |= words[i];
+    return acc == 0;
+}
+
+static bool write_at(int fd, const void* data, size_t size, uint64_t offset)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size) {
+        const ssize_t written = pwrite(fd, p, size, offset);
+        if (written <= 0) {
+            perror("Failed to write dump");
+            return false;
+        }
+        p += written;
+        size -= written;
+        offset += written;
+    }
+
+    return true;
+}
+
+// The launch record, as an ELF note for the curious; crash ignores notes it doesn't know.
+static std::vector<char> build_note(const std::string& text)
+{
+    static const char name[] = "SLICELOADER";
+    Elf64_Nhdr nhdr = { .n_namesz = sizeof(name), .n_descsz = static_cast<Elf64_Word>(text.size()),
+                        .n_type = NT_SLICE_LAUNCH_RECORD };
+    std::vector<char> note(sizeof(nhdr) + ALIGN_UP(sizeof(name), 4) + ALIGN_UP(text.size(), 4));
+    memcpy(note.data(), &nhdr, sizeof(nhdr));
+    memcpy(note.data() + sizeof(nhdr), name, sizeof(name));
+    memcpy(note.data() + sizeof(nhdr) + ALIGN_UP(sizeof(name), 4), text.data(), text.size());
+    return note;
+}
+
+// An ELF core, with a PT_LOAD for each range at its physical address, and another for the
+// kernel's text mapping (overlapping the first in the file), from which crash finds phys_base.
+static bool write_elf_dump(int fd, const SliceDumpLayout& layout, const std::vector<DumpChunk>& chunks,
+                           std::atomic<uint64_t>& zero_pages)
+{
+    const std::vector<char> note = build_note(layout.record);
+
+    std::vector<Elf64_Phdr> phdrs;
+    const size_t phnum = 1 + layout.ranges.size() + (layout.text_size ? 1 : 0);
+    uint64_t offset = ALIGN_UP(sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr) + note.size(), DUMP_PAGE_SIZE);
+    const uint64_t data_offset = offset;
+
+    auto add_phdr = [&](uint32_t type, uint64_t offset, uint64_t vaddr, uint64_t paddr, uint64_t size) {
+        phdrs.push_back({ .p_type = type, .p_flags = type == PT_LOAD ? PF_R | PF_W | PF_X : 0u, .p_offset = offset,
+                          .p_vaddr = vaddr, .p_paddr = paddr, .p_filesz = size, .p_memsz = size,
+                          .p_align = type == PT_LOAD ? DUMP_PAGE_SIZE : 0 });
+    };
+
+    add_phdr(PT_NOTE, sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr), 0, 0, note.size());
+    for (const auto& [base, size] : layout.ranges) {
+        add_phdr(PT_LOAD, offset, 0, base, size);
+
+        if (layout.text_size && base <= layout.text_base && layout.text_base < base + size) {
+            add_phdr(PT_LOAD, offset + (layout.text_base - base),
+                     START_KERNEL_MAP + (layout.text_base - layout.phys_base), layout.text_base,
+                     std::min(layout.text_size, base + size - layout.text_base));
+        }
+        offset += size;
+    }
+
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = phdrs.size();
+
+    if (!write_at(fd, &ehdr, sizeof(ehdr), 0)
+        || !write_at(fd, phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr), sizeof(ehdr))
+        || !write_at(fd, note.data(), note.size(), phdrs[0].p_offset))
+        return false;
+
+    // Ranges are laid out back to back, so a page's offset follows from its index. Zero pages
+    // are left as holes.
+    const bool ok = thread_pool().parallel_for(chunks.size(), [&](size_t i) {
+        const DumpChunk& chunk = chunks[i];
+        uint64_t file_offset = data_offset + chunk.first_page * DUMP_PAGE_SIZE;
+        for (uint64_t pos = 0; pos < chunk.size;) {
+            if (is_zero_page(chunk.data + pos)) {
+                zero_pages++;
+                pos += DUMP_PAGE_SIZE;
+                continue;
+            }
+
+            uint64_t run = DUMP_PAGE_SIZE;
+            while (pos + run < chunk.size && !is_zero_page(chunk.data + pos + run))
+                run += DUMP_PAGE_SIZE;
+            if (!write_at(fd, chunk.data + pos, run, file_offset + pos))
+                return false;
+            pos += run;
+        }
+        return true;
+    });
+
+    if (ok && ftruncate(fd, offset) != 0) {
+        perror("Failed to write dump");
+        return false;
+    }
+
+    return ok;
+}
+
+// makedumpfile's format, with each page compressed on its own. Every page is in the dump, but
+// zero pages all refer to the same data.
+static bool write_kdump(int fd, const SliceDumpLayout& layout, const std::vector<DumpChunk>& chunks,
+                        std::atomic<uint64_t>& zero_pages)
+{
+    const std::vector<char> note = build_note(layout.record);
+    const auto& last = layout.ranges.back();
+    const uint64_t max_mapnr = (last.first + last.second) / DUMP_PAGE_SIZE;
+    const uint64_t bitmap_size = ALIGN_UP((max_mapnr + 7) / 8, DUMP_PAGE_SIZE);
+
+    uint64_t page_count = 0;
+    std::vector<uint8_t> bitmap(bitmap_size);
+    for (const auto& [base, size] : layout.ranges) {
+        for (uint64_t pfn = base / DUMP_PAGE_SIZE; pfn < (base + size) / DUMP_PAGE_SIZE; pfn++)
+            bitmap[pfn / 8] |= 1 << (pfn % 8);
+        page_count += size / DUMP_PAGE_SIZE;
+    }
+
+    const uint64_t sub_hdr_blocks = ALIGN_UP(sizeof(KdumpSubHeader) + note.size(), DUMP_PAGE_SIZE) / DUMP_PAGE_SIZE;
+    const uint64_t bitmap_offset = (1 + sub_hdr_blocks) * DUMP_PAGE_SIZE;
+    const uint64_t desc_offset = bitmap_offset + 2 * bitmap_size;
+    uint64_t data_offset = desc_offset + page_count * sizeof(KdumpPageDesc);
+
+    KdumpHeader header = {};
+    memcpy(header.signature, KDUMP_SIGNATURE, sizeof(header.signature));
+    header.header_version = KDUMP_HEADER_VERSION;
+    strcpy(header.utsname.sysname, "Linux");
+    snprintf(header.utsname.nodename, sizeof(header.utsname.nodename), "%s", layout.hostname.c_str());
+    strcpy(header.utsname.machine, "x86_64");
+    gettimeofday(&header.timestamp, nullptr);
+    header.status = KDUMP_COMPRESSED_ZLIB;
+    header.block_size = DUMP_PAGE_SIZE;
+    header.sub_hdr_size = sub_hdr_blocks;
+    header.bitmap_blocks = 2 * bitmap_size / DUMP_PAGE_SIZE;
+    header.max_mapnr = std::min<uint64_t>(max_mapnr, UINT32_MAX);
+    header.total_ram_blocks = std::min<uint64_t>(page_count, UINT32_MAX);
+    header.nr_cpus = layout.cpus;
+
+    KdumpSubHeader sub_header = {};
+    sub_header.phys_base = layout.phys_base;
+    sub_header.offset_note = DUMP_PAGE_SIZE + sizeof(sub_header);
+    sub_header.size_note = note.size();
+    sub_header.max_mapnr_64 = max_mapnr;
+
+    // Both bitmaps are the same: nothing is filtered out.
+    if (!write_at(fd, &header, sizeof(header), 0)
+        || !write_at(fd, &sub_header, sizeof(sub_header), DUMP_PAGE_SIZE)
+        || !write_at(fd, note.data(), note.size(), sub_header.offset_note)
+        || !write_at(fd, bitmap.data(), bitmap_size, bitmap_offset)
+        || !write_at(fd, bitmap.data(), bitmap_size, bitmap_offset + bitmap_size))
+        return false;
+
+    // The shared zero page.
+    std::vector<char> zero_page(DUMP_PAGE_SIZE);
+    const KdumpPageDesc zero_desc = { data_offset, DUMP_PAGE_SIZE, 0, 0 };
+    if (!write_at(fd, zero_page.data(), zero_page.size(), data_offset))
+        return false;
+    data_offset += DUMP_PAGE_SIZE;
+
+    // Compress a batch of chunks in parallel, then write them out in order, bounding memory use.
+    struct CompressedChunk
+    {
+        std::vector<char> data;
+        std::vector<KdumpPageDesc> descs;   // offsets relative to data
+    };
+    const size_t batch_size = 8 * (thread_pool().size() + 1);
+    std::vector<CompressedChunk> batch(batch_size);
+
+    for (size_t first = 0; first < chunks.size(); first += batch_size) {
+        const size_t count = std::min(batch_size, chunks.size() - first);
+        const bool ok = thread_pool().parallel_for(count, [&](size_t i) {
+            const DumpChunk& chunk = chunks[first + i];
+            CompressedChunk& out = batch[i];
+            out.data.resize(chunk.size);
+            out.descs.clear();
+
+            size_t used = 0;
+            for (uint64_t pos = 0; pos < chunk.size; pos += DUMP_PAGE_SIZE) {
+                if (is_zero_page(chunk.data + pos)) {
+                    zero_pages++;
+                    out.descs.push_back({ UINT64_MAX, 0, 0, 0 });
+                    continue;
+                }
+
+                // Keep the page uncompressed if compressing doesn't help.
+                uLongf size = DUMP_PAGE_SIZE - 1;
+                if (compress2(reinterpret_cast<Bytef*>(out.data.data() + used), &size,
+                              reinterpret_cast<const Bytef*>(chunk.data + pos), DUMP_PAGE_SIZE, 1) == Z_OK) {
+                    out.descs.push_back({ used, static_cast<uint32_t>(size), KDUMP_COMPRESSED_ZLIB, 0 });
+                } else {
+                    size = DUMP_PAGE_SIZE;
+                    memcpy(out.data.data() + used, chunk.data + pos, size);
+                    out.descs.push_back({ used, static_cast<uint32_t>(size), 0, 0 });
+                }
+                used += size;
+            }
+            out.data.resize(used);
+            return true;
+        });
+        if (!ok)
+            return false;
+
+        for (size_t i = 0; i < count; i++) {
+            CompressedChunk& out = batch[i];
+            for (KdumpPageDesc& desc : out.descs)
+                desc = desc.offset == UINT64_MAX ? zero_desc : KdumpPageDesc{ desc.offset + data_offset, desc.size, desc.flags, 0 };
+
+            if (!write_at(fd, out.descs.data(), out.descs.size() * sizeof(KdumpPageDesc),
+                          desc_offset + chunks[first + i].first_page * sizeof(KdumpPageDesc))
+                || !write_at(fd, out.data.data(), out.data.size(), data_offset))
+                return false;
+            data_offset += out.data.size();
+        }
+    }
+
+    return true;
+}
+
+// Dump the memory of the slice at -rambase, as recorded in the launch log, to -dump.
+bool dump_slice(const Options& options)
+{
+    SliceDumpLayout layout;
+    if (!read_dump_layout(options, layout))
+        return false;
+
+    AutoFd devmem = open("/dev/mem", O_RDONLY);
+    if (devmem < 0) {
+        perror("Error: Failed to open /dev/mem");
+        return false;
+    }
+
+    std::vector<DumpChunk> chunks;
+    std::vector<std::pair<void*, uint64_t>> maps;
+    uint64_t total = 0;
+    for (const auto& [base, size] : layout.ranges) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, devmem, base);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to map slice memory at 0x%" PRIx64 ": %s\n", base, strerror(errno));
+            for (const auto& [map, map_size] : maps)
+                munmap(map, map_size);
+            return false;
+        }
+        maps.push_back({ p, size });
+
+        for (uint64_t offset = 0; offset < size; offset += DUMP_CHUNK_SIZE) {
+            chunks.push_back({ .data = static_cast<const char*>(p) + offset,
+                               .size = std::min<uint64_t>(DUMP_CHUNK_SIZE, size - offset),
+                               .first_page = (total + offset) / DUMP_PAGE_SIZE });
+        }
+        total += size;
+    }
+
+    AutoFd out = open(options.dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0) {
+        perror("Error: Failed to create dump file");
+        return false;
+    }
+
+    printf("Dumping %" PRIu64 " MiB of slice memory in %zu ranges to %s\n", total >> 20, layout.ranges.size(),
+           options.dump_path);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> zero_pages = 0;
+    const bool ok = options.dump_compressed
+        ? write_kdump(out, layout, chunks, zero_pages)
+        : write_elf_dump(out, layout, chunks, zero_pages);
+
+    for (const auto& [map, map_size] : maps)
+        munmap(map, map_size);
+    if (!ok)
+        return false;
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    struct stat st;
+    const uint64_t file_size = fstat(out, &st) == 0 ? st.st_blocks * 512 : 0;
+    printf("Dumped in %.1f ms (%.2f GiB/s): %" PRIu64 " zero pages skipped, %" PRIu64 " MiB on disk\n",
+           ms, ms > 0 ? total / double(1 << 30) / (ms / 1000) : 0.0, zero_pages.load(), file_size >> 20);
+    if (!layout.text_size)
+        fprintf(stderr, "Warning: the launch record has no Linux kernel layout; crash must find phys_base itself\n");
+
+    return true;
+}
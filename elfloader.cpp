@@ -0,0 +1,412 @@
+#include <elf.h>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "multiboot2.h"
+#include "runslice.h"
+
+// Loader for bare-metal and unikernel payloads: a statically-linked ELF image, optionally with
+// a Multiboot2 header. Both kinds receive a Multiboot2 boot information structure describing
+// the memory map, ACPI tables, command line and modules.
+//
+// Plain ELF64 images are entered in 64-bit mode, with the (identity-mapped) page tables built by
+// the real-mode stub, RDI holding the Multiboot2 magic and RSI the boot information address.
+// Images with a Multiboot2 header are entered in 32-bit protected mode with paging disabled, and
+// EAX/EBX set as the specification requires.
+
+struct ElfImage
+{
+    uint64_t entry;     // physical address
+    uint64_t load_end;  // end of the highest segment
+};
+
+static bool check_range(const Options& options, uint64_t ram_top, uint64_t base, uint64_t size)
+{
+    return base >= options.rambase && base <= ram_top && size <= ram_top - base;
+}
+
+template<typename Ehdr, typename Phdr>
+static bool load_segments(
+    const Options& options,
+    const std::vector<char>& image,
+    void* slice_ram,
+    uint64_t ram_top,
+    uint16_t machine,
+    ElfImage& result)
+{
+    const Ehdr* ehdr = reinterpret_cast<const Ehdr*>(image.data());
+    if (image.size() < sizeof(*ehdr) || ehdr->e_type != ET_EXEC || ehdr->e_machine != machine
+        || ehdr->e_phentsize != sizeof(Phdr)
+        || ehdr->e_phoff + ehdr->e_phnum * sizeof(Phdr) > image.size()) {
+        std::cerr << "Invalid ELF image: not a static x86 executable" << std::endl;
+        return false;
+    }
+
+    const Phdr* phdrs = reinterpret_cast<const Phdr*>(image.data() + ehdr->e_phoff);
+    bool have_entry = false;
+    result.load_end = 0;
+
+    for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+        const Phdr& ph = phdrs[i];
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+            continue;
+
+        if (ph.p_filesz > ph.p_memsz || ph.p_offset + ph.p_filesz > image.size()) {
+            std::cerr << "Invalid ELF image: segment " << i << " is truncated" << std::endl;
+            return false;
+        }
+
+        if (!check_range(options, ram_top, ph.p_paddr, ph.p_memsz)) {
+            fprintf(stderr, "Error: ELF segment at 0x%lx-0x%lx is outside slice RAM\n",
+                    static_cast<uint64_t>(ph.p_paddr), static_cast<uint64_t>(ph.p_paddr + ph.p_memsz - 1));
+            return false;
+        }
+
+        printf("Loading ELF segment at 0x%lx (0x%lx bytes)\n",
+               static_cast<uint64_t>(ph.p_paddr), static_cast<uint64_t>(ph.p_memsz));
+
+        char* dest = static_cast<char*>(slice_ram) + (ph.p_paddr - options.rambase);
+        memcpy(dest, image.data() + ph.p_offset, ph.p_filesz);
+        memset(dest + ph.p_filesz, 0, ph.p_memsz - ph.p_filesz);
+
+        result.load_end = std::max<uint64_t>(result.load_end, ph.p_paddr + ph.p_memsz);
+
+        // We run with an identity map, so translate the entry point to its physical address.
+        if (ehdr->e_entry >= ph.p_vaddr && ehdr->e_entry - ph.p_vaddr < ph.p_memsz) {
+            result.entry = ehdr->e_entry - ph.p_vaddr + ph.p_paddr;
+            have_entry = true;
+        }
+    }
+
+    if (!have_entry) {
+        std::cerr << "Invalid ELF image: entry point is not in a loaded segment" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Find and check the Multiboot2 header, if any. Returns false if the image requires something
+// we can't provide.
+static bool parse_multiboot2_header(const std::vector<char>& image, bool& found, uint64_t& entry)
+{
+    found = false;
+
+    const size_t search_end = std::min(image.size(), MULTIBOOT2_SEARCH);
+    const multiboot2_header* hdr = nullptr;
+    for (size_t off = 0; off + sizeof(*hdr) <= search_end; off += MULTIBOOT2_TAG_ALIGN) {
+        const multiboot2_header* h = reinterpret_cast<const multiboot2_header*>(image.data() + off);
+        if (h->magic == MULTIBOOT2_HEADER_MAGIC
+            && h->magic + h->architecture + h->header_length + h->checksum == 0
+            && h->header_length >= sizeof(*h) && off + h->header_length <= image.size()) {
+            hdr = h;
+            break;
+        }
+    }
+
+    if (hdr == nullptr)
+        return true;
+
+    found = true;
+    if (hdr->architecture != MULTIBOOT2_ARCHITECTURE_I386) {
+        std::cerr << "Unsupported Multiboot2 architecture" << std::endl;
+        return false;
+    }
+
+    const char* const end = reinterpret_cast<const char*>(hdr) + hdr->header_length;
+    const char* p = reinterpret_cast<const char*>(hdr + 1);
+    while (p + sizeof(multiboot2_header_tag) <= end) {
+        const multiboot2_header_tag* tag = reinterpret_cast<const multiboot2_header_tag*>(p);
+        if (tag->type == MULTIBOOT2_HEADER_TAG_END || tag->size < sizeof(*tag) || p + tag->size > end)
+            break;
+
+        const bool optional = tag->flags & MULTIBOOT2_HEADER_TAG_OPTIONAL;
+        switch (tag->type) {
+        case MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST: {
+            const uint32_t* requests = reinterpret_cast<const uint32_t*>(tag + 1);
+            for (size_t i = 0; i < (tag->size - sizeof(*tag)) / sizeof(uint32_t); i++) {
+                switch (requests[i]) {
+                case MULTIBOOT2_TAG_TYPE_CMDLINE:
+                case MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME:
+                case MULTIBOOT2_TAG_TYPE_MODULE:
+                case MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO:
+                case MULTIBOOT2_TAG_TYPE_MMAP:
+                case MULTIBOOT2_TAG_TYPE_ACPI_NEW:
+                    break;
+                default:
+                    if (!optional) {
+                        fprintf(stderr, "Error: image requires unsupported Multiboot2 information (type %u)\n", requests[i]);
+                        return false;
+                    }
+                }
+            }
+            break;
+        }
+
+        case MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS:
+            entry = reinterpret_cast<const multiboot2_header_tag_entry_address*>(tag)->entry_addr;
+            break;
+
+        // We load at the ELF physical addresses, which satisfies any relocation constraints, and
+        // page-align modules. The EFI tags are only relevant when booted from EFI.
+        case MULTIBOOT2_HEADER_TAG_CONSOLE_FLAGS:
+        case MULTIBOOT2_HEADER_TAG_MODULE_ALIGN:
+        case MULTIBOOT2_HEADER_TAG_EFI_BS:
+        case MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI64:
+        case MULTIBOOT2_HEADER_TAG_RELOCATABLE:
+            break;
+
+        default:
+            if (!optional) {
+                fprintf(stderr, "Error: unsupported Multiboot2 header tag %u\n", tag->type);
+                return false;
+            }
+        }
+
+        p += ALIGN_UP(tag->size, MULTIBOOT2_TAG_ALIGN);
+    }
+
+    return true;
+}
+
+// Builder for the boot information structure.
+class BootInfo
+{
+    std::vector<char> m_buf;
+
+public:
+    BootInfo() : m_buf(sizeof(multiboot2_info_header), 0) {}
+
+    template<typename T>
+    T* add(uint32_t type, size_t extra = 0)
+    {
+        const size_t offset = m_buf.size();
+        const size_t size = sizeof(T) + extra;
+        m_buf.resize(offset + ALIGN_UP(size, MULTIBOOT2_TAG_ALIGN), 0);
+
+        multiboot2_tag* tag = reinterpret_cast<multiboot2_tag*>(m_buf.data() + offset);
+        tag->type = type;
+        tag->size = size;
+        return reinterpret_cast<T*>(tag);
+    }
+
+    void add_string(uint32_t type, const char* str)
+    {
+        const size_t len = strlen(str) + 1;
+        memcpy(add<multiboot2_tag>(type, len) + 1, str, len);
+    }
+
+    const std::vector<char>& finish()
+    {
+        add<multiboot2_tag>(MULTIBOOT2_TAG_TYPE_END);
+        reinterpret_cast<multiboot2_info_header*>(m_buf.data())->total_size = m_buf.size();
+        return m_buf;
+    }
+};
+
+static bool load_module(
+    const char* path,
+    const char* component,
+    uintptr_t loadaddr_phys,
+    char* loadaddr_virt,
+    uint64_t max_size,
+    uint64_t& size)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::in);
+    if (!file.is_open()) {
+        fprintf(stderr, "Failed to open module %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    file.seekg(0, std::ios::end);
+    size = file.tellg();
+    if (size > max_size) {
+        fprintf(stderr, "Error: module %s does not fit in slice RAM\n", path);
+        return false;
+    }
+
+    Sha256 hash;
+    if (!read_to_devmem(path, 0, loadaddr_virt, size, &hash)) {
+        fprintf(stderr, "Failed to read module %s\n", path);
+        return false;
+    }
+
+    record_measurement(component, path, hash.finish());
+    printf("Loaded module %s at 0x%lx\n", path, loadaddr_phys);
+
+    return true;
+}
+
+bool load_elf(const Options& options, void* slice_ram, KernelEntry& entry)
+{
+    if (options.seed_dir || options.hostname) {
+        std::cerr << "Cloud-init seeds are only supported for Linux kernels" << std::endl;
+        return false;
+    }
+
+    if (options.clock_page) {
+        std::cerr << "The shared clock page is only supported for Linux kernels" << std::endl;
+        return false;
+    }
+
+    // The ELF image fixes its own load addresses, so only the persistent-memory images and the
+    // hotplug mailbox are planned, at the top of slice RAM.
+    SliceLayout layout(options);
+    std::vector<MemRegion> regions;
+    if (!plan_pmem_images(options, layout, regions) || !reserve_hotplug_mailbox(options, layout, regions)
+        || !layout.check(options) || !load_pmem_images(options, slice_ram, regions))
+        return false;
+    write_hotplug_mailbox(options, slice_ram);
+    const uint64_t ram_top = layout.top;
+    record_slice_layout(layout);
+
+    // Payloads are expected to be small, so read (and measure) the whole file up front.
+    std::vector<char> image;
+    {
+        std::ifstream file(options.kernel_path, std::ios::binary | std::ios::in);
+        if (!file.is_open()) {
+            perror("Failed to open kernel image");
+            return false;
+        }
+
+        file.seekg(0, std::ios::end);
+        image.resize(file.tellg());
+        if (!file.seekg(0) || !file.read(image.data(), image.size())) {
+            perror("Failed to read kernel image");
+            return false;
+        }
+
+        Sha256 hash;
+        hash.update(image.data(), image.size());
+        record_measurement("kernel", options.kernel_path, hash.finish());
+    }
+
+    bool multiboot2;
+    uint64_t multiboot2_entry = 0;
+    if (!parse_multiboot2_header(image, multiboot2, multiboot2_entry))
+        return false;
+
+    ElfImage elf;
+    const bool ok = image.size() > EI_CLASS && image[EI_CLASS] == ELFCLASS64
+        ? load_segments<Elf64_Ehdr, Elf64_Phdr>(options, image, slice_ram, ram_top, EM_X86_64, elf)
+        : load_segments<Elf32_Ehdr, Elf32_Phdr>(options, image, slice_ram, ram_top, EM_386, elf);
+    if (!ok)
+        return false;
+
+    if (!multiboot2 && image[EI_CLASS] != ELFCLASS64) {
+        std::cerr << "32-bit ELF images require a Multiboot2 header" << std::endl;
+        return false;
+    }
+
+    if (multiboot2_entry)
+        elf.entry = multiboot2_entry;
+
+    printf("Loaded %s image, entry point 0x%lx\n", multiboot2 ? "Multiboot2" : "ELF64", elf.entry);
+
+    uintptr_t loadaddr_phys = ALIGN_UP(elf.load_end, 0x1000);
+    char* loadaddr_virt = static_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+    // ACPI tables.
+    std::vector<char> acpi_tables;
+    uintptr_t mmconfig_base = 0;
+    const uintptr_t rsdp_pa = build_acpi(options, loadaddr_phys, acpi_tables, mmconfig_base);
+    if (rsdp_pa == 0)
+        return false;
+    if (!check_range(options, ram_top, loadaddr_phys, acpi_tables.size())) {
+        std::cerr << "Slice RAM is too small for the ACPI tables" << std::endl;
+        return false;
+    }
+    memcpy(loadaddr_virt, acpi_tables.data(), acpi_tables.size());
+    loadaddr_phys += acpi_tables.size();
+    loadaddr_virt += acpi_tables.size();
+
+    BootInfo info;
+    info.add_string(MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME, "sliceloader");
+    info.add_string(MULTIBOOT2_TAG_TYPE_CMDLINE, options.kernel_cmdline ? options.kernel_cmdline : "");
+
+    // Modules: the initrd (if any) followed by each -module, in order.
+    std::vector<const char*> modules;
+    if (options.initrd_path)
+        modules.push_back(options.initrd_path);
+    modules.insert(modules.end(), options.module_paths.begin(), options.module_paths.end());
+
+    for (size_t i = 0; i < modules.size(); i++) {
+        loadaddr_phys = ALIGN_UP(loadaddr_phys, 0x1000);
+        loadaddr_virt = static_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+        const std::string component = (options.initrd_path && i == 0) ? "initrd" : "module" + std::to_string(i);
+        uint64_t size;
+        if (!check_range(options, ram_top, loadaddr_phys, 0)
+            || !load_module(modules[i], component.c_str(), loadaddr_phys, loadaddr_virt, ram_top - loadaddr_phys, size))
+            return false;
+
+        const size_t len = strlen(modules[i]) + 1;
+        if (loadaddr_phys + size <= UINT32_MAX) {
+            multiboot2_tag_module* tag = info.add<multiboot2_tag_module>(MULTIBOOT2_TAG_TYPE_MODULE, len);
+            tag->mod_start = loadaddr_phys;
+            tag->mod_end = loadaddr_phys + size;
+            memcpy(tag->cmdline, modules[i], len);
+        } else {
+            multiboot2_tag_module64* tag = info.add<multiboot2_tag_module64>(MULTIBOOT2_TAG_TYPE_SLICE_MODULE64, len);
+            tag->mod_start = loadaddr_phys;
+            tag->mod_end = loadaddr_phys + size;
+            memcpy(tag->cmdline, modules[i], len);
+        }
+
+        loadaddr_phys += size;
+        loadaddr_virt += size;
+    }
+
+    // Our RAM is not contiguous from 1MiB, so there is no upper memory in the legacy sense.
+    multiboot2_tag_basic_meminfo* meminfo = info.add<multiboot2_tag_basic_meminfo>(MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO);
+    meminfo->mem_lower = 639;
+    meminfo->mem_upper = 0;
+
+    {
+        const std::vector<MemRegion> map = build_memory_map(options, mmconfig_base, ram_top, regions);
+        multiboot2_tag_mmap* mmap = info.add<multiboot2_tag_mmap>(
+            MULTIBOOT2_TAG_TYPE_MMAP, map.size() * sizeof(multiboot2_mmap_entry));
+        mmap->entry_size = sizeof(multiboot2_mmap_entry);
+        mmap->entry_version = 0;
+        for (size_t i = 0; i < map.size(); i++)
+            mmap->entries[i] = { .addr = map[i].base, .len = map[i].size, .type = map[i].e820_type, .zero = 0 };
+    }
+
+    {
+        // The tag holds a copy of the RSDP, which is now in slice RAM.
+        const char* rsdp = static_cast<const char*>(slice_ram) + (rsdp_pa - options.rambase);
+        uint32_t rsdp_len;
+        memcpy(&rsdp_len, rsdp + 20, sizeof(rsdp_len));
+        memcpy(info.add<multiboot2_tag>(MULTIBOOT2_TAG_TYPE_ACPI_NEW, rsdp_len) + 1, rsdp, rsdp_len);
+    }
+
+    const std::vector<char>& info_buf = info.finish();
+    loadaddr_phys = ALIGN_UP(loadaddr_phys, MULTIBOOT2_TAG_ALIGN);
+    loadaddr_virt = static_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+    if (!check_range(options, ram_top, loadaddr_phys, info_buf.size())) {
+        std::cerr << "Slice RAM is too small for the payload, modules and pmem images" << std::endl;
+        return false;
+    }
+
+    memcpy(loadaddr_virt, info_buf.data(), info_buf.size());
+
+    // Everything was loaded from the bottom up, or carved from the top.
+    record_devmem_write(options.rambase, loadaddr_phys + info_buf.size() - options.rambase);
+    record_devmem_write(ram_top, options.rambase + options.ramsize - ram_top);
+
+    entry.entry = elf.entry;
+    entry.arg = loadaddr_phys;
+    entry.magic = MULTIBOOT2_BOOTLOADER_MAGIC;
+    entry.protected_mode = multiboot2;
+
+    if (multiboot2 && (entry.entry > UINT32_MAX || entry.arg > UINT32_MAX)) {
+        std::cerr << "Multiboot2 images must be loaded below 4GiB" << std::endl;
+        return false;
+    }
+
+    return true;
+}
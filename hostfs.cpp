@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include "runslice.h"
+
+// All accesses to /sys and /proc go through host_path(), so that device preparation can be
+// exercised against a fake tree (see the -hostroot option).
+static std::string host_root;
+
+void set_host_root(const char* root)
+{
+    host_root = root;
+    while (!host_root.empty() && host_root.back() == '/')
+        host_root.pop_back();
+}
+
+std::string host_path(const std::string& path)
+{
+    return host_root + path;
+}
+
+bool read_host_file(const std::string& path, std::string& value)
+{
+    AutoFd fd = open(host_path(path).c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0)
+        return false;
+
+    value.assign(buf, len);
+    while (!value.empty() && (value.back() == '\n' || value.back() == ' '))
+        value.pop_back();
+
+    return true;
+}
+
+bool read_host_file(const std::string& path, uint64_t& value)
+{
+    std::string str;
+    if (!read_host_file(path, str))
+        return false;
+
+    char* end;
+    value = strtoull(str.c_str(), &end, 0);
+    return end != str.c_str() && *end == '\0';
+}
+
+bool write_host_file(const std::string& path, const std::string& value)
+{
+    AutoFd fd = open(host_path(path).c_str(), O_WRONLY);
+    if (fd < 0 || write(fd, value.data(), value.size()) != static_cast<ssize_t>(value.size())) {
+        fprintf(stderr, "Failed to write '%s' to %s: %s\n", value.c_str(), path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Return the final component of a symlink's target, e.g. the PCI address of a virtfnN link.
+bool read_host_link(const std::string& path, std::string& target)
+{
+    char buf[PATH_MAX];
+    ssize_t len = readlink(host_path(path).c_str(), buf, sizeof(buf) - 1);
+    if (len < 0)
+        return false;
+
+    buf[len] = '\0';
+    const char* base = strrchr(buf, '/');
+    target = base ? base + 1 : buf;
+    return true;
+}
+
+// List the names of entries in a directory, in sorted order.
+bool list_host_dir(const std::string& path, std::vector<std::string>& names)
+{
+    std::error_code err;
+    std::filesystem::directory_iterator it(host_path(path), err);
+    if (err)
+        return false;
+
+    names.clear();
+    for (const auto& entry : it)
+        names.push_back(entry.path().filename().string());
+    std::sort(names.begin(), names.end());
+
+    return true;
+}
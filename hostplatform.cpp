@@ -0,0 +1,246 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "hostplatform.h"
+#include "runslice.h"
+
+static const char* const HOST_TABLES[] = { "APIC", "MCFG" };
+static_assert(sizeof(HOST_TABLES) / sizeof(HOST_TABLES[0]) == sizeof(host_platform_header::tables) / sizeof(host_platform_table));
+
+static bool read_boot_id(std::string& boot_id)
+{
+    if (!read_host_file("/proc/sys/kernel/random/boot_id", boot_id)
+        || boot_id.size() >= sizeof(host_platform_header::boot_id))
+    {
+        fprintf(stderr, "Failed to read host boot ID\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_table_ids(host_platform_table* tables)
+{
+    for (size_t i = 0; i < sizeof(HOST_TABLES) / sizeof(HOST_TABLES[0]); i++) {
+        memset(&tables[i], 0, sizeof(tables[i]));
+        memcpy(tables[i].signature, HOST_TABLES[i], sizeof(tables[i].signature));
+        if (!acpi_read_host_table_id(HOST_TABLES[i], tables[i].length, tables[i].checksum)) {
+            fprintf(stderr, "Failed to read host %s table\n", HOST_TABLES[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Map from Linux CPU number to APIC ID for CPUs that are online on the host.
+bool get_online_apic_ids(std::map<uint32_t, uint32_t>& online_ids)
+{
+    std::ifstream cpuinfo(host_path("/proc/cpuinfo"));
+    if (!cpuinfo.is_open()) {
+        perror("Failed to open /proc/cpuinfo");
+        return false;
+    }
+
+    uint32_t processor = UINT32_MAX;
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+
+        const std::string key = line.substr(0, line.find_first_of(" \t"));
+        const uint32_t value = strtoul(line.c_str() + colon + 1, nullptr, 0);
+        if (key == "processor")
+            processor = value;
+        else if (key == "apicid" && processor != UINT32_MAX)
+            online_ids[processor] = value;
+    }
+
+    if (online_ids.empty()) {
+        fprintf(stderr, "Error: no APIC IDs found in /proc/cpuinfo\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Host APIC IDs, indexed as Linux numbers CPUs: the boot CPU is 0, and the rest follow in MADT
+// order.
+static bool gather_cpus(const std::vector<uint8_t>& madt, std::vector<uint32_t>& apic_ids)
+{
+    std::map<uint32_t, uint32_t> online_ids;
+    if (!acpi_get_host_apic_ids(madt, apic_ids) || !get_online_apic_ids(online_ids))
+        return false;
+
+    // Linux's CPU 0 can't be taken offline, so it is always listed.
+    auto boot_cpu = online_ids.find(0);
+    auto it = std::find(apic_ids.begin(), apic_ids.end(), boot_cpu == online_ids.end() ? UINT32_MAX : boot_cpu->second);
+    if (it == apic_ids.end()) {
+        fprintf(stderr, "Error: host CPU 0 is missing from the MADT\n");
+        return false;
+    }
+    std::rotate(apic_ids.begin(), it, it + 1);
+
+    return true;
+}
+
+template<typename T>
+static void add_section(std::vector<uint8_t>& file, host_platform_section& section, const std::vector<T>& data)
+{
+    file.resize(ALIGN_UP(file.size(), alignof(T)));
+    section.offset = file.size();
+    section.count = data.size();
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+    file.insert(file.end(), bytes, bytes + data.size() * sizeof(T));
+}
+
+static bool gather(const std::string& boot_id, std::vector<uint8_t>& file)
+{
+    std::vector<uint8_t> madt, mcfg;
+    std::vector<uint32_t> cpus;
+    if (!acpi_read_host_table("APIC", madt) || !acpi_read_host_table("MCFG", mcfg) || !gather_cpus(madt, cpus))
+        return false;
+
+    host_platform_header header = {};
+    memcpy(header.magic, HOST_PLATFORM_MAGIC, sizeof(header.magic));
+    header.version = HOST_PLATFORM_VERSION;
+    strcpy(header.boot_id, boot_id.c_str());
+
+    // The table IDs come from the tables we read, so that a change since is caught next time.
+    for (size_t i = 0; i < 2; i++) {
+        const std::vector<uint8_t>& table = i == 0 ? madt : mcfg;
+        memcpy(header.tables[i].signature, HOST_TABLES[i], sizeof(header.tables[i].signature));
+        header.tables[i].length = table.size();
+        header.tables[i].checksum = table[9];  // ACPI_TABLE_HEADER Checksum
+    }
+
+    file.assign(sizeof(header), 0);
+    add_section(file, header.cpus, cpus);
+    add_section(file, header.mcfg, mcfg);
+    header.size = file.size();
+    memcpy(file.data(), &header, sizeof(header));
+
+    printf("Gathered host platform: %zu CPUs\n", cpus.size());
+
+    return true;
+}
+
+// Write the snapshot under a temporary name and rename it into place, so that concurrent
+// launches only ever see a complete file.
+static bool write_snapshot(const char* path, const std::vector<uint8_t>& file)
+{
+    const std::string dir = std::string(path).substr(0, std::string(path).find_last_of('/'));
+    if (dir != path && !dir.empty())
+        mkdir(dir.c_str(), 0755);
+
+    const std::string tmp_path = std::string(path) + ".tmp" + std::to_string(getpid());
+    AutoFd fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, file.data(), file.size()) != static_cast<ssize_t>(file.size())
+        || rename(tmp_path.c_str(), path) != 0)
+    {
+        fprintf(stderr, "Warning: failed to write host platform cache %s: %s\n", path, strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool HostPlatform::map(const char* path)
+{
+    AutoFd fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(host_platform_header)))
+        return false;
+
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    m_base = static_cast<const uint8_t*>(base);
+    m_size = st.st_size;
+    m_mapped = true;
+    return true;
+}
+
+bool HostPlatform::valid(const std::string& boot_id, const host_platform_table* tables) const
+{
+    const host_platform_header* h = header();
+    if (m_size < sizeof(*h) || memcmp(h->magic, HOST_PLATFORM_MAGIC, sizeof(h->magic)) != 0
+        || h->version != HOST_PLATFORM_VERSION || h->size != m_size)
+    {
+        return false;
+    }
+
+    if (strncmp(h->boot_id, boot_id.c_str(), sizeof(h->boot_id)) != 0
+        || memcmp(h->tables, tables, sizeof(h->tables)) != 0)
+    {
+        return false;
+    }
+
+    auto in_bounds = [this](const host_platform_section& section, size_t size, size_t align) {
+        return section.offset % align == 0 && section.offset <= m_size
+            && section.count <= (m_size - section.offset) / size;
+    };
+
+    return in_bounds(h->cpus, sizeof(uint32_t), alignof(uint32_t))
+        && in_bounds(h->mcfg, sizeof(uint8_t), alignof(uint8_t));
+}
+
+std::unique_ptr<HostPlatform> HostPlatform::open(const char* path)
+{
+    std::string boot_id;
+    host_platform_table tables[2];
+    if (!read_boot_id(boot_id) || !read_table_ids(tables))
+        return nullptr;
+
+    std::unique_ptr<HostPlatform> platform(new HostPlatform);
+    if (platform->map(path) && platform->valid(boot_id, tables))
+        return platform;
+
+    platform.reset(new HostPlatform);
+    std::vector<uint8_t> file;
+    if (!gather(boot_id, file))
+        return nullptr;
+
+    // Prefer to use the file we just wrote, just as a later launch would.
+    if (!write_snapshot(path, file) || !platform->map(path) || !platform->valid(boot_id, tables)) {
+        platform.reset(new HostPlatform);
+        platform->m_owned = std::move(file);
+        platform->m_base = platform->m_owned.data();
+        platform->m_size = platform->m_owned.size();
+    }
+
+    return platform;
+}
+
+HostPlatform::~HostPlatform()
+{
+    if (m_mapped)
+        munmap(const_cast<uint8_t*>(m_base), m_size);
+}
+
+static const char* platform_path = HOST_PLATFORM_DEFAULT_PATH;
+static std::unique_ptr<HostPlatform> platform;
+
+void set_host_platform_path(const char* path)
+{
+    platform_path = path;
+}
+
+const HostPlatform* host_platform()
+{
+    if (!platform)
+        platform = HostPlatform::open(platform_path);
+
+    return platform.get();
+}
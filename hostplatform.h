@@ -0,0 +1,100 @@
+#ifndef HOSTPLATFORM_H
+#define HOSTPLATFORM_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Snapshot of the host facts that every launch needs but that only change across reboots: the
+// host's CPUs (from the MADT) and its MCFG. The first run after boot gathers
+// them into a cache file; later runs map the file and use it in place. The file is rebuilt when
+// the boot ID or the host's MADT/MCFG headers (length and checksum) no longer match.
+//
+// The file is a header followed by sections, each an array of one of the types below. It is
+// only ever read by the runslice that wrote it, so it is in host byte order.
+
+constexpr char HOST_PLATFORM_MAGIC[8] = { 'S', 'L', 'P', 'L', 'A', 'T', 'F', 'M' };
+constexpr uint32_t HOST_PLATFORM_VERSION = 2;
+constexpr const char* HOST_PLATFORM_DEFAULT_PATH = "/run/sliceloader/platform";
+
+struct host_platform_section
+{
+    uint32_t offset;    // from start of file
+    uint32_t count;     // of elements
+};
+
+struct host_platform_table
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t checksum;
+    uint8_t reserved[3];
+};
+
+struct host_platform_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                      // of the whole file
+    char boot_id[40];                   // /proc/sys/kernel/random/boot_id, NUL-terminated
+    host_platform_table tables[2];      // APIC, MCFG
+    host_platform_section cpus;         // uint32_t APIC IDs, indexed by Linux CPU number
+    host_platform_section mcfg;         // uint8_t copy of the host MCFG
+};
+
+// A typed view of one section of the mapped snapshot.
+template<typename T>
+class PlatformView
+{
+public:
+    PlatformView(const T* data, size_t count) : m_data(data), m_count(count) {}
+
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_count; }
+    size_t size() const { return m_count; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+
+private:
+    const T* m_data;
+    size_t m_count;
+};
+
+class HostPlatform
+{
+public:
+    // Map an existing snapshot, or (if it is missing or stale) gather a new one and write it.
+    static std::unique_ptr<HostPlatform> open(const char* path);
+
+    ~HostPlatform();
+
+    PlatformView<uint32_t> cpu_apic_ids() const { return view<uint32_t>(header()->cpus); }
+    PlatformView<uint8_t> mcfg() const { return view<uint8_t>(header()->mcfg); }
+
+private:
+    HostPlatform() = default;
+
+    const uint8_t* m_base = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<uint8_t> m_owned;   // if the snapshot couldn't be written to the cache
+
+    const host_platform_header* header() const { return reinterpret_cast<const host_platform_header*>(m_base); }
+
+    template<typename T>
+    PlatformView<T> view(const host_platform_section& section) const
+    {
+        return PlatformView<T>(reinterpret_cast<const T*>(m_base + section.offset), section.count);
+    }
+
+    bool map(const char* path);
+    bool valid(const std::string& boot_id, const host_platform_table* tables) const;
+};
+
+// The snapshot shared by all of runslice, opened on first use. Returns null (having reported
+// the problem) if the host platform could not be read.
+void set_host_platform_path(const char* path);
+const HostPlatform* host_platform();
+
+#endif
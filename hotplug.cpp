@@ -0,0 +1,384 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "aml.h"
+#include "linuxboot.h"
+#include "runslice.h"
+
+// CPU and memory hot-add. The slice's SSDT declares an ACPI Generic Event Device, a fixed set of
+// memory device slots, and a processor slot for each spare CPU, all backed by a mailbox page that
+// runslice -grow fills in. The GED's interrupt is a pin of an IOAPIC that the host doesn't use;
+// we never raise the pin itself, but send the vector that the guest programmed for it as an IPI.
+static constexpr unsigned MAX_HOTPLUG_MEM = 16;
+static constexpr uint32_t HOTPLUG_GED_GSI = 16;
+static constexpr uint64_t HOTPLUG_MEM_ALIGN = 128 << 20; // memory section size
+
+static constexpr uint32_t HOTPLUG_EVENT_MEM = 1 << 0;
+static constexpr uint32_t HOTPLUG_EVENT_CPU = 1 << 1;
+static constexpr uint32_t HOTPLUG_STATUS_PRESENT = 0xf; // _STA: present, enabled, shown, functional
+
+struct hotplug_mailbox {
+    char magic[4]; // "SLHP"
+    uint32_t version;
+    uint32_t events; // HOTPLUG_EVENT_*, cleared by the GED's _EVT method
+    uint32_t cpu_slots;
+    struct {
+        uint64_t base;
+        uint64_t size;
+        uint32_t status;
+        uint32_t reserved;
+    } __attribute__((packed)) mem[MAX_HOTPLUG_MEM];
+    struct {
+        uint32_t apic_id;
+        uint32_t status;
+    } __attribute__((packed)) cpu[MAX_HOTPLUG_CPUS];
+} __attribute__((packed));
+static_assert(sizeof(hotplug_mailbox) <= 0x1000);
+
+static uint64_t mailbox_pa;
+
+uint64_t hotplug_mailbox_address()
+{
+    return mailbox_pa;
+}
+
+// Carve the mailbox page from the top of slice RAM, and describe the (as yet empty) slots.
+bool reserve_hotplug_mailbox(const Options& options, SliceLayout& layout, std::vector<MemRegion>& regions)
+{
+    if (options.hotplug_ioapic == 0)
+        return true;
+
+    if (!layout.place_top("hotplug mailbox", 0x1000, 0x1000, mailbox_pa))
+        return false;
+
+    regions.push_back({ mailbox_pa, 0x1000, E820_TYPE_RESERVED });
+
+    printf("Hotplug mailbox at 0x%lx\n", mailbox_pa);
+    return true;
+}
+
+void write_hotplug_mailbox(const Options& options, void* slice_ram)
+{
+    if (options.hotplug_ioapic == 0)
+        return;
+
+    hotplug_mailbox* mailbox = reinterpret_cast<hotplug_mailbox*>(static_cast<char*>(slice_ram) + (mailbox_pa - options.rambase));
+    memset(mailbox, 0, 0x1000);
+    memcpy(mailbox->magic, "SLHP", sizeof(mailbox->magic));
+    mailbox->version = 1;
+    mailbox->cpu_slots = options.spare_apic_ids.size();
+    for (size_t i = 0; i < options.spare_apic_ids.size(); i++)
+        mailbox->cpu[i].apic_id = options.spare_apic_ids[i];
+}
+
+static std::string slot_name(const char* format, unsigned n)
+{
+    char name[8];
+    snprintf(name, sizeof(name), format, n);
+    return name;
+}
+
+// The AML for the SSDT. This is the equivalent of the following ASL:
+//
+//   Scope (\_SB) {
+//     OperationRegion (HPMB, SystemMemory, <mailbox>, 0x1000)
+//     Field (HPMB, DWordAcc, NoLock, Preserve) { Offset (8), EVNT, 32, ..., M0BA, 64, M0SZ, 64,
+//                                                M0ST, 32, ..., C00S, 32, ... }
+//     Device (MEM0) { Name (_HID, EisaId ("PNP0C80")) Method (_STA) { Return (M0ST) }
+//                     Method (_CRS, 0, Serialized) { <QWordMemory from M0BA/M0SZ> } }
+//     Device (CP00) { Name (_HID, "ACPI0007") Method (_STA) { Return (C00S) }
+//                     Name (_MAT, <x2APIC entry>) }
+//     Device (GED0) { Name (_HID, "ACPI0013") Name (_CRS, <Interrupt (Edge, ActiveHigh) { 16 }>)
+//                     Method (_EVT, 1, Serialized) { Local0 = EVNT; EVNT = 0
+//                                                    If (Local0 & 1) { Notify (MEM0, 1) ... }
+//                                                    If (Local0 & 2) { Notify (CP00, 1) ... } } }
+//   }
+std::vector<uint8_t> hotplug_aml(const Options& options)
+{
+    std::vector<std::pair<std::string, unsigned>> fields = {
+        { "", 64 },
+        { "EVNT", 32 },
+        { "", 32 },
+    };
+    for (unsigned i = 0; i < MAX_HOTPLUG_MEM; i++) {
+        fields.push_back({ slot_name("M%XBA", i), 64 });
+        fields.push_back({ slot_name("M%XSZ", i), 64 });
+        fields.push_back({ slot_name("M%XST", i), 32 });
+        fields.push_back({ "", 32 });
+    }
+    for (unsigned i = 0; i < options.spare_apic_ids.size(); i++) {
+        fields.push_back({ "", 32 });
+        fields.push_back({ slot_name("C%02XS", i), 32 });
+    }
+
+    std::vector<Aml> terms = {
+        aml_operation_region("HPMB", AML_SYSTEM_MEMORY, mailbox_pa, 0x1000),
+        aml_field("HPMB", AML_DWORD_ACC, fields),
+    };
+    std::vector<Aml> mem_notify, cpu_notify;
+
+    // QWordMemory (ResourceConsumer, PosDecode, MinFixed, MaxFixed, Cacheable, ReadWrite)
+    // with the range filled in at runtime, followed by an end tag.
+    std::vector<uint8_t> memory_crs = { 0x8a, 0x2b, 0x00, 0x00, 0x0d, 0x03 };
+    memory_crs.resize(memory_crs.size() + 5 * sizeof(uint64_t), 0);
+    memory_crs.insert(memory_crs.end(), { 0x79, 0x00 });
+    constexpr unsigned CRS_MIN = 14, CRS_MAX = 22, CRS_LEN = 38;
+
+    for (unsigned i = 0; i < MAX_HOTPLUG_MEM; i++) {
+        const std::string device = slot_name("MEM%X", i);
+        terms.push_back(aml_device(device, {
+            aml_name_decl("_HID", aml_eisaid("PNP0C80")),
+            aml_name_decl("_UID", aml_int(i)),
+            aml_method("_STA", 0, false, { aml_return(aml_name(slot_name("M%XST", i))) }),
+            aml_method("_CRS", 0, true, {
+                aml_name_decl("BUF_", aml_buffer(memory_crs)),
+                aml_create_qword_field(aml_name("BUF_"), CRS_MIN, "MIN_"),
+                aml_create_qword_field(aml_name("BUF_"), CRS_MAX, "MAX_"),
+                aml_create_qword_field(aml_name("BUF_"), CRS_LEN, "LEN_"),
+                aml_store(aml_name(slot_name("M%XBA", i)), aml_name("MIN_")),
+                aml_store(aml_name(slot_name("M%XSZ", i)), aml_name("LEN_")),
+                aml_subtract(aml_add(aml_name(slot_name("M%XBA", i)), aml_name(slot_name("M%XSZ", i))),
+                             aml_int(1), aml_name("MAX_")),
+                aml_return(aml_name("BUF_")),
+            }),
+        }));
+        mem_notify.push_back(aml_notify(aml_name(device), aml_int(1))); // Device Check
+    }
+
+    for (unsigned i = 0; i < options.spare_apic_ids.size(); i++) {
+        const std::string device = slot_name("CP%02X", i);
+        const uint32_t uid = HOTPLUG_CPU_UID_BASE + i;
+        const uint32_t apic_id = options.spare_apic_ids[i];
+
+        // Local x2APIC structure, as in the MADT, but enabled.
+        std::vector<uint8_t> mat = { 9, 16, 0, 0 };
+        for (uint32_t value : { apic_id, 1u, uid })
+            for (int b = 0; b < 4; b++)
+                mat.push_back(static_cast<uint8_t>(value >> (8 * b)));
+
+        terms.push_back(aml_device(device, {
+            aml_name_decl("_HID", aml_string("ACPI0007")),
+            aml_name_decl("_UID", aml_int(uid)),
+            aml_method("_STA", 0, false, { aml_return(aml_name(slot_name("C%02XS", i))) }),
+            aml_name_decl("_MAT", aml_buffer(mat)),
+        }));
+        cpu_notify.push_back(aml_notify(aml_name(device), aml_int(1)));
+    }
+
+    // Extended Interrupt (ResourceConsumer, Edge, ActiveHigh, Exclusive), followed by an end tag.
+    std::vector<uint8_t> ged_crs = { 0x89, 0x06, 0x00, 0x03, 0x01 };
+    for (int b = 0; b < 4; b++)
+        ged_crs.push_back(static_cast<uint8_t>(HOTPLUG_GED_GSI >> (8 * b)));
+    ged_crs.insert(ged_crs.end(), { 0x79, 0x00 });
+
+    std::vector<Aml> evt = {
+        aml_store(aml_name("EVNT"), aml_local(0)),
+        aml_store(aml_int(0), aml_name("EVNT")),
+        aml_if(aml_and(aml_local(0), aml_int(HOTPLUG_EVENT_MEM)), mem_notify),
+    };
+    if (!cpu_notify.empty())
+        evt.push_back(aml_if(aml_and(aml_local(0), aml_int(HOTPLUG_EVENT_CPU)), cpu_notify));
+
+    terms.push_back(aml_device("GED0", {
+        aml_name_decl("_HID", aml_string("ACPI0013")),
+        aml_name_decl("_UID", aml_int(0)),
+        aml_name_decl("_CRS", aml_buffer(ged_crs)),
+        aml_method("_EVT", 1, true, evt),
+    }));
+
+    return aml_scope("\\_SB_", terms);
+}
+
+// Access the slice's IOAPIC through its index and data registers.
+static uint32_t ioapic_read(volatile uint32_t* ioapic, uint32_t reg)
+{
+    ioapic[0] = reg;
+    return ioapic[4];
+}
+
+// Send the guest the GED's interrupt, using the vector and destination it programmed into the
+// IOAPIC redirection entry.
+static bool signal_hotplug_event(AutoFd& devmem, uint64_t ioapic_addr)
+{
+    void* regs = mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, ioapic_addr);
+    if (regs == MAP_FAILED) {
+        perror("Error: Failed to map IOAPIC");
+        return false;
+    }
+
+    volatile uint32_t* ioapic = static_cast<volatile uint32_t*>(regs);
+    const uint32_t max_entry = (ioapic_read(ioapic, 1) >> 16) & 0xff;
+    uint32_t low = 0, high = 0;
+    if (HOTPLUG_GED_GSI <= max_entry) {
+        low = ioapic_read(ioapic, 0x10 + 2 * HOTPLUG_GED_GSI);
+        high = ioapic_read(ioapic, 0x11 + 2 * HOTPLUG_GED_GSI);
+    }
+    munmap(regs, 0x1000);
+
+    if (HOTPLUG_GED_GSI > max_entry) {
+        fprintf(stderr, "Error: IOAPIC at 0x%lx has no pin %u\n", ioapic_addr, HOTPLUG_GED_GSI);
+        return false;
+    }
+
+    // The guest owns the entry; it should be unmasked, fixed delivery, physical destination.
+    const uint8_t vector = low & 0xff;
+    if ((low & 0x10000) || (low & 0xf00) != 0 || vector < 0x10) {
+        fprintf(stderr, "Warning: the slice has not enabled its hotplug interrupt; "
+                        "the new resources will be seen on its next ACPI rescan\n");
+        return true;
+    }
+
+    const uint32_t dest = high >> 24;
+    printf("Signalling hotplug event: vector 0x%x to APIC ID %u\n", vector, dest);
+    return send_fixed_ipi(devmem, dest, vector);
+}
+
+// Hand additional (offline) CPUs and (host-unused) memory ranges to a running slice. The slice's
+// mailbox and IOAPIC are found from its launch record.
+bool grow_slice(const Options& options)
+{
+    std::vector<std::pair<std::string, std::string>> record;
+    if (!read_launch_record(options.log_path, options.rambase, record))
+        return false;
+
+    uint64_t mailbox_addr = 0, ioapic_addr = 0, ramsize = 0;
+    for (const auto& [key, value] : record) {
+        if (key == "hotplug")
+            sscanf(value.c_str(), "%lx %lx", &mailbox_addr, &ioapic_addr);
+        else if (key == "ramsize")
+            ramsize = strtoull(value.c_str(), nullptr, 0);
+    }
+
+    if (mailbox_addr == 0 || ioapic_addr == 0) {
+        fprintf(stderr, "Error: slice at 0x%lx was not launched with -hotplug\n", options.rambase);
+        return false;
+    }
+
+    // Added memory must not overlap low memory, or anything any live slice (this one included)
+    // is using: its RAM, far memory, clock page, datasets, or memory it was already given.
+    std::vector<std::pair<uint64_t, uint64_t>> in_use = { { 0, 0x100000 }, { options.rambase, ramsize } };
+    std::vector<std::pair<uint64_t, uint64_t>> live_mem;
+    if (!options.grow_mem.empty() && !read_live_memory(options.log_path, live_mem))
+        return false;
+    in_use.insert(in_use.end(), live_mem.begin(), live_mem.end());
+
+    AutoFd devmem = open("/dev/mem", O_RDWR);
+    if (devmem < 0) {
+        perror("Error: Failed to open /dev/mem");
+        return false;
+    }
+
+    void* page = mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, mailbox_addr);
+    if (page == MAP_FAILED) {
+        perror("Error: Failed to map hotplug mailbox");
+        return false;
+    }
+
+    hotplug_mailbox* mailbox = static_cast<hotplug_mailbox*>(page);
+    bool ok = memcmp(mailbox->magic, "SLHP", sizeof(mailbox->magic)) == 0 && mailbox->version == 1;
+    if (!ok)
+        fprintf(stderr, "Error: invalid hotplug mailbox at 0x%lx\n", mailbox_addr);
+
+    // Find a slot for each CPU and memory range, checking for conflicts.
+    std::vector<unsigned> cpu_slots, mem_slots;
+    for (uint32_t apic_id : options.apic_ids) {
+        unsigned slot = 0;
+        while (ok && slot < mailbox->cpu_slots && mailbox->cpu[slot].apic_id != apic_id)
+            slot++;
+
+        if (!ok || slot == mailbox->cpu_slots || mailbox->cpu[slot].status != 0) {
+            fprintf(stderr, "Error: APIC ID %u is not a spare CPU of this slice, or was already added\n", apic_id);
+            ok = false;
+            break;
+        }
+        cpu_slots.push_back(slot);
+    }
+
+    for (const auto& [base, size] : options.grow_mem) {
+        if (!ok)
+            break;
+
+        if (base % HOTPLUG_MEM_ALIGN != 0 || size % HOTPLUG_MEM_ALIGN != 0 || size == 0) {
+            fprintf(stderr, "Error: added memory must be aligned to %lu MiB\n", HOTPLUG_MEM_ALIGN >> 20);
+            ok = false;
+            break;
+        }
+
+        auto overlaps = [base = base, size = size](uint64_t other_base, uint64_t other_size) {
+            return base < other_base + other_size && other_base < base + size;
+        };
+
+        for (const auto& [other_base, other_size] : in_use) {
+            if (overlaps(other_base, other_size)) {
+                fprintf(stderr, "Error: memory 0x%lx-0x%lx overlaps low memory or memory in use by a slice "
+                        "(0x%lx-0x%lx)\n", base, base + size - 1, other_base, other_base + other_size - 1);
+                ok = false;
+                break;
+            }
+        }
+        if (!ok)
+            break;
+
+        unsigned free_slot = MAX_HOTPLUG_MEM;
+        for (unsigned i = 0; ok && i < MAX_HOTPLUG_MEM; i++) {
+            if (mailbox->mem[i].status != 0 || std::find(mem_slots.begin(), mem_slots.end(), i) != mem_slots.end())
+                ok = !overlaps(mailbox->mem[i].base, mailbox->mem[i].size);
+            else if (free_slot == MAX_HOTPLUG_MEM)
+                free_slot = i;
+        }
+
+        if (!ok || free_slot == MAX_HOTPLUG_MEM) {
+            fprintf(stderr, "Error: memory 0x%lx-0x%lx overlaps the slice, or no slots are free\n", base, base + size - 1);
+            ok = false;
+            break;
+        }
+
+        mailbox->mem[free_slot].base = base;
+        mailbox->mem[free_slot].size = size;
+        mem_slots.push_back(free_slot);
+    }
+
+    // Clear the new memory before the guest can see it, and reset the new CPUs to wait-for-SIPI,
+    // from which the guest will start them.
+    for (size_t i = 0; ok && i < options.grow_mem.size(); i++) {
+        const auto& [base, size] = options.grow_mem[i];
+        void* ram = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, base);
+        if (ram == MAP_FAILED) {
+            perror("Error: Failed to map added memory");
+            ok = false;
+            break;
+        }
+
+        printf("Clearing memory 0x%lx-0x%lx\n", base, base + size - 1);
+        clear_devmem(ram, size);
+        munmap(ram, size);
+    }
+
+    for (size_t i = 0; ok && i < options.apic_ids.size(); i++)
+        ok = send_init_ipi(devmem, options.apic_ids[i]);
+
+    // Publish the slots, then the events, then tell the guest.
+    uint32_t events = 0;
+    if (ok) {
+        for (unsigned slot : mem_slots)
+            __atomic_store_n(&mailbox->mem[slot].status, HOTPLUG_STATUS_PRESENT, __ATOMIC_RELEASE);
+        for (unsigned slot : cpu_slots)
+            __atomic_store_n(&mailbox->cpu[slot].status, HOTPLUG_STATUS_PRESENT, __ATOMIC_RELEASE);
+
+        events = (mem_slots.empty() ? 0 : HOTPLUG_EVENT_MEM) | (cpu_slots.empty() ? 0 : HOTPLUG_EVENT_CPU);
+        __atomic_fetch_or(&mailbox->events, events, __ATOMIC_SEQ_CST);
+    }
+
+    munmap(page, 0x1000);
+
+    if (!ok)
+        return false;
+
+    printf("Added %zu CPUs and %zu memory ranges to the slice at 0x%lx\n", cpu_slots.size(), mem_slots.size(), options.rambase);
+
+    return append_grow_log(options, options.log_path) && signal_hotplug_event(devmem, ioapic_addr);
+}
@@ -0,0 +1,505 @@
+// Cloning golden images for sliceimg: a parallel sparse copy, then per-clone identity patching.
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "sliceimg.h"
+
+static constexpr size_t DIRECT_IO_ALIGN = 0x1000;    // O_DIRECT alignment
+static constexpr size_t CHUNK_SIZE = 0x100000;  // unit of work for the copy threads
+static constexpr size_t GPT_ENTRIES_MAX = 0x4000;    // 128 entries of 128 bytes
+
+static bool get_size(int fd, uint64_t& size)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKGETSIZE64, &size) == 0;
+
+    size = st.st_size;
+    return true;
+}
+
+static bool is_block_device(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+//
+// Loop devices. Their logical block size must match the GPT's sector size, or the kernel won't
+// find the partitions.
+//
+
+LoopDevice::~LoopDevice()
+{
+    if (m_fd >= 0)
+        ioctl(m_fd, LOOP_CLR_FD, 0);
+}
+
+bool LoopDevice::attach(const char* file, uint32_t sector_size)
+{
+    AutoFd ctl = open("/dev/loop-control", O_RDWR);
+    int num = ctl < 0 ? -1 : ioctl(ctl, LOOP_CTL_GET_FREE);
+    if (num < 0) {
+        perror("Failed to allocate loop device");
+        return false;
+    }
+
+    AutoFd backing = open(file, O_RDWR);
+    if (backing < 0) {
+        perror("Failed to open image");
+        return false;
+    }
+
+    m_path = "/dev/loop" + std::to_string(num);
+    m_fd = open(m_path.c_str(), O_RDWR);
+    if (m_fd < 0) {
+        perror("Failed to open loop device");
+        return false;
+    }
+
+    loop_config config = {};
+    config.fd = backing;
+    config.block_size = sector_size;
+    config.info.lo_flags = LO_FLAGS_PARTSCAN | LO_FLAGS_AUTOCLEAR;
+    strncpy(reinterpret_cast<char*>(config.info.lo_file_name), file, LO_NAME_SIZE - 1);
+    if (ioctl(m_fd, LOOP_CONFIGURE, &config) != 0) {
+        perror("Failed to configure loop device");
+        m_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Parallel copy. The golden image is split into chunks, each either copied or zeroed, which
+// are handed out to a pool of threads that keep up to qd requests in flight.
+//
+
+struct CopyWork
+{
+    uint64_t offset;
+    uint64_t length;
+    bool hole;
+};
+
+static void list_work(int fd, uint64_t size, bool assume_zeroed, std::vector<CopyWork>& work)
+{
+    auto add = [&](uint64_t start, uint64_t end, bool hole) {
+        if (hole && assume_zeroed)
+            return;
+        for (uint64_t off = start; off < end; off += CHUNK_SIZE)
+            work.push_back({ off, std::min<uint64_t>(CHUNK_SIZE, end - off), hole });
+    };
+
+    uint64_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        uint64_t data_start = (data < 0) ? size : std::min<uint64_t>(data & ~(DIRECT_IO_ALIGN - 1), size);
+        add(pos, data_start, true);
+        if (data_start >= size)
+            break;
+
+        off_t hole = lseek(fd, data_start, SEEK_HOLE);
+        uint64_t data_end = (hole < 0) ? size : std::min<uint64_t>(ALIGN_UP(hole, DIRECT_IO_ALIGN), size);
+        add(data_start, data_end, false);
+        pos = data_end;
+    }
+}
+
+static bool zero_range(int fd, bool blkdev, uint64_t offset, uint64_t length)
+{
+    if (blkdev) {
+        uint64_t range[2] = { offset, length };
+        return ioctl(fd, BLKZEROOUT, range) == 0;
+    }
+
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+}
+
+static bool is_zero(const char* buf, size_t len)
+{
+    const uint64_t* p = reinterpret_cast<const uint64_t*>(buf);
+    for (size_t i = 0; i < len / sizeof(*p); i++) {
+        if (p[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static bool parallel_copy(int src, int dst, const std::vector<CopyWork>& work, unsigned qd, bool assume_zeroed)
+{
+    const bool blkdev = is_block_device(dst);
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::atomic<uint64_t> copied(0);
+
+    auto worker = [&]() {
+        char* buf = static_cast<char*>(aligned_alloc(DIRECT_IO_ALIGN, CHUNK_SIZE));
+        for (size_t i; !failed && (i = next++) < work.size(); ) {
+            const CopyWork& w = work[i];
+            bool ok;
+            if (w.hole) {
+                ok = zero_range(dst, blkdev, w.offset, w.length);
+            } else {
+                // Round the length up for O_DIRECT; a short read at EOF is expected, and the rest of
+                // the buffer (left over from the last chunk) is written as zeros.
+                ssize_t len = pread(src, buf, ALIGN_UP(w.length, DIRECT_IO_ALIGN), w.offset);
+                ok = len >= static_cast<ssize_t>(w.length);
+                if (ok)
+                    memset(buf + w.length, 0, ALIGN_UP(w.length, DIRECT_IO_ALIGN) - w.length);
+                if (ok && is_zero(buf, w.length)) {
+                    ok = assume_zeroed || zero_range(dst, blkdev, w.offset, w.length);
+                } else if (ok) {
+                    ok = pwrite(dst, buf, ALIGN_UP(w.length, DIRECT_IO_ALIGN), w.offset) == static_cast<ssize_t>(ALIGN_UP(w.length, DIRECT_IO_ALIGN));
+                    if (ok)
+                        copied += w.length;
+                }
+            }
+
+            if (!ok) {
+                fprintf(stderr, "Error: failed to clone 0x%lx bytes at 0x%lx: %s\n", w.length, w.offset, strerror(errno));
+                failed = true;
+            }
+        }
+        free(buf);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < qd; i++)
+        threads.emplace_back(worker);
+    for (std::thread& t : threads)
+        t.join();
+
+    printf("Copied %lu MiB of data\n", copied.load() >> 20);
+    return !failed;
+}
+
+//
+// Per-slice identity patching.
+//
+
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t len, uint32_t poly)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+    }
+    return crc;
+}
+
+static uint32_t crc32(const void* data, size_t len)
+{
+    return ~crc32_update(~0u, data, len, 0xedb88320);
+}
+
+// ext4 metadata checksums are raw CRC32C, with no final inversion.
+static uint32_t ext4_crc32c(const void* data, size_t len)
+{
+    return crc32_update(~0u, data, len, 0x82f63b78);
+}
+
+static void new_uuid(uint8_t uuid[16])
+{
+    if (getrandom(uuid, 16, 0) != 16)
+        abort();
+    uuid[6] = (uuid[6] & 0x0f) | 0x40; // version 4
+    uuid[8] = (uuid[8] & 0x3f) | 0x80; // variant 1
+}
+
+bool get_gpt_sector_size(int fd, uint32_t& sector_size)
+{
+    for (uint32_t size : { 512, 4096 }) {
+        char signature[8];
+        if (pread(fd, signature, sizeof(signature), size) == sizeof(signature)
+            && memcmp(signature, "EFI PART", sizeof(signature)) == 0) {
+            sector_size = size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Read the primary GPT, give the disk a new GUID, and rewrite the backup GPT at the end of the
+// target (which may be larger than the golden image). Returns the byte offset of the first
+// partition.
+static bool patch_gpt(int fd, uint64_t disk_size, uint32_t sector_size, uint64_t& part_offset)
+{
+    std::vector<char> primary(2 * sector_size + GPT_ENTRIES_MAX);
+    if (pread(fd, primary.data(), primary.size(), 0) != static_cast<ssize_t>(primary.size())) {
+        perror("Failed to read partition table");
+        return false;
+    }
+
+    gpt_header* hdr = reinterpret_cast<gpt_header*>(primary.data() + sector_size);
+    if (memcmp(hdr->signature, "EFI PART", 8) != 0 || hdr->sizeof_partition_entry != sizeof(gpt_entry)
+        || hdr->partition_entry_lba != 2 || hdr->num_partition_entries * sizeof(gpt_entry) > GPT_ENTRIES_MAX) {
+        fprintf(stderr, "Error: golden image has no (supported) GPT\n");
+        return false;
+    }
+
+    const size_t entries_size = hdr->num_partition_entries * sizeof(gpt_entry);
+    const gpt_entry* entries = reinterpret_cast<const gpt_entry*>(primary.data() + 2 * sector_size);
+    part_offset = entries[0].starting_lba * sector_size;
+    if (part_offset == 0) {
+        fprintf(stderr, "Error: golden image has no partitions\n");
+        return false;
+    }
+
+    const uint64_t last_lba = disk_size / sector_size - 1;
+    const uint64_t entries_sectors = ALIGN_UP(entries_size, sector_size) / sector_size;
+
+    new_uuid(hdr->disk_guid);
+    hdr->alternate_lba = last_lba;
+    hdr->last_usable_lba = last_lba - entries_sectors - 1;
+    hdr->header_crc32 = 0;
+    hdr->header_crc32 = crc32(hdr, hdr->header_size);
+
+    gpt_header backup = *hdr;
+    backup.my_lba = last_lba;
+    backup.alternate_lba = 1;
+    backup.partition_entry_lba = last_lba - entries_sectors;
+    backup.header_crc32 = 0;
+    backup.header_crc32 = crc32(&backup, backup.header_size);
+
+    std::vector<char> backup_sectors((entries_sectors + 1) * sector_size, 0);
+    memcpy(backup_sectors.data(), entries, entries_size);
+    memcpy(backup_sectors.data() + entries_sectors * sector_size, &backup, sizeof(backup));
+
+    if (pwrite(fd, primary.data(), primary.size(), 0) != static_cast<ssize_t>(primary.size())
+        || pwrite(fd, backup_sectors.data(), backup_sectors.size(), backup.partition_entry_lba * sector_size)
+            != static_cast<ssize_t>(backup_sectors.size())) {
+        perror("Failed to write partition table");
+        return false;
+    }
+
+    return true;
+}
+
+// Give the ext4 filesystem at the given offset a new UUID. This only touches the primary
+// superblock, which is safe only if the filesystem stores its checksum seed separately from the
+// UUID (mkfs.ext4 -O metadata_csum_seed, as mkimage.sh does).
+static bool patch_ext4_uuid(int fd, uint64_t fs_offset)
+{
+    constexpr size_t SB_OFFSET = 1024, SB_SIZE = 1024;
+    constexpr size_t S_MAGIC = 0x38, S_FEATURE_INCOMPAT = 0x60, S_FEATURE_RO_COMPAT = 0x64,
+        S_UUID = 0x68, S_CHECKSUM = 0x3fc;
+    constexpr uint32_t RO_COMPAT_METADATA_CSUM = 0x400, INCOMPAT_CSUM_SEED = 0x2000;
+
+    uint8_t sb[SB_SIZE];
+    if (pread(fd, sb, sizeof(sb), fs_offset + SB_OFFSET) != sizeof(sb)) {
+        perror("Failed to read ext4 superblock");
+        return false;
+    }
+
+    uint16_t magic;
+    uint32_t incompat, ro_compat;
+    memcpy(&magic, sb + S_MAGIC, sizeof(magic));
+    memcpy(&incompat, sb + S_FEATURE_INCOMPAT, sizeof(incompat));
+    memcpy(&ro_compat, sb + S_FEATURE_RO_COMPAT, sizeof(ro_compat));
+
+    if (magic != 0xef53) {
+        fprintf(stderr, "Error: first partition is not an ext4 filesystem\n");
+        return false;
+    }
+
+    const bool csum = ro_compat & RO_COMPAT_METADATA_CSUM;
+    if (csum && !(incompat & INCOMPAT_CSUM_SEED)) {
+        fprintf(stderr, "Error: golden filesystem has metadata_csum without metadata_csum_seed\n");
+        return false;
+    }
+
+    new_uuid(sb + S_UUID);
+    if (csum) {
+        uint32_t checksum = ext4_crc32c(sb, S_CHECKSUM);
+        memcpy(sb + S_CHECKSUM, &checksum, sizeof(checksum));
+    }
+
+    if (pwrite(fd, sb, sizeof(sb), fs_offset + SB_OFFSET) != sizeof(sb)) {
+        perror("Failed to write ext4 superblock");
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_file(const std::filesystem::path& path, const std::string& contents)
+{
+    std::ofstream file(path, std::ios::trunc);
+    return file.is_open() && (file << contents) && file.flush();
+}
+
+// Mount the first partition of the clone, and populate the cloud-init NoCloud seed directory.
+static bool write_seed(const std::string& partdev, const char* hostname, const char* seed_dir)
+{
+    char mountpoint[] = "/tmp/sliceimg.XXXXXX";
+    if (mkdtemp(mountpoint) == nullptr) {
+        perror("Failed to create mount point");
+        return false;
+    }
+
+    if (mount(partdev.c_str(), mountpoint, "ext4", 0, nullptr) != 0) {
+        fprintf(stderr, "Failed to mount %s: %s\n", partdev.c_str(), strerror(errno));
+        rmdir(mountpoint);
+        return false;
+    }
+
+    const std::filesystem::path seed = std::filesystem::path(mountpoint) / "var/lib/cloud/seed/nocloud";
+    std::error_code err;
+    std::filesystem::create_directories(seed, err);
+
+    bool ok = !err;
+    if (ok && hostname) {
+        uint8_t id[16];
+        new_uuid(id);
+        char instance_id[48];
+        snprintf(instance_id, sizeof(instance_id), "%s-%02x%02x%02x%02x", hostname, id[0], id[1], id[2], id[3]);
+        ok = write_file(seed / "meta-data",
+            std::string("instance-id: ") + instance_id + "\nlocal-hostname: " + hostname + "\n");
+    }
+
+    for (const char* name : { "user-data", "network-config", "vendor-data" }) {
+        if (!ok || !seed_dir)
+            break;
+        const std::filesystem::path src = std::filesystem::path(seed_dir) / name;
+        if (std::filesystem::exists(src))
+            ok = std::filesystem::copy_file(src, seed / name, std::filesystem::copy_options::overwrite_existing, err);
+    }
+
+    if (!ok)
+        fprintf(stderr, "Failed to write cloud-init seed\n");
+
+    if (umount(mountpoint) != 0) {
+        perror("Failed to unmount clone");
+        ok = false;
+    }
+    rmdir(mountpoint);
+
+    return ok;
+}
+
+// Copy a golden image to a block device or file, then give the copy a fresh filesystem UUID and
+// (optionally) a cloud-init seed.
+bool clone_image(const char* image, const char* target, const CloneOptions& options)
+{
+    AutoFd src = open(image, O_RDONLY | O_DIRECT);
+    AutoFd probe = open(image, O_RDONLY);
+    if (src < 0 || probe < 0) {
+        perror("Failed to open image");
+        return false;
+    }
+
+    uint32_t sector_size;
+    if (!get_gpt_sector_size(probe, sector_size)) {
+        fprintf(stderr, "Error: golden image has no GPT\n");
+        return false;
+    }
+
+    AutoFd dst = open(target, O_RDWR | O_DIRECT | (options.force ? O_CREAT : O_CREAT | O_EXCL), 0644);
+    if (dst < 0 && errno == EEXIST) {
+        fprintf(stderr, "Error: %s already exists (use -force to overwrite it)\n", target);
+        return false;
+    } else if (dst < 0) {
+        perror("Failed to open target");
+        return false;
+    }
+
+    uint64_t image_size, target_size;
+    if (!get_size(src, image_size) || !get_size(dst, target_size)) {
+        perror("Failed to determine image size");
+        return false;
+    }
+
+    // The kernel looks for the GPT header at the device's logical block size, so a copy onto a
+    // device with other sectors would have no readable partition table.
+    const bool blkdev = is_block_device(dst);
+    int block_size = 0;
+    if (blkdev && ioctl(dst, BLKSSZGET, &block_size) != 0) {
+        perror("Failed to get target block size");
+        return false;
+    } else if (blkdev && static_cast<uint32_t>(block_size) != sector_size) {
+        fprintf(stderr, "Error: golden image has %u-byte sectors, but %s has %d-byte blocks (see sliceimg golden -b)\n",
+                sector_size, target, block_size);
+        return false;
+    }
+
+    if (!blkdev && target_size < image_size) {
+        if (ftruncate(dst, image_size) != 0) {
+            perror("Failed to extend target");
+            return false;
+        }
+        target_size = image_size;
+    } else if (target_size < image_size) {
+        fprintf(stderr, "Error: target is smaller than the golden image\n");
+        return false;
+    }
+
+    std::vector<CopyWork> work;
+    list_work(src, image_size, options.assume_zeroed, work);
+    printf("Cloning %s to %s (%zu chunks, queue depth %u)\n", image, target, work.size(), options.qd);
+
+    if (!parallel_copy(src, dst, work, options.qd, options.assume_zeroed))
+        return false;
+
+    // Writing the last chunk in whole O_DIRECT blocks may have extended a file.
+    if (!blkdev && ftruncate(dst, target_size) != 0) {
+        perror("Failed to truncate target");
+        return false;
+    }
+
+    // Identity patching uses small unaligned I/O, so switch to a buffered descriptor.
+    dst = -1;
+    dst = open(target, O_RDWR);
+    uint64_t part_offset;
+    if (dst < 0 || !patch_gpt(dst, target_size, sector_size, part_offset) || !patch_ext4_uuid(dst, part_offset))
+        return false;
+
+    if (fsync(dst) != 0) {
+        perror("Failed to flush target");
+        return false;
+    }
+
+    if (options.hostname || options.seed_dir) {
+        LoopDevice loop;
+        std::string partdev;
+        if (blkdev) {
+            if (ioctl(dst, BLKRRPART) != 0) {
+                perror("Failed to re-read partition table");
+                return false;
+            }
+            partdev = target;
+            partdev += isdigit(partdev.back()) ? "p1" : "1";
+        } else {
+            dst = -1;
+            if (!loop.attach(target, sector_size))
+                return false;
+            partdev = loop.path() + "p1";
+        }
+
+        if (!write_seed(partdev, options.hostname, options.seed_dir))
+            return false;
+    }
+
+    printf("Cloned %s to %s\n", image, target);
+    return true;
+}
@@ -0,0 +1,243 @@
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "cpio.h"
+#include "runslice.h"
+
+// Generated initrds are cached here, keyed by kernel version and device set.
+static const char INITRD_CACHE_DIR[] = "/var/cache/sliceloader";
+
+// Minimal init for a standalone initrd: load the slice's drivers, mount the root filesystem named
+// by root= on the kernel command line, and switch to it. Everything else is left to the real init.
+static const char INIT_SCRIPT[] = R"(#!/bin/busybox sh
+/bin/busybox --install -s /bin
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t devtmpfs devtmpfs /dev
+
+while read -r mod; do
+    insmod "$mod"
+done < /etc/slice-modules
+
+root=
+rootflags=ro
+for arg in $(cat /proc/cmdline); do
+    case "$arg" in
+    root=*) root="${arg#root=}" ;;
+    rw) rootflags=rw ;;
+    esac
+done
+
+for i in $(seq 100); do
+    dev=$(findfs "$root" 2>/dev/null || echo "$root")
+    [ -b "$dev" ] && break
+    sleep 0.1
+done
+
+mount -o "$rootflags" "$dev" /root || exec sh
+umount /proc /sys
+mount --move /dev /root/dev
+exec switch_root /root /sbin/init
+)";
+
+static std::string module_name(const std::string& path)
+{
+    std::string name = std::filesystem::path(path).filename().string();
+    name = name.substr(0, name.find(".ko"));
+    std::replace(name.begin(), name.end(), '-', '_');
+    return name;
+}
+
+// Parsed modules.dep: module name -> (path relative to the module directory, dependency names)
+typedef std::map<std::string, std::pair<std::string, std::vector<std::string>>> ModuleDeps;
+
+static bool read_module_deps(const std::string& moddir, ModuleDeps& deps)
+{
+    std::ifstream file(moddir + "/modules.dep");
+    if (!file.is_open()) {
+        fprintf(stderr, "Failed to open %s/modules.dep\n", moddir.c_str());
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+
+        const std::string path = line.substr(0, colon);
+        std::vector<std::string> names;
+        std::istringstream rest(line.substr(colon + 1));
+        for (std::string dep; rest >> dep; )
+            names.push_back(module_name(dep));
+
+        deps[module_name(path)] = { path, names };
+    }
+
+    return true;
+}
+
+// Find the modules whose aliases match any of the given device modaliases.
+static bool match_aliases(const std::string& moddir, const std::vector<std::string>& modaliases, std::vector<std::string>& modules)
+{
+    std::ifstream file(moddir + "/modules.alias");
+    if (!file.is_open()) {
+        fprintf(stderr, "Failed to open %s/modules.alias\n", moddir.c_str());
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string keyword, pattern, module;
+        if (!(fields >> keyword >> pattern >> module) || keyword != "alias")
+            continue;
+
+        for (const std::string& modalias : modaliases) {
+            if (fnmatch(pattern.c_str(), modalias.c_str(), 0) == 0) {
+                module = module_name(module);
+                if (std::find(modules.begin(), modules.end(), module) == modules.end())
+                    modules.push_back(module);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Append a module and its dependencies to the load order, dependencies first. Modules absent
+// from modules.dep are built in to the kernel.
+static void add_with_deps(const ModuleDeps& deps, const std::string& name, std::vector<std::string>& order)
+{
+    auto it = deps.find(name);
+    if (it == deps.end() || std::find(order.begin(), order.end(), it->second.first) != order.end())
+        return;
+
+    for (const std::string& dep : it->second.second)
+        add_with_deps(deps, dep, order);
+
+    order.push_back(it->second.first);
+}
+
+static bool read_file(const std::string& path, std::vector<char>& data)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+// Build (or find in the cache) an uncompressed initrd holding just the kernel modules needed
+// for the slice's assigned PCI devices. A standalone initrd also holds busybox and a minimal
+// init; otherwise the archive is meant to be appended to a base initrd, and lists the modules
+// in conf/modules for its (initramfs-tools) init to load.
+bool build_slice_initrd(const Options& options, const std::string& kernel_version, bool standalone, std::string& path)
+{
+    const std::string moddir = std::string(options.modules_dir) + "/" + kernel_version;
+
+    std::vector<std::string> modaliases;
+    for (const char* dev : options.assign_devices) {
+        std::string modalias;
+        if (!read_host_file(std::string("/sys/bus/pci/devices/") + dev + "/modalias", modalias)) {
+            fprintf(stderr, "Error: failed to read modalias of %s\n", dev);
+            return false;
+        }
+        modaliases.push_back(modalias);
+    }
+    std::sort(modaliases.begin(), modaliases.end());
+
+    // The cache key covers everything that determines the archive's contents.
+    Sha256 key;
+    for (const std::string& s : { moddir, std::string(standalone ? "standalone" : "append"),
+                                  std::string(options.busybox_path ? options.busybox_path : "") })
+        key.update(s.c_str(), s.size() + 1);
+    for (const std::string& modalias : modaliases)
+        key.update(modalias.c_str(), modalias.size() + 1);
+
+    path = std::string(INITRD_CACHE_DIR) + "/initrd-" + kernel_version + "-" + Sha256::to_hex(key.finish()).substr(0, 16) + ".cpio";
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        printf("Using cached initrd %s\n", path.c_str());
+        return true;
+    }
+
+    ModuleDeps deps;
+    std::vector<std::string> matched, order;
+    if (!read_module_deps(moddir, deps) || !match_aliases(moddir, modaliases, matched))
+        return false;
+
+    for (const std::string& name : matched)
+        add_with_deps(deps, name, order);
+
+    CpioWriter cpio;
+    std::string module_list;
+    const std::string module_prefix = "lib/modules/" + kernel_version + "/";
+    for (const std::string& module : order) {
+        std::vector<char> data;
+        if (!read_file(moddir + "/" + module, data)) {
+            fprintf(stderr, "Failed to read module %s\n", module.c_str());
+            return false;
+        }
+
+        printf("Adding module %s to initrd\n", module.c_str());
+        cpio.add_file(module_prefix + module, data.data(), data.size());
+        module_list += (standalone ? "/" + module_prefix + module : module_name(module)) + "\n";
+    }
+
+    if (standalone) {
+        std::vector<char> busybox;
+        if (!read_file(options.busybox_path, busybox)) {
+            fprintf(stderr, "Failed to read %s\n", options.busybox_path);
+            return false;
+        }
+
+        for (const char* dir : { "dev", "proc", "sys", "root" })
+            cpio.add_directory(dir);
+        cpio.add_file("bin/busybox", busybox.data(), busybox.size(), 0755);
+        cpio.add_symlink("bin/sh", "busybox");
+        cpio.add_file("init", INIT_SCRIPT, strlen(INIT_SCRIPT), 0755);
+        cpio.add_file("etc/slice-modules", module_list.data(), module_list.size());
+    } else {
+        // The guest's full module indices are a superset of the base initrd's, so they can
+        // safely replace them, and let modprobe find the modules we add.
+        for (const char* index : { "modules.dep", "modules.dep.bin", "modules.alias", "modules.alias.bin",
+                                   "modules.builtin", "modules.builtin.bin" }) {
+            std::vector<char> data;
+            if (read_file(moddir + "/" + index, data))
+                cpio.add_file(module_prefix + index, data.data(), data.size());
+        }
+        cpio.add_file("conf/modules", module_list.data(), module_list.size());
+    }
+
+    const std::vector<char>& archive = cpio.finish();
+
+    // Write atomically, in case another launch is racing to create the same entry.
+    std::error_code err;
+    std::filesystem::create_directories(INITRD_CACHE_DIR, err);
+    const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open() || !file.write(archive.data(), archive.size()) || !file.flush()) {
+            fprintf(stderr, "Failed to write %s\n", tmp_path.c_str());
+            return false;
+        }
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        perror("Failed to write initrd to cache");
+        return false;
+    }
+
+    printf("Generated initrd %s (%zu modules, %zu KiB)\n", path.c_str(), order.size(), archive.size() >> 10);
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef KDUMP_H
+#define KDUMP_H 1
+
+#include <sys/time.h>
+#include <cstdint>
+
+// The compressed ("kdump") dump format written by makedumpfile and read by crash, as defined in
+// makedumpfile's diskdump_mod.h. The file is a sequence of blocks (of the page size):
+//   block 0:   KdumpHeader
+//   block 1:   KdumpSubHeader (sub_hdr_size blocks)
+//   bitmaps:   two bitmaps of max_mapnr bits (bitmap_blocks blocks in total); bit N of the first
+//              is set if PFN N exists, and of the second if it is in the dump
+//   then:      one KdumpPageDesc for each PFN in the second bitmap, in order, followed by the
+//              page data they refer to.
+
+constexpr char KDUMP_SIGNATURE[8] = { 'K', 'D', 'U', 'M', 'P', ' ', ' ', ' ' };
+constexpr int KDUMP_HEADER_VERSION = 6;
+
+constexpr uint32_t KDUMP_COMPRESSED_ZLIB = 0x1;     // header status and page flags
+
+struct KdumpUtsname
+{
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+};
+
+struct KdumpHeader
+{
+    char signature[8];
+    int32_t header_version;
+    KdumpUtsname utsname;
+    struct timeval timestamp;
+    uint32_t status;
+    int32_t block_size;
+    int32_t sub_hdr_size;           // in blocks
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;             // truncated; see max_mapnr_64
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    int32_t nr_cpus;
+};
+static_assert(sizeof(KdumpHeader) == 464);
+
+struct KdumpSubHeader
+{
+    uint64_t phys_base;
+    int32_t dump_level;
+    int32_t split;
+    uint64_t start_pfn;             // only for split dumps
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t size_note;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+};
+static_assert(sizeof(KdumpSubHeader) == 104);
+
+struct KdumpPageDesc
+{
+    uint64_t offset;                // of the page data in the file
+    uint32_t size;
+    uint32_t flags;                 // KDUMP_COMPRESSED_*, or 0 if stored uncompressed
+    uint64_t page_flags;
+};
+static_assert(sizeof(KdumpPageDesc) == 24);
+
+#endif
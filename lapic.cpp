@@ -1,12 +1,16 @@
 #include <fcntl.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
-#include <filesystem>
+#include <cstring>
+#include <memory>
+#include <string>
 
 #include "runslice.h"
 
@@ -16,6 +20,7 @@ static constexpr uint32_t APIC_ESR = 0x28;
 static constexpr uint32_t APIC_ICR = 0x30;
 
 static constexpr uint32_t APIC_ICR_DLV_STATUS = 0x1000;
+static constexpr uint32_t APIC_ICR_DLV_MODE_FIXED = 0x000;
 static constexpr uint32_t APIC_ICR_DLV_MODE_INIT = 0x500;
 static constexpr uint32_t APIC_ICR_DLV_MODE_STARTUP = 0x600;
 static constexpr uint32_t APIC_ICR_LEVEL_ASSERT = 0x4000;
@@ -61,6 +66,11 @@ public:
         send_ipi(APIC_ICR_DLV_MODE_INIT | APIC_ICR_TRIGGER_LEVEL, dest, true);
     }
 
+    void send_fixed(uint32_t dest, uint8_t vector)
+    {
+        send_ipi(APIC_ICR_DLV_MODE_FIXED | APIC_ICR_LEVEL_ASSERT | vector, dest, true);
+    }
+
     void send_startup(uint32_t dest, uint64_t startup_pa)
     {
         assert(startup_pa % 0x1000 == 0);
@@ -150,62 +160,91 @@ public:
     }
 };
 
-static bool open_dev_msr(AutoFd& devmsr)
+// Only meaningful once we are pinned to a host CPU (see pin_host_cpu()).
+uint32_t get_local_apic_id()
 {
-    // Ensure that there is only one CPU!
-    std::filesystem::path devcpu("/dev/cpu");
-    std::error_code err;
-    std::filesystem::directory_iterator it(devcpu, err);
-    if (err)
+    uint32_t apic_id = UINT32_MAX;
     {
-        fprintf(stderr, "Failed to list /dev/cpu: %s\n", err.message().c_str());
-        return false;
-    }
+        uint32_t max_cpuid_leaf, a, b, c, d;
+        cpuid(0, 0, max_cpuid_leaf, b, c, d);
 
-    for (const auto& entry : it)
-    {
-        if (entry.is_directory())
+        assert(max_cpuid_leaf >= 0xb);
+        cpuid(0xb, 0, a, b, c, apic_id);
+
+        if (max_cpuid_leaf >= 0x1f)
         {
-            if (devmsr >= 0)
-            {
-                fprintf(stderr, "Error: multiple CPUs found. We only support uniprocessor.\n");
-                return false;
-            }
-
-            devmsr = open((entry.path().string() + "/msr").c_str(), O_RDWR);
-            if (devmsr < 0) {
-                perror("Failed to open /dev/cpu/*/msr");
-                return false;
-            }
+            cpuid(0x1f, 0, a, b, c, d);
+            assert(d == apic_id);
         }
     }
 
-    if (devmsr < 0)
-    {
-        fprintf(stderr, "Error: no CPUs found.\n");
+    return apic_id;
+}
+
+// The host CPU that runslice is pinned to, and whose local APIC and MSRs it uses.
+static int host_cpu = -1;
+
+// Pin the calling thread to the CPU it is running on, so that the local APIC (and MSR device) we
+// use stay the same throughout. Returns the set of CPUs we were allowed to run on, for workers.
+bool pin_host_cpu(cpu_set_t& host_cpus)
+{
+    if (sched_getaffinity(0, sizeof(host_cpus), &host_cpus) != 0) {
+        perror("Failed to get CPU affinity");
         return false;
     }
 
+    host_cpu = sched_getcpu();
+    if (host_cpu < 0) {
+        perror("Failed to get current CPU");
+        return false;
+    }
+
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(host_cpu, &pinned);
+    if (sched_setaffinity(0, sizeof(pinned), &pinned) != 0) {
+        perror("Failed to pin to host CPU");
+        return false;
+    }
+
+    // On stderr, since -prepare prints only PCI addresses on stdout.
+    fprintf(stderr, "Running on host CPU %d (of %d)\n", host_cpu, CPU_COUNT(&host_cpus));
     return true;
 }
 
-bool send_startup_ipi(AutoFd& devmem, uint32_t target_id, uint64_t startup_pa)
+static bool open_dev_msr(AutoFd& devmsr)
+{
+    assert(host_cpu >= 0);
+
+    const std::string path = "/dev/cpu/" + std::to_string(host_cpu) + "/msr";
+    devmsr = open(path.c_str(), O_RDWR);
+    if (devmsr < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Open our host CPU's local APIC, in whichever mode it is in. In xAPIC mode, the registers are mapped
+// at apic_regs, which the caller must unmap.
+static std::unique_ptr<LocalApicBase> open_local_apic(AutoFd& devmem, void*& apic_regs)
 {
     AutoFd devmsr;
     if (!open_dev_msr(devmsr))
-        return false;
+        return nullptr;
 
     static constexpr uint32_t MSR_IA32_APIC_BASE = 0x1b;
     uint64_t apic_base_msr;
     if (!rdmsr(devmsr, MSR_IA32_APIC_BASE, apic_base_msr))
     {
         perror("Failed to read IA32_APIC_BASE MSR");
-        return false;
+        return nullptr;
     }
 
-    assert(apic_base_msr & 0x900); // APIC enabled, is BSP
+    assert(apic_base_msr & 0x800); // APIC enabled
 
-    void* apic_regs = nullptr;
+    apic_regs = nullptr;
     std::unique_ptr<LocalApicBase> lapic;
 
     if (apic_base_msr & 0x400)
@@ -219,7 +258,8 @@ bool send_startup_ipi(AutoFd& devmem, uint32_t target_id, uint64_t startup_pa)
         apic_regs = mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, apic_base);
         if (apic_regs == MAP_FAILED) {
             perror("Error: Failed to map APIC");
-            return false;
+            apic_regs = nullptr;
+            return nullptr;
         }
 
         lapic = std::make_unique<LocalApic>(apic_regs);
@@ -227,6 +267,16 @@ bool send_startup_ipi(AutoFd& devmem, uint32_t target_id, uint64_t startup_pa)
 
     assert(lapic->read_apic_id() == get_local_apic_id());
 
+    return lapic;
+}
+
+bool send_startup_ipi(AutoFd& devmem, uint32_t target_id, uint64_t startup_pa)
+{
+    void* apic_regs;
+    std::unique_ptr<LocalApicBase> lapic = open_local_apic(devmem, apic_regs);
+    if (!lapic)
+        return false;
+
     lapic->send_init_assert(target_id);
     lapic->send_init_deassert(target_id);
     lapic->send_startup(target_id, startup_pa);
@@ -238,3 +288,45 @@ bool send_startup_ipi(AutoFd& devmem, uint32_t target_id, uint64_t startup_pa)
 
     return true;
 }
+
+// Return a CPU to the wait-for-SIPI state.
+bool send_init_ipi(AutoFd& devmem, uint32_t target_id)
+{
+    void* apic_regs;
+    std::unique_ptr<LocalApicBase> lapic = open_local_apic(devmem, apic_regs);
+    if (!lapic)
+        return false;
+
+    lapic->send_init_assert(target_id);
+    lapic->send_init_deassert(target_id);
+
+    if (apic_regs != nullptr)
+        munmap(apic_regs, 0x1000);
+
+    return true;
+}
+
+// Deliver an interrupt to another CPU, as if from a device.
+bool send_fixed_ipi(AutoFd& devmem, uint32_t target_id, uint8_t vector)
+{
+    void* apic_regs;
+    std::unique_ptr<LocalApicBase> lapic = open_local_apic(devmem, apic_regs);
+    if (!lapic)
+        return false;
+
+    lapic->send_fixed(target_id, vector);
+
+    if (apic_regs != nullptr)
+        munmap(apic_regs, 0x1000);
+
+    return true;
+}
+
+bool read_host_msr(uint32_t msrnum, uint64_t& value)
+{
+    AutoFd devmsr;
+    if (!open_dev_msr(devmsr))
+        return false;
+
+    return pread(devmsr, &value, sizeof(value), msrnum) == sizeof(value);
+}
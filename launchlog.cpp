@@ -0,0 +1,317 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+#include "runslice.h"
+#include "sliceclock.h"
+
+// Layout of the slice's memory, as reported by the loaders, for post-mortem dumps (-dump).
+static std::vector<MemRegion> memory_map;
+static uint64_t linux_text_base, linux_text_size, linux_phys_base;
+static std::vector<LayoutItem> layout_items;
+
+void record_memory_map(const std::vector<MemRegion>& map)
+{
+    memory_map = map;
+}
+
+// Where a Linux kernel will run: the physical range of its image, and its phys_base (the
+// physical address that its kernel text mapping, at __START_KERNEL_map, maps). This assumes
+// that it decompresses in place, as it does unless physical KASLR moves it.
+void record_linux_layout(uint64_t text_base, uint64_t text_size, uint64_t phys_base)
+{
+    linux_text_base = text_base;
+    linux_text_size = text_size;
+    linux_phys_base = phys_base;
+}
+
+void record_slice_layout(const SliceLayout& layout)
+{
+    layout_items = layout.items;
+}
+
+// The launch log is a plain-text file to which we append one record per launch. Each record is
+// a series of "key value..." lines, terminated by a blank line.
+bool append_launch_log(const Options& options, const char* path)
+{
+    std::ofstream log(path, std::ios::app);
+    if (!log.is_open()) {
+        perror("Failed to open launch log");
+        return false;
+    }
+
+    char timestr[32];
+    time_t now = time(nullptr);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    log << "launch " << timestr << std::endl;
+    if (options.bundle_path)
+        log << "bundle " << options.bundle_path << std::endl;
+    else
+        log << "kernel " << options.kernel_path << std::endl;
+    if (options.initrd_path)
+        log << "initrd " << options.initrd_path << std::endl;
+    for (const char* path : options.module_paths)
+        log << "module " << path << std::endl;
+    if (options.dsdt_path)
+        log << "dsdt " << options.dsdt_path << std::endl;
+    for (const char* path : options.pmem_paths)
+        log << "pmem " << path << std::endl;
+    if (options.seed_dir)
+        log << "seed " << options.seed_dir << std::endl;
+    if (options.hostname)
+        log << "hostname " << options.hostname << std::endl;
+    log << std::hex << std::showbase;
+    log << "rambase " << options.rambase << std::endl;
+    log << "ramsize " << options.ramsize << std::endl;
+    log << "lowmem " << options.lowmem << std::endl;
+    for (const auto& [base, size] : options.far_mem)
+        log << "farmem " << base << " " << size << std::endl;
+    if (options.clock_page)
+        log << "clock " << options.clock_page << std::endl;
+    for (const SharedDataset& dataset : options.datasets)
+        log << "dataset " << dataset.base << " " << dataset.size << " " << dataset.path << std::endl;
+    log << std::dec << std::noshowbase;
+    log << "apic_ids";
+    for (uint32_t id : options.apic_ids)
+        log << " " << id;
+    log << std::endl;
+    if (options.cpu_profile)
+        log << "profile " << options.cpu_profile << std::endl;
+    log << std::hex << std::showbase;
+    for (const MsrWrite& w : options.msr_writes)
+        log << "msr " << w.msr << " " << w.clear << " " << w.set << std::endl;
+    log << std::dec << std::noshowbase;
+    if (options.hotplug_ioapic) {
+        log << std::hex << std::showbase;
+        log << "hotplug " << hotplug_mailbox_address() << " " << options.hotplug_ioapic << std::endl;
+        log << std::dec << std::noshowbase;
+        log << "spare_apic_ids";
+        for (uint32_t id : options.spare_apic_ids)
+            log << " " << id;
+        log << std::endl;
+    }
+
+    log << std::hex << std::showbase;
+    for (const MemRegion& region : memory_map)
+        log << "e820 " << region.base << " " << region.size << " " << region.e820_type << std::endl;
+    if (linux_text_size) {
+        log << "kernel_text " << linux_text_base << " " << linux_text_size << std::endl;
+        log << "phys_base " << linux_phys_base << std::endl;
+    }
+    for (const LayoutItem& item : layout_items)
+        log << "layout " << item.name << " " << item.base << " " << item.size << std::endl;
+    log << std::dec << std::noshowbase;
+
+    for (const Measurement& m : get_measurements())
+        log << "sha256 " << m.component << " " << Sha256::to_hex(m.digest) << " " << m.path << std::endl;
+
+    log << std::endl;
+
+    if (!log) {
+        perror("Failed to write launch log");
+        return false;
+    }
+
+    return true;
+}
+
+// Find the most recent launch record for the slice at rambase, as a list of (key, value) lines,
+// optionally followed by the lines of any later grow records for it.
+bool read_launch_record(const char* path, uint64_t rambase, std::vector<std::pair<std::string, std::string>>& record,
+                        bool with_growth)
+{
+    std::ifstream log(path);
+    if (!log.is_open()) {
+        perror("Failed to open launch log");
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> current;
+    bool found = false;
+    std::string line;
+    while (std::getline(log, line)) {
+        if (!line.empty()) {
+            const size_t space = line.find(' ');
+            current.push_back({ line.substr(0, space), space == std::string::npos ? "" : line.substr(space + 1) });
+            if (!log.eof())
+                continue;
+        }
+
+        const bool launch = !current.empty() && current.front().first == "launch";
+        const bool grow = !current.empty() && current.front().first == "grow";
+        if (launch || (grow && found && with_growth)) {
+            for (const auto& [key, value] : current) {
+                if (key == "rambase" && strtoull(value.c_str(), nullptr, 0) == rambase) {
+                    if (launch)
+                        record = current;
+                    else
+                        record.insert(record.end(), current.begin(), current.end());
+                    found = true;
+                }
+            }
+        }
+        current.clear();
+    }
+
+    if (!found)
+        fprintf(stderr, "Error: no launch record for a slice at 0x%lx in %s\n", rambase, path);
+
+    return found;
+}
+
+// Record that a slice has been shut down and its resources released, ending its launch record.
+bool append_release_log(const Options& options, const char* path)
+{
+    std::ofstream log(path, std::ios::app);
+    if (!log.is_open()) {
+        perror("Failed to open launch log");
+        return false;
+    }
+
+    char timestr[32];
+    time_t now = time(nullptr);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    log << "release " << timestr << std::endl;
+    log << std::hex << std::showbase;
+    log << "rambase " << options.rambase << std::endl;
+    log << std::dec << std::noshowbase;
+    log << std::endl;
+
+    if (!log) {
+        perror("Failed to write launch log");
+        return false;
+    }
+
+    return true;
+}
+
+// Collect the lines of each slice in a launch log that has not been released: its latest launch
+// record and any later grow records, keyed by RAM base.
+static bool read_live_records(const char* path,
+                              std::map<uint64_t, std::vector<std::pair<std::string, std::string>>>& live)
+{
+    std::ifstream log(path);
+    if (!log.is_open()) {
+        perror("Failed to open launch log");
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> current;
+    uint64_t rambase = 0;
+    std::string line;
+    while (std::getline(log, line)) {
+        if (!line.empty()) {
+            const size_t space = line.find(' ');
+            const std::string key = line.substr(0, space);
+            const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+            if (key == "rambase")
+                rambase = strtoull(value.c_str(), nullptr, 0);
+            current.push_back({ key, value });
+            if (!log.eof())
+                continue;
+        }
+
+        const std::string kind = current.empty() ? "" : current.front().first;
+        if (kind == "launch")
+            live[rambase].clear();
+        if (kind == "release")
+            live.erase(rambase);
+        else if ((kind == "launch" || kind == "grow") && live.count(rambase))
+            live[rambase].insert(live[rambase].end(), current.begin(), current.end());
+        current.clear();
+        rambase = 0;
+    }
+
+    return true;
+}
+
+// Find the APIC IDs of all the slices in a launch log that have not been released: the boot and
+// spare CPUs of each one's latest launch, and any CPUs it grew.
+bool read_live_apic_ids(const char* path, std::vector<uint32_t>& apic_ids)
+{
+    std::map<uint64_t, std::vector<std::pair<std::string, std::string>>> live;
+    if (!read_live_records(path, live))
+        return false;
+
+    apic_ids.clear();
+    for (const auto& [base, record] : live) {
+        for (const auto& [key, value] : record) {
+            if (key != "apic_ids" && key != "spare_apic_ids")
+                continue;
+            const char* p = value.c_str();
+            char* end;
+            for (uint32_t id = strtoul(p, &end, 0); end != p; id = strtoul(p, &end, 0)) {
+                apic_ids.push_back(id);
+                p = end;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Find the physical memory in use by all the slices in a launch log that have not been released:
+// each one's RAM, far memory, clock page, datasets, and any memory it grew.
+bool read_live_memory(const char* path, std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    std::map<uint64_t, std::vector<std::pair<std::string, std::string>>> live;
+    if (!read_live_records(path, live))
+        return false;
+
+    ranges.clear();
+    for (const auto& [rambase, record] : live) {
+        for (const auto& [key, value] : record) {
+            uint64_t base, size;
+            if (key == "ramsize")
+                ranges.push_back({ rambase, strtoull(value.c_str(), nullptr, 0) });
+            else if (key == "clock")
+                ranges.push_back({ strtoull(value.c_str(), nullptr, 0), SLICE_CLOCK_PAGE_SIZE });
+            else if ((key == "farmem" || key == "dataset" || key == "mem")
+                     && sscanf(value.c_str(), "%" SCNx64 " %" SCNx64, &base, &size) == 2)
+                ranges.push_back({ base, size });
+        }
+    }
+
+    return true;
+}
+
+// Record resources added to a running slice, following its launch record.
+bool append_grow_log(const Options& options, const char* path)
+{
+    std::ofstream log(path, std::ios::app);
+    if (!log.is_open()) {
+        perror("Failed to open launch log");
+        return false;
+    }
+
+    char timestr[32];
+    time_t now = time(nullptr);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    log << "grow " << timestr << std::endl;
+    log << std::hex << std::showbase;
+    log << "rambase " << options.rambase << std::endl;
+    for (const auto& [base, size] : options.grow_mem)
+        log << "mem " << base << " " << size << std::endl;
+    log << std::dec << std::noshowbase;
+    if (!options.apic_ids.empty()) {
+        log << "apic_ids";
+        for (uint32_t id : options.apic_ids)
+            log << " " << id;
+        log << std::endl;
+    }
+
+    log << std::endl;
+
+    if (!log) {
+        perror("Failed to write launch log");
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+#include "runslice.h"
+
+// The layout of slice RAM is planned in full before anything is loaded, so that it can be checked
+// as a whole, logged, and then written in any order (or all at once). The same inputs always give
+// the same plan, so a relaunch puts everything where it was before.
+
+SliceLayout::SliceLayout(const Options& options)
+    : rambase(options.rambase), bottom(options.rambase), top(options.rambase + options.ramsize)
+{
+}
+
+bool SliceLayout::place(const std::string& name, uint64_t size, uint64_t align, uint64_t& base)
+{
+    base = next(align);
+    if (base > top || size > top - base) {
+        fprintf(stderr, "Error: slice RAM is too small for the %s (0x%" PRIx64 " bytes at 0x%" PRIx64
+                ", below 0x%" PRIx64 ")\n", name.c_str(), size, base, top);
+        return false;
+    }
+
+    items.push_back({ name, base, size, align });
+    bottom = base + size;
+    return true;
+}
+
+bool SliceLayout::place_top(const std::string& name, uint64_t size, uint64_t align, uint64_t& base)
+{
+    const uint64_t end = top & ~(align - 1);
+    if (end < bottom || size > end - bottom) {
+        fprintf(stderr, "Error: slice RAM is too small for the %s (0x%" PRIx64 " bytes below 0x%" PRIx64 ")\n",
+                name.c_str(), size, end);
+        return false;
+    }
+
+    base = end - size;
+    items.push_back({ name, base, size, align });
+    top = base;
+    return true;
+}
+
+// Check the plan as a whole: each component aligned and within slice RAM, none overlapping
+// another, nor the low memory used to boot.
+bool SliceLayout::check(const Options& options) const
+{
+    const uint64_t ram_end = options.rambase + options.ramsize;
+    std::vector<const LayoutItem*> sorted;
+    for (const LayoutItem& item : items) {
+        if (item.base % item.align != 0 || item.base < options.rambase || item.base > ram_end
+            || item.size > ram_end - item.base) {
+            fprintf(stderr, "Error: the %s at 0x%" PRIx64 " is misaligned or outside slice RAM\n",
+                    item.name.c_str(), item.base);
+            return false;
+        }
+        if (item.base < 0x100000) {
+            fprintf(stderr, "Error: the %s at 0x%" PRIx64 " is in low memory\n", item.name.c_str(), item.base);
+            return false;
+        }
+        sorted.push_back(&item);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const LayoutItem* a, const LayoutItem* b) { return a->base < b->base; });
+    for (size_t i = 1; i < sorted.size(); i++) {
+        if (sorted[i - 1]->base + sorted[i - 1]->size > sorted[i]->base) {
+            fprintf(stderr, "Error: the %s and %s overlap in slice RAM\n", sorted[i - 1]->name.c_str(),
+                    sorted[i]->name.c_str());
+            return false;
+        }
+    }
+
+    return bottom <= top;
+}
+
+void SliceLayout::print() const
+{
+    std::vector<const LayoutItem*> sorted;
+    for (const LayoutItem& item : items)
+        sorted.push_back(&item);
+    std::sort(sorted.begin(), sorted.end(), [](const LayoutItem* a, const LayoutItem* b) { return a->base < b->base; });
+
+    printf("Slice layout:\n");
+    for (const LayoutItem* item : sorted) {
+        printf("  0x%" PRIx64 "-0x%" PRIx64 " %s\n", item->base, item->base + std::max<uint64_t>(item->size, 1) - 1,
+               item->name.c_str());
+    }
+}
@@ -63,12 +63,31 @@ struct efi_info {
 	uint32_t efi_memmap_hi;
 };
 
+/* setup_data types defined by the kernel are small integers; ours are tagged 'SL' */
+#define SETUP_SLICE_MEASUREMENTS	0x534c0001
+#define SETUP_SLICE_CLOUD_SEED		0x534c0002
+#define SETUP_SLICE_CLOCK		0x534c0003
+
+/* extensible setup data list node */
+struct setup_data {
+	uint64_t next;
+	uint32_t type;
+	uint32_t len;
+	uint8_t data[];
+} __attribute__((packed));
+
 /*
  * This is the maximum number of entries in struct boot_params::e820_table
  * (the zeropage), which is part of the x86 boot protocol ABI:
  */
 #define E820_MAX_ENTRIES_ZEROPAGE 128
 
+/* E820 region types */
+#define E820_TYPE_RAM		1
+#define E820_TYPE_RESERVED	2
+#define E820_TYPE_PMEM		12
+#define E820_TYPE_SOFT_RESERVED	0xefffffff
+
 /*
  * The E820 memory region entry of the boot protocol ABI:
  */
@@ -1,15 +1,32 @@
+#include <elf.h>
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <iostream>
 
+#include "bundle.h"
 #include "linuxboot.h"
 #include "runslice.h"
+#include "sliceclock.h"
+#include "threadpool.h"
 
-static void fill_e820_table(const Options& options, uintptr_t mmconfig_base, boot_params& params)
+// Build the physical memory map presented to the guest, in E820 terms. This is shared by all
+// the loaders; each translates it to its own boot protocol.
+std::vector<MemRegion> build_memory_map(
+    const Options& options,
+    uintptr_t mmconfig_base,
+    uint64_t ram_top,
+    const std::vector<MemRegion>& regions)
 {
-    constexpr int E820_RAM = 1;
-    constexpr int E820_RESERVED = 2;
-
     // Size of the PCIe MMCONFIG region, assuming that it is contiguous for all buses.
     constexpr size_t MMCONFIG_SIZE = 0x20000000;
 
@@ -17,45 +34,420 @@ static void fill_e820_table(const Options& options, uintptr_t mmconfig_base, boo
     // memory, allocated on boot by reserve_real_mode(). We also happen to know that after boot,
     // Linux unconditionally reserves (and thus avoids touching) the first 1MiB of memory, so we
     // should be safe to use it here.
-    params.e820_table[0] = { .addr = 0, .size = 639 * 1024, .type = E820_RAM };
-    params.e820_table[1] = { .addr = mmconfig_base, .size = MMCONFIG_SIZE, .type = E820_RESERVED };
-    params.e820_table[2] = { .addr = options.rambase, .size = options.ramsize, .type = E820_RAM };
-    params.e820_entries = 3;
-    static_assert(3 <= E820_MAX_ENTRIES_ZEROPAGE);
+    std::vector<MemRegion> map = {
+        { .base = 0, .size = 639 * 1024, .e820_type = E820_TYPE_RAM },
+        { .base = mmconfig_base, .size = MMCONFIG_SIZE, .e820_type = E820_TYPE_RESERVED },
+        { .base = options.rambase, .size = ram_top - options.rambase, .e820_type = E820_TYPE_RAM },
+    };
+
+    // Keep the guest from putting its own real-mode trampoline in the standby pool, which it would
+    // otherwise take for low RAM.
+    if (options.standby_pool) {
+        const uint64_t pool_end = options.standby_pool + standby_pool_size();
+        map[0].size = options.standby_pool;
+        map.push_back({ options.standby_pool, pool_end - options.standby_pool, E820_TYPE_RESERVED });
+        if (pool_end < 639 * 1024)
+            map.push_back({ pool_end, 639 * 1024 - pool_end, E820_TYPE_RAM });
+    }
+
+    map.insert(map.end(), regions.begin(), regions.end());
+    for (const auto& [base, size] : options.far_mem)
+        map.push_back({ base, size, options.far_mem_soft_reserved ? E820_TYPE_SOFT_RESERVED : E820_TYPE_RAM });
+    if (options.clock_page)
+        map.push_back({ options.clock_page, SLICE_CLOCK_PAGE_SIZE, E820_TYPE_RESERVED });
+    for (const SharedDataset& dataset : options.datasets)
+        map.push_back({ dataset.base, dataset.size, E820_TYPE_PMEM });
+    record_memory_map(map);
+    return map;
+}
+
+static void fill_e820_table(const std::vector<MemRegion>& map, boot_params& params)
+{
+    assert(map.size() <= E820_MAX_ENTRIES_ZEROPAGE);
+
+    params.e820_entries = 0;
+    for (const MemRegion& region : map)
+        params.e820_table[params.e820_entries++] = { .addr = region.base, .size = region.size, .type = region.e820_type };
 }
 
-bool read_to_devmem(std::ifstream& file, uint64_t offset, void* dest, size_t size)
+// Unit of work when copying to or clearing slice memory.
+static constexpr size_t DEVMEM_CHUNK_SIZE = 0x100000;
+static constexpr size_t DIRECT_IO_ALIGN = 0x1000;
+
+bool read_to_devmem(const char* path, uint64_t offset, void* dest, size_t size, Sha256* hash)
 {
-    // Linux doesn't permit I/O directly to a mapping of /dev/mem, so we must use a temporary
-    // buffer.
-    if (!file.seekg(offset, std::ios::beg))
+    AutoFd fd = open(path, O_RDONLY);
+    if (fd < 0)
         return false;
 
-    while (size > 0) {
-        char buf[0x8000];
-        const size_t chunk = std::min(size, sizeof(buf));
+    return read_fd_to_devmem(fd, false, offset, dest, size, hash);
+}
+
+// With direct set, fd was opened with O_DIRECT: offset must be aligned, and the file must be
+// readable up to the next aligned boundary after the data.
+bool read_fd_to_devmem(int fd, bool direct, uint64_t offset, void* dest, size_t size, Sha256* hash)
+{
+    // Linux doesn't permit I/O directly to a mapping of /dev/mem, so each chunk is read into a
+    // bounce buffer and copied out by the thread pool. Buffers come from a small ring: we wait for
+    // chunks in order, hash (if requested) each buffer rather than reading slice RAM back, and
+    // only then reuse the buffer for a later chunk.
+    enum { CHUNK_PENDING, CHUNK_DONE, CHUNK_FAILED };
+    ThreadPool& pool = thread_pool();
+    const size_t chunks = (size + DEVMEM_CHUNK_SIZE - 1) / DEVMEM_CHUNK_SIZE;
+    const size_t slots = std::min<size_t>(chunks, 2 * (pool.size() + 1));
+    std::vector<std::unique_ptr<char, decltype(&free)>> ring;
+    for (size_t i = 0; i < slots; i++) {
+        ring.emplace_back(static_cast<char*>(aligned_alloc(DIRECT_IO_ALIGN, DEVMEM_CHUNK_SIZE)), &free);
+        if (!ring.back())
+            return false;
+    }
+
+    std::vector<int> status(chunks, CHUNK_PENDING);
+    size_t outstanding = 0;
+    std::mutex lock;
+    std::condition_variable landed;
+
+    auto chunk_size = [&](size_t i) { return std::min(size - i * DEVMEM_CHUNK_SIZE, DEVMEM_CHUNK_SIZE); };
+
+    // Called with lock held.
+    auto submit = [&](size_t i) {
+        outstanding++;
+        pool.submit([&, i] {
+            char* buf = ring[i % slots].get();
+            const size_t chunk = chunk_size(i);
+            const size_t length = direct ? ALIGN_UP(chunk, DIRECT_IO_ALIGN) : chunk;
+
+            bool ok = pread(fd, buf, length, offset + i * DEVMEM_CHUNK_SIZE) >= static_cast<ssize_t>(chunk);
+            if (ok)
+                memcpy(static_cast<char*>(dest) + i * DEVMEM_CHUNK_SIZE, buf, chunk);
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                status[i] = ok ? CHUNK_DONE : CHUNK_FAILED;
+                outstanding--;
+            }
+            landed.notify_all();
+        });
+    };
+
+    std::unique_lock<std::mutex> guard(lock);
+    for (size_t i = 0; i < slots; i++)
+        submit(i);
+
+    bool ok = true;
+    for (size_t i = 0; i < chunks && ok; i++) {
+        while (status[i] == CHUNK_PENDING) {
+            guard.unlock();
+            const bool ran = pool.run_one();
+            guard.lock();
+            if (!ran)
+                landed.wait(guard, [&] { return status[i] != CHUNK_PENDING; });
+        }
+
+        ok = status[i] == CHUNK_DONE;
+        if (ok && hash) {
+            guard.unlock();
+            hash->update(ring[i % slots].get(), chunk_size(i));
+            guard.lock();
+        }
+
+        if (ok && i + slots < chunks)
+            submit(i + slots);
+    }
+
+    // The copies refer to our locals, so wait for all of them, even after a failure.
+    while (outstanding > 0) {
+        guard.unlock();
+        const bool ran = pool.run_one();
+        guard.lock();
+        if (!ran)
+            landed.wait(guard, [&] { return outstanding == 0; });
+    }
+
+    return ok;
+}
+
+// Copy a (possibly sparse) file to slice memory. Holes in the file are never read; the
+// corresponding memory is zero-filled instead. Chunks are copied by the thread pool.
+bool copy_sparse_to_devmem(int fd, size_t size, void* dest)
+{
+    char* const base = static_cast<char*>(dest);
+
+    // Each chunk is either data to copy, or a hole to zero.
+    struct Chunk
+    {
+        off_t offset;
+        size_t size;
+        bool data;
+    };
+    std::vector<Chunk> chunks;
+    off_t pos = 0;
+
+    auto add_chunks = [&chunks](off_t start, off_t end, bool data) {
+        for (off_t off = start; off < end; off += DEVMEM_CHUNK_SIZE)
+            chunks.push_back({ off, std::min(DEVMEM_CHUNK_SIZE, static_cast<size_t>(end - off)), data });
+    };
+
+    while (pos < static_cast<off_t>(size)) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            data = size; // no more data before EOF
+        else if (data < 0)
+            return false;
+        data = std::min(data, static_cast<off_t>(size));
+
+        add_chunks(pos, data, false);
+
+        if (data == static_cast<off_t>(size))
+            break;
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            return false;
+        hole = std::min(hole, static_cast<off_t>(size));
+
+        add_chunks(data, hole, true);
+        pos = hole;
+    }
+
+    return thread_pool().parallel_for(chunks.size(), [&](size_t i) {
+        const Chunk& chunk = chunks[i];
+        if (!chunk.data) {
+            memset(base + chunk.offset, 0, chunk.size);
+            return true;
+        }
 
-        if (!file.read(buf, chunk))
+        thread_local std::vector<char> buf(DEVMEM_CHUNK_SIZE);
+        if (pread(fd, buf.data(), chunk.size, chunk.offset) != static_cast<ssize_t>(chunk.size))
             return false;
 
-        memcpy(dest, buf, chunk);
-        dest = static_cast<char*>(dest) + chunk;
-        size -= chunk;
+        memcpy(base + chunk.offset, buf.data(), chunk.size);
+        return true;
+    });
+}
+
+// Zero memory with non-temporal stores, which go straight to memory (write-combined) rather than
+// filling the cache with lines that would need flushing before boot. This is also the fastest way
+// to clear both write-back and write-combining mappings.
+static void stream_zero(char* p, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    if (reinterpret_cast<uintptr_t>(p) % 16 == 0) {
+        for (; i + 64 <= size; i += 64) {
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p + i), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p + i + 16), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p + i + 32), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p + i + 48), zero);
+        }
+        _mm_sfence();
+    }
+    memset(p + i, 0, size - i);
+}
+
+// Zero slice memory, across the thread pool.
+void clear_devmem(void* dest, size_t size)
+{
+    char* const base = static_cast<char*>(dest);
+    const size_t chunks = (size + DEVMEM_CHUNK_SIZE - 1) / DEVMEM_CHUNK_SIZE;
+
+    thread_pool().parallel_for(chunks, [&](size_t i) {
+        stream_zero(base + i * DEVMEM_CHUNK_SIZE, std::min(size - i * DEVMEM_CHUNK_SIZE, DEVMEM_CHUNK_SIZE));
+        return true;
+    });
+}
+
+// Extract the kernel release (as in `uname -r`) from the version string in the setup code.
+static bool read_kernel_version(std::ifstream& kernel_file, const setup_header& header, std::string& version)
+{
+    char buf[256] = {};
+    kernel_file.clear();
+    if (header.kernel_version == 0
+        || !kernel_file.seekg(header.kernel_version + 0x200)
+        || !kernel_file.read(buf, sizeof(buf) - 1)) {
+        std::cerr << "Failed to read kernel version" << std::endl;
+        return false;
+    }
+
+    version.assign(buf, strcspn(buf, " "));
+    return !version.empty();
+}
+
+// Prepend a setup_data node to the boot_params list.
+static void add_setup_data(
+    boot_params* boot_params,
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt,
+    uint32_t type,
+    const void* data,
+    size_t size)
+{
+    setup_data* node = reinterpret_cast<setup_data*>(loadaddr_virt);
+    node->next = boot_params->hdr.setup_data;
+    node->type = type;
+    node->len = size;
+    memcpy(node->data, data, size);
+
+    boot_params->hdr.setup_data = loadaddr_phys;
+
+    size_t node_size = ALIGN_UP(sizeof(*node) + size, 8);
+    loadaddr_phys += node_size;
+    loadaddr_virt += node_size;
+}
+
+static void set_cmdline(boot_params* boot_params, uintptr_t& loadaddr_phys, char*& loadaddr_virt, const std::string& cmdline)
+{
+    if (cmdline.empty())
+        return;
+
+    strcpy(loadaddr_virt, cmdline.c_str());
+    boot_params->hdr.cmd_line_ptr = static_cast<uint32_t>(loadaddr_phys);
+    boot_params->ext_cmd_line_ptr = loadaddr_phys >> 32;
+    size_t cmdline_size = ALIGN_UP(cmdline.size() + 1, 8);
+    loadaddr_phys += cmdline_size;
+    loadaddr_virt += cmdline_size;
+}
+
+// Load initrd segments from files, one after another, each padded to 4 bytes.
+static bool load_initrd_segments(
+    const std::vector<std::pair<const char*, std::string>>& segments,
+    uint64_t ram_top,
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt)
+{
+    for (const auto& [component, path] : segments) {
+        std::ifstream initrd_file(path, std::ios::binary | std::ios::in);
+        if (!initrd_file.is_open()) {
+            perror("Failed to open initrd");
+            return false;
+        }
+
+        initrd_file.seekg(0, std::ios::end);
+        size_t initrd_size = initrd_file.tellg();
+        if (loadaddr_phys + initrd_size > ram_top) {
+            std::cerr << "Slice RAM is too small for the initrd" << std::endl;
+            return false;
+        }
+
+        Sha256 initrd_hash;
+        if (!read_to_devmem(path.c_str(), 0, loadaddr_virt, initrd_size, &initrd_hash)) {
+            perror("Failed to read initrd");
+            return false;
+        }
+
+        record_measurement(component, path.c_str(), initrd_hash.finish());
+
+        const size_t padded_size = ALIGN_UP(initrd_size, 4);
+        memset(loadaddr_virt + initrd_size, 0, padded_size - initrd_size);
+        loadaddr_phys += padded_size;
+        loadaddr_virt += padded_size;
     }
 
     return true;
 }
 
-bool load_linux(
+static void set_ramdisk(boot_params* boot_params, uintptr_t start, uintptr_t end)
+{
+    boot_params->hdr.ramdisk_size = end - start;
+
+    boot_params->hdr.ramdisk_image = static_cast<uint32_t>(start);
+    boot_params->ext_ramdisk_image = start >> 32;
+}
+
+// Space for the setup_data nodes that finish_boot_params() adds, given the number of
+// measurements it will pass on.
+static size_t setup_data_size(const Options& options, size_t seed_size, size_t measurements)
+{
+    size_t size = ALIGN_UP(sizeof(setup_data) + measurement_blob_size(measurements), 8);
+    if (seed_size != 0)
+        size += ALIGN_UP(sizeof(setup_data) + seed_size, 8);
+    if (options.clock_page)
+        size += ALIGN_UP(sizeof(setup_data) + sizeof(slice_clock_info), 8);
+    return size;
+}
+
+// Common to both Linux loaders, once everything is loaded: add the seed (from build_cloud_seed())
+// and measurements, check that it all fit, and fill in the memory map.
+static bool finish_boot_params(
     const Options& options,
     void* slice_ram,
-    uintptr_t& kernel_entry_phys, // Out: entry point at which to jump to kernel in 64-bit mode
-    uintptr_t& kernel_entry_arg)  // Out: argument to be passed to kernel entry (in RSI)
+    boot_params* boot_params,
+    uintptr_t& loadaddr_phys,
+    char*& loadaddr_virt,
+    uint64_t ram_top,
+    uintptr_t mmconfig_base,
+    const std::vector<MemRegion>& regions,
+    const std::vector<char>& seed)
+{
+    // Per-launch cloud-init seed, for the guest's slice-seed service to unpack. It is measured
+    // like everything else, so must be listed (as "seed") in any -digests manifest.
+    if (!seed.empty()) {
+        loadaddr_phys = ALIGN_UP(loadaddr_phys, 8);
+        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+        if (loadaddr_phys + sizeof(setup_data) + seed.size() > ram_top) {
+            std::cerr << "Slice RAM is too small for the cloud-init seed" << std::endl;
+            return false;
+        }
+
+        Sha256 seed_hash;
+        seed_hash.update(seed.data(), seed.size());
+        record_measurement("seed", options.seed_dir ? options.seed_dir : "", seed_hash.finish());
+        add_setup_data(boot_params, loadaddr_phys, loadaddr_virt, SETUP_SLICE_CLOUD_SEED, seed.data(), seed.size());
+    }
+
+    // Where to find the shared clock page.
+    if (options.clock_page) {
+        loadaddr_phys = ALIGN_UP(loadaddr_phys, 8);
+        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+        const slice_clock_info info = { options.clock_page, SLICE_CLOCK_PAGE_SIZE, SLICE_CLOCK_VERSION };
+        add_setup_data(boot_params, loadaddr_phys, loadaddr_virt, SETUP_SLICE_CLOCK, &info, sizeof(info));
+    }
+
+    // Measurements of everything loaded above, for the guest to report.
+    {
+        loadaddr_phys = ALIGN_UP(loadaddr_phys, 8);
+        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+        std::vector<uint8_t> blob = measurement_blob();
+        add_setup_data(boot_params, loadaddr_phys, loadaddr_virt, SETUP_SLICE_MEASUREMENTS, blob.data(), blob.size());
+    }
+
+    if (loadaddr_phys > ram_top) {
+        std::cerr << "Slice RAM is too small for the kernel, initrd and pmem images" << std::endl;
+        return false;
+    }
+
+    // Everything was loaded from the bottom up, or carved from the top.
+    record_devmem_write(options.rambase, loadaddr_phys - options.rambase);
+    record_devmem_write(ram_top, options.rambase + options.ramsize - ram_top);
+
+	boot_params->hdr.type_of_loader = 0xff;
+
+    fill_e820_table(build_memory_map(options, mmconfig_base, ram_top, regions), *boot_params);
+
+    return true;
+}
+
+bool load_linux(const Options& options, void* slice_ram, KernelEntry& entry)
 {
     static constexpr size_t header_offset = offsetof(boot_params, hdr);
     static_assert(header_offset == 0x1f1);
     setup_header header;
 
+    if (!options.module_paths.empty()) {
+        std::cerr << "Modules are not supported for Linux kernels" << std::endl;
+        return false;
+    }
+
+    // Plan where everything goes before writing any of it. Persistent-memory images and the
+    // hotplug mailbox are carved from the top of slice RAM; the kernel, boot_params, ACPI tables,
+    // command line, initrd and setup_data follow one another from the bottom up.
+    SliceLayout layout(options);
+    std::vector<MemRegion> regions;
+    if (!plan_pmem_images(options, layout, regions) || !reserve_hotplug_mailbox(options, layout, regions))
+        return false;
+
     // open the kernel image, and determine its size
     std::ifstream kernel_file(options.kernel_path, std::ios::binary | std::ios::in);
     if (!kernel_file.is_open()) {
@@ -96,82 +488,389 @@ bool load_linux(
         return false;
     }
 
-	// Load the kernel first.
-    uintptr_t loadaddr_phys = ALIGN_UP(options.rambase, header.kernel_alignment);
-    printf("Loading Linux at 0x%lx\n", loadaddr_phys);
-    char* loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+    // The kernel is followed by the space it needs for early boot code (init_size), which it
+    // should always cover.
+    const size_t kernel_size = kernel_file_size - kernel_image_offset;
+    uint64_t kernel_pa, boot_params_pa;
+    if (!layout.place("kernel", ALIGN_UP(std::max<uint64_t>(header.init_size, kernel_size), 0x1000),
+                      header.kernel_alignment, kernel_pa)
+        || !layout.place("boot_params", sizeof(boot_params), 0x1000, boot_params_pa))
+        return false;
 
-    if (!read_to_devmem(kernel_file, kernel_image_offset, loadaddr_virt, kernel_file_size - kernel_image_offset)) {
-        perror("Failed to read kernel image");
+    // The ACPI tables are built now, at the address they will be copied to.
+    std::vector<char> acpi_tables;
+    uintptr_t mmconfig_base = 0;
+    uint64_t acpi_pa;
+    const uintptr_t rsdp_pa = build_acpi(options, layout.next(16), acpi_tables, mmconfig_base);
+    if (rsdp_pa == 0 || !layout.place("acpi", acpi_tables.size(), 16, acpi_pa))
+        return false;
+
+    const std::string cmdline = options.kernel_cmdline ? options.kernel_cmdline : "";
+    uint64_t cmdline_pa = 0;
+    if (!cmdline.empty() && !layout.place("cmdline", cmdline.size() + 1, 8, cmdline_pa))
         return false;
+
+    // The initrd may consist of a base archive, a generated archive, or both concatenated (each
+    // 4-byte aligned, as the kernel's unpacker requires).
+    struct InitrdSegment
+    {
+        const char* component;
+        std::string path;
+        uint64_t size;
+        uint64_t base;
+    };
+    std::vector<InitrdSegment> initrd_segments;
+    if (options.initrd_path)
+        initrd_segments.push_back({ "initrd", options.initrd_path, 0, 0 });
+    if (options.modules_dir) {
+        std::string kernel_version, generated_path;
+        if (!read_kernel_version(kernel_file, header, kernel_version)
+            || !build_slice_initrd(options, kernel_version, options.initrd_path == nullptr, generated_path))
+            return false;
+        initrd_segments.push_back({ "initrd-modules", generated_path, 0, 0 });
     }
 
-    kernel_entry_phys = loadaddr_phys + 0x200;
+    for (InitrdSegment& segment : initrd_segments) {
+        struct stat st;
+        if (stat(segment.path.c_str(), &st) != 0) {
+            perror("Failed to open initrd");
+            return false;
+        }
+        segment.size = st.st_size;
+        if (!layout.place(segment.component, ALIGN_UP(segment.size, 4), &segment == &initrd_segments.front() ? 0x1000 : 4,
+                          segment.base))
+            return false;
+    }
+
+    // setup_data last, including the measurements of everything above.
+    std::vector<char> seed;
+    if (!build_cloud_seed(options, seed))
+        return false;
+    const size_t measurements = get_measurements().size() + 1 + initrd_segments.size() + (seed.empty() ? 0 : 1);
+    uint64_t setup_data_pa;
+    if (!layout.place("setup_data", setup_data_size(options, seed.size(), measurements), 8, setup_data_pa)
+        || !layout.check(options))
+        return false;
+
+    layout.print();
+    record_slice_layout(layout);
+    printf("Loading Linux at 0x%lx\n", kernel_pa);
+    record_linux_layout(kernel_pa, header.init_size, kernel_pa - header.pref_address);
 
-    // Leave space required for early boot code.
+    auto virt = [&](uint64_t pa) { return static_cast<char*>(slice_ram) + (pa - options.rambase); };
+
+    // The setup code isn't loaded, but it is part of the measured image.
+    Sha256 kernel_hash;
     {
-        size_t header_size = ALIGN_UP(header.init_size, 0x1000);
-        loadaddr_phys += header_size;
-        loadaddr_virt += header_size;
+        std::vector<char> setup(kernel_image_offset);
+        if (!kernel_file.seekg(0) || !kernel_file.read(setup.data(), setup.size())) {
+            perror("Failed to read kernel setup code");
+            return false;
+        }
+        kernel_hash.update(setup.data(), setup.size());
     }
 
-	// Boot params ("zero page") follows the kernel.
-	struct boot_params *boot_params = reinterpret_cast<struct boot_params*>(loadaddr_virt);
-    kernel_entry_arg = loadaddr_phys;
+    // Now that everything has its place, the files are read in parallel: each read is itself
+    // split across the thread pool, so the pool is kept busy through the smaller files. They are
+    // measured in the order of the plan.
+    std::vector<Sha256::Digest> initrd_digests(initrd_segments.size());
+    Sha256::Digest kernel_digest;
+    const size_t jobs = 2 + initrd_segments.size();
+    const bool loaded = thread_pool().parallel_for(jobs, [&](size_t i) {
+        if (i == 0) {
+            if (!read_to_devmem(options.kernel_path, kernel_image_offset, virt(kernel_pa), kernel_size, &kernel_hash)) {
+                perror("Failed to read kernel image");
+                return false;
+            }
+            kernel_digest = kernel_hash.finish();
+            return true;
+        } else if (i == 1) {
+            return load_pmem_images(options, slice_ram, regions);
+        }
+
+        const InitrdSegment& segment = initrd_segments[i - 2];
+        Sha256 initrd_hash;
+        if (!read_to_devmem(segment.path.c_str(), 0, virt(segment.base), segment.size, &initrd_hash)) {
+            perror("Failed to read initrd");
+            return false;
+        }
+        memset(virt(segment.base + segment.size), 0, ALIGN_UP(segment.size, 4) - segment.size);
+        initrd_digests[i - 2] = initrd_hash.finish();
+        return true;
+    });
+    if (!loaded)
+        return false;
 
-	memset(boot_params, 0, sizeof(*boot_params));
-	boot_params->hdr = header;
+    record_measurement("kernel", options.kernel_path, kernel_digest);
+    for (size_t i = 0; i < initrd_segments.size(); i++)
+        record_measurement(initrd_segments[i].component, initrd_segments[i].path.c_str(), initrd_digests[i]);
 
-	loadaddr_phys += sizeof(*boot_params);
-    loadaddr_virt += sizeof(*boot_params);
+    write_hotplug_mailbox(options, slice_ram);
+    memcpy(virt(acpi_pa), acpi_tables.data(), acpi_tables.size());
+
+    // 64-bit entry point
+    entry.entry = kernel_pa + 0x200;
+    entry.arg = boot_params_pa;
+
+    struct boot_params *boot_params = reinterpret_cast<struct boot_params*>(virt(boot_params_pa));
+    memset(boot_params, 0, sizeof(*boot_params));
+    boot_params->hdr = header;
+    boot_params->acpi_rsdp_addr = rsdp_pa;
 
-	// ACPI tables.
-    uintptr_t mmconfig_base = 0;
-	boot_params->acpi_rsdp_addr = build_acpi(options, loadaddr_phys, loadaddr_virt, mmconfig_base);
-    if (boot_params->acpi_rsdp_addr == 0)
     {
+        uintptr_t cmdline_phys = cmdline_pa;
+        char* cmdline_virt = virt(cmdline_pa);
+        set_cmdline(boot_params, cmdline_phys, cmdline_virt, cmdline);
+    }
+
+    if (!initrd_segments.empty()) {
+        const InitrdSegment& last = initrd_segments.back();
+        set_ramdisk(boot_params, initrd_segments.front().base, last.base + ALIGN_UP(last.size, 4));
+    }
+
+    uintptr_t loadaddr_phys = setup_data_pa;
+    char* loadaddr_virt = virt(setup_data_pa);
+    if (!finish_boot_params(options, slice_ram, boot_params, loadaddr_phys, loadaddr_virt, layout.top, mmconfig_base,
+                            regions, seed))
+        return false;
+
+    assert(loadaddr_phys == layout.bottom);
+    return true;
+}
+
+// Load a bundle built by slicebundle. Its sections are read in one sequential pass (with
+// O_DIRECT, where the filesystem allows it) straight to the places in slice memory that
+// slicebundle chose for them, and are checked against the digests it recorded.
+bool load_bundle(const Options& options, void* slice_ram, KernelEntry& entry)
+{
+    if (!options.module_paths.empty()) {
+        std::cerr << "Modules are not supported for Linux kernels" << std::endl;
         return false;
     }
 
-	// Command line.
-    if (options.kernel_cmdline) {
-        strcpy(loadaddr_virt, options.kernel_cmdline);
-        boot_params->hdr.cmd_line_ptr = static_cast<uint32_t>(loadaddr_phys);
-        boot_params->ext_cmd_line_ptr = loadaddr_phys >> 32;
-        size_t cmdline_size = ALIGN_UP(strlen(options.kernel_cmdline) + 1, 8);
-	    loadaddr_phys += cmdline_size;
-        loadaddr_virt += cmdline_size;
+    // slicebundle fixed the layout of the bundle itself; only the persistent-memory images and the
+    // hotplug mailbox are planned here, at the top of slice RAM.
+    SliceLayout layout(options);
+    std::vector<MemRegion> regions;
+    if (!plan_pmem_images(options, layout, regions) || !reserve_hotplug_mailbox(options, layout, regions)
+        || !layout.check(options) || !load_pmem_images(options, slice_ram, regions))
+        return false;
+    write_hotplug_mailbox(options, slice_ram);
+    const uint64_t ram_top = layout.top;
+    record_slice_layout(layout);
+
+    bool direct = true;
+    AutoFd fd = open(options.bundle_path, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs
+        direct = false;
+        fd = open(options.bundle_path, O_RDONLY);
+    }
+    if (fd < 0) {
+        perror("Failed to open bundle");
+        return false;
     }
 
-	// Load initrd if present.
-    if (options.initrd_path)
-    {
-        loadaddr_phys = ALIGN_UP(loadaddr_phys, 0x1000);
-        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+    std::unique_ptr<bundle_header, decltype(&free)> header(
+        static_cast<bundle_header*>(aligned_alloc(DIRECT_IO_ALIGN, BUNDLE_ALIGN)), &free);
+    if (pread(fd, header.get(), BUNDLE_ALIGN, 0) != BUNDLE_ALIGN) {
+        perror("Failed to read bundle header");
+        return false;
+    }
 
-        std::ifstream initrd_file(options.initrd_path, std::ios::binary | std::ios::in);
-        if (!initrd_file.is_open()) {
-            perror("Failed to open initrd");
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BUNDLE_VERSION
+        || header->section_count > BUNDLE_MAX_SECTIONS
+        || header->cmdline[BUNDLE_CMDLINE_SIZE - 1] != '\0'
+        || header->kernel_version[sizeof(header->kernel_version) - 1] != '\0') {
+        std::cerr << "Invalid or unsupported bundle" << std::endl;
+        return false;
+    }
+
+    const uintptr_t kernel_pa = ALIGN_UP(options.rambase, header->setup.kernel_alignment);
+    printf("Loading bundle at 0x%lx\n", kernel_pa);
+    record_linux_layout(kernel_pa, header->setup.init_size, kernel_pa - header->setup.pref_address);
+
+    // The layout is fixed, so every section can go straight to its final place.
+    const uintptr_t boot_area = kernel_pa + header->boot_area_offset;
+    const uintptr_t boot_area_end = boot_area + header->boot_area_size;
+    if (kernel_pa > ram_top || header->boot_area_offset > ram_top - kernel_pa
+        || header->boot_area_size > ram_top - boot_area) {
+        std::cerr << "Slice RAM is too small for the bundle boot area" << std::endl;
+        return false;
+    }
+    if (header->boot_area_size < sizeof(boot_params)) {
+        std::cerr << "Invalid bundle boot area" << std::endl;
+        return false;
+    }
+    PreloadedAcpi acpi;
+    uintptr_t tables_end = boot_area + sizeof(boot_params);
+    uintptr_t initrd_start = 0, initrd_end = 0;
+
+    // The kernel is measured with its setup sectors, just as for a bzImage.
+    Sha256 kernel_hash;
+
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        const bundle_section& section = header->sections[i];
+        const char* const name = bundle_section_name(section.type);
+        Sha256 section_hash;
+        Sha256& hash = section.type == BUNDLE_KERNEL ? kernel_hash : section_hash;
+
+        if (section.file_offset % BUNDLE_ALIGN != 0) {
+            std::cerr << "Invalid bundle " << name << " section" << std::endl;
             return false;
         }
 
-        initrd_file.seekg(0, std::ios::end);
-        size_t initrd_size = initrd_file.tellg();
+        if (section.load_offset == BUNDLE_NOT_LOADED) {
+            const size_t length = ALIGN_UP(section.size, BUNDLE_ALIGN);
+            std::unique_ptr<char, decltype(&free)> buf(static_cast<char*>(aligned_alloc(DIRECT_IO_ALIGN, length)), &free);
+            if (pread(fd, buf.get(), length, section.file_offset) < static_cast<ssize_t>(section.size)) {
+                perror("Failed to read bundle");
+                return false;
+            }
+
+            hash.update(buf.get(), section.size);
+            if (section.type == BUNDLE_SETUP)
+                kernel_hash.update(buf.get(), section.size);
+        } else {
+            if (section.load_offset > ram_top - kernel_pa || section.size > ram_top - kernel_pa - section.load_offset) {
+                std::cerr << "Slice RAM is too small for the bundle" << std::endl;
+                return false;
+            }
+
+            const uintptr_t pa = kernel_pa + section.load_offset;
+            char* const virt = reinterpret_cast<char*>(slice_ram) + (pa - options.rambase);
+            if (!read_fd_to_devmem(fd, direct, section.file_offset, virt, section.size, &hash)) {
+                perror("Failed to read bundle");
+                return false;
+            }
+
+            if (section.type == BUNDLE_DSDT || section.type == BUNDLE_SSDT) {
+                if (pa < tables_end || pa + section.size > boot_area_end) {
+                    std::cerr << "Invalid bundle " << name << " section" << std::endl;
+                    return false;
+                }
+                tables_end = pa + section.size;
+                if (section.type == BUNDLE_DSDT)
+                    acpi.dsdt = pa;
+                else
+                    acpi.ssdts.push_back(pa);
+            } else if (section.type == BUNDLE_INITRD) {
+                initrd_start = pa;
+                initrd_end = pa + section.size;
+            }
+        }
 
-        if (!read_to_devmem(initrd_file, 0, loadaddr_virt, initrd_size)) {
-            perror("Failed to read initrd");
+        const Sha256::Digest digest = hash.finish();
+        if (memcmp(digest.data(), section.sha256, digest.size()) != 0) {
+            std::cerr << "Bundle " << name << " section is corrupt" << std::endl;
             return false;
         }
 
-        boot_params->hdr.ramdisk_size = initrd_size;
+        if (section.type != BUNDLE_SETUP)
+            record_measurement(name, options.bundle_path, digest);
+    }
+
+    // 64-bit entry point
+    entry.entry = kernel_pa + 0x200;
+
+    uintptr_t loadaddr_phys = boot_area;
+    char* loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+    struct boot_params *boot_params = reinterpret_cast<struct boot_params*>(loadaddr_virt);
+    entry.arg = loadaddr_phys;
+
+    memset(boot_params, 0, sizeof(*boot_params));
+    boot_params->hdr = header->setup;
 
-        boot_params->hdr.ramdisk_image = static_cast<uint32_t>(loadaddr_phys);
-        boot_params->ext_ramdisk_image = loadaddr_phys >> 32;
+    // The remaining ACPI tables and the command line follow the preloaded tables.
+    loadaddr_phys = ALIGN_UP(tables_end, 8);
+    loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+
+    std::vector<char> acpi_tables;
+    uintptr_t mmconfig_base = 0;
+    boot_params->acpi_rsdp_addr = build_acpi(options, loadaddr_phys, acpi_tables, mmconfig_base, acpi);
+    if (boot_params->acpi_rsdp_addr == 0)
+        return false;
+    if (acpi_tables.size() > boot_area_end - loadaddr_phys) {
+        std::cerr << "Bundle boot area is too small for the ACPI tables" << std::endl;
+        return false;
+    }
+    memcpy(loadaddr_virt, acpi_tables.data(), acpi_tables.size());
+    loadaddr_phys += acpi_tables.size();
+    loadaddr_virt += acpi_tables.size();
+
+    std::string cmdline = header->cmdline;
+    if (options.kernel_cmdline)
+        cmdline += std::string(cmdline.empty() ? "" : " ") + options.kernel_cmdline;
+    if (!cmdline.empty() && ALIGN_UP(cmdline.size() + 1, 8) > boot_area_end - loadaddr_phys) {
+        std::cerr << "Bundle boot area is too small for the ACPI tables and command line" << std::endl;
+        return false;
     }
+    set_cmdline(boot_params, loadaddr_phys, loadaddr_virt, cmdline);
 
-	boot_params->hdr.type_of_loader = 0xff;
+    // A generated initrd follows any bundled one.
+    if (initrd_start != 0) {
+        loadaddr_phys = initrd_end;
+        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+        const size_t padding = ALIGN_UP(loadaddr_phys, 4) - loadaddr_phys;
+        memset(loadaddr_virt, 0, padding);
+        loadaddr_phys += padding;
+        loadaddr_virt += padding;
+    } else {
+        loadaddr_phys = initrd_start = boot_area_end;
+        loadaddr_virt = reinterpret_cast<char*>(slice_ram) + (loadaddr_phys - options.rambase);
+    }
+
+    if (options.modules_dir) {
+        if (initrd_end == 0 && options.busybox_path == nullptr) {
+            std::cerr << "A generated initrd needs either a bundled initrd or busybox" << std::endl;
+            return false;
+        }
+        if (header->kernel_version[0] == '\0') {
+            std::cerr << "Bundle has no kernel version, needed for -modules" << std::endl;
+            return false;
+        }
 
-    fill_e820_table(options, mmconfig_base, *boot_params);
+        std::string generated_path;
+        if (!build_slice_initrd(options, header->kernel_version, initrd_end == 0, generated_path)
+            || !load_initrd_segments({ { "initrd-modules", generated_path } }, ram_top, loadaddr_phys, loadaddr_virt))
+            return false;
+    }
 
-    return true;
+    if (loadaddr_phys > initrd_start)
+        set_ramdisk(boot_params, initrd_start, loadaddr_phys);
+
+    std::vector<char> seed;
+    if (!build_cloud_seed(options, seed))
+        return false;
+    return finish_boot_params(options, slice_ram, boot_params, loadaddr_phys, loadaddr_virt, ram_top, mmconfig_base,
+                              regions, seed);
+}
+
+// Determine the format of the kernel image, and load it accordingly.
+bool load_kernel(const Options& options, void* slice_ram, KernelEntry& entry)
+{
+    if (options.bundle_path)
+        return load_bundle(options, slice_ram, entry);
+
+    std::ifstream kernel_file(options.kernel_path, std::ios::binary | std::ios::in);
+    if (!kernel_file.is_open()) {
+        perror("Failed to open kernel image");
+        return false;
+    }
+
+    char ident[offsetof(boot_params, hdr) + offsetof(setup_header, header) + sizeof(uint32_t)] = {};
+    kernel_file.read(ident, sizeof(ident));
+
+    uint32_t linux_magic;
+    memcpy(&linux_magic, ident + sizeof(ident) - sizeof(linux_magic), sizeof(linux_magic));
+
+    if (linux_magic == 0x53726448) // "HdrS"
+        return load_linux(options, slice_ram, entry);
+    else if (memcmp(ident, ELFMAG, SELFMAG) == 0)
+        return load_elf(options, slice_ram, entry);
+
+    std::cerr << "Unrecognised kernel image format (expected bzImage or ELF)" << std::endl;
+    return false;
 }
@@ -1,5 +1,7 @@
 #include <sys/mman.h>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 
@@ -12,8 +14,64 @@ struct realmode_header {
     uint64_t reserved;
     uint64_t kernel_entry;
     uint64_t kernel_arg;
+    uint32_t kernel_magic;
+    uint32_t kernel_mode;
+    uint32_t msr_count;
+    uint32_t msr_table_offset;
+    uint32_t msr_table_max;
+    uint32_t park_count;
+    uint32_t standby_hint;
+    uint32_t mailbox_offset;
+    uint32_t mailbox_count;
+    uint32_t boot32_offset;
 } __attribute__((__packed__));
 
+struct realmode_msr_write {
+    uint32_t msr;
+    uint32_t reserved;
+    uint64_t clear;
+    uint64_t set;
+} __attribute__((__packed__));
+
+static constexpr uint32_t REALMODE_PARK = 0;
+static constexpr uint32_t REALMODE_STANDBY = 1;
+static constexpr uint64_t REALMODE_MAGIC = 0x5c3921544fd4ae2d;     // initial kernel_entry
+
+// A standby CPU's mailbox, on its own cache line so that it can MONITOR it.
+struct standby_mailbox {
+    uint32_t apic_id;
+    uint32_t state;
+    uint32_t boot_ip;       // with MAILBOX_GO: where the slice's copy of the stub is
+    uint8_t reserved[52];
+};
+static_assert(sizeof(standby_mailbox) == 64);
+
+static constexpr uint32_t MAILBOX_EMPTY = 0;
+static constexpr uint32_t MAILBOX_PARKED = 1;      // set by the CPU, once it is waiting
+static constexpr uint32_t MAILBOX_GO = 2;
+static constexpr uint32_t MAILBOX_RUNNING = 3;     // set by the CPU, as it leaves for boot_ip
+static constexpr uint32_t MAILBOX_CLAIMED = 4;     // taken by a slice that will start it itself
+
+// Fill in the MSR table in the real-mode blob, and return its header.
+static realmode_header* setup_realmode_header(const Options& options)
+{
+    realmode_header* header = reinterpret_cast<realmode_header*>(realmode_blob_start);
+    assert(realmode_blob_size > sizeof(*header));
+    assert(header->msr_table_offset + header->msr_table_max * sizeof(realmode_msr_write) <= realmode_blob_size);
+    assert(header->msr_table_max == MAX_MSR_WRITES);
+    assert(options.msr_writes.size() <= MAX_MSR_WRITES);
+
+    realmode_msr_write* table = reinterpret_cast<realmode_msr_write*>(realmode_blob_start + header->msr_table_offset);
+    for (size_t i = 0; i < options.msr_writes.size(); i++) {
+        const MsrWrite& w = options.msr_writes[i];
+        table[i] = { .msr = w.msr, .reserved = 0, .clear = w.clear, .set = w.set };
+    }
+    header->msr_count = options.msr_writes.size();
+    header->park_count = 0;
+
+    return header;
+}
+
 // MPTABLE kludges, only necessary if the guest enables CONFIG_X86_MPPARSE
 #ifdef CONFIG_EMIT_MPTABLE
 static uintptr_t obliterate_mptable_range(void* lowmem, uintptr_t base, uintptr_t size)
@@ -109,7 +167,7 @@ static void write_mptable(const Options& options, void* vaddr, uintptr_t paddr)
 }
 #endif
 
-bool lowmem_init(const Options& options, const AutoFd& devmem, uintptr_t kernel_entry, uintptr_t kernel_arg, uintptr_t &boot_ip)
+bool lowmem_init(const Options& options, const AutoFd& devmem, const KernelEntry& entry, uintptr_t &boot_ip)
 {
     constexpr size_t MiB = 0x100000;
 
@@ -119,11 +177,12 @@ bool lowmem_init(const Options& options, const AutoFd& devmem, uintptr_t kernel_
         return false;
     }
 
-    struct realmode_header* realmode_header = reinterpret_cast<struct realmode_header*>(realmode_blob_start);
-    assert(realmode_blob_size > sizeof(*realmode_header));
-    assert(realmode_header->kernel_entry == 0x5c3921544fd4ae2d);
-    realmode_header->kernel_entry = kernel_entry;
-    realmode_header->kernel_arg = kernel_arg;
+    struct realmode_header* realmode_header = setup_realmode_header(options);
+    assert(realmode_header->kernel_entry == REALMODE_MAGIC);
+    realmode_header->kernel_entry = entry.entry;
+    realmode_header->kernel_arg = entry.arg;
+    realmode_header->kernel_magic = entry.magic;
+    realmode_header->kernel_mode = entry.protected_mode ? 32 : 64;
 
     memcpy(static_cast<char*>(lowmem) + options.lowmem, realmode_blob_start, realmode_blob_size);
     boot_ip = options.lowmem;
@@ -143,10 +202,278 @@ bool lowmem_init(const Options& options, const AutoFd& devmem, uintptr_t kernel_
     write_mptable(options, static_cast<char*>(lowmem) + mptable_pa, mptable_pa);
 #endif
 
+    flush_cache(lowmem, MiB);
     munmap(lowmem, MiB);
 
-    printf("Copied real-mode boot code to 0x%lx-%lx. Will enter kernel at %lx.\n",
-           options.lowmem, options.lowmem + realmode_blob_size - 1, kernel_entry);
+    printf("Copied real-mode boot code to 0x%lx-%lx. Will enter kernel at %lx in %u-bit mode.\n",
+           options.lowmem, options.lowmem + realmode_blob_size - 1, entry.entry, realmode_header->kernel_mode);
 
     return true;
 }
+
+// The guest kernel starts its APs itself, with its own trampoline, so to apply MSR writes on them
+// we first run each in turn through our real-mode stub in park mode: it applies the writes, counts
+// itself in, and halts. INIT then returns it to wait-for-SIPI, which preserves MSRs.
+bool tune_secondary_cpus(const Options& options, AutoFd& devmem)
+{
+    constexpr size_t MiB = 0x100000;
+
+    // Spare CPUs are tuned now too, so that they are ready if hot-added later.
+    std::vector<uint32_t> apic_ids(options.apic_ids.begin() + 1, options.apic_ids.end());
+    apic_ids.insert(apic_ids.end(), options.spare_apic_ids.begin(), options.spare_apic_ids.end());
+
+    if (options.msr_writes.empty() || apic_ids.empty())
+        return true;
+
+    void* lowmem = mmap(nullptr, MiB, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, 0);
+    if (lowmem == MAP_FAILED) {
+        perror("Error: Failed to map first MiB of RAM");
+        return false;
+    }
+
+    char* const blob = static_cast<char*>(lowmem) + options.lowmem;
+    volatile realmode_header* const parked = reinterpret_cast<volatile realmode_header*>(blob);
+
+    realmode_header* header = setup_realmode_header(options);
+    const uint32_t saved_mode = header->kernel_mode;
+    header->kernel_mode = REALMODE_PARK;
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < apic_ids.size(); i++) {
+        const uint32_t apic_id = apic_ids[i];
+
+        // The stub relocates itself in place, so each CPU needs a fresh copy.
+        memcpy(blob, realmode_blob_start, realmode_blob_size);
+        ok = send_startup_ipi(devmem, apic_id, options.lowmem);
+
+        for (int wait_us = 0; ok && parked->park_count == 0; wait_us += 10) {
+            if (wait_us >= 100000) {
+                fprintf(stderr, "Error: CPU with APIC ID %u did not apply MSR settings\n", apic_id);
+                ok = false;
+            }
+            usleep(10);
+        }
+
+        ok = send_init_ipi(devmem, apic_id) && ok;
+    }
+
+    header->kernel_mode = saved_mode;
+    munmap(lowmem, MiB);
+
+    if (ok)
+        printf("Applied %zu MSR writes to %zu secondary CPUs\n", options.msr_writes.size(), apic_ids.size());
+
+    return ok;
+}
+
+// Size of the standby pool: a copy of the stub, followed by a mailbox for each CPU.
+uint64_t standby_pool_size()
+{
+    return ALIGN_UP(ALIGN_UP(realmode_blob_size, sizeof(standby_mailbox)) + MAX_STANDBY_CPUS * sizeof(standby_mailbox),
+                    0x1000);
+}
+
+// The deepest MWAIT C-state the host CPU supports, as Linux's mwait_play_dead() picks it, or
+// UINT32_MAX without MONITOR/MWAIT.
+static uint32_t standby_mwait_hint()
+{
+    uint32_t max_leaf, a, b, c, d;
+    cpuid(0, 0, max_leaf, b, c, d);
+    cpuid(1, 0, a, b, c, d);
+    if (max_leaf < 5 || !(c & (1 << 3)))
+        return UINT32_MAX;
+
+    // EDX has the number of sub-states of each C-state, 4 bits each, from C0.
+    cpuid(5, 0, a, b, c, d);
+    uint32_t hint = 0;
+    for (unsigned cstate = 1; cstate < 8; cstate++) {
+        const uint32_t substates = (d >> (4 * cstate)) & 0xf;
+        if (substates != 0)
+            hint = (cstate - 1) << 4 | (substates - 1);
+    }
+    return hint;
+}
+
+// Find a valid standby pool in low memory, as left by park_standby_cpus().
+static volatile standby_mailbox* find_standby_pool(char* pool, uint32_t& count)
+{
+    const realmode_header* const header = reinterpret_cast<const realmode_header*>(pool);
+    if (header->kernel_entry != REALMODE_MAGIC || header->kernel_mode != REALMODE_STANDBY
+        || header->mailbox_offset + header->mailbox_count * sizeof(standby_mailbox) > standby_pool_size()) {
+        return nullptr;
+    }
+
+    count = header->mailbox_count;
+    return reinterpret_cast<volatile standby_mailbox*>(pool + header->mailbox_offset);
+}
+
+// Start the given CPUs in the stub's standby mode, in a pool at options.standby_pool: each finds
+// its mailbox and waits on it with MONITOR/MWAIT, until start_standby_cpu() hands it a slice to
+// boot. The mailboxes of CPUs already in the pool are kept, so that those left out stay parked,
+// and those claimed by a slice are not restarted while it may be running: restarting a CPU that a
+// slice has claimed needs the launch log (-log) to show that the slice has been released.
+bool park_standby_cpus(const Options& options, AutoFd& devmem)
+{
+    constexpr size_t MiB = 0x100000;
+
+    std::vector<uint32_t> live_ids;
+    if (options.log_path && !read_live_apic_ids(options.log_path, live_ids))
+        return false;
+
+    void* lowmem = mmap(nullptr, MiB, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, 0);
+    if (lowmem == MAP_FAILED) {
+        perror("Error: Failed to map first MiB of RAM");
+        return false;
+    }
+
+    char* const pool = static_cast<char*>(lowmem) + options.standby_pool;
+    uint32_t old_count = 0;
+    volatile standby_mailbox* const old_mailboxes = find_standby_pool(pool, old_count);
+    std::vector<uint32_t> pool_ids;
+    for (uint32_t i = 0; old_mailboxes && i < old_count; i++)
+        pool_ids.push_back(static_cast<uint32_t>(old_mailboxes[i].apic_id));
+
+    bool ok = true;
+    std::vector<uint32_t> slots;
+    for (uint32_t apic_id : options.apic_ids) {
+        auto it = std::find(pool_ids.begin(), pool_ids.end(), apic_id);
+        const uint32_t state = it == pool_ids.end() ? MAILBOX_EMPTY : old_mailboxes[it - pool_ids.begin()].state;
+        if (std::find(live_ids.begin(), live_ids.end(), apic_id) != live_ids.end()) {
+            fprintf(stderr, "Error: CPU with APIC ID %u belongs to a slice that has not been released\n", apic_id);
+            ok = false;
+        } else if (state != MAILBOX_EMPTY && state != MAILBOX_PARKED && options.log_path == nullptr) {
+            fprintf(stderr, "Error: CPU with APIC ID %u was taken from the pool by a slice; give its launch "
+                            "log with -log to check that it has been released\n", apic_id);
+            ok = false;
+        }
+
+        slots.push_back(it - pool_ids.begin());
+        if (it == pool_ids.end())
+            pool_ids.push_back(apic_id);
+    }
+
+    if (ok && pool_ids.size() > MAX_STANDBY_CPUS) {
+        fprintf(stderr, "Error: the standby pool can hold at most %zu CPUs\n", MAX_STANDBY_CPUS);
+        ok = false;
+    }
+
+    // CPUs already in the pool watch their own mailboxes, which must stay where they are.
+    const uint32_t mailbox_offset = ALIGN_UP(realmode_blob_size, sizeof(standby_mailbox));
+    volatile standby_mailbox* const mailboxes = reinterpret_cast<volatile standby_mailbox*>(pool + mailbox_offset);
+    if (ok && old_mailboxes != nullptr && old_mailboxes != mailboxes) {
+        fprintf(stderr, "Error: the standby pool at 0x%lx is from another version of runslice\n", options.standby_pool);
+        ok = false;
+    }
+
+    if (!ok) {
+        munmap(lowmem, MiB);
+        return false;
+    }
+
+    realmode_header* header = setup_realmode_header(options);
+    const uint32_t saved_mode = header->kernel_mode;
+    header->kernel_mode = REALMODE_STANDBY;
+    header->standby_hint = standby_mwait_hint();
+    header->mailbox_offset = mailbox_offset;
+    header->mailbox_count = pool_ids.size();
+
+    // Rewriting the stub is harmless to CPUs already in the pool: it is unchanged but for the MSR
+    // writes, which they have already made.
+    memcpy(pool, realmode_blob_start, realmode_blob_size);
+    if (old_mailboxes == nullptr)
+        memset(pool + header->mailbox_offset, 0, MAX_STANDBY_CPUS * sizeof(standby_mailbox));
+    for (size_t i = 0; i < options.apic_ids.size(); i++) {
+        mailboxes[slots[i]].apic_id = options.apic_ids[i];
+        mailboxes[slots[i]].state = MAILBOX_EMPTY;
+    }
+    flush_cache(pool, standby_pool_size());
+
+    header->kernel_mode = saved_mode;
+    header->standby_hint = header->mailbox_offset = header->mailbox_count = 0;
+
+    for (uint32_t apic_id : options.apic_ids)
+        ok = send_startup_ipi(devmem, apic_id, options.standby_pool) && ok;
+
+    for (size_t i = 0; ok && i < options.apic_ids.size(); i++) {
+        for (int wait_us = 0; mailboxes[slots[i]].state != MAILBOX_PARKED; wait_us += 10) {
+            if (wait_us >= 100000) {
+                fprintf(stderr, "Error: CPU with APIC ID %u did not enter standby\n", options.apic_ids[i]);
+                ok = false;
+                break;
+            }
+            usleep(10);
+        }
+    }
+
+    munmap(lowmem, MiB);
+
+    if (ok) {
+        const uint32_t hint = standby_mwait_hint();
+        if (hint == UINT32_MAX)
+            printf("Parked %zu CPUs in standby at 0x%lx, spinning (no MWAIT)\n", options.apic_ids.size(),
+                   options.standby_pool);
+        else
+            printf("Parked %zu CPUs in standby at 0x%lx, in MWAIT C%u (hint 0x%x)\n", options.apic_ids.size(),
+                   options.standby_pool, (hint >> 4) + 1, hint);
+    }
+
+    return ok;
+}
+
+// If the slice's boot CPU is waiting in the standby pool, hand it the stub at boot_ip, and claim
+// the slice's other CPUs from the pool, so that they stay put until the guest starts them.
+// Returns false if the boot CPU is not in standby (or did not respond), and so needs INIT/SIPI.
+bool start_standby_cpu(const Options& options, AutoFd& devmem, uintptr_t boot_ip)
+{
+    constexpr size_t MiB = 0x100000;
+
+    void* lowmem = mmap(nullptr, MiB, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, 0);
+    if (lowmem == MAP_FAILED) {
+        perror("Error: Failed to map first MiB of RAM");
+        return false;
+    }
+
+    char* const pool = static_cast<char*>(lowmem) + options.standby_pool;
+    uint32_t mailbox_count;
+    volatile standby_mailbox* const mailboxes = find_standby_pool(pool, mailbox_count);
+    if (mailboxes == nullptr) {
+        fprintf(stderr, "Warning: no standby pool at 0x%lx (see runslice -park)\n", options.standby_pool);
+        munmap(lowmem, MiB);
+        return false;
+    }
+
+    volatile standby_mailbox* boot = nullptr;
+    std::vector<uint32_t> apic_ids = options.apic_ids;
+    apic_ids.insert(apic_ids.end(), options.spare_apic_ids.begin(), options.spare_apic_ids.end());
+    for (uint32_t i = 0; i < mailbox_count; i++) {
+        volatile standby_mailbox& mailbox = mailboxes[i];
+        const uint32_t apic_id = mailbox.apic_id;
+        if (std::find(apic_ids.begin(), apic_ids.end(), apic_id) == apic_ids.end())
+            continue;
+        if (apic_id == options.apic_ids.front() && mailbox.state == MAILBOX_PARKED)
+            boot = &mailbox;
+        else
+            __atomic_store_n(&mailbox.state, MAILBOX_CLAIMED, __ATOMIC_RELEASE);
+    }
+
+    bool started = false;
+    if (boot != nullptr) {
+        const auto start = std::chrono::steady_clock::now();
+        boot->boot_ip = boot_ip;
+        __atomic_store_n(&boot->state, MAILBOX_GO, __ATOMIC_RELEASE);
+        const auto deadline = start + std::chrono::milliseconds(10);
+        while (!(started = boot->state == MAILBOX_RUNNING) && std::chrono::steady_clock::now() < deadline)
+            __builtin_ia32_pause();
+
+        if (started) {
+            printf("Started boot CPU from standby in %.1f us\n",
+                   std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        } else {
+            fprintf(stderr, "Warning: standby CPU with APIC ID %u did not respond\n", options.apic_ids.front());
+            __atomic_store_n(&boot->state, MAILBOX_CLAIMED, __ATOMIC_RELEASE);
+        }
+    }
+
+    munmap(lowmem, MiB);
+    return started;
+}
@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "runslice.h"
+
+// Layout of the measurement blob handed to the guest as setup_data, readable from
+// /sys/kernel/boot_params/setup_data/N/data.
+struct slice_measurements_header {
+    char magic[4]; // "SLMS"
+    uint32_t version;
+    uint32_t count;
+    uint32_t entry_size;
+} __attribute__((packed));
+
+struct slice_measurement_entry {
+    char component[16];
+    uint8_t sha256[Sha256::DIGEST_SIZE];
+} __attribute__((packed));
+
+static std::vector<Measurement> measurements;
+
+void record_measurement(const char* component, const char* path, const Sha256::Digest& digest)
+{
+    measurements.push_back({component, path ? path : "", digest});
+    printf("Measured %s: sha256:%s\n", component, Sha256::to_hex(digest).c_str());
+}
+
+const std::vector<Measurement>& get_measurements()
+{
+    return measurements;
+}
+
+std::vector<uint8_t> measurement_blob()
+{
+    std::vector<uint8_t> blob(sizeof(slice_measurements_header)
+        + measurements.size() * sizeof(slice_measurement_entry));
+
+    slice_measurements_header* header = reinterpret_cast<slice_measurements_header*>(blob.data());
+    memcpy(header->magic, "SLMS", sizeof(header->magic));
+    header->version = 1;
+    header->count = measurements.size();
+    header->entry_size = sizeof(slice_measurement_entry);
+
+    slice_measurement_entry* entry = reinterpret_cast<slice_measurement_entry*>(header + 1);
+    for (const Measurement& m : measurements) {
+        strncpy(entry->component, m.component.c_str(), sizeof(entry->component));
+        memcpy(entry->sha256, m.digest.data(), sizeof(entry->sha256));
+        entry++;
+    }
+
+    return blob;
+}
+
+size_t measurement_blob_size(size_t count)
+{
+    return sizeof(slice_measurements_header) + count * sizeof(slice_measurement_entry);
+}
+
+static bool manifest_name_matches(const std::string& name, const Measurement& m)
+{
+    if (name == m.component || name == m.path)
+        return true;
+
+    size_t slash = m.path.rfind('/');
+    return slash != std::string::npos && name == m.path.substr(slash + 1);
+}
+
+// The manifest uses sha256sum(1) format: one "<hex digest>  <name>" line per component, where
+// the name is either the component ("kernel", "initrd", "dsdt"), or the path or file name
+// from which it was loaded. Every measured component must be listed with a matching digest.
+bool verify_measurements(const char* manifest_path)
+{
+    std::ifstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        perror("Failed to open digest manifest");
+        return false;
+    }
+
+    std::vector<std::pair<std::string, Sha256::Digest>> expected;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        Sha256::Digest digest;
+        size_t sep = line.find_first_of(" \t");
+        size_t name_start = line.find_first_not_of(" \t*", sep);
+        if (sep == std::string::npos || name_start == std::string::npos
+            || !Sha256::from_hex(line.c_str(), digest)) {
+            fprintf(stderr, "Invalid digest manifest line: %s\n", line.c_str());
+            return false;
+        }
+
+        expected.emplace_back(line.substr(name_start), digest);
+    }
+
+    bool ok = true;
+    for (const Measurement& m : measurements) {
+        bool found = false;
+        for (const auto& [name, digest] : expected) {
+            if (!manifest_name_matches(name, m))
+                continue;
+
+            found = true;
+            if (digest != m.digest) {
+                fprintf(stderr, "Error: %s digest mismatch (expected %s)\n",
+                        m.component.c_str(), Sha256::to_hex(digest).c_str());
+                ok = false;
+            }
+            break;
+        }
+
+        if (!found) {
+            fprintf(stderr, "Error: %s (%s) is not listed in the digest manifest\n",
+                    m.component.c_str(), m.path.c_str());
+            ok = false;
+        }
+    }
+
+    if (ok)
+        printf("Verified %zu measurements against %s\n", measurements.size(), manifest_path);
+
+    return ok;
+}
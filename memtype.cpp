@@ -0,0 +1,188 @@
+#include <immintrin.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include "runslice.h"
+#include "threadpool.h"
+
+const char* mem_type_name(MemType type)
+{
+    switch (type) {
+    case MemType::WriteBack: return "write-back";
+    case MemType::WriteCombining: return "write-combining";
+    case MemType::WriteThrough: return "write-through";
+    case MemType::WriteProtect: return "write-protect";
+    case MemType::UncachedMinus: return "uncached-minus";
+    case MemType::Uncached: return "uncached";
+    default: return "unknown";
+    }
+}
+
+static MemType parse_mem_type(const std::string& name)
+{
+    for (MemType type : { MemType::WriteBack, MemType::WriteCombining, MemType::WriteThrough,
+                          MemType::WriteProtect, MemType::UncachedMinus, MemType::Uncached }) {
+        if (name == mem_type_name(type))
+            return type;
+    }
+
+    return MemType::Unknown;
+}
+
+// The effective memory type of a mapping of physical memory, which the kernel chose (from PAT and
+// the MTRRs) when it was mapped. The kernel lists its PAT memory types in debugfs, with lines like
+// "PAT: [mem 0x0000000880000000-0x0000000c80000000] write-back". Without debugfs, fall back to the
+// variable MTRRs, which give the type of a PAT write-back request.
+MemType get_mem_type(uint64_t base, uint64_t size)
+{
+    std::ifstream pat(host_path("/sys/kernel/debug/x86/pat_memtype_list"));
+    std::string line;
+    while (std::getline(pat, line)) {
+        uint64_t start, end;
+        char name[32];
+        if (sscanf(line.c_str(), "PAT: [mem 0x%" SCNx64 "-0x%" SCNx64 "] %31s", &start, &end, name) == 3
+            && start <= base && base + size <= end)
+            return parse_mem_type(name);
+    }
+
+    // e.g. "reg01: base=0x880000000 (34816MB), size=16384MB, count=1: write-back"
+    std::ifstream mtrr(host_path("/proc/mtrr"));
+    while (std::getline(mtrr, line)) {
+        uint64_t start, size_mb;
+        const size_t colon = line.rfind(": ");
+        if (colon != std::string::npos
+            && sscanf(line.c_str(), "reg%*u: base=0x%" SCNx64 " (%*uMB), size=%" SCNu64 "MB", &start, &size_mb) == 2
+            && start <= base && base + size <= start + (size_mb << 20))
+            return parse_mem_type(line.substr(colon + 2));
+    }
+
+    return MemType::Unknown;
+}
+
+// Map slice memory from /dev/mem. The kernel picks the memory type: without O_SYNC, it asks for
+// write-back, which it grants unless the MTRRs or an existing mapping of the range say otherwise.
+// There is no way to ask for anything else (O_SYNC only makes it uncached), so we report what we
+// got, since the copy and clear rates depend on it.
+void* map_devmem(const AutoFd& devmem, uint64_t base, uint64_t size, const char* what)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, base);
+    if (p == MAP_FAILED)
+        return p;
+
+    const MemType type = get_mem_type(base, size);
+    printf("Mapped %s at 0x%" PRIx64 " as %s\n", what, base, mem_type_name(type));
+    if (type == MemType::Uncached || type == MemType::UncachedMinus)
+        fprintf(stderr, "Warning: %s is mapped uncached, so loading will be slow; check the MTRRs "
+                        "cover it as write-back\n", what);
+
+    return p;
+}
+
+static constexpr size_t FLUSH_CHUNK_SIZE = 0x100000;
+
+// Ranges of slice memory that the loaders wrote through the cache, to be flushed before boot.
+static std::mutex written_lock;
+static std::vector<std::pair<uint64_t, uint64_t>> written;
+
+void record_devmem_write(uint64_t base, uint64_t size)
+{
+    std::lock_guard<std::mutex> guard(written_lock);
+    if (size)
+        written.push_back({ base, size });
+}
+
+uint64_t devmem_written_bytes()
+{
+    std::lock_guard<std::mutex> guard(written_lock);
+    uint64_t total = 0;
+    for (const auto& range : written)
+        total += range.second;
+    return total;
+}
+
+__attribute__((target("clwb")))
+static void flush_clwb(char* p, size_t size)
+{
+    for (size_t i = 0; i < size; i += 64)
+        _mm_clwb(p + i);
+    _mm_sfence();
+}
+
+__attribute__((target("clflushopt")))
+static void flush_clflushopt(char* p, size_t size)
+{
+    for (size_t i = 0; i < size; i += 64)
+        _mm_clflushopt(p + i);
+    _mm_sfence();
+}
+
+static void flush_clflush(char* p, size_t size)
+{
+    for (size_t i = 0; i < size; i += 64)
+        _mm_clflush(p + i);
+    _mm_mfence();
+}
+
+// The cheapest flush the CPU has: clwb leaves the lines valid, and clflushopt is weakly ordered,
+// unlike clflush.
+static void (*select_flush(const char*& name))(char*, size_t)
+{
+    uint32_t max_leaf, a, b, c, d;
+    cpuid(0, 0, max_leaf, b, c, d);
+    if (max_leaf >= 7)
+        cpuid(7, 0, a, b, c, d);
+    else
+        b = 0;
+
+    if (b & (1u << 24)) {
+        name = "clwb";
+        return flush_clwb;
+    } else if (b & (1u << 23)) {
+        name = "clflushopt";
+        return flush_clflushopt;
+    }
+
+    name = "clflush";
+    return flush_clflush;
+}
+
+// Write back a range from the host's caches to memory, then fence.
+void flush_cache(void* p, size_t size)
+{
+    const char* name;
+    char* const start = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(63));
+    select_flush(name)(start, static_cast<char*>(p) + size - start);
+}
+
+// Write back everything recorded with record_devmem_write(), so that it is in memory before the
+// slice's CPUs start, whatever their cache state.
+void flush_devmem_writes(void* slice_ram, uint64_t rambase)
+{
+    const char* name;
+    auto flush = select_flush(name);
+
+    std::vector<std::pair<char*, size_t>> chunks;
+    {
+        std::lock_guard<std::mutex> guard(written_lock);
+        for (const auto& [base, size] : written) {
+            char* start = static_cast<char*>(slice_ram) + (base - rambase);
+            char* const end = start + size;
+            start = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(start) & ~uintptr_t(63));
+            for (; start < end; start += FLUSH_CHUNK_SIZE)
+                chunks.push_back({ start, std::min<size_t>(end - start, FLUSH_CHUNK_SIZE) });
+        }
+    }
+
+    // Each worker fences its own flushes.
+    thread_pool().parallel_for(chunks.size(), [&](size_t i) {
+        flush(chunks[i].first, chunks[i].second);
+        return true;
+    });
+
+    printf("Flushed %" PRIu64 " KiB of slice RAM (%s)\n", devmem_written_bytes() >> 10, name);
+}
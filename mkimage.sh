@@ -65,7 +65,8 @@ mountpoint=$(mktemp -d)
 
 set -x
 
-mkfs.ext4 -L cloudimg-rootfs $partdev
+# metadata_csum_seed lets sliceimg give clones a new UUID by rewriting only the superblock
+mkfs.ext4 -L cloudimg-rootfs -O metadata_csum_seed $partdev
 
 mount $partdev $mountpoint
 
@@ -91,6 +92,20 @@ done
 
 cp "$cloudcfg" $mountpoint/etc/cloud/cloud.cfg.d/10_local.cfg
 
+# unpack any per-launch cloud-init seed passed by runslice -seed/-hostname, before cloud-init runs
+install -m 755 "$resdir/slice-seed" $mountpoint/usr/local/sbin/slice-seed
+install -m 644 "$resdir/slice-seed.service" $mountpoint/etc/systemd/system/slice-seed.service
+mkdir -p $mountpoint/etc/systemd/system/cloud-init.target.wants
+ln -sf ../slice-seed.service $mountpoint/etc/systemd/system/cloud-init.target.wants/slice-seed.service
+
+# install the slicebench agent (not enabled: a benchmark seed starts it), if it has been built,
+# with the token that slicebench run must give it
+if [[ -x "$resdir/builddir/slicebench" && -f "$resdir/bench.token" ]]; then
+    install -m 755 "$resdir/builddir/slicebench" $mountpoint/usr/local/bin/slicebench
+    install -m 644 "$resdir/slicebench-agent.service" $mountpoint/etc/systemd/system/slicebench-agent.service
+    install -m 600 "$resdir/bench.token" $mountpoint/etc/slicebench.token
+fi
+
 # capture a copy of the kernel image and initrd -- we'll need these to boot
 cp -b $mountpoint/boot/{vmlinuz,initrd.img} .
 
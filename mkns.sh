@@ -9,6 +9,7 @@ NVME_DEV=/dev/nvme0
 SIZE_GB=512
 BLOCK_SIZE=4096
 VFNID=-1
+GOLDEN=
 
 # Parse arguments
 while [[ $# -gt 0 ]]
@@ -34,12 +35,18 @@ do
     shift
     ;;
 
+  -G)
+    GOLDEN="$2"
+    shift
+    ;;
+
   -h)
     echo "Usage: $0 [args]"
     echo "   -d DEV       host NVME device"
     echo "   -g GB        namespace size in GB"
     echo "   -b BYTES     block size"
     echo "   -v VFNID     (0-based) virtual function ID to which to attach the namespace"
+    echo "   -G IMAGE     clone a golden image (see sliceimg) rather than running mkimage.sh"
     exit 0
     ;;
 
@@ -102,7 +109,11 @@ done
 set -x
 
 # Partition/format/image the new namespace
-$(dirname "$BASH_SOURCE")/mkimage.sh $NSDEV
+if [[ -n "$GOLDEN" ]]; then
+    $(dirname "$BASH_SOURCE")/builddir/sliceimg clone "$GOLDEN" $NSDEV -force -hostname slice$VFNID
+else
+    $(dirname "$BASH_SOURCE")/mkimage.sh $NSDEV
+fi
 
 # Detach the new namespace from the primary controller
 nvme detach-ns $NVME_DEV -c $HOST_CNTLID -n $NSID
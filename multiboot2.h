@@ -0,0 +1,124 @@
+#ifndef MULTIBOOT2_H
+#define MULTIBOOT2_H 1
+
+#include <cstdint>
+
+// Subset of the Multiboot2 specification (version 2.0) used to load non-Linux payloads.
+
+// The OS image header must be 8-byte aligned within the first 32KiB of the image.
+constexpr size_t MULTIBOOT2_SEARCH = 32768;
+constexpr uint32_t MULTIBOOT2_HEADER_MAGIC = 0xe85250d6;
+constexpr uint32_t MULTIBOOT2_ARCHITECTURE_I386 = 0;
+
+// Passed to the payload (in EAX, and also RDI) along with the address of the boot information.
+constexpr uint32_t MULTIBOOT2_BOOTLOADER_MAGIC = 0x36d76289;
+
+struct multiboot2_header
+{
+    uint32_t magic;
+    uint32_t architecture;
+    uint32_t header_length;
+    uint32_t checksum;
+} __attribute__((packed));
+
+// Header tags
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_END = 0;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST = 1;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_ADDRESS = 2;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS = 3;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_CONSOLE_FLAGS = 4;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_FRAMEBUFFER = 5;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_MODULE_ALIGN = 6;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_EFI_BS = 7;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI64 = 9;
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_RELOCATABLE = 10;
+
+constexpr uint16_t MULTIBOOT2_HEADER_TAG_OPTIONAL = 1;
+
+struct multiboot2_header_tag
+{
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+} __attribute__((packed));
+
+struct multiboot2_header_tag_entry_address
+{
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+    uint32_t entry_addr;
+} __attribute__((packed));
+
+// Boot information tags
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_END = 0;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_CMDLINE = 1;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME = 2;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_MODULE = 3;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO = 4;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_MMAP = 6;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_ACPI_OLD = 14;
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_ACPI_NEW = 15;
+
+// Slice extension: like MULTIBOOT2_TAG_TYPE_MODULE, but with 64-bit addresses, used for modules
+// loaded above 4GiB (the spec says that unknown tags are to be ignored).
+constexpr uint32_t MULTIBOOT2_TAG_TYPE_SLICE_MODULE64 = 0x534c0003;
+
+constexpr size_t MULTIBOOT2_TAG_ALIGN = 8;
+
+struct multiboot2_info_header
+{
+    uint32_t total_size;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct multiboot2_tag
+{
+    uint32_t type;
+    uint32_t size;
+} __attribute__((packed));
+
+struct multiboot2_tag_basic_meminfo
+{
+    uint32_t type;
+    uint32_t size;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+} __attribute__((packed));
+
+struct multiboot2_tag_module
+{
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];
+} __attribute__((packed));
+
+struct multiboot2_tag_module64
+{
+    uint32_t type;
+    uint32_t size;
+    uint64_t mod_start;
+    uint64_t mod_end;
+    char cmdline[];
+} __attribute__((packed));
+
+struct multiboot2_mmap_entry
+{
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+} __attribute__((packed));
+
+struct multiboot2_tag_mmap
+{
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    multiboot2_mmap_entry entries[];
+} __attribute__((packed));
+
+#endif
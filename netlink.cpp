@@ -0,0 +1,245 @@
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "runslice.h"
+
+// Minimal rtnetlink request builder, just sufficient to configure SR-IOV VFs on a PF.
+class NetlinkRequest
+{
+    std::vector<char> m_buf;
+
+    nlmsghdr* header() { return reinterpret_cast<nlmsghdr*>(m_buf.data()); }
+
+    void* grow(size_t len)
+    {
+        size_t offset = m_buf.size();
+        m_buf.resize(offset + NLMSG_ALIGN(len), 0);
+        header()->nlmsg_len = m_buf.size();
+        return m_buf.data() + offset;
+    }
+
+public:
+    NetlinkRequest(uint16_t type, uint16_t flags)
+    {
+        nlmsghdr* hdr = static_cast<nlmsghdr*>(grow(sizeof(nlmsghdr)));
+        hdr->nlmsg_type = type;
+        hdr->nlmsg_flags = flags;
+    }
+
+    template<typename T>
+    void put(const T& value)
+    {
+        memcpy(grow(sizeof(T)), &value, sizeof(T));
+    }
+
+    void put_attr(uint16_t type, const void* data, size_t len)
+    {
+        rtattr* rta = static_cast<rtattr*>(grow(RTA_LENGTH(len)));
+        rta->rta_type = type;
+        rta->rta_len = RTA_LENGTH(len);
+        memcpy(RTA_DATA(rta), data, len);
+    }
+
+    size_t begin_nested(uint16_t type)
+    {
+        size_t offset = m_buf.size();
+        rtattr* rta = static_cast<rtattr*>(grow(sizeof(rtattr)));
+        rta->rta_type = type | NLA_F_NESTED;
+        return offset;
+    }
+
+    void end_nested(size_t offset)
+    {
+        reinterpret_cast<rtattr*>(m_buf.data() + offset)->rta_len = m_buf.size() - offset;
+    }
+
+    // Send the request, and wait for the kernel's acknowledgement. If reply is given, it receives
+    // the payload of the kernel's response (e.g. to RTM_GETLINK) that precedes the acknowledgement.
+    bool transact(std::vector<char>* reply = nullptr)
+    {
+        AutoFd sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (sock < 0) {
+            perror("Failed to open netlink socket");
+            return false;
+        }
+
+        header()->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+        header()->nlmsg_seq = 1;
+
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        if (sendto(sock, m_buf.data(), m_buf.size(), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            perror("Failed to send netlink request");
+            return false;
+        }
+
+        // Large enough for a link with all its VFs, without statistics.
+        std::vector<char> buf(65536);
+        while (true) {
+            ssize_t len = recv(sock, buf.data(), buf.size(), 0);
+            if (len < 0) {
+                perror("Failed to receive netlink reply");
+                return false;
+            }
+
+            size_t remaining = len;
+            for (nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buf.data()); NLMSG_OK(nh, remaining); nh = NLMSG_NEXT(nh, remaining)) {
+                if (nh->nlmsg_type == NLMSG_ERROR) {
+                    const nlmsgerr* err = static_cast<const nlmsgerr*>(NLMSG_DATA(nh));
+                    if (err->error != 0) {
+                        fprintf(stderr, "Netlink request failed: %s\n", strerror(-err->error));
+                        return false;
+                    }
+                    if (reply && reply->empty()) {
+                        fprintf(stderr, "Netlink request got no reply\n");
+                        return false;
+                    }
+                    return true;
+                } else if (reply) {
+                    const char* data = static_cast<const char*>(NLMSG_DATA(nh));
+                    reply->assign(data, data + NLMSG_PAYLOAD(nh, 0));
+                }
+            }
+
+            if (reply == nullptr || len == 0)
+                break;
+        }
+
+        fprintf(stderr, "Netlink request was not acknowledged\n");
+        return false;
+    }
+};
+
+static NetlinkRequest vf_request(int ifindex)
+{
+    NetlinkRequest req(RTM_SETLINK, 0);
+
+    ifinfomsg ifi = {};
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    req.put(ifi);
+
+    return req;
+}
+
+// Set one IFLA_VF_* attribute of a VF, whose data starts with the VF number.
+static bool set_vf_attr(int ifindex, uint16_t type, const void* data, size_t len)
+{
+    NetlinkRequest req = vf_request(ifindex);
+
+    size_t vfinfo_list = req.begin_nested(IFLA_VFINFO_LIST);
+    size_t vfinfo = req.begin_nested(IFLA_VF_INFO);
+    req.put_attr(type, data, len);
+    req.end_nested(vfinfo);
+    req.end_nested(vfinfo_list);
+
+    return req.transact();
+}
+
+bool VfNetlink::set_vf_mac(int ifindex, uint32_t vf, const uint8_t mac[6])
+{
+    ifla_vf_mac vf_mac = {};
+    vf_mac.vf = vf;
+    memcpy(vf_mac.mac, mac, 6);
+
+    return set_vf_attr(ifindex, IFLA_VF_MAC, &vf_mac, sizeof(vf_mac));
+}
+
+bool VfNetlink::set_vf_rate(int ifindex, uint32_t vf, uint32_t min_tx_rate, uint32_t max_tx_rate)
+{
+    ifla_vf_rate rate = { vf, min_tx_rate, max_tx_rate };
+    return set_vf_attr(ifindex, IFLA_VF_RATE, &rate, sizeof(rate));
+}
+
+bool VfNetlink::set_vf_vlan(int ifindex, uint32_t vf, uint32_t vlan, uint32_t qos)
+{
+    ifla_vf_vlan vf_vlan = { vf, vlan, qos };
+    return set_vf_attr(ifindex, IFLA_VF_VLAN, &vf_vlan, sizeof(vf_vlan));
+}
+
+bool VfNetlink::set_vf_spoofchk(int ifindex, uint32_t vf, bool on)
+{
+    ifla_vf_spoofchk spoofchk = { vf, on };
+    return set_vf_attr(ifindex, IFLA_VF_SPOOFCHK, &spoofchk, sizeof(spoofchk));
+}
+
+bool VfNetlink::set_vf_trust(int ifindex, uint32_t vf, bool on)
+{
+    ifla_vf_trust trust = { vf, on };
+    return set_vf_attr(ifindex, IFLA_VF_TRUST, &trust, sizeof(trust));
+}
+
+// Read back the settings of a VF, as reported in the PF's IFLA_VFINFO_LIST.
+bool VfNetlink::get_vf(int ifindex, uint32_t vf, NetlinkVfState& state)
+{
+    NetlinkRequest req(RTM_GETLINK, 0);
+
+    ifinfomsg ifi = {};
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    req.put(ifi);
+
+    const uint32_t ext_mask = RTEXT_FILTER_VF | RTEXT_FILTER_SKIP_STATS;
+    req.put_attr(IFLA_EXT_MASK, &ext_mask, sizeof(ext_mask));
+
+    std::vector<char> reply;
+    if (!req.transact(&reply))
+        return false;
+
+    auto for_each_attr = [](const void* data, int len, auto fn) {
+        for (const rtattr* rta = static_cast<const rtattr*>(data); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+            fn(rta);
+    };
+
+    bool found = false;
+    auto parse_vf_info = [&](const rtattr* info) {
+        NetlinkVfState vf_state = {};
+        bool match = false;
+        for_each_attr(RTA_DATA(info), RTA_PAYLOAD(info), [&](const rtattr* rta) {
+            const void* data = RTA_DATA(rta);
+            switch (rta->rta_type) {
+            case IFLA_VF_MAC:
+                match = static_cast<const ifla_vf_mac*>(data)->vf == vf;
+                memcpy(vf_state.mac, static_cast<const ifla_vf_mac*>(data)->mac, sizeof(vf_state.mac));
+                break;
+            case IFLA_VF_VLAN:
+                vf_state.vlan = static_cast<const ifla_vf_vlan*>(data)->vlan;
+                vf_state.vlan_qos = static_cast<const ifla_vf_vlan*>(data)->qos;
+                break;
+            case IFLA_VF_RATE:
+                vf_state.min_tx_rate = static_cast<const ifla_vf_rate*>(data)->min_tx_rate;
+                vf_state.max_tx_rate = static_cast<const ifla_vf_rate*>(data)->max_tx_rate;
+                break;
+            case IFLA_VF_SPOOFCHK:
+                vf_state.spoofchk = static_cast<const ifla_vf_spoofchk*>(data)->setting == 1;
+                break;
+            case IFLA_VF_TRUST:
+                vf_state.trust = static_cast<const ifla_vf_trust*>(data)->setting == 1;
+                break;
+            }
+        });
+
+        if (match) {
+            state = vf_state;
+            found = true;
+        }
+    };
+
+    const size_t ifi_len = NLMSG_ALIGN(sizeof(ifinfomsg));
+    if (reply.size() > ifi_len) {
+        for_each_attr(reply.data() + ifi_len, reply.size() - ifi_len, [&](const rtattr* rta) {
+            if ((rta->rta_type & ~NLA_F_NESTED) == IFLA_VFINFO_LIST)
+                for_each_attr(RTA_DATA(rta), RTA_PAYLOAD(rta), parse_vf_info);
+        });
+    }
+
+    if (!found)
+        fprintf(stderr, "Error: VF %u is not listed by interface %d\n", vf, ifindex);
+
+    return found;
+}
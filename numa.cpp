@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "runslice.h"
+
+// Just enough ACPI-CA headers to define the tables
+#include "external/acpi/acenv.h"
+#include "external/acpi/actypes.h"
+#include "external/acpi/actbl.h"
+
+// Far memory (-farmem) is a second, CPU-less NUMA node of the slice, on DRAM that belongs to
+// another socket. To describe it to the guest, we find the host proximity domains of the
+// slice's CPUs, its RAM and its far memory (from the host SRAT), and then the host's distance
+// (SLIT) and performance (HMAT) figures between them.
+
+static constexpr uint32_t NO_PXM = UINT32_MAX;
+
+template<typename Fn>
+static void for_each_subtable(const std::vector<uint8_t>& table, size_t header_size, Fn fn)
+{
+    for (size_t offset = header_size; offset + sizeof(ACPI_SUBTABLE_HEADER) <= table.size();) {
+        const ACPI_SUBTABLE_HEADER* entry = reinterpret_cast<const ACPI_SUBTABLE_HEADER*>(table.data() + offset);
+        if (entry->Length < sizeof(*entry) || offset + entry->Length > table.size())
+            break;
+        fn(entry);
+        offset += entry->Length;
+    }
+}
+
+static uint32_t srat_cpu_pxm(const std::vector<uint8_t>& srat, uint32_t apic_id)
+{
+    uint32_t pxm = NO_PXM;
+    for_each_subtable(srat, sizeof(ACPI_TABLE_SRAT), [&](const ACPI_SUBTABLE_HEADER* entry) {
+        if (entry->Type == ACPI_SRAT_TYPE_CPU_AFFINITY && entry->Length >= sizeof(ACPI_SRAT_CPU_AFFINITY)) {
+            const auto* cpu = reinterpret_cast<const ACPI_SRAT_CPU_AFFINITY*>(entry);
+            if ((cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY) && cpu->ApicId == apic_id) {
+                pxm = cpu->ProximityDomainLo | cpu->ProximityDomainHi[0] << 8
+                    | cpu->ProximityDomainHi[1] << 16 | cpu->ProximityDomainHi[2] << 24;
+            }
+        } else if (entry->Type == ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY
+                   && entry->Length >= sizeof(ACPI_SRAT_X2APIC_CPU_AFFINITY)) {
+            const auto* cpu = reinterpret_cast<const ACPI_SRAT_X2APIC_CPU_AFFINITY*>(entry);
+            if ((cpu->Flags & ACPI_SRAT_CPU_ENABLED) && cpu->ApicId == apic_id)
+                pxm = cpu->ProximityDomain;
+        }
+    });
+    return pxm;
+}
+
+static uint32_t srat_mem_pxm(const std::vector<uint8_t>& srat, uint64_t base, uint64_t size)
+{
+    uint32_t pxm = NO_PXM;
+    for_each_subtable(srat, sizeof(ACPI_TABLE_SRAT), [&](const ACPI_SUBTABLE_HEADER* entry) {
+        if (entry->Type == ACPI_SRAT_TYPE_MEMORY_AFFINITY && entry->Length >= sizeof(ACPI_SRAT_MEM_AFFINITY)) {
+            const auto* mem = reinterpret_cast<const ACPI_SRAT_MEM_AFFINITY*>(entry);
+            if ((mem->Flags & ACPI_SRAT_MEM_ENABLED) && mem->BaseAddress <= base
+                && base + size <= mem->BaseAddress + mem->Length)
+                pxm = mem->ProximityDomain;
+        }
+    });
+    return pxm;
+}
+
+// Copy the host's memory latency and bandwidth figures from the slice's CPUs to its RAM and
+// far memory.
+static void read_host_hmat(uint32_t cpu_pxm, uint32_t local_pxm, uint32_t far_pxm, std::vector<HmatLocality>& hmat)
+{
+    uint32_t length;
+    uint8_t checksum;
+    std::vector<uint8_t> table;
+    if (!acpi_read_host_table_id("HMAT", length, checksum) || !acpi_read_host_table("HMAT", table))
+        return;
+
+    // HMAT structures have their own header, with a 32-bit length.
+    for (size_t offset = sizeof(ACPI_TABLE_HMAT); offset + sizeof(ACPI_HMAT_STRUCTURE) <= table.size();) {
+        const auto* entry = reinterpret_cast<const ACPI_HMAT_STRUCTURE*>(table.data() + offset);
+        if (entry->Length < sizeof(*entry) || offset + entry->Length > table.size())
+            break;
+        offset += entry->Length;
+
+        if (entry->Type != ACPI_HMAT_TYPE_LOCALITY || entry->Length < sizeof(ACPI_HMAT_LOCALITY))
+            continue;
+        const auto* locality = reinterpret_cast<const ACPI_HMAT_LOCALITY*>(entry);
+        if ((locality->Flags & ACPI_HMAT_MEMORY_HIERARCHY) != ACPI_HMAT_MEMORY)
+            continue;
+
+        // Followed by the initiator and target domains, then a 16-bit entry for each pair.
+        const uint32_t initiators = locality->NumberOfInitiatorPDs, targets = locality->NumberOfTargetPDs;
+        if (entry->Length < sizeof(*locality) + 4 * (initiators + targets) + 2 * uint64_t(initiators) * targets)
+            continue;
+        const uint32_t* const domains = reinterpret_cast<const uint32_t*>(locality + 1);
+        const uint16_t* const values = reinterpret_cast<const uint16_t*>(domains + initiators + targets);
+
+        const uint32_t* const initiator = std::find(domains, domains + initiators, cpu_pxm);
+        const uint32_t* const local = std::find(domains + initiators, domains + initiators + targets, local_pxm);
+        const uint32_t* const far = std::find(domains + initiators, domains + initiators + targets, far_pxm);
+        if (initiator == domains + initiators || local == domains + initiators + targets
+            || far == domains + initiators + targets)
+            continue;
+
+        const size_t row = (initiator - domains) * targets;
+        hmat.push_back({ .data_type = locality->DataType, .base_unit = locality->EntryBaseUnit,
+                         .local = values[row + (local - domains - initiators)],
+                         .far = values[row + (far - domains - initiators)] });
+    }
+}
+
+// Find where the slice's far memory sits relative to its CPUs on the host.
+bool get_far_memory_topology(const Options& options, FarMemoryTopology& topology)
+{
+    std::vector<uint8_t> srat;
+    if (!acpi_read_host_table("SRAT", srat))
+        return false;
+
+    const uint32_t cpu_pxm = srat_cpu_pxm(srat, options.apic_ids.front());
+    const uint32_t local_pxm = srat_mem_pxm(srat, options.rambase, options.ramsize);
+    if (cpu_pxm == NO_PXM || local_pxm == NO_PXM) {
+        fprintf(stderr, "Error: the host SRAT does not cover the slice's CPUs and RAM\n");
+        return false;
+    }
+
+    uint32_t far_pxm = NO_PXM;
+    for (const auto& [base, size] : options.far_mem) {
+        const uint32_t pxm = srat_mem_pxm(srat, base, size);
+        if (pxm == NO_PXM || (far_pxm != NO_PXM && pxm != far_pxm)) {
+            fprintf(stderr, "Error: far memory 0x%" PRIx64 " is not within one host proximity domain\n", base);
+            return false;
+        }
+        far_pxm = pxm;
+    }
+    if (far_pxm == local_pxm)
+        fprintf(stderr, "Warning: far memory is in the same host proximity domain (%u) as slice RAM\n", far_pxm);
+
+    // Without a SLIT, assume the usual remote socket distance.
+    topology.distance = 20;
+    std::vector<uint8_t> slit_data;
+    uint32_t length;
+    uint8_t checksum;
+    if (acpi_read_host_table_id("SLIT", length, checksum) && acpi_read_host_table("SLIT", slit_data)) {
+        const auto* slit = reinterpret_cast<const ACPI_TABLE_SLIT*>(slit_data.data());
+        const uint64_t count = slit->LocalityCount;
+        if (cpu_pxm < count && far_pxm < count && offsetof(ACPI_TABLE_SLIT, Entry) + count * count <= slit_data.size())
+            topology.distance = slit->Entry[cpu_pxm * count + far_pxm];
+    }
+
+    topology.hmat.clear();
+    read_host_hmat(cpu_pxm, local_pxm, far_pxm, topology.hmat);
+
+    printf("Far memory is in host proximity domain %u, at distance %u from the slice's CPUs (%s)\n",
+           far_pxm, topology.distance, topology.hmat.empty() ? "no HMAT" : "with HMAT");
+    return true;
+}
@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "nvme.h"
+
+bool NvmeAdmin::identify_primary_caps(nvme_primary_ctrl_caps& caps)
+{
+    nvme_admin_cmd cmd = {};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.addr = reinterpret_cast<uintptr_t>(&caps);
+    cmd.data_len = sizeof(caps);
+    cmd.cdw10 = NVME_ID_CNS_PRIMARY_CTRL_CAPS;
+
+    return admin_command(cmd);
+}
+
+bool NvmeAdmin::list_secondary(std::vector<nvme_secondary_ctrl_entry>& controllers)
+{
+    controllers.clear();
+
+    // Each page lists up to 127 controllers with identifiers >= the one given in CDW10.
+    uint16_t first_id = 0;
+    while (true) {
+        nvme_secondary_ctrl_list list = {};
+        nvme_admin_cmd cmd = {};
+        cmd.opcode = NVME_ADMIN_IDENTIFY;
+        cmd.addr = reinterpret_cast<uintptr_t>(&list);
+        cmd.data_len = sizeof(list);
+        cmd.cdw10 = static_cast<uint32_t>(first_id) << 16 | NVME_ID_CNS_SECONDARY_CTRL_LIST;
+
+        if (!admin_command(cmd))
+            return false;
+
+        const size_t num = std::min<size_t>(list.num, std::size(list.entries));
+        controllers.insert(controllers.end(), list.entries, list.entries + num);
+
+        if (num < std::size(list.entries))
+            return true;
+
+        first_id = list.entries[num - 1].scid + 1;
+    }
+}
+
+bool NvmeAdmin::virt_mgmt(uint16_t cntlid, uint8_t action, uint8_t resource_type, uint16_t count)
+{
+    nvme_admin_cmd cmd = {};
+    cmd.opcode = NVME_ADMIN_VIRT_MGMT;
+    cmd.cdw10 = static_cast<uint32_t>(cntlid) << 16 | (resource_type & 0x7) << 8 | (action & 0xf);
+    cmd.cdw11 = count;
+
+    return admin_command(cmd);
+}
+
+bool NvmeDevice::admin_command(nvme_admin_cmd& cmd)
+{
+    int status = ioctl(m_fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+    if (status < 0) {
+        perror("NVMe admin command failed");
+        return false;
+    } else if (status > 0) {
+        fprintf(stderr, "NVMe admin command 0x%x failed with status 0x%x\n", cmd.opcode, status);
+        return false;
+    }
+
+    return true;
+}
+
+std::unique_ptr<NvmeAdmin> open_nvme_admin(const std::string& devname)
+{
+    const std::string path = "/dev/" + devname;
+    AutoFd fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open NVMe device %s: %s\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    return std::make_unique<NvmeDevice>(std::move(fd));
+}
+
+static const nvme_secondary_ctrl_entry* find_secondary(
+    const std::vector<nvme_secondary_ctrl_entry>& controllers,
+    unsigned vf)
+{
+    for (const nvme_secondary_ctrl_entry& ctrl : controllers) {
+        if (ctrl.vfn == vf + 1)
+            return &ctrl;
+    }
+
+    return nullptr;
+}
+
+unsigned NvmeSlicePlan::io_queues() const
+{
+    const unsigned queues = std::min<unsigned>(nvq > 0 ? nvq - 1 : 0, nvi);
+    return cpus ? std::min(queues, cpus) : queues;
+}
+
+// Split one flexible resource pool across the slices, in units of the controller's preferred
+// granularity. Each slice first gets the minimum for its secondary to come online, then the rest
+// goes one unit at a time to whichever slice has the smallest fraction of what it wants (a queue
+// or vector per CPU, plus admin_extra for the admin queue), so that slices share in proportion to
+// their CPU counts until each is satisfied or the pool is exhausted.
+static bool split_pool(
+    std::vector<NvmeSlicePlan>& plan,
+    uint16_t NvmeSlicePlan::*count,
+    const char* name,
+    uint32_t pool,
+    uint16_t secondary_max,
+    uint16_t gran,
+    uint16_t min,
+    unsigned admin_extra)
+{
+    gran = std::max<uint16_t>(gran, 1);
+    const unsigned max = secondary_max / gran * gran;
+    min = (min + gran - 1) / gran * gran;
+
+    std::vector<unsigned> want;
+    for (NvmeSlicePlan& slice : plan) {
+        const unsigned cpus_want = (slice.cpus + admin_extra + gran - 1) / gran * gran;
+        want.push_back(std::max<unsigned>(min, std::min(slice.cpus ? cpus_want : max, max)));
+
+        if (min > max || pool < min) {
+            fprintf(stderr, "Error: not enough NVMe %s resources for %zu VFs\n", name, plan.size());
+            return false;
+        }
+        slice.*count = min;
+        pool -= min;
+    }
+
+    while (pool >= gran) {
+        size_t best = plan.size();
+        for (size_t i = 0; i < plan.size(); i++) {
+            if (plan[i].*count >= want[i])
+                continue;
+            if (best == plan.size() || static_cast<uint64_t>(plan[i].*count) * want[best] < static_cast<uint64_t>(plan[best].*count) * want[i])
+                best = i;
+        }
+        if (best == plan.size())
+            break;
+
+        plan[best].*count += gran;
+        pool -= gran;
+    }
+
+    return true;
+}
+
+// Fill in the VQ and VI counts for each slice in the plan, from the primary controller's pool of
+// flexible resources (less any it keeps for itself).
+bool plan_nvme_resources(const nvme_primary_ctrl_caps& caps, std::vector<NvmeSlicePlan>& plan)
+{
+    // A secondary needs an admin and an I/O queue, and an interrupt, to come online. The admin
+    // queue takes a queue of its own, but shares vector 0 with the first I/O queue.
+    return split_pool(plan, &NvmeSlicePlan::nvq, "VQ", caps.vqfrt - std::min<uint32_t>(caps.vqrfap, caps.vqfrt),
+                      caps.vqfrsm, caps.vqgran, 2, 1)
+        && split_pool(plan, &NvmeSlicePlan::nvi, "VI", caps.vifrt - std::min<uint32_t>(caps.virfap, caps.vifrt),
+                      caps.vifrsm, caps.vigran, 1, 0);
+}
+
+static void report_plan(const char* pf_addr, const std::vector<NvmeSlicePlan>& plan)
+{
+    for (const NvmeSlicePlan& slice : plan) {
+        fprintf(stderr, "NVMe %s VF %u: %u VQ, %u VI resources, %u I/O queues", pf_addr, slice.vf, slice.nvq,
+                slice.nvi, slice.io_queues());
+        if (slice.cpus)
+            fprintf(stderr, " for %u CPUs", slice.cpus);
+        fprintf(stderr, "\n");
+    }
+}
+
+// Assign the planned resources to each secondary controller, taking them away from any others.
+// Decreases go first, so that the total assigned never exceeds the pool.
+static bool assign_resources(
+    NvmeAdmin& nvme,
+    const std::vector<nvme_secondary_ctrl_entry>& controllers,
+    const std::vector<NvmeSlicePlan>& plan)
+{
+    for (bool increase : { false, true }) {
+        for (const nvme_secondary_ctrl_entry& ctrl : controllers) {
+            auto it = std::find_if(plan.begin(), plan.end(), [&ctrl](const NvmeSlicePlan& slice) { return slice.scid == ctrl.scid; });
+            const uint16_t nvq = it == plan.end() ? 0 : it->nvq;
+            const uint16_t nvi = it == plan.end() ? 0 : it->nvi;
+
+            if ((nvq > ctrl.nvq) == increase && nvq != ctrl.nvq
+                && !nvme.virt_mgmt(ctrl.scid, NVME_VIRT_MGMT_ACT_SECONDARY_ASSIGN, NVME_VIRT_MGMT_RT_VQ, nvq))
+                return false;
+            if ((nvi > ctrl.nvi) == increase && nvi != ctrl.nvi
+                && !nvme.virt_mgmt(ctrl.scid, NVME_VIRT_MGMT_ACT_SECONDARY_ASSIGN, NVME_VIRT_MGMT_RT_VI, nvi))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Enable SR-IOV on an NVMe controller (if not already done), and bring the secondary controller
+// for a given (0-based) VF online. Returns the PCI address of the VF.
+//
+// When the VFs are created, the primary's flexible VQ and VI resources are split across the slices
+// using VFs 0..N-1, in proportion to their CPU counts (slice_cpus), or evenly across VFs 0-3 if
+// these are not given. Given slice_cpus, the VFs are recreated with a new split if none is online.
+bool setup_sriov_nvme(NvmeAdmin& nvme, const char* pf_addr, unsigned vf, const std::vector<unsigned>& slice_cpus,
+                      std::string& vf_addr)
+{
+    const std::string sysfsdir = std::string("/sys/bus/pci/devices/") + pf_addr;
+
+    uint64_t numvfs, totalvfs;
+    if (!read_host_file(sysfsdir + "/sriov_numvfs", numvfs)
+        || !read_host_file(sysfsdir + "/sriov_totalvfs", totalvfs)) {
+        fprintf(stderr, "Error: %s does not exist or does not support SR-IOV\n", pf_addr);
+        return false;
+    }
+
+    if (vf >= totalvfs) {
+        fprintf(stderr, "Error: %s has only %lu VFs\n", pf_addr, totalvfs);
+        return false;
+    }
+
+    std::vector<nvme_secondary_ctrl_entry> controllers;
+    if (!nvme.list_secondary(controllers))
+        return false;
+
+    std::vector<NvmeSlicePlan> plan;
+    const std::vector<unsigned> cpus = slice_cpus.empty() ? std::vector<unsigned>(4, 0) : slice_cpus;
+    for (unsigned i = 0; i < cpus.size(); i++) {
+        const nvme_secondary_ctrl_entry* ctrl = find_secondary(controllers, i);
+        if (ctrl)
+            plan.push_back({ ctrl->scid, i, cpus[i], ctrl->nvq, ctrl->nvi });
+    }
+
+    const bool any_online = std::any_of(controllers.begin(), controllers.end(),
+                                        [](const nvme_secondary_ctrl_entry& ctrl) { return ctrl.scs & 1; });
+    if (numvfs != 0 && !slice_cpus.empty() && !any_online) {
+        if (!write_host_file(sysfsdir + "/sriov_numvfs", "0"))
+            return false;
+        numvfs = 0;
+    }
+
+    if (numvfs == 0) {
+        // XXX: assign VQ & VI resources for all the controllers we might need, before enabling
+        // any (if we assign these resources later, then the command to online the secondary fails)
+        nvme_primary_ctrl_caps caps;
+        if (!nvme.identify_primary_caps(caps) || !plan_nvme_resources(caps, plan)
+            || !assign_resources(nvme, controllers, plan))
+            return false;
+
+        // prevent probing of virtual function drivers, then create all the VFs
+        if (!write_host_file(sysfsdir + "/sriov_drivers_autoprobe", "0")
+            || !write_host_file(sysfsdir + "/sriov_numvfs", std::to_string(totalvfs)))
+            return false;
+    } else if (!slice_cpus.empty()) {
+        fprintf(stderr, "Warning: %s has secondary controllers online; keeping its existing resource split\n", pf_addr);
+    }
+
+    report_plan(pf_addr, plan);
+
+    // Bring the secondary controller online
+    const nvme_secondary_ctrl_entry* ctrl = find_secondary(controllers, vf);
+    if (ctrl == nullptr) {
+        fprintf(stderr, "Error: no secondary controller for VF %u of %s\n", vf, pf_addr);
+        return false;
+    }
+
+    if (!nvme.virt_mgmt(ctrl->scid, NVME_VIRT_MGMT_ACT_SECONDARY_ONLINE, 0, 0))
+        return false;
+
+    if (!read_host_link(sysfsdir + "/virtfn" + std::to_string(vf), vf_addr)) {
+        fprintf(stderr, "Error: failed to find VF %u of %s\n", vf, pf_addr);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,116 @@
+#ifndef NVME_H
+#define NVME_H 1
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <linux/nvme_ioctl.h>
+
+#include "runslice.h"
+
+constexpr uint8_t NVME_ADMIN_IDENTIFY = 0x06;
+constexpr uint8_t NVME_ADMIN_VIRT_MGMT = 0x1c;
+
+constexpr uint8_t NVME_ID_CNS_PRIMARY_CTRL_CAPS = 0x14;
+constexpr uint8_t NVME_ID_CNS_SECONDARY_CTRL_LIST = 0x15;
+
+// Virtualization Management actions and resource types
+constexpr uint8_t NVME_VIRT_MGMT_ACT_SECONDARY_OFFLINE = 0x7;
+constexpr uint8_t NVME_VIRT_MGMT_ACT_SECONDARY_ASSIGN = 0x8;
+constexpr uint8_t NVME_VIRT_MGMT_ACT_SECONDARY_ONLINE = 0x9;
+constexpr uint8_t NVME_VIRT_MGMT_RT_VQ = 0;
+constexpr uint8_t NVME_VIRT_MGMT_RT_VI = 1;
+
+struct nvme_primary_ctrl_caps
+{
+    uint16_t cntlid;
+    uint16_t portid;
+    uint8_t crt;
+    uint8_t rsvd5[27];
+    uint32_t vqfrt;     // VQ flexible resources total
+    uint32_t vqrfa;     // VQ resources flexible assigned
+    uint16_t vqrfap;    // VQ resources flexible allocated to primary
+    uint16_t vqprt;     // VQ private resources total
+    uint16_t vqfrsm;    // VQ flexible resources secondary maximum
+    uint16_t vqgran;    // VQ flexible resource preferred granularity
+    uint8_t rsvd48[16];
+    uint32_t vifrt;     // VI flexible resources total
+    uint32_t virfa;
+    uint16_t virfap;
+    uint16_t viprt;
+    uint16_t vifrsm;
+    uint16_t vigran;
+    uint8_t rsvd80[4016];
+} __attribute__((packed));
+static_assert(sizeof(nvme_primary_ctrl_caps) == 4096);
+
+struct nvme_secondary_ctrl_entry
+{
+    uint16_t scid;      // secondary controller identifier
+    uint16_t pcid;      // primary controller identifier
+    uint8_t scs;        // secondary controller state (bit 0: online)
+    uint8_t rsvd5[3];
+    uint16_t vfn;       // virtual function number (1-based)
+    uint16_t nvq;       // number of VQ flexible resources assigned
+    uint16_t nvi;       // number of VI flexible resources assigned
+    uint8_t rsvd14[18];
+} __attribute__((packed));
+static_assert(sizeof(nvme_secondary_ctrl_entry) == 32);
+
+struct nvme_secondary_ctrl_list
+{
+    uint8_t num;
+    uint8_t rsvd[31];
+    nvme_secondary_ctrl_entry entries[127];
+} __attribute__((packed));
+static_assert(sizeof(nvme_secondary_ctrl_list) == 4096);
+
+// Admin command interface to an NVMe controller. Everything above admin_command() is
+// independent of the transport, so it can be driven by a mock.
+class NvmeAdmin
+{
+public:
+    virtual ~NvmeAdmin() = default;
+
+    virtual bool admin_command(nvme_admin_cmd& cmd) = 0;
+
+    bool identify_primary_caps(nvme_primary_ctrl_caps& caps);
+    bool list_secondary(std::vector<nvme_secondary_ctrl_entry>& controllers);
+    bool virt_mgmt(uint16_t cntlid, uint8_t action, uint8_t resource_type, uint16_t count);
+};
+
+// NVMe controller accessed through its /dev/nvmeN character device.
+class NvmeDevice : public NvmeAdmin
+{
+protected:
+    AutoFd m_fd;
+
+public:
+    NvmeDevice(AutoFd&& fd) : m_fd(std::move(fd)) {}
+
+    bool admin_command(nvme_admin_cmd& cmd) override;
+};
+
+std::unique_ptr<NvmeAdmin> open_nvme_admin(const std::string& devname);
+
+// Flexible queue (VQ) and interrupt (VI) resources for the secondary controller of one slice's VF.
+struct NvmeSlicePlan
+{
+    uint16_t scid;
+    unsigned vf;        // 0-based
+    unsigned cpus;      // of the slice; 0 if unknown (as many as the controller allows)
+    uint16_t nvq;
+    uint16_t nvi;
+
+    // I/O queues the guest driver can create: one per CPU, if it has the queues and vectors
+    // (the admin queue takes a VQ, and shares its vector with the first I/O queue).
+    unsigned io_queues() const;
+};
+
+bool plan_nvme_resources(const nvme_primary_ctrl_caps& caps, std::vector<NvmeSlicePlan>& plan);
+
+bool setup_sriov_nvme(NvmeAdmin& nvme, const char* pf_addr, unsigned vf, const std::vector<unsigned>& slice_cpus,
+                      std::string& vf_addr);
+
+#endif
@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <iostream>
+
+#include "aml.h"
+#include "linuxboot.h"
+#include "runslice.h"
+
+// Each pmem region is aligned to a memory section (128MiB on x86), so that it never shares a
+// section with System RAM in the guest.
+static constexpr uint64_t PMEM_ALIGN = 128 << 20;
+
+// The image is preceded by an fsdax "PFN info block", just as `ndctl create-namespace -m fsdax`
+// would write, so that the guest's pmem driver sets up struct pages and permits DAX mounts. The
+// info block lives at 4KiB into the region, and the image itself starts at PFN_DATA_OFFSET.
+static constexpr uint64_t PFN_INFO_OFFSET = 0x1000;
+static constexpr uint64_t PFN_DATA_OFFSET = 2 << 20;
+static constexpr uint32_t PFN_ALIGN = 2 << 20;
+static constexpr uint32_t PFN_MODE_RAM = 1; // struct pages are allocated from guest RAM
+
+struct nd_pfn_sb {
+    uint8_t signature[16];
+    uint8_t uuid[16];
+    uint8_t parent_uuid[16];
+    uint32_t flags;
+    uint16_t version_major;
+    uint16_t version_minor;
+    uint64_t dataoff;
+    uint64_t npfns;
+    uint32_t mode;
+    uint32_t start_pad;
+    uint32_t end_trunc;
+    uint32_t align;
+    uint32_t page_size;
+    uint16_t page_struct_size;
+    uint8_t padding[3994];
+    uint64_t checksum;
+} __attribute__((packed));
+static_assert(sizeof(nd_pfn_sb) == 4096);
+
+static uint64_t fletcher64(const void* addr, size_t len)
+{
+    const uint32_t* buf = static_cast<const uint32_t*>(addr);
+    uint32_t lo32 = 0;
+    uint64_t hi32 = 0;
+
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        lo32 += buf[i];
+        hi32 += lo32;
+    }
+
+    return hi32 << 32 | lo32;
+}
+
+static void write_pfn_info(char* region, uint64_t region_size)
+{
+    nd_pfn_sb* sb = reinterpret_cast<nd_pfn_sb*>(region + PFN_INFO_OFFSET);
+    memset(sb, 0, sizeof(*sb));
+
+    memcpy(sb->signature, "NVDIMM_PFN_INFO", sizeof(sb->signature));
+    if (getrandom(sb->uuid, sizeof(sb->uuid), 0) != sizeof(sb->uuid))
+        memcpy(sb->uuid, "SLICER-PMEM-UUID", sizeof(sb->uuid));
+    // parent_uuid must be null for legacy (E820) namespaces
+    sb->version_major = 1;
+    sb->version_minor = 4;
+    sb->dataoff = PFN_DATA_OFFSET;
+    sb->npfns = (region_size - PFN_DATA_OFFSET) / 0x1000;
+    sb->mode = PFN_MODE_RAM;
+    sb->align = PFN_ALIGN;
+    sb->page_size = 0x1000;
+    sb->page_struct_size = 64;
+    sb->checksum = fletcher64(sb, sizeof(*sb));
+}
+
+// Carve a region for each pmem image from the top of slice RAM.
+bool plan_pmem_images(const Options& options, SliceLayout& layout, std::vector<MemRegion>& regions)
+{
+    for (size_t i = 0; i < options.pmem_paths.size(); i++) {
+        struct stat st;
+        if (stat(options.pmem_paths[i], &st) != 0) {
+            perror("Failed to open pmem image");
+            return false;
+        }
+
+        uint64_t region_base;
+        const uint64_t region_size = ALIGN_UP(PFN_DATA_OFFSET + st.st_size, PMEM_ALIGN);
+        if (!layout.place_top("pmem" + std::to_string(i), region_size, PMEM_ALIGN, region_base))
+            return false;
+
+        regions.push_back({ region_base, region_size, E820_TYPE_PMEM });
+    }
+
+    return true;
+}
+
+// Load each pmem image into its region, as planned by plan_pmem_images().
+bool load_pmem_images(const Options& options, void* slice_ram, const std::vector<MemRegion>& regions)
+{
+    auto region = regions.begin();
+    for (const char* path : options.pmem_paths) {
+        region = std::find_if(region, regions.end(), [](const MemRegion& r) { return r.e820_type == E820_TYPE_PMEM; });
+        assert(region != regions.end());
+
+        AutoFd fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror("Failed to open pmem image");
+            return false;
+        }
+
+        if (PFN_DATA_OFFSET + st.st_size > region->size) {
+            fprintf(stderr, "Error: pmem image %s has grown\n", path);
+            return false;
+        }
+
+        char* region_virt = static_cast<char*>(slice_ram) + (region->base - options.rambase);
+
+        printf("Loading pmem image %s at 0x%lx-0x%lx\n", path, region->base, region->base + region->size - 1);
+
+        memset(region_virt, 0, PFN_DATA_OFFSET);
+        write_pfn_info(region_virt, region->size);
+
+        if (!copy_sparse_to_devmem(fd, st.st_size, region_virt + PFN_DATA_OFFSET)) {
+            perror("Failed to read pmem image");
+            return false;
+        }
+
+        memset(region_virt + PFN_DATA_OFFSET + st.st_size, 0, region->size - PFN_DATA_OFFSET - st.st_size);
+        ++region;
+    }
+
+    return true;
+}
+
+//
+// Shared datasets (-dataset FILE@ADDR). A dataset is a pmem image loaded once into a range of
+// host memory outside every slice, and then attached to each slice that names it, as a pmem
+// region of its own. The region is laid out as for a private pmem image, with a dataset_header
+// in the otherwise unused first page, which lets later launches recognise the file already
+// loaded there without reading it again.
+//
+
+static constexpr char DATASET_MAGIC[8] = { 'S', 'L', 'D', 'A', 'T', 'A', 'S', 'T' };
+static constexpr uint32_t DATASET_VERSION = 1;
+
+struct dataset_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t ready;         // set once the data is loaded, hashed and flushed
+    uint64_t size;          // of the data, at PFN_DATA_OFFSET
+    uint64_t dev;           // identity of the file it was loaded from
+    uint64_t ino;
+    uint64_t mtime_ns;
+    uint8_t sha256[32];
+    char name[64];
+};
+static_assert(sizeof(dataset_header) <= PFN_INFO_OFFSET);
+
+uint64_t dataset_region_size(uint64_t file_size)
+{
+    return ALIGN_UP(PFN_DATA_OFFSET + file_size, PMEM_ALIGN);
+}
+
+// The name under which a dataset is described to the guest: its file name, in printable ASCII.
+static std::string dataset_name(const char* path)
+{
+    const char* base = strrchr(path, '/');
+    std::string name = base ? base + 1 : path;
+    name.resize(std::min(name.size(), sizeof(dataset_header::name) - 1));
+    for (char& c : name) {
+        if (c < 0x20 || c > 0x7e)
+            c = '_';
+    }
+    return name;
+}
+
+static bool attach_dataset(const AutoFd& devmem, SharedDataset& dataset, bool reload)
+{
+    // Launches sharing the dataset take turns, so that only the first loads it.
+    AutoFd fd = open(dataset.path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open dataset");
+        return false;
+    }
+
+    if (dataset_region_size(st.st_size) > dataset.size) {
+        fprintf(stderr, "Error: dataset %s has grown\n", dataset.path.c_str());
+        return false;
+    }
+
+    dataset.name = dataset_name(dataset.path.c_str());
+    dataset.data_size = st.st_size;
+
+    char* const region = static_cast<char*>(mmap(nullptr, dataset.size, PROT_READ | PROT_WRITE, MAP_SHARED, devmem,
+                                                 dataset.base));
+    if (region == MAP_FAILED) {
+        perror("Error: Failed to map dataset");
+        return false;
+    }
+    dataset_header* const header = reinterpret_cast<dataset_header*>(region);
+
+    const uint64_t mtime_ns = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    const bool valid = memcmp(header->magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) == 0
+        && header->version == DATASET_VERSION && header->ready;
+    bool ok = true;
+    if (valid && header->size == dataset.data_size && header->dev == st.st_dev && header->ino == st.st_ino
+        && header->mtime_ns == mtime_ns && dataset.name == header->name) {
+        // Already loaded: attach it as it is.
+        memcpy(dataset.digest.data(), header->sha256, dataset.digest.size());
+        printf("Attached dataset %s at 0x%" PRIx64 "-0x%" PRIx64 "\n", dataset.name.c_str(), dataset.base,
+               dataset.base + dataset.size - 1);
+    } else if (valid && !reload) {
+        fprintf(stderr, "Error: 0x%" PRIx64 " holds another version of dataset %.*s; stop the slices using it, "
+                "then relaunch with -dataset-reload\n", dataset.base, int(sizeof(header->name)), header->name);
+        ok = false;
+    } else if (!check_not_host_ram(dataset.base, dataset.size)) {
+        ok = false;
+    } else {
+        const auto start = std::chrono::steady_clock::now();
+        memset(region, 0, PFN_DATA_OFFSET);
+        write_pfn_info(region, dataset.size);
+
+        Sha256 hash;
+        if (!read_to_devmem(dataset.path.c_str(), 0, region + PFN_DATA_OFFSET, dataset.data_size, &hash)) {
+            perror("Failed to read dataset");
+            ok = false;
+        } else {
+            dataset.digest = hash.finish();
+            memset(region + PFN_DATA_OFFSET + dataset.data_size, 0, dataset.size - PFN_DATA_OFFSET - dataset.data_size);
+            flush_cache(region, dataset.size);
+
+            // Publish the header last, so that a partly loaded dataset is never attached.
+            memcpy(header->magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+            header->version = DATASET_VERSION;
+            header->size = dataset.data_size;
+            header->dev = st.st_dev;
+            header->ino = st.st_ino;
+            header->mtime_ns = mtime_ns;
+            memcpy(header->sha256, dataset.digest.data(), sizeof(header->sha256));
+            strncpy(header->name, dataset.name.c_str(), sizeof(header->name) - 1);
+            std::atomic_thread_fence(std::memory_order_release);
+            header->ready = 1;
+            flush_cache(header, sizeof(*header));
+
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            printf("Loaded dataset %s at 0x%" PRIx64 "-0x%" PRIx64 " in %.1f ms\n", dataset.name.c_str(),
+                   dataset.base, dataset.base + dataset.size - 1, ms);
+        }
+    }
+
+    munmap(region, dataset.size);
+    if (ok)
+        record_measurement("dataset", dataset.path.c_str(), dataset.digest);
+    return ok;
+}
+
+// Load each dataset into its range, unless it is already there, and fill in its name and digest.
+bool attach_datasets(Options& options, const AutoFd& devmem)
+{
+    for (SharedDataset& dataset : options.datasets) {
+        if (!attach_dataset(devmem, dataset, options.dataset_reload))
+            return false;
+    }
+    return true;
+}
+
+// An SSDT describing each dataset, so that the guest can tell which pmem region holds which:
+//   Scope (\_SB) {
+//     Device (DS00) { Name (_HID, "SLCD0001") Name (_UID, 0) Name (_STR, Unicode ("NAME"))
+//                     Name (_CRS, <QWordMemory (..., ReadOnly, BASE, ...)>)
+//                     Name (DGST, "sha256 hex") Name (DOFF, 0x200000) Name (DLEN, SIZE) }
+//   }
+std::vector<uint8_t> dataset_aml(const Options& options)
+{
+    std::vector<Aml> terms;
+    for (size_t i = 0; i < options.datasets.size(); i++) {
+        const SharedDataset& dataset = options.datasets[i];
+        char device[5];
+        snprintf(device, sizeof(device), "DS%02X", static_cast<unsigned>(i & 0xff));
+
+        // _STR is a Unicode (UTF-16) string.
+        std::vector<uint8_t> str;
+        for (char c : dataset.name)
+            str.insert(str.end(), { static_cast<uint8_t>(c), 0 });
+        str.insert(str.end(), { 0, 0 });
+
+        // QWordMemory (ResourceConsumer, PosDecode, MinFixed, MaxFixed, Cacheable, ReadOnly),
+        // followed by an end tag. The guest should not write the dataset, though nothing stops it.
+        std::vector<uint8_t> crs = { 0x8a, 0x2b, 0x00, 0x00, 0x0d, 0x02 };
+        for (uint64_t value : { uint64_t(0), dataset.base, dataset.base + dataset.size - 1, uint64_t(0), dataset.size }) {
+            for (unsigned byte = 0; byte < sizeof(value); byte++)
+                crs.push_back(value >> (8 * byte));
+        }
+        crs.insert(crs.end(), { 0x79, 0x00 });
+
+        terms.push_back(aml_device(device, {
+            aml_name_decl("_HID", aml_string("SLCD0001")),
+            aml_name_decl("_UID", aml_int(i)),
+            aml_name_decl("_STR", aml_buffer(str)),
+            aml_name_decl("_CRS", aml_buffer(crs)),
+            aml_name_decl("DGST", aml_string(Sha256::to_hex(dataset.digest).c_str())),
+            aml_name_decl("DOFF", aml_int(PFN_DATA_OFFSET)),
+            aml_name_decl("DLEN", aml_int(dataset.data_size)),
+        }));
+    }
+
+    return aml_scope("\\_SB_", terms);
+}
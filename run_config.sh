@@ -7,9 +7,16 @@ SRIOV_NIC_PF="0000:99:00.0"
 # host PF for SR-IOV NVME
 SRIOV_NVME_PF="0000:8d:00.0"
 
+# CPU counts of the slices on NVMe VFs 0, 1, ..., to split the controller's queue and interrupt
+# resources in proportion when the VFs are created (default: evenly between four VFs)
+#NVME_SLICE_CPUS=8,8,4,2
+
 # base MAC address for the NIC VFs
 NIC_VF_MACADDR_BASE="02:22:33:44:55:66"
 
+# network profile for each slice's NIC VF (see runslice -h): e.g. rate limits, VLAN and trust
+#NIC_VF_PROFILE="-nicrate 1000,10000 -nicvlan 100"
+
 # Default guest resources
 DEFAULT_MEM_GB=16
 DEFAULT_CPUS=8
@@ -1,11 +1,18 @@
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cinttypes>
 #include <cstring>
 #include <iostream>
+#include <map>
 
+#include "hostplatform.h"
 #include "runslice.h"
+#include "sliceclock.h"
+#include "threadpool.h"
 
 [[noreturn]] static void usage(const char* errmsg = nullptr)
 {
@@ -13,72 +20,207 @@
         std::cerr << "Error: " << errmsg << std::endl;
 
     std::cerr << "Usage: runslice [OPTIONS]" << std::endl
-        << "  -kernel PATH    Kernel image to boot. Required." << std::endl
-        << "  -initrd PATH    RAM disk image." << std::endl
+        << "       runslice -prepare -vf N [-nic PF -macbase MAC] [-nvme PF] [-assign ADDR]..." << std::endl
+        << "       runslice -grow -log FILE -rambase ADDR [-cpus CPUS] [-addmem BASE,SIZE]..." << std::endl
+        << "       runslice -release -log FILE -rambase ADDR" << std::endl
+        << "       runslice -dump FILE -log FILE -rambase ADDR [-compress] [-dumpram]" << std::endl
+        << "       runslice -clockd ADDR" << std::endl
+        << "       runslice -park ADDR -cpus CPUS [-carve] [-log FILE]" << std::endl
+        << "  -kernel PATH    Kernel image to boot: a Linux bzImage, an ELF64 executable, or" << std::endl
+        << "                  a Multiboot2 ELF image. Required, unless -bundle is given." << std::endl
+        << "  -bundle PATH    Boot bundle built by slicebundle (instead of -kernel, -initrd and" << std::endl
+        << "                  -dsdt). -cmdline is appended to the bundle's command line." << std::endl
+        << "  -initrd PATH    RAM disk image (for ELF images, passed as the first module)." << std::endl
+        << "  -module PATH    Module to load for an ELF/Multiboot2 image. May be repeated." << std::endl
+        << "  -modules DIR    Generate an initrd with the guest kernel modules (from DIR/<version>)" << std::endl
+        << "                  needed by the -assign devices, appended to any -initrd." << std::endl
+        << "  -busybox PATH   Static busybox for a generated initrd without a base -initrd." << std::endl
         << "  -cmdline CMD    Kernel command line." << std::endl
+        << "  -console ADDR   PCI address of a 16550 serial port to use as the console (adds a" << std::endl
+        << "                  console= argument to the command line)." << std::endl
+        << "  -seed DIR       Pass a cloud-init NoCloud seed (user-data, network-config, etc." << std::endl
+        << "                  from DIR) to the slice for this launch only." << std::endl
+        << "  -hostname NAME  Hostname for the seed's meta-data (implies a seed)." << std::endl
         << "  -rambase ADDR   Physical base address of slice memory." << std::endl
         << "  -ramsize SIZE   Size of slice memory." << std::endl
         << "  -lowmem ADDR    Physical address of low memory used for boot." << std::endl
         << "  -cpus CPUS      Comma-separated list of CPU ID ranges. e.g.: 1-2,4" << std::endl
-        << "  -dsdt FILE      ACPI DSDT AML file." << std::endl;
+        << "                  CPUs must be offline on the host (see -carve)." << std::endl
+        << "  -dsdt FILE      ACPI DSDT AML file." << std::endl
+        << "  -profile NAME   Tune each slice CPU's MSRs before boot for a workload: latency," << std::endl
+        << "                  throughput, streaming, random or powersave." << std::endl
+        << "  -msr MSR=VAL[/MASK] Write (the bits in MASK of) an MSR on each slice CPU, after" << std::endl
+        << "                  any profile. May be repeated." << std::endl
+        << "  -hotplug ADDR   Support hot-add of CPUs and memory (with -grow), signalled through" << std::endl
+        << "                  the IOAPIC at ADDR, which must be unused by the host." << std::endl
+        << "  -spare-cpus CPUS Offline CPUs that may later be hot-added to the slice." << std::endl
+        << "  -farmem BASE,SIZE Add a (128MiB-aligned) range of another socket's memory to the" << std::endl
+        << "                  slice, as a CPU-less NUMA node. May be repeated." << std::endl
+        << "  -farmem-sp      Mark far memory soft-reserved (EFI_MEMORY_SP), for the guest to" << std::endl
+        << "                  online as a lower memory tier through dax/kmem." << std::endl
+        << "  -standby ADDR   Start the boot CPU through its mailbox in the standby pool at ADDR," << std::endl
+        << "                  if it is parked there (see -park), rather than INIT/SIPI." << std::endl
+        << "  -clock ADDR     Tell the slice where to find the shared clock page, kept up to date" << std::endl
+        << "                  by runslice -clockd." << std::endl
+        << "  -pmem IMAGE     Preload IMAGE into slice RAM as a DAX-capable pmem device." << std::endl
+        << "                  May be repeated." << std::endl
+        << "  -dataset FILE@ADDR Share FILE read-only, as a pmem device, with every slice that" << std::endl
+        << "                  names it. The first launch loads it at ADDR (128MiB-aligned, outside" << std::endl
+        << "                  slice RAM); later ones attach it as it is. May be repeated." << std::endl
+        << "  -dataset-reload Replace a different version of a dataset already loaded at ADDR." << std::endl
+        << "  -digests FILE   Verify loaded images against a sha256sum-format manifest." << std::endl
+        << "  -log FILE       Append a launch record (resources and measurements) to FILE." << std::endl
+        << "  -threads N      Worker threads for loading and clearing slice RAM (default: one" << std::endl
+        << "                  per host CPU)." << std::endl
+        << "  -platform FILE  Cache of host CPU and ACPI details, rebuilt after a reboot" << std::endl
+        << "                  or ACPI table change (default: /run/sliceloader/platform)." << std::endl
+        << "  -carve          Offline the slice's CPUs and memory on the host first, rather than" << std::endl
+        << "                  relying on maxcpus= and mem=. Also applies to -grow." << std::endl
+        << "  -hostroot DIR   Prefix for /sys and /proc paths (for testing)." << std::endl
+        << std::endl
+        << "Device preparation options:" << std::endl
+        << "  -prepare        Setup and detach devices to assign to a slice, then print their" << std::endl
+        << "                  PCI addresses." << std::endl
+        << "  -vf N           (0-based) SR-IOV virtual function ID." << std::endl
+        << "  -nic PF         PCI address of SR-IOV NIC physical function." << std::endl
+        << "  -macbase MAC    Base MAC address for NIC VFs (VF N gets MAC + N)." << std::endl
+        << "  -nicrate MIN,MAX Guaranteed and maximum TX rate (Mbps, 0 for none) of the NIC VF." << std::endl
+        << "  -nicvlan ID[,QOS] Tag the NIC VF's traffic with a VLAN (and priority)." << std::endl
+        << "  -nictrust       Trust the NIC VF (allowing promiscuous/all-multicast modes)." << std::endl
+        << "  -nicqueues N    RX/TX queue pairs for the NIC VF (e.g. the slice's CPU count)," << std::endl
+        << "                  where the NIC supports it." << std::endl
+        << "  -nvme PF        PCI address of SR-IOV NVMe physical function." << std::endl
+        << "  -nvmecpus N,... CPU counts of the slices on NVMe VFs 0, 1, ...: when the VFs are" << std::endl
+        << "                  created, split the controller's queues and interrupts among them" << std::endl
+        << "                  in proportion (default: evenly between VFs 0-3)." << std::endl
+        << "  -assign ADDR    PCI address of another device to assign. May be repeated." << std::endl
+        << "                  When booting, the devices assigned to the slice (for -modules)." << std::endl
+        << std::endl
+        << "Hot-add options:" << std::endl
+        << "  -grow           Add resources to the running slice with the given -rambase, which" << std::endl
+        << "                  was launched with -hotplug and -log. -cpus lists spare CPUs to add." << std::endl
+        << "  -addmem BASE,SIZE Scrub and add a (128MiB-aligned) memory range. May be repeated." << std::endl
+        << std::endl
+        << "Release options:" << std::endl
+        << "  -release        Return the CPUs and memory of the stopped slice with the given" << std::endl
+        << "                  -rambase (as recorded by -log) to the host." << std::endl
+        << std::endl
+        << "Dump options:" << std::endl
+        << "  -dump FILE      Write the memory of the (crashed) slice with the given -rambase," << std::endl
+        << "                  as recorded by -log, to an ELF core for crash." << std::endl
+        << "  -compress       Write a compressed kdump file, as makedumpfile does, instead." << std::endl
+        << "  -dumpram        Only dump the slice's RAM, not pmem images or other regions." << std::endl
+        << std::endl
+        << "Clock options:" << std::endl
+        << "  -clockd ADDR    Publish the shared clock page at ADDR, a page of host memory outside" << std::endl
+        << "                  every slice, and keep it up to date until killed." << std::endl
+        << std::endl
+        << "Standby options:" << std::endl
+        << "  -park ADDR      Park -cpus in a standby pool at ADDR in low memory, waiting in a" << std::endl
+        << "                  deep C-state to boot a slice launched with -standby ADDR. Adds to" << std::endl
+        << "                  any pool at ADDR; CPUs that a slice took from it are only restarted" << std::endl
+        << "                  once -log shows the slice was released." << std::endl;
 
     exit(1);
 }
 
-// XXX: This assumes we're on a uniprocessor (!!)
-uint32_t get_local_apic_id()
+static constexpr uint64_t IORESOURCE_TYPE_BITS = 0x1f00;
+static constexpr uint64_t IORESOURCE_IO = 0x100;
+
+// Find the I/O port base of the 16550-compatible PCI serial port to use as the slice console. This
+// is read from sysfs on every launch, rather than cached, since BARs can move on a rescan.
+static bool get_console_ioport(const char* addr, uint64_t& ioport)
 {
-    uint32_t apic_id = UINT32_MAX;
-    {
-        uint32_t max_cpuid_leaf, a, b, c, d;
-        cpuid(0, 0, max_cpuid_leaf, b, c, d);
+    const std::string dir = std::string("/sys/bus/pci/devices/") + addr;
+    uint64_t class_code;
+    if (!read_host_file(dir + "/class", class_code)) {
+        fprintf(stderr, "Error: PCI device %s not found\n", addr);
+        return false;
+    }
+
+    if (class_code != 0x070002) {
+        fprintf(stderr, "Error: %s is not a 16550 serial port\n", addr);
+        return false;
+    }
 
-        assert(max_cpuid_leaf >= 0xb);
-        cpuid(0xb, 0, a, b, c, apic_id);
+    // One "start end flags" line per resource, BAR 0 first.
+    std::string resource;
+    uint64_t start = 0, end = 0, flags = 0;
+    if (!read_host_file(dir + "/resource", resource)
+        || sscanf(resource.c_str(), "%" SCNx64 " %" SCNx64 " %" SCNx64, &start, &end, &flags) != 3
+        || (flags & IORESOURCE_TYPE_BITS) != IORESOURCE_IO) {
+        fprintf(stderr, "Error: %s doesn't implement an I/O port resource\n", addr);
+        return false;
+    }
 
-        if (max_cpuid_leaf >= 0x1f)
-        {
-            cpuid(0x1f, 0, a, b, c, d);
-            assert(d == apic_id);
+    ioport = start;
+    return true;
+}
+
+// Check that CPU IDs exist on the host and are not repeated, before anything is carved for them.
+static bool check_cpu_ids(const std::vector<uint32_t>& slice_ids)
+{
+    const HostPlatform* platform = host_platform();
+    if (platform == nullptr)
+        return false;
+
+    const size_t host_cpus = platform->cpu_apic_ids().size();
+    std::vector<bool> used(host_cpus);
+    for (uint32_t id : slice_ids) {
+        if (id >= host_cpus) {
+            fprintf(stderr, "Error: CPU %u does not exist\n", id);
+            return false;
         }
+        if (used[id]) {
+            fprintf(stderr, "Error: CPU %u was used twice\n", id);
+            return false;
+        }
+        used[id] = true;
     }
 
-    return apic_id;
+    return true;
 }
 
-// Given a set of 0-based CPU IDs, validate and translate them to host APIC IDs.
+// Given a set of CPU IDs, validate and translate them to host APIC IDs. CPU IDs are numbered as
+// Linux numbers CPUs: the host's boot CPU is 0, and the rest follow in MADT order. CPUs that are
+// online on the host are unavailable to slices; offline them first.
 static bool translate_apic_ids(std::vector<uint32_t>& slice_ids)
 {
-    std::vector<uint32_t> host_ids;
-    if (!acpi_get_host_apic_ids(host_ids))
+    const HostPlatform* platform = host_platform();
+    std::map<uint32_t, uint32_t> online_ids;
+    if (platform == nullptr || !get_online_apic_ids(online_ids))
         return false;
 
-    uint32_t bsp_apic_id = get_local_apic_id();
+    const PlatformView<uint32_t> cpus = platform->cpu_apic_ids();
+    std::vector<uint32_t> host_ids(cpus.begin(), cpus.end());
+
+    auto is_online = [&online_ids](uint32_t apic_id) {
+        return std::any_of(online_ids.begin(), online_ids.end(), [apic_id](const auto& cpu) { return cpu.second == apic_id; });
+    };
 
     // Print the host APIC IDs.
     std::cout << "Host APIC IDs: ";
     for (uint32_t id : host_ids) {
-        std::cout << id << (id == bsp_apic_id ? "(BSP) " : " ");
+        std::cout << id << (is_online(id) ? "(online) " : " ");
     }
     std::cout << std::endl;
 
-    // Remove the BSP from the list
-    auto it = std::find(host_ids.begin(), host_ids.end(), bsp_apic_id);
-    assert(it != host_ids.end());
-    host_ids.erase(it);
-
     // Check that the slice IDs are valid, and not duplicated, and translate them.
     for (uint32_t& id : slice_ids) {
-        if (id == 0 || id > host_ids.size()) {
-            fprintf(stderr, "Error: CPU %u is unavailable\n", id);
+        if (id >= host_ids.size()) {
+            fprintf(stderr, "Error: CPU %u does not exist\n", id);
             return false;
         }
-        uint32_t apic_id = host_ids[id - 1];
-        host_ids[id - 1] = UINT32_MAX;
+        uint32_t apic_id = host_ids[id];
+        host_ids[id] = UINT32_MAX;
         if (apic_id == UINT32_MAX) {
             fprintf(stderr, "Error: CPU %u was used twice\n", id);
             return false;
         }
+        if (is_online(apic_id)) {
+            fprintf(stderr, "Error: CPU %u is online on the host\n", id);
+            return false;
+        }
         // translate to APIC ID
         id = apic_id;
     }
@@ -95,8 +237,91 @@ static bool translate_apic_ids(std::vector<uint32_t>& slice_ids)
 
 void Options::validate()
 {
-    if (kernel_path == nullptr)
+    if (prepare) {
+        if (sriov_vf < 0 && (nic_pf || nvme_pf))
+            usage("VF ID is required");
+        if (nic_pf && nic_mac_base == nullptr)
+            usage("Base MAC address is required");
+        if (nic_profile.vlan > 4095 || nic_profile.vlan_qos > 7)
+            usage("Invalid NIC VLAN");
+        if (nic_profile.max_tx_rate && nic_profile.min_tx_rate > nic_profile.max_tx_rate)
+            usage("NIC minimum rate exceeds the maximum");
+        if (!nic_pf && !nvme_pf && assign_devices.empty())
+            usage("No devices to prepare");
+        if (!nvme_slice_cpus.empty() && (nvme_pf == nullptr || sriov_vf >= static_cast<int>(nvme_slice_cpus.size())))
+            usage("NVMe CPU counts must include the VF");
+        return;
+    }
+
+    if (release) {
+        if (log_path == nullptr)
+            usage("The launch log is required to release a slice");
+        if (rambase == 0)
+            usage("RAM base is required to identify the slice");
+        return;
+    }
+
+    if (standby_pool) {
+        if (standby_pool % 0x1000 != 0 || standby_pool + standby_pool_size() > 640 * 1024)
+            usage("The standby pool must be page-aligned and fit below 640K");
+        if (standby_pool < lowmem + realmode_blob_size && lowmem < standby_pool + standby_pool_size())
+            usage("The standby pool overlaps low memory used for boot");
+    }
+
+    if (park) {
+        if (apic_ids.empty() || apic_ids.size() > MAX_STANDBY_CPUS)
+            usage("Between 1 and 256 CPUs may be parked");
+        if (!check_cpu_ids(apic_ids))
+            usage("Invalid CPU IDs");
+        if (carve && !carve_host_resources(apic_ids, {}))
+            exit(1);
+        if (!translate_apic_ids(apic_ids))
+            usage("Invalid CPU IDs");
+        return;
+    }
+
+    if (clock_daemon) {
+        if (clock_page % SLICE_CLOCK_PAGE_SIZE != 0)
+            usage("The clock page must be page-aligned");
+        if (!check_not_host_ram(clock_page, SLICE_CLOCK_PAGE_SIZE))
+            exit(1);
+        return;
+    }
+
+    if (dump_path) {
+        if (log_path == nullptr)
+            usage("The launch log is required to dump a slice");
+        if (rambase == 0)
+            usage("RAM base is required to identify the slice");
+        return;
+    }
+
+    if (grow) {
+        if (log_path == nullptr)
+            usage("The launch log is required to grow a slice");
+        if (rambase == 0)
+            usage("RAM base is required to identify the slice");
+        if (apic_ids.empty() && grow_mem.empty())
+            usage("No CPUs or memory to add");
+        if (!apic_ids.empty() && !check_cpu_ids(apic_ids))
+            usage("Invalid CPU IDs");
+        if (carve && !carve_host_resources(apic_ids, grow_mem))
+            exit(1);
+        for (const auto& [base, size] : grow_mem) {
+            if (!carve && !check_not_host_ram(base, size))
+                exit(1);
+        }
+        if (!apic_ids.empty() && !translate_apic_ids(apic_ids))
+            usage("Invalid CPU IDs");
+        return;
+    }
+
+    if (bundle_path && (kernel_path || initrd_path || dsdt_path))
+        usage("A bundle replaces -kernel, -initrd and -dsdt");
+    if (kernel_path == nullptr && bundle_path == nullptr)
         usage("Kernel image path is required");
+    if (modules_dir && !bundle_path && initrd_path == nullptr && busybox_path == nullptr)
+        usage("A generated initrd needs either a base initrd or busybox");
     if (rambase == 0 || ramsize == 0)
         usage("RAM base and size are required");
     if (rambase % 0x1000 != 0)
@@ -109,8 +334,89 @@ void Options::validate()
         usage("Low memory must be page-aligned");
     if (apic_ids.empty())
         usage("CPU IDs are required");
-    if (!translate_apic_ids(apic_ids))
+    if (!spare_apic_ids.empty() && hotplug_ioapic == 0)
+        usage("Spare CPUs require -hotplug");
+    if (spare_apic_ids.size() > MAX_HOTPLUG_CPUS)
+        usage("Too many spare CPUs");
+    for (const auto& [base, size] : far_mem) {
+        if (size == 0 || base % FAR_MEM_ALIGN != 0 || size % FAR_MEM_ALIGN != 0)
+            usage("Far memory must be aligned to 128MiB");
+        if (base < rambase + ramsize && rambase < base + size)
+            usage("Far memory overlaps slice RAM");
+        for (const auto& [other_base, other_size] : far_mem) {
+            if (&other_base != &base && base < other_base + other_size && other_base < base + size)
+                usage("Far memory ranges overlap");
+        }
+    }
+    if (far_mem_soft_reserved && far_mem.empty())
+        usage("-farmem-sp requires -farmem");
+    if (clock_page) {
+        if (clock_page % SLICE_CLOCK_PAGE_SIZE != 0)
+            usage("The clock page must be page-aligned");
+        if (clock_page < 0x100000 || (clock_page < rambase + ramsize && rambase < clock_page + SLICE_CLOCK_PAGE_SIZE))
+            usage("The clock page must be outside low memory and slice RAM");
+        for (const auto& [base, size] : far_mem) {
+            if (clock_page < base + size && base < clock_page + SLICE_CLOCK_PAGE_SIZE)
+                usage("The clock page overlaps far memory");
+        }
+    }
+
+    if (datasets.size() > MAX_DATASETS)
+        usage("Too many datasets");
+    for (SharedDataset& dataset : datasets) {
+        struct stat st;
+        if (stat(dataset.path.c_str(), &st) != 0)
+            usage("Dataset file not found");
+        dataset.size = dataset_region_size(st.st_size);
+        if (dataset.base == 0 || dataset.base % DATASET_ALIGN != 0)
+            usage("Datasets must be aligned to 128MiB");
+        if (dataset.base < rambase + ramsize && rambase < dataset.base + dataset.size)
+            usage("Dataset overlaps slice RAM");
+        for (const auto& [base, size] : far_mem) {
+            if (dataset.base < base + size && base < dataset.base + dataset.size)
+                usage("Dataset overlaps far memory");
+        }
+        if (clock_page && clock_page < dataset.base + dataset.size && dataset.base < clock_page + SLICE_CLOCK_PAGE_SIZE)
+            usage("Dataset overlaps the clock page");
+        for (const SharedDataset& other : datasets) {
+            if (&other != &dataset && other.size && dataset.base < other.base + other.size
+                && other.base < dataset.base + dataset.size)
+                usage("Datasets overlap");
+        }
+    }
+    if (dataset_reload && datasets.empty())
+        usage("-dataset-reload requires -dataset");
+
+    // Translate boot and spare CPUs together, so that neither may repeat the other.
+    std::vector<uint32_t> all_ids = apic_ids;
+    all_ids.insert(all_ids.end(), spare_apic_ids.begin(), spare_apic_ids.end());
+    std::vector<std::pair<uint64_t, uint64_t>> all_mem = { { rambase, ramsize } };
+    all_mem.insert(all_mem.end(), far_mem.begin(), far_mem.end());
+    for (const SharedDataset& dataset : datasets)
+        all_mem.push_back({ dataset.base, dataset.size });
+    if (!check_cpu_ids(all_ids))
         usage("Invalid CPU IDs");
+    if (carve && !carve_host_resources(all_ids, all_mem))
+        exit(1);
+    if (!translate_apic_ids(all_ids))
+        usage("Invalid CPU IDs");
+    spare_apic_ids.assign(all_ids.begin() + apic_ids.size(), all_ids.end());
+    apic_ids.assign(all_ids.begin(), all_ids.begin() + apic_ids.size());
+    if (!resolve_cpu_profile(*this))
+        usage("Invalid CPU profile or MSR settings");
+
+    if (console_dev) {
+        uint64_t ioport;
+        if (!get_console_ioport(console_dev, ioport))
+            usage("Invalid console device");
+
+        char arg[64];
+        snprintf(arg, sizeof(arg), "console=uart,io,0x%lx,115200n8", ioport);
+        console_cmdline = arg;
+        if (kernel_cmdline)
+            console_cmdline = console_cmdline + " " + kernel_cmdline;
+        kernel_cmdline = console_cmdline.c_str();
+    }
 }
 
 static void parse_cpus(const char* str, std::vector<uint32_t>& cpu_ids)
@@ -160,14 +466,34 @@ static void parse_args(int argc, const char* argv[], Options& options)
             if (++i >= argc)
                 usage();
             options.kernel_path = argv[i];
+        } else if (strcmp(argv[i], "-bundle") == 0) {
+            if (++i >= argc)
+                usage();
+            options.bundle_path = argv[i];
         } else if (strcmp(argv[i], "-initrd") == 0) {
             if (++i >= argc)
                 usage();
             options.initrd_path = argv[i];
+        } else if (strcmp(argv[i], "-module") == 0) {
+            if (++i >= argc)
+                usage();
+            options.module_paths.push_back(argv[i]);
+        } else if (strcmp(argv[i], "-modules") == 0) {
+            if (++i >= argc)
+                usage();
+            options.modules_dir = argv[i];
+        } else if (strcmp(argv[i], "-busybox") == 0) {
+            if (++i >= argc)
+                usage();
+            options.busybox_path = argv[i];
         } else if (strcmp(argv[i], "-cmdline") == 0) {
             if (++i >= argc)
                 usage();
             options.kernel_cmdline = argv[i];
+        } else if (strcmp(argv[i], "-console") == 0) {
+            if (++i >= argc)
+                usage();
+            options.console_dev = argv[i];
         } else if (strcmp(argv[i], "-rambase") == 0) {
             if (++i >= argc)
                 usage();
@@ -184,10 +510,192 @@ static void parse_args(int argc, const char* argv[], Options& options)
             if (++i >= argc)
                 usage();
             parse_cpus(argv[i], options.apic_ids);
+        } else if (strcmp(argv[i], "-profile") == 0) {
+            if (++i >= argc)
+                usage();
+            options.cpu_profile = argv[i];
+        } else if (strcmp(argv[i], "-msr") == 0) {
+            MsrWrite write;
+            if (++i >= argc)
+                usage();
+            if (!parse_msr_write(argv[i], write))
+                usage("Invalid MSR setting");
+            options.msr_writes.push_back(write);
         } else if (strcmp(argv[i], "-dsdt") == 0) {
             if (++i >= argc)
                 usage();
             options.dsdt_path = argv[i];
+        } else if (strcmp(argv[i], "-hotplug") == 0) {
+            if (++i >= argc)
+                usage();
+            options.hotplug_ioapic = strtoull(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-spare-cpus") == 0) {
+            if (++i >= argc)
+                usage();
+            parse_cpus(argv[i], options.spare_apic_ids);
+        } else if (strcmp(argv[i], "-farmem") == 0) {
+            char* end;
+            if (++i >= argc)
+                usage();
+            const uint64_t base = strtoull(argv[i], &end, 0);
+            if (*end != ',')
+                usage("Invalid far memory range");
+            const uint64_t size = strtoull(end + 1, &end, 0);
+            if (*end != '\0')
+                usage("Invalid far memory range");
+            options.far_mem.push_back({ base, size });
+        } else if (strcmp(argv[i], "-dataset") == 0) {
+            if (++i >= argc)
+                usage();
+            const char* at = strrchr(argv[i], '@');
+            char* end;
+            if (at == nullptr || at == argv[i])
+                usage("Invalid dataset (expected FILE@ADDR)");
+            const uint64_t base = strtoull(at + 1, &end, 0);
+            if (*end != '\0')
+                usage("Invalid dataset (expected FILE@ADDR)");
+            SharedDataset dataset;
+            dataset.path.assign(argv[i], at - argv[i]);
+            dataset.base = base;
+            options.datasets.push_back(dataset);
+        } else if (strcmp(argv[i], "-dataset-reload") == 0) {
+            options.dataset_reload = true;
+        } else if (strcmp(argv[i], "-farmem-sp") == 0) {
+            options.far_mem_soft_reserved = true;
+        } else if (strcmp(argv[i], "-clock") == 0) {
+            if (++i >= argc)
+                usage();
+            options.clock_page = strtoull(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-clockd") == 0) {
+            if (++i >= argc)
+                usage();
+            options.clock_page = strtoull(argv[i], nullptr, 0);
+            options.clock_daemon = true;
+        } else if (strcmp(argv[i], "-standby") == 0) {
+            if (++i >= argc)
+                usage();
+            options.standby_pool = strtoull(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-park") == 0) {
+            if (++i >= argc)
+                usage();
+            options.standby_pool = strtoull(argv[i], nullptr, 0);
+            options.park = true;
+        } else if (strcmp(argv[i], "-pmem") == 0) {
+            if (++i >= argc)
+                usage();
+            options.pmem_paths.push_back(argv[i]);
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            if (++i >= argc)
+                usage();
+            options.seed_dir = argv[i];
+        } else if (strcmp(argv[i], "-hostname") == 0) {
+            if (++i >= argc)
+                usage();
+            options.hostname = argv[i];
+        } else if (strcmp(argv[i], "-digests") == 0) {
+            if (++i >= argc)
+                usage();
+            options.digests_path = argv[i];
+        } else if (strcmp(argv[i], "-log") == 0) {
+            if (++i >= argc)
+                usage();
+            options.log_path = argv[i];
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            if (++i >= argc)
+                usage();
+            options.threads = strtoul(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-platform") == 0) {
+            if (++i >= argc)
+                usage();
+            set_host_platform_path(argv[i]);
+        } else if (strcmp(argv[i], "-hostroot") == 0) {
+            if (++i >= argc)
+                usage();
+            set_host_root(argv[i]);
+        } else if (strcmp(argv[i], "-prepare") == 0) {
+            options.prepare = true;
+        } else if (strcmp(argv[i], "-vf") == 0) {
+            if (++i >= argc)
+                usage();
+            options.sriov_vf = strtoul(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-nic") == 0) {
+            if (++i >= argc)
+                usage();
+            options.nic_pf = argv[i];
+        } else if (strcmp(argv[i], "-macbase") == 0) {
+            if (++i >= argc)
+                usage();
+            options.nic_mac_base = argv[i];
+        } else if (strcmp(argv[i], "-nvme") == 0) {
+            if (++i >= argc)
+                usage();
+            options.nvme_pf = argv[i];
+        } else if (strcmp(argv[i], "-carve") == 0) {
+            options.carve = true;
+        } else if (strcmp(argv[i], "-release") == 0) {
+            options.release = true;
+        } else if (strcmp(argv[i], "-dump") == 0) {
+            if (++i >= argc)
+                usage();
+            options.dump_path = argv[i];
+        } else if (strcmp(argv[i], "-compress") == 0) {
+            options.dump_compressed = true;
+        } else if (strcmp(argv[i], "-dumpram") == 0) {
+            options.dump_ram_only = true;
+        } else if (strcmp(argv[i], "-nicrate") == 0) {
+            char* end;
+            if (++i >= argc)
+                usage();
+            options.nic_profile.min_tx_rate = strtoul(argv[i], &end, 0);
+            if (*end != ',')
+                usage("Invalid NIC rate");
+            options.nic_profile.max_tx_rate = strtoul(end + 1, &end, 0);
+            if (*end != '\0')
+                usage("Invalid NIC rate");
+        } else if (strcmp(argv[i], "-nicvlan") == 0) {
+            char* end;
+            if (++i >= argc)
+                usage();
+            options.nic_profile.vlan = strtoul(argv[i], &end, 0);
+            if (*end == ',')
+                options.nic_profile.vlan_qos = strtoul(end + 1, &end, 0);
+            if (*end != '\0')
+                usage("Invalid NIC VLAN");
+        } else if (strcmp(argv[i], "-nictrust") == 0) {
+            options.nic_profile.trust = true;
+        } else if (strcmp(argv[i], "-nicqueues") == 0) {
+            if (++i >= argc)
+                usage();
+            options.nic_profile.queues = strtoul(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-nvmecpus") == 0) {
+            if (++i >= argc)
+                usage();
+            for (const char* p = argv[i];; p++) {
+                char* end;
+                options.nvme_slice_cpus.push_back(strtoul(p, &end, 0));
+                if (end == p || options.nvme_slice_cpus.back() == 0 || (*end != ',' && *end != '\0'))
+                    usage("Invalid NVMe CPU counts");
+                if (*end == '\0')
+                    break;
+                p = end;
+            }
+        } else if (strcmp(argv[i], "-grow") == 0) {
+            options.grow = true;
+        } else if (strcmp(argv[i], "-addmem") == 0) {
+            char* end;
+            if (++i >= argc)
+                usage();
+            const uint64_t base = strtoull(argv[i], &end, 0);
+            if (*end != ',')
+                usage("Invalid memory range");
+            const uint64_t size = strtoull(end + 1, &end, 0);
+            if (*end != '\0')
+                usage("Invalid memory range");
+            options.grow_mem.push_back({ base, size });
+        } else if (strcmp(argv[i], "-assign") == 0) {
+            if (++i >= argc)
+                usage();
+            options.assign_devices.push_back(argv[i]);
         } else {
             usage("Unrecognised option");
         }
@@ -199,34 +707,117 @@ int main(int argc, const char* argv[])
     Options options;
 
     parse_args(argc, argv, options);
+
+    cpu_set_t host_cpus;
+    if (!pin_host_cpu(host_cpus))
+        return 1;
+
     options.validate();
 
+    if (options.prepare)
+        return prepare_devices(options) ? 0 : 1;
+
+    if (options.release)
+        return release_slice(options) ? 0 : 1;
+
+    if (options.clock_daemon)
+        return run_clock_daemon(options) ? 0 : 1;
+
+    if (options.park) {
+        AutoFd devmem = open("/dev/mem", O_RDWR);
+        if (devmem < 0) {
+            perror("Error: Failed to open /dev/mem");
+            return 1;
+        }
+        return park_standby_cpus(options, devmem) ? 0 : 1;
+    }
+
+    // Workers may not use CPUs that -carve just took from the host.
+    if (options.carve)
+        remove_offline_cpus(host_cpus);
+    start_thread_pool(options.threads ? options.threads : CPU_COUNT(&host_cpus), host_cpus);
+
+    if (options.grow)
+        return grow_slice(options) ? 0 : 1;
+
+    if (options.dump_path)
+        return dump_slice(options) ? 0 : 1;
+
     AutoFd devmem = open("/dev/mem", O_RDWR);
     if (devmem < 0) {
         perror("Error: Failed to open /dev/mem");
         return 1;
     }
 
-    void* slice_ram = mmap(nullptr, options.ramsize, PROT_READ | PROT_WRITE, MAP_SHARED, devmem, options.rambase);
+    void* slice_ram = map_devmem(devmem, options.rambase, options.ramsize, "slice RAM");
     if (slice_ram == MAP_FAILED) {
         perror("Error: Failed to map slice RAM");
         return 1;
     }
 
-    uintptr_t kernel_entry, kernel_arg;
-    if (!load_linux(options, slice_ram, kernel_entry, kernel_arg))
+    auto elapsed_ms = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto report_rate = [](const char* what, uint64_t bytes, double ms) {
+        printf("%s %.1f MiB in %.1f ms (%.2f GiB/s)\n", what, bytes / double(1 << 20), ms,
+               ms > 0 ? bytes / double(1 << 30) / (ms / 1000) : 0.0);
+    };
+
+    // Clear all of slice RAM first, so that nothing left by the host or a previous slice is
+    // visible to this one.
+    auto start = std::chrono::steady_clock::now();
+    clear_devmem(slice_ram, options.ramsize);
+    report_rate("Cleared", options.ramsize, elapsed_ms(start));
+
+    for (const auto& [base, size] : options.far_mem) {
+        void* far_mem = map_devmem(devmem, base, size, "far memory");
+        if (far_mem == MAP_FAILED) {
+            perror("Error: Failed to map far memory");
+            return 1;
+        }
+
+        start = std::chrono::steady_clock::now();
+        clear_devmem(far_mem, size);
+        report_rate("Cleared far memory:", size, elapsed_ms(start));
+        munmap(far_mem, size);
+    }
+
+    // Before the kernel, so that the loaders can describe (and measure) the datasets.
+    if (!attach_datasets(options, devmem))
+        return 1;
+
+    start = std::chrono::steady_clock::now();
+    KernelEntry kernel_entry;
+    if (!load_kernel(options, slice_ram, kernel_entry))
         return 1;
+    report_rate("Loaded", devmem_written_bytes(), elapsed_ms(start));
 
-    // TODO: zero-fill remaining slice RAM
+    // The slice's CPUs are coherent with ours, but start with their caches disabled; make sure
+    // nothing they need is left only in our caches.
+    flush_devmem_writes(slice_ram, options.rambase);
 
     munmap(slice_ram, options.ramsize);
 
+    if (options.digests_path && !verify_measurements(options.digests_path))
+        return 1;
+
+    if (options.clock_page)
+        check_clock_page(devmem, options.clock_page);
+
+    if (!tune_secondary_cpus(options, devmem))
+        return 1;
+
     uintptr_t boot_ip = UINTPTR_MAX;
-    if (!lowmem_init(options, devmem, kernel_entry, kernel_arg, boot_ip))
+    if (!lowmem_init(options, devmem, kernel_entry, boot_ip))
         return 1;
 
     assert(boot_ip != UINTPTR_MAX);
-    send_startup_ipi(devmem, options.apic_ids.front(), boot_ip);
+
+    if (options.log_path && !append_launch_log(options, options.log_path))
+        return 1;
+
+    if (!options.standby_pool || !start_standby_cpu(options, devmem, boot_ip))
+        send_startup_ipi(devmem, options.apic_ids.front(), boot_ip);
 
     return 0;
 }
@@ -1,23 +1,174 @@
+#ifndef RUNSLICE_H
+#define RUNSLICE_H 1
+
+#include <sched.h>
 #include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
 #include <vector>
 #include <unistd.h>
 
+#include "sha256.h"
+
 #define ALIGN_UP(_v, _a)	(((_v) + (_a) - 1) & ~(static_cast<uintptr_t>(_a) - 1))
 
+// A read-modify-write of an MSR, applied on each slice CPU before it enters the kernel.
+struct MsrWrite
+{
+    uint32_t msr;
+    uint64_t clear;     // bits to clear
+    uint64_t set;       // bits to set
+};
+
+constexpr size_t MAX_MSR_WRITES = 16; // size of msr_table in realmode.S
+
+// Spare CPUs that may be hot-added to a slice are declared in its MADT with these ACPI UIDs.
+constexpr size_t MAX_HOTPLUG_CPUS = 64;
+constexpr uint32_t HOTPLUG_CPU_UID_BASE = 0x100;
+
+// Mailboxes in the standby pool of parked CPUs (see -park).
+constexpr size_t MAX_STANDBY_CPUS = 256;
+
+// Far memory ranges must be whole memory sections, so that no section spans two NUMA nodes.
+constexpr uint64_t FAR_MEM_ALIGN = 128 << 20;
+
+// Shared datasets are placed on memory section boundaries, like pmem images.
+constexpr uint64_t DATASET_ALIGN = 128 << 20;
+constexpr size_t MAX_DATASETS = 256;     // named DS00-DSFF in the guest's SSDT
+
+// A read-only dataset shared by slices (-dataset FILE@ADDR), loaded once into a range of host
+// memory outside every slice.
+struct SharedDataset
+{
+    std::string path;
+    uint64_t base = 0;
+    uint64_t size = 0;          // of the whole region, set by validate()
+    uint64_t data_size = 0;     // the rest is set by attach_datasets()
+    std::string name;
+    Sha256::Digest digest = {};
+};
+
+// Per-slice settings for its NIC VF, applied (and checked) by -prepare.
+struct NicProfile
+{
+    uint32_t min_tx_rate = 0;   // Mbps; 0: no guarantee
+    uint32_t max_tx_rate = 0;   // Mbps; 0: unlimited
+    uint32_t vlan = 0;          // 0: untagged
+    uint32_t vlan_qos = 0;
+    bool trust = false;         // allow promiscuous and all-multicast modes, and MAC changes
+    unsigned queues = 0;        // RX/TX queue pairs; 0: driver default
+};
+
 struct Options
 {
     const char* kernel_path = nullptr;
+    const char* bundle_path = nullptr;
     const char* initrd_path = nullptr;
     const char* kernel_cmdline = nullptr;
+    const char* console_dev = nullptr;
     const char* dsdt_path = nullptr;
+    const char* modules_dir = nullptr;
+    const char* busybox_path = nullptr;
+    const char* digests_path = nullptr;
+    const char* log_path = nullptr;
+    const char* seed_dir = nullptr;
+    const char* hostname = nullptr;
+    std::vector<const char*> pmem_paths;
+    std::vector<const char*> module_paths;
     uint64_t rambase = 0;
     uint64_t ramsize = 0;
     uint64_t lowmem = 0x6000;
     std::vector<uint32_t> apic_ids;
+    const char* cpu_profile = nullptr;
+    std::vector<MsrWrite> msr_writes;
+    unsigned threads = 0;   // 0: one per host CPU
+    uint64_t hotplug_ioapic = 0;
+    std::vector<uint32_t> spare_apic_ids;
+
+    // Remote-socket memory, presented as a CPU-less NUMA node (-farmem)
+    std::vector<std::pair<uint64_t, uint64_t>> far_mem;
+    bool far_mem_soft_reserved = false;     // as EFI_MEMORY_SP, for the guest's dax/kmem tiering
+
+    // Shared clock page (-clock), or publish it (-clockd)
+    uint64_t clock_page = 0;
+    bool clock_daemon = false;
+
+    // Shared read-only datasets (-dataset), and whether to replace one that differs (-dataset-reload)
+    std::vector<SharedDataset> datasets;
+    bool dataset_reload = false;
+
+    // Boot from the standby pool in low memory (-standby), or fill it with parked CPUs (-park)
+    uint64_t standby_pool = 0;
+    bool park = false;
+
+    // Hot-add to a running slice (-grow)
+    bool grow = false;
+    std::vector<std::pair<uint64_t, uint64_t>> grow_mem;
+
+    // Take CPUs and memory from the host first (-carve), or return a stopped slice's (-release)
+    bool carve = false;
+    bool release = false;
+
+    // Post-mortem dump of a slice's memory (-dump)
+    const char* dump_path = nullptr;
+    bool dump_compressed = false;   // makedumpfile's kdump format, rather than an ELF core
+    bool dump_ram_only = false;     // only the slice's E820 RAM
+
+    // Device preparation (-prepare)
+    bool prepare = false;
+    int sriov_vf = -1;
+    const char* nic_pf = nullptr;
+    const char* nic_mac_base = nullptr;
+    NicProfile nic_profile;
+    const char* nvme_pf = nullptr;
+    std::vector<unsigned> nvme_slice_cpus;  // CPU count of the slice on each NVMe VF, for the resource split
+    std::vector<const char*> assign_devices;
+
+    std::string console_cmdline;    // kernel_cmdline, with the -console argument prepended
 
     void validate();
 };
 
+// A range of slice memory set aside for something other than general-purpose RAM, and described
+// to the guest by its own E820 entry.
+struct MemRegion
+{
+    uint64_t base;
+    uint64_t size;
+    uint32_t e820_type;
+};
+
+// One component of what is loaded into slice RAM, e.g. "kernel" or "initrd".
+struct LayoutItem
+{
+    std::string name;
+    uint64_t base;
+    uint64_t size;
+    uint64_t align;
+};
+
+// Where everything loaded into slice RAM goes, planned from file sizes and headers before any of
+// it is written (see layout.cpp). Components are placed from the bottom of slice RAM up, except
+// for regions carved from the top (pmem images and the hotplug mailbox).
+struct SliceLayout
+{
+    uint64_t rambase;
+    uint64_t bottom;    // end of the components placed from the bottom
+    uint64_t top;       // start of those carved from the top, and so the top of general-purpose RAM
+    std::vector<LayoutItem> items;
+
+    explicit SliceLayout(const Options& options);
+
+    // Where place() would put a component with the given alignment.
+    uint64_t next(uint64_t align) const { return ALIGN_UP(bottom, align); }
+
+    bool place(const std::string& name, uint64_t size, uint64_t align, uint64_t& base);
+    bool place_top(const std::string& name, uint64_t size, uint64_t align, uint64_t& base);
+    bool check(const Options& options) const;
+    void print() const;
+};
+
 class AutoFd
 {
 public:
@@ -45,25 +196,224 @@ bool send_startup_ipi(AutoFd& devmem, uint32_t apic_id, uint64_t startup_pa);
 
 uint8_t acpi_checksum(const void* data, size_t size);
 
+// ACPI tables already placed in slice memory (e.g. from a bundle), by physical address.
+struct PreloadedAcpi
+{
+    uintptr_t dsdt = 0;
+    std::vector<uintptr_t> ssdts;
+};
+
 uintptr_t build_acpi(
     const Options& options,
-    uintptr_t& loadaddr_phys,
-    char*& loadaddr_virt,
-    uintptr_t& mmconfig_base);
+    uintptr_t base_pa,
+    std::vector<char>& tables,
+    uintptr_t& mmconfig_base,
+    const PreloadedAcpi& preloaded = PreloadedAcpi());
+
+bool acpi_read_host_table(const char* signature, std::vector<uint8_t>& data);
+
+// One of the host's HMAT latency or bandwidth figures (ACPI_HMAT_*_LATENCY/BANDWIDTH) from the
+// slice's CPUs to its RAM and to its far memory.
+struct HmatLocality
+{
+    uint8_t data_type;
+    uint64_t base_unit;
+    uint16_t local;
+    uint16_t far;
+};
+
+struct FarMemoryTopology
+{
+    uint8_t distance = 20;              // SLIT distance from the slice's CPUs to far memory
+    std::vector<HmatLocality> hmat;     // empty if the host has no HMAT
+};
+
+bool get_far_memory_topology(const Options& options, FarMemoryTopology& topology);
+
+bool acpi_read_host_table_id(const char* signature, uint32_t& length, uint8_t& checksum);
 
 bool acpi_get_host_apic_ids(
+    const std::vector<uint8_t>& madt_data,
     std::vector<uint32_t>& apic_ids);
 
-bool read_to_devmem(std::ifstream& file, uint64_t offset, void* dest, size_t size);
+bool read_to_devmem(const char* path, uint64_t offset, void* dest, size_t size, Sha256* hash = nullptr);
+
+bool read_fd_to_devmem(int fd, bool direct, uint64_t offset, void* dest, size_t size, Sha256* hash = nullptr);
+
+bool copy_sparse_to_devmem(int fd, size_t size, void* dest);
+
+void clear_devmem(void* dest, size_t size);
+
+// Effective memory type of a mapping, as set by PAT and the MTRRs.
+enum class MemType
+{
+    Unknown,
+    Uncached,
+    UncachedMinus,
+    WriteCombining,
+    WriteThrough,
+    WriteProtect,
+    WriteBack,
+};
 
-bool load_linux(
+const char* mem_type_name(MemType type);
+MemType get_mem_type(uint64_t base, uint64_t size);
+void* map_devmem(const AutoFd& devmem, uint64_t base, uint64_t size, const char* what);
+
+void record_devmem_write(uint64_t base, uint64_t size);
+uint64_t devmem_written_bytes();
+void flush_cache(void* p, size_t size);
+void flush_devmem_writes(void* slice_ram, uint64_t rambase);
+
+bool plan_pmem_images(const Options& options, SliceLayout& layout, std::vector<MemRegion>& regions);
+bool load_pmem_images(const Options& options, void* slice_ram, const std::vector<MemRegion>& regions);
+
+uint64_t dataset_region_size(uint64_t file_size);
+bool attach_datasets(Options& options, const AutoFd& devmem);
+std::vector<uint8_t> dataset_aml(const Options& options);
+
+std::vector<MemRegion> build_memory_map(
     const Options& options,
-    void* slice_ram,
-    uintptr_t& kernel_entry_phys,
-    uintptr_t& kernel_entry_arg);
+    uintptr_t mmconfig_base,
+    uint64_t ram_top,
+    const std::vector<MemRegion>& regions);
+
+// How the real-mode stub should enter the loaded kernel.
+struct KernelEntry
+{
+    uintptr_t entry = 0;            // physical address of entry point
+    uintptr_t arg = 0;              // passed in RSI (and RBX)
+    uint32_t magic = 0;             // passed in RDI (and EAX)
+    bool protected_mode = false;    // enter in 32-bit protected mode, rather than 64-bit mode
+};
+
+bool reserve_hotplug_mailbox(const Options& options, SliceLayout& layout, std::vector<MemRegion>& regions);
+void write_hotplug_mailbox(const Options& options, void* slice_ram);
+
+uint64_t hotplug_mailbox_address();
+
+std::vector<uint8_t> hotplug_aml(const Options& options);
+
+bool grow_slice(const Options& options);
+
+bool check_not_host_ram(uint64_t base, uint64_t size);
+
+bool carve_host_resources(const std::vector<uint32_t>& cpus, const std::vector<std::pair<uint64_t, uint64_t>>& mem);
+void remove_offline_cpus(cpu_set_t& cpus);
+
+bool release_slice(const Options& options);
+
+bool dump_slice(const Options& options);
+
+bool run_clock_daemon(const Options& options);
+void check_clock_page(const AutoFd& devmem, uint64_t address);
+
+bool load_kernel(const Options& options, void* slice_ram, KernelEntry& entry);
+
+bool load_linux(const Options& options, void* slice_ram, KernelEntry& entry);
+
+bool load_bundle(const Options& options, void* slice_ram, KernelEntry& entry);
+
+bool load_elf(const Options& options, void* slice_ram, KernelEntry& entry);
+
+bool build_slice_initrd(const Options& options, const std::string& kernel_version, bool standalone, std::string& path);
+
+bool lowmem_init(const Options& options, const AutoFd& devmem, const KernelEntry& entry, uintptr_t &boot_ip);
+
+bool tune_secondary_cpus(const Options& options, AutoFd& devmem);
+
+uint64_t standby_pool_size();
+bool park_standby_cpus(const Options& options, AutoFd& devmem);
+bool start_standby_cpu(const Options& options, AutoFd& devmem, uintptr_t boot_ip);
+
+bool send_init_ipi(AutoFd& devmem, uint32_t apic_id);
+
+bool send_fixed_ipi(AutoFd& devmem, uint32_t apic_id, uint8_t vector);
+
+bool pin_host_cpu(cpu_set_t& host_cpus);
 
-bool lowmem_init(const Options& options, const AutoFd& devmem, uintptr_t kernel_entry, uintptr_t kernel_arg, uintptr_t &boot_ip);
+bool read_host_msr(uint32_t msrnum, uint64_t& value);
+
+bool parse_msr_write(const char* str, MsrWrite& write);
+bool resolve_cpu_profile(Options& options);
 
 extern "C" const size_t realmode_blob_size;
 
 uint32_t get_local_apic_id();
+
+bool get_online_apic_ids(std::map<uint32_t, uint32_t>& online_ids);
+
+struct Measurement
+{
+    std::string component;
+    std::string path;
+    Sha256::Digest digest;
+};
+
+void record_measurement(const char* component, const char* path, const Sha256::Digest& digest);
+
+const std::vector<Measurement>& get_measurements();
+
+std::vector<uint8_t> measurement_blob();
+size_t measurement_blob_size(size_t count);
+
+bool verify_measurements(const char* manifest_path);
+
+bool build_cloud_seed(const Options& options, std::vector<char>& archive);
+
+void record_memory_map(const std::vector<MemRegion>& map);
+void record_linux_layout(uint64_t text_base, uint64_t text_size, uint64_t phys_base);
+void record_slice_layout(const SliceLayout& layout);
+
+bool append_launch_log(const Options& options, const char* path);
+
+bool read_launch_record(const char* path, uint64_t rambase, std::vector<std::pair<std::string, std::string>>& record,
+                        bool with_growth = false);
+
+bool append_grow_log(const Options& options, const char* path);
+
+bool append_release_log(const Options& options, const char* path);
+
+bool read_live_apic_ids(const char* path, std::vector<uint32_t>& apic_ids);
+bool read_live_memory(const char* path, std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+void set_host_root(const char* root);
+std::string host_path(const std::string& path);
+bool read_host_file(const std::string& path, std::string& value);
+bool read_host_file(const std::string& path, uint64_t& value);
+bool write_host_file(const std::string& path, const std::string& value);
+bool read_host_link(const std::string& path, std::string& target);
+bool list_host_dir(const std::string& path, std::vector<std::string>& names);
+
+struct NetlinkVfState
+{
+    uint8_t mac[6];
+    uint32_t vlan;
+    uint32_t vlan_qos;
+    uint32_t min_tx_rate;   // Mbps
+    uint32_t max_tx_rate;
+    bool spoofchk;
+    bool trust;
+};
+
+// VF settings of a NIC, made through rtnetlink requests to its PF. Virtual, so that the tests can
+// substitute a mock (as for NvmeAdmin).
+class VfNetlink
+{
+public:
+    virtual ~VfNetlink() = default;
+
+    virtual bool set_vf_mac(int ifindex, uint32_t vf, const uint8_t mac[6]);
+    virtual bool set_vf_rate(int ifindex, uint32_t vf, uint32_t min_tx_rate, uint32_t max_tx_rate);
+    virtual bool set_vf_vlan(int ifindex, uint32_t vf, uint32_t vlan, uint32_t qos);
+    virtual bool set_vf_spoofchk(int ifindex, uint32_t vf, bool on);
+    virtual bool set_vf_trust(int ifindex, uint32_t vf, bool on);
+    virtual bool get_vf(int ifindex, uint32_t vf, NetlinkVfState& state);
+};
+
+bool setup_sriov_nic(VfNetlink& netlink, const char* pf_addr, unsigned vf, const char* mac_base,
+                     const NicProfile& profile, std::string& vf_addr);
+bool unbind_pci_driver(const std::string& addr);
+bool prepare_devices(const Options& options);
+
+#endif
@@ -7,6 +7,15 @@ source ./run_config.sh
 MEM_GB=$DEFAULT_MEM_GB
 CPUS=$DEFAULT_CPUS
 SRIOV_VF=0
+PMEM_ARGS=""
+DATASET_ARGS=""
+HOTPLUG_ARGS=""
+LAUNCH_LOG="slices.log"
+PROFILE_ARGS=""
+INITRD_ARGS="-initrd initrd.img"
+MODULES_DIR=""
+BUNDLE=""
+SEED_DIR=""
 
 # Parse arguments
 while [[ $# -gt 0 ]]
@@ -27,11 +36,65 @@ do
     shift
     ;;
 
+  -p)
+    PMEM_ARGS="$PMEM_ARGS -pmem $2"
+    shift
+    ;;
+
+  -P)
+    PROFILE_ARGS="-profile $2"
+    shift
+    ;;
+
+  -M)
+    MODULES_DIR="$2"
+    shift
+    ;;
+
+  -B)
+    INITRD_ARGS="-busybox $2"
+    shift
+    ;;
+
+  -b)
+    BUNDLE="$2"
+    shift
+    ;;
+
+  -S)
+    SEED_DIR="$2"
+    shift
+    ;;
+
+  -C)
+    CLOCK_ARGS="-clock $2"
+    shift
+    ;;
+
+  -D)
+    DATASET_ARGS="$DATASET_ARGS -dataset $2"
+    shift
+    ;;
+
+  -H)
+    HOTPLUG_ARGS="-hotplug $2 -log $LAUNCH_LOG"
+    shift
+    ;;
+
   -h)
     echo "Usage: $0 [args]"
     echo "   -m GIB       set memory size in GiB"
     echo "   -c CPUS      set number of VCPUs"
     echo "   -v VFID      set virtual function ID to use"
+    echo "   -p IMAGE     preload a filesystem image as a pmem device (may be repeated)"
+    echo "   -P PROFILE   tune slice CPUs for a workload (see runslice -h)"
+    echo "   -M DIR       add just the needed modules from guest module tree DIR to the initrd"
+    echo "   -B BUSYBOX   with -M, boot a minimal busybox initrd instead of initrd.img"
+    echo "   -b BUNDLE    boot a slicebundle bundle instead of vmlinuz, initrd.img and the DSDT"
+    echo "   -S DIR       pass a cloud-init seed (user-data etc.) from DIR for this launch only"
+    echo "   -C ADDR      use the shared clock page at ADDR (see runslice -clockd)"
+    echo "   -D FILE@ADDR share the read-only dataset FILE, loaded once at ADDR (may be repeated)"
+    echo "   -H IOAPIC    allow hot-add through the host IOAPIC at IOAPIC (see runslice -grow)"
     exit 0
     ;;
 
@@ -57,41 +120,21 @@ echo "  RAM:           $MEM_GB GiB"
 echo "  Virt Fn ID:    $SRIOV_VF"
 echo "  Console:       $PCI_SERIAL_CONSOLE"
 
-# find the IO port occupied by the serial console
-sysfsdir=/sys/bus/pci/devices/$PCI_SERIAL_CONSOLE
-read class < $sysfsdir/class
-if [ "$class" != "0x070002" ]; then
-  echo "Error: $PCI_SERIAL_CONSOLE is not a 16550 serial port"
-  exit 1
-fi
-read SERIAL_IOPORT_BASE SERIAL_IOPORT_LIMIT flags < $sysfsdir/resource
-if (( (flags >> 8 & 0xff) != 1 )); then
-  echo "Error: $PCI_SERIAL_CONSOLE doesn't implement an I/O port resource"
-  exit 1
-fi
-
-# PCI devices/functions to assign
-PCI_ASSIGN="$PCI_SERIAL_CONSOLE"
-
-# Create SR-IOV virtual function for NIC/NVME
-PCI_ASSIGN="$PCI_ASSIGN $(setup_sriov_nic $SRIOV_NIC_PF $SRIOV_VF)"
-PCI_ASSIGN="$PCI_ASSIGN $(setup_sriov_nvme $SRIOV_NVME_PF $SRIOV_VF)"
-
-# Ensure that all assigned devices exist and are not bound to drivers on the host
-for dev in $PCI_ASSIGN; do
-  sysfsdir=/sys/bus/pci/devices/$dev
-  if [ ! -d $sysfsdir ]; then
-    echo "Error: device $dev does not exist"
-    exit 1
-  fi
-  if [ -e $sysfsdir/driver ]; then
-    echo "Unbinding PCI device $dev from host driver $(basename $(readlink $sysfsdir/driver))"
-    echo -n $dev > $sysfsdir/driver/unbind
-  fi
-done
+# Create SR-IOV virtual functions for NIC/NVMe, and ensure that all assigned devices exist and
+# are not bound to drivers on the host
+PCI_ASSIGN=$(builddir/runslice -prepare -vf $SRIOV_VF -assign $PCI_SERIAL_CONSOLE \
+  -nic $SRIOV_NIC_PF -macbase $NIC_VF_MACADDR_BASE -nicqueues $CPUS $NIC_VF_PROFILE \
+  -nvme $SRIOV_NVME_PF \
+  ${NVME_SLICE_CPUS:+-nvmecpus $NVME_SLICE_CPUS})
 
 probe_only_arg=""
+if [ -n "$MODULES_DIR" ]; then
+  INITRD_ARGS="$INITRD_ARGS -modules $MODULES_DIR"
+fi
 for dev_full in $PCI_ASSIGN; do
+  if [ -n "$MODULES_DIR" ]; then
+    INITRD_ARGS="$INITRD_ARGS -assign $dev_full"
+  fi
   dev=${dev_full#0000:} # remove the PCI segment prefix
   if [ -n "$probe_only_arg" ]; then
     probe_only_arg="$probe_only_arg;$dev"
@@ -100,17 +143,19 @@ for dev_full in $PCI_ASSIGN; do
   fi
 done
 
-# enable plenty of debug output, and configure the console
+# enable plenty of debug output (the console argument is added by runslice -console)
 CMDLINE=""
 #CMDLINE="$CMDLINE loglevel=7 apic=debug"
-CMDLINE="$CMDLINE console=uart,io,$SERIAL_IOPORT_BASE,115200n8"
 CMDLINE="$CMDLINE root=LABEL=cloudimg-rootfs ro"
 
 # magic to enable cloud-init on first boot
 CMDLINE="$CMDLINE ds=nocloud"
 
-# disable use of the IO-APICs
-CMDLINE="$CMDLINE noapic"
+# disable use of the IO-APICs, except for hot-add, whose GED interrupt needs the guest to program
+# the IOAPIC pin that runslice -grow signals
+if [ -z "$HOTPLUG_ARGS" ]; then
+  CMDLINE="$CMDLINE noapic"
+fi
 
 # PCI config:
 # nobios: disable search for legacy PCI BIOS (if not enabled in the kernel config, this prints an unknown option warning)
@@ -139,6 +184,19 @@ RAM_PHYS_BASE=$((NUMA1_PHYS_BASE + SRIOV_VF * MEM_GB * 0x40000000))
 # XXX: same assumption as above
 CORE_BASE=$((NUMA1_CORE_BASE + SRIOV_VF * CPUS))
 
+# A per-launch cloud-init seed, unpacked in the guest by slice-seed.service
+SEED_ARGS=""
+if [ -n "$SEED_DIR" ]; then
+  SEED_ARGS="-seed $SEED_DIR -hostname slice$SRIOV_VF"
+fi
+
+# A bundle replaces the kernel, initrd and DSDT (but may still be extended by -M)
+if [ -n "$BUNDLE" ]; then
+  BOOT_ARGS="-bundle $BUNDLE ${INITRD_ARGS#-initrd initrd.img}"
+else
+  BOOT_ARGS="-kernel vmlinuz $INITRD_ARGS -dsdt builddir/dsdt.aml"
+fi
+
 sync # lingering paranoia
 
 set -x
@@ -146,6 +204,7 @@ set -x
 builddir/runslice -rambase $RAM_PHYS_BASE \
   -ramsize $((MEM_GB * 0x40000000)) \
   -cpus $CORE_BASE-$((CORE_BASE + CPUS - 1)) \
-  -kernel vmlinuz -initrd initrd.img \
-  -dsdt builddir/dsdt.aml \
+  $BOOT_ARGS $PMEM_ARGS $PROFILE_ARGS \
+  $SEED_ARGS $CLOCK_ARGS $DATASET_ARGS $HOTPLUG_ARGS \
+  -console $PCI_SERIAL_CONSOLE \
   -cmdline "$CMDLINE"
@@ -0,0 +1,78 @@
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "cpio.h"
+#include "runslice.h"
+#include "sha256.h"
+
+// Files of a NoCloud seed, as read by cloud-init. meta-data and user-data are required.
+static const char* const SEED_FILES[] = { "meta-data", "user-data", "vendor-data", "network-config" };
+
+static bool read_seed_file(const std::string& path, std::string& contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+// Build a cloud-init NoCloud seed for this launch, as a cpio archive, from the files in
+// -seed DIR and the -hostname. Unless DIR has its own meta-data, the instance ID is derived from
+// the seed's contents, so cloud-init treats the slice as a new instance (and reapplies its
+// per-instance config) exactly when the config changes. Returns an empty archive if neither
+// option was given.
+bool build_cloud_seed(const Options& options, std::vector<char>& archive)
+{
+    archive.clear();
+    if (options.seed_dir == nullptr && options.hostname == nullptr)
+        return true;
+
+    struct stat st;
+    if (options.seed_dir && (stat(options.seed_dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "Error: seed directory %s not found\n", options.seed_dir);
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> files;
+    for (const char* name : SEED_FILES) {
+        std::string contents;
+        if (options.seed_dir && read_seed_file(std::string(options.seed_dir) + "/" + name, contents))
+            files.push_back({ name, contents });
+    }
+
+    auto has = [&files](const char* name) {
+        return std::any_of(files.begin(), files.end(), [name](const auto& file) { return file.first == name; });
+    };
+
+    if (!has("user-data"))
+        files.push_back({ "user-data", "#cloud-config\n" });
+
+    if (!has("meta-data")) {
+        Sha256 id;
+        for (const auto& [name, contents] : files) {
+            id.update(name.c_str(), name.size() + 1);
+            id.update(contents.data(), contents.size());
+        }
+        if (options.hostname)
+            id.update(options.hostname, strlen(options.hostname));
+
+        std::string meta_data = "instance-id: slice-" + Sha256::to_hex(id.finish()).substr(0, 16) + "\n";
+        if (options.hostname)
+            meta_data += std::string("local-hostname: ") + options.hostname + "\n";
+        files.push_back({ "meta-data", meta_data });
+    }
+
+    CpioWriter cpio;
+    for (const auto& [name, contents] : files)
+        cpio.add_file(name, contents.data(), contents.size(), 0600);
+    archive = cpio.finish();
+
+    printf("Built cloud-init seed (%zu files, %zu bytes)\n", files.size(), archive.size());
+    return true;
+}
@@ -0,0 +1,214 @@
+#include <immintrin.h>
+#include <cstring>
+
+#include "runslice.h"
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void compress_generic(uint32_t state[8], const uint8_t* data, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16
+                | uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+// SHA-NI version. The state is kept as ABEF/CDGH halves, as required by sha256rnds2, and the
+// message schedule is rotated through four registers.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_shani(uint32_t state[8], const uint8_t* data, size_t nblocks)
+{
+    const __m128i bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; nblocks > 0; nblocks--, data += 64) {
+        const __m128i abef_save = state0;
+        const __m128i cdgh_save = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4)
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), bswap_mask);
+
+            __m128i msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * i])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+            if (i >= 3 && i <= 14) {
+                tmp = _mm_alignr_epi8(w[i % 4], w[(i + 3) % 4], 4);
+                w[(i + 1) % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(w[(i + 1) % 4], tmp), w[i % 4]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (i >= 1 && i <= 12)
+                w[(i + 3) % 4] = _mm_sha256msg1_epu32(w[(i + 3) % 4], w[i % 4]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+typedef void (*compress_fn)(uint32_t state[8], const uint8_t* data, size_t nblocks);
+
+static compress_fn select_compress()
+{
+    uint32_t max_leaf, a, b, c, d;
+    cpuid(0, 0, max_leaf, b, c, d);
+    if (max_leaf < 7)
+        return compress_generic;
+
+    cpuid(1, 0, a, b, c, d);
+    const bool have_ssse3 = c & (1u << 9);
+    const bool have_sse41 = c & (1u << 19);
+
+    cpuid(7, 0, a, b, c, d);
+    const bool have_sha = b & (1u << 29);
+
+    return (have_sha && have_ssse3 && have_sse41) ? compress_shani : compress_generic;
+}
+
+static const compress_fn compress = select_compress();
+
+Sha256::Sha256()
+    : m_state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      m_buflen(0), m_total(0)
+{
+}
+
+void Sha256::update(const void* data, size_t size)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    m_total += size;
+
+    if (m_buflen > 0) {
+        size_t n = std::min(size, sizeof(m_buf) - m_buflen);
+        memcpy(m_buf + m_buflen, p, n);
+        m_buflen += n;
+        p += n;
+        size -= n;
+        if (m_buflen < sizeof(m_buf))
+            return;
+        compress(m_state, m_buf, 1);
+        m_buflen = 0;
+    }
+
+    // Process whole blocks straight from the caller's buffer.
+    if (size >= sizeof(m_buf)) {
+        size_t nblocks = size / sizeof(m_buf);
+        compress(m_state, p, nblocks);
+        p += nblocks * sizeof(m_buf);
+        size -= nblocks * sizeof(m_buf);
+    }
+
+    memcpy(m_buf, p, size);
+    m_buflen = size;
+}
+
+Sha256::Digest Sha256::finish()
+{
+    const uint64_t bits = m_total * 8;
+
+    m_buf[m_buflen++] = 0x80;
+    if (m_buflen > sizeof(m_buf) - 8) {
+        memset(m_buf + m_buflen, 0, sizeof(m_buf) - m_buflen);
+        compress(m_state, m_buf, 1);
+        m_buflen = 0;
+    }
+    memset(m_buf + m_buflen, 0, sizeof(m_buf) - 8 - m_buflen);
+    for (int i = 0; i < 8; i++)
+        m_buf[sizeof(m_buf) - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    compress(m_state, m_buf, 1);
+
+    Digest digest;
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = m_state[i] >> 24;
+        digest[4 * i + 1] = m_state[i] >> 16;
+        digest[4 * i + 2] = m_state[i] >> 8;
+        digest[4 * i + 3] = m_state[i];
+    }
+
+    return digest;
+}
+
+std::string Sha256::to_hex(const Digest& digest)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    std::string hex;
+    for (uint8_t byte : digest) {
+        hex += hexdigits[byte >> 4];
+        hex += hexdigits[byte & 0xf];
+    }
+    return hex;
+}
+
+bool Sha256::from_hex(const char* hex, Digest& digest)
+{
+    for (size_t i = 0; i < digest.size(); i++) {
+        uint8_t byte = 0;
+        for (int j = 0; j < 2; j++) {
+            char ch = *hex++;
+            byte <<= 4;
+            if (ch >= '0' && ch <= '9')
+                byte |= ch - '0';
+            else if (ch >= 'a' && ch <= 'f')
+                byte |= ch - 'a' + 10;
+            else if (ch >= 'A' && ch <= 'F')
+                byte |= ch - 'A' + 10;
+            else
+                return false;
+        }
+        digest[i] = byte;
+    }
+
+    return *hex == '\0' || *hex == ' ' || *hex == '\t';
+}
@@ -0,0 +1,32 @@
+#ifndef SHA256_H
+#define SHA256_H 1
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental SHA-256. Uses the SHA-NI extensions when the host CPU has them, and a portable
+// implementation otherwise.
+class Sha256
+{
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+    typedef std::array<uint8_t, DIGEST_SIZE> Digest;
+
+    Sha256();
+
+    void update(const void* data, size_t size);
+    Digest finish();
+
+    static std::string to_hex(const Digest& digest);
+    static bool from_hex(const char* hex, Digest& digest);
+
+private:
+    uint32_t m_state[8];
+    uint8_t m_buf[64];
+    size_t m_buflen;
+    uint64_t m_total;
+};
+
+#endif
@@ -0,0 +1,729 @@
+// slicebench: run the same workloads natively, in a VM and in a slice, and compare the results.
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <thread>
+
+#include "runslice.h"
+#include "slicebench.h"
+
+// A spec lists the configurations to compare (each a command that launches it, and the address of
+// the agent that will run inside it) and the workloads to run in each. The host connects to each
+// configuration's agent over TCP in turn, and runs every workload there repeat times, interleaved.
+// Results are appended to a results file as they arrive, along with the spec and details of the
+// host and each agent, so that a run can be reported on (and reproduced) later.
+
+static constexpr unsigned RESULTS_VERSION = 1;
+static constexpr unsigned CONNECT_RETRY_MS = 1000;
+static constexpr unsigned LAUNCH_EXIT_TIMEOUT_MS = 30000;
+static constexpr unsigned AUTH_TIMEOUT_MS = 10000;
+static constexpr double PROBE_SECONDS = 1.0;
+
+[[noreturn]] static void usage(const char* errmsg = nullptr)
+{
+    if (errmsg)
+        std::cerr << "Error: " << errmsg << std::endl;
+
+    std::cerr << "Usage: slicebench run SPEC [-o RESULTS] [-only NAME,...]" << std::endl
+        << "       slicebench report RESULTS..." << std::endl
+        << "       slicebench agent [-listen [ADDR:]PORT] [-token FILE]" << std::endl
+        << std::endl
+        << "  run             Launch each configuration in SPEC in turn, run its workloads, and" << std::endl
+        << "                  report on the results." << std::endl
+        << "  -o RESULTS      Append results to this file (default slicebench.results). Output" << std::endl
+        << "                  of each launch command goes to RESULTS.NAME.log." << std::endl
+        << "  -only NAME,...  Run only these configurations." << std::endl
+        << std::endl
+        << "  report          Summarise the results in one or more results files." << std::endl
+        << std::endl
+        << "  agent           Run workloads on behalf of slicebench run, until it says to quit." << std::endl
+        << "  -listen         Address and port to listen on (default 127.0.0.1:7070). Any address" << std::endl
+        << "                  but loopback needs -token, since the agent runs what it is sent." << std::endl
+        << "  -token FILE     Only serve hosts that give the token in the first line of FILE, as" << std::endl
+        << "                  slicebench run does with the spec's token." << std::endl;
+
+    exit(1);
+}
+
+//
+// The channel between slicebench run and an agent: text lines over TCP. The host sends one request
+// at a time ("exec COMMAND", "probe ARGS" or "quit [COMMAND]"), and the agent answers with any
+// number of "out LINE" and "metric NAME VALUE" lines, then "done STATUS". On connecting, the agent
+// first describes itself with "hello KEY VALUE...".
+//
+
+class LineChannel
+{
+public:
+    explicit LineChannel(int fd) : m_fd(fd) {}
+
+    bool send(const std::string& line)
+    {
+        const std::string data = line + "\n";
+        for (size_t done = 0; done < data.size();) {
+            const ssize_t n = write(m_fd, data.data() + done, data.size() - done);
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // Read a line, waiting up to timeout_ms (or forever if negative).
+    bool receive(std::string& line, int timeout_ms = -1)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        size_t newline;
+        while ((newline = m_buf.find('\n')) == std::string::npos) {
+            int wait = -1;
+            if (timeout_ms >= 0) {
+                wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (wait <= 0)
+                    return false;
+            }
+
+            pollfd pfd = { m_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, wait) <= 0)
+                return false;
+
+            char buf[4096];
+            const ssize_t n = read(m_fd, buf, sizeof(buf));
+            if (n <= 0)
+                return false;
+            m_buf.append(buf, n);
+        }
+
+        line = m_buf.substr(0, newline);
+        m_buf.erase(0, newline + 1);
+        return true;
+    }
+
+private:
+    AutoFd m_fd;
+    std::string m_buf;
+};
+
+static bool parse_address(const std::string& address, std::string& host, std::string& port)
+{
+    const size_t colon = address.rfind(':');
+    host = colon == std::string::npos ? "" : address.substr(0, colon);
+    port = colon == std::string::npos ? address : address.substr(colon + 1);
+    return !port.empty();
+}
+
+//
+// Agent side.
+//
+
+// Memory bandwidth: each thread repeatedly copies one half of its own buffer to the other, and
+// we count bytes read and written, as STREAM's copy kernel does.
+static double probe_membw(size_t size, unsigned threads)
+{
+    std::vector<double> rates(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            const size_t half = size / threads / 2;
+            std::vector<char> buf(half * 2, 1);
+            uint64_t bytes = 0;
+            const auto start = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed;
+            bool forward = true;
+            do {
+                memcpy(buf.data() + (forward ? half : 0), buf.data() + (forward ? 0 : half), half);
+                forward = !forward;
+                bytes += half * 2;
+                elapsed = std::chrono::steady_clock::now() - start;
+            } while (elapsed.count() < PROBE_SECONDS);
+            volatile char sink = buf[half];
+            (void)sink;
+            rates[t] = bytes / elapsed.count() / 1e6;
+        });
+    }
+    for (std::thread& worker : workers)
+        worker.join();
+    return std::accumulate(rates.begin(), rates.end(), 0.0);
+}
+
+// Memory latency: chase pointers around a random cycle through the buffer's cache lines. The
+// cycle is seeded, so it is the same on every configuration.
+static double probe_memlat(size_t size)
+{
+    constexpr size_t LINE = 64;
+    const size_t lines = std::max<size_t>(size / LINE, 2);
+    std::vector<size_t> next(lines * (LINE / sizeof(size_t)));
+    std::vector<size_t> order(lines);
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937_64 rng(1);
+    for (size_t i = lines - 1; i > 0; i--)  // Sattolo's algorithm gives a single cycle
+        std::swap(order[i], order[std::uniform_int_distribution<size_t>(0, i - 1)(rng)]);
+    for (size_t i = 0; i < lines; i++)
+        next[order[i] * (LINE / sizeof(size_t))] = order[(i + 1) % lines] * (LINE / sizeof(size_t));
+
+    const size_t loads = std::max<size_t>(lines * 4, 1 << 24);
+    size_t p = 0;
+    for (size_t i = 0; i < lines; i++)  // warm the TLB and caches
+        p = next[p];
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loads; i++)
+        p = next[p];
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    volatile size_t sink = p;
+    (void)sink;
+    return elapsed.count() / loads;
+}
+
+static bool parse_size(const std::string& s, size_t& size)
+{
+    char* end;
+    size = strtoull(s.c_str(), &end, 0);
+    switch (*end) {
+    case 'G': size <<= 10; [[fallthrough]];
+    case 'M': size <<= 10; [[fallthrough]];
+    case 'K': size <<= 10; end++; break;
+    }
+    return !s.empty() && *end == '\0' && size != 0;
+}
+
+static bool agent_probe(LineChannel& channel, const std::string& args)
+{
+    std::istringstream in(args);
+    std::string kind, size_arg;
+    unsigned threads = 1;
+    size_t size;
+    in >> kind >> size_arg;
+    if (!(in >> threads))
+        threads = 1;
+
+    if (!parse_size(size_arg, size) || threads == 0) {
+        channel.send("out invalid probe size or thread count");
+        return channel.send("done 1");
+    }
+
+    char metric[64];
+    if (kind == "membw") {
+        snprintf(metric, sizeof(metric), "metric copy_mbps %.1f", probe_membw(size, threads));
+    } else if (kind == "memlat") {
+        snprintf(metric, sizeof(metric), "metric latency_ns %.2f", probe_memlat(size));
+    } else {
+        channel.send("out unknown probe " + kind);
+        return channel.send("done 1");
+    }
+    return channel.send(metric) && channel.send("done 0");
+}
+
+static bool agent_exec(LineChannel& channel, const std::string& command)
+{
+    FILE* pipe = popen((command + " 2>&1").c_str(), "r");
+    if (pipe == nullptr)
+        return channel.send("out failed to run command") && channel.send("done 127");
+
+    char buf[4096];
+    bool ok = true;
+    while (fgets(buf, sizeof(buf), pipe)) {
+        std::string line = buf;
+        if (!line.empty() && line.back() == '\n')
+            line.pop_back();
+        ok = ok && channel.send("out " + line);
+    }
+
+    const int status = pclose(pipe);
+    return ok && channel.send("done " + std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : 128));
+}
+
+static std::string agent_hello()
+{
+    utsname uts;
+    uname(&uts);
+    long mem_kb = 0;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    while (meminfo >> key && key != "MemTotal:")
+        meminfo.ignore(256, '\n');
+    meminfo >> mem_kb;
+    return std::string("hello host ") + uts.nodename + " cpus " + std::to_string(sysconf(_SC_NPROCESSORS_ONLN))
+        + " mem_kb " + std::to_string(mem_kb) + " kernel " + uts.release;
+}
+
+static bool is_loopback(const sockaddr* addr)
+{
+    if (addr->sa_family == AF_INET)
+        return ntohl(reinterpret_cast<const sockaddr_in*>(addr)->sin_addr.s_addr) >> 24 == 127;
+    if (addr->sa_family == AF_INET6)
+        return IN6_IS_ADDR_LOOPBACK(&reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr);
+    return false;
+}
+
+// Serve one host at a time, until one says to quit. With a token, a host must send "auth TOKEN"
+// first, and is only then greeted.
+static int agent(int argc, const char* argv[])
+{
+    std::string address = "127.0.0.1:7070";
+    std::string token;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-listen") == 0) {
+            if (++i >= argc)
+                usage();
+            address = argv[i];
+        } else if (strcmp(argv[i], "-token") == 0) {
+            if (++i >= argc)
+                usage();
+            if (!read_token(argv[i], token)) {
+                fprintf(stderr, "Error: failed to read token from %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage("Unrecognised option");
+        }
+    }
+
+    std::string host, port;
+    addrinfo hints = {}, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (!parse_address(address, host, port)
+        || getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &ai) != 0) {
+        fprintf(stderr, "Error: invalid listen address %s\n", address.c_str());
+        return 1;
+    }
+
+    if (token.empty() && !is_loopback(ai->ai_addr)) {
+        fprintf(stderr, "Error: listening on %s needs -token\n", address.c_str());
+        freeaddrinfo(ai);
+        return 1;
+    }
+
+    AutoFd listener = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    const int one = 1;
+    if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+        || bind(listener, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listener, 1) != 0) {
+        perror("Failed to listen");
+        freeaddrinfo(ai);
+        return 1;
+    }
+    freeaddrinfo(ai);
+
+    printf("slicebench agent listening on %s\n", address.c_str());
+    fflush(stdout);
+
+    for (;;) {
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            perror("Failed to accept connection");
+            return 1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        LineChannel channel(fd);
+        std::string request;
+        bool ok = true;
+        if (!token.empty() && (!channel.receive(request, AUTH_TIMEOUT_MS) || request != "auth " + token)) {
+            fprintf(stderr, "Warning: rejected a host without the token\n");
+            channel.send("error authentication failed");
+            ok = false;
+        }
+        ok = ok && channel.send(agent_hello());
+        while (ok && channel.receive(request)) {
+            const size_t space = request.find(' ');
+            const std::string verb = request.substr(0, space);
+            const std::string args = space == std::string::npos ? "" : request.substr(space + 1);
+            if (verb == "auth") {
+                // Not needed without a token.
+            } else if (verb == "exec") {
+                ok = agent_exec(channel, args);
+            } else if (verb == "probe") {
+                ok = agent_probe(channel, args);
+            } else if (verb == "quit") {
+                channel.send("done 0");
+                if (!args.empty() && system(args.c_str()) != 0)
+                    fprintf(stderr, "Warning: %s failed\n", args.c_str());
+                return 0;
+            } else {
+                ok = channel.send("out unknown request") && channel.send("done 1");
+            }
+        }
+    }
+}
+
+//
+// Host side.
+//
+
+// Run a host command in its own process group, with its output going to a log file.
+static pid_t start_command(const std::string& command, const std::string& log_path)
+{
+    const pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        const int log = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        const int null = open("/dev/null", O_RDONLY);
+        if (log >= 0 && null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+        }
+        execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+        _exit(127);
+    }
+    if (pid < 0)
+        perror("Failed to start command");
+    return pid;
+}
+
+// Wait for a command to exit, killing it (and everything it started) after timeout_ms.
+static int finish_command(pid_t pid, unsigned timeout_ms)
+{
+    int status = 0;
+    for (unsigned waited = 0; waitpid(pid, &status, WNOHANG) == 0; waited += 100) {
+        if (waited >= timeout_ms) {
+            kill(-pid, SIGTERM);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        usleep(100000);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+// Connect to an agent, retrying while the configuration boots (and its launch command runs).
+static int connect_agent(const std::string& address, pid_t launch, unsigned timeout_s, bool& launch_exited)
+{
+    std::string host, port;
+    addrinfo hints = {}, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (!parse_address(address, host, port) || host.empty()
+        || getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) != 0) {
+        fprintf(stderr, "Error: invalid agent address %s\n", address.c_str());
+        return -1;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_s);
+    int fd = -1;
+    while (fd < 0 && std::chrono::steady_clock::now() < deadline) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+
+        int status;
+        if (fd < 0 && !launch_exited && waitpid(launch, &status, WNOHANG) == launch) {
+            launch_exited = true;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Error: launch command failed\n");
+                break;
+            }
+        }
+        if (fd < 0)
+            usleep(CONNECT_RETRY_MS * 1000);
+    }
+    freeaddrinfo(ai);
+
+    if (fd < 0)
+        fprintf(stderr, "Error: could not connect to agent at %s\n", address.c_str());
+    return fd;
+}
+
+// Send a request, and collect its output and metrics.
+static bool agent_request(LineChannel& channel, const std::string& request, unsigned timeout_s,
+                          std::string& output, std::vector<std::pair<std::string, double>>& metrics, int& status)
+{
+    if (!channel.send(request))
+        return false;
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_s);
+    std::string line;
+    for (;;) {
+        const int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0 || !channel.receive(line, remaining))
+            return false;
+
+        if (line.compare(0, 4, "out ") == 0) {
+            output += line.substr(4) + "\n";
+        } else if (line.compare(0, 7, "metric ") == 0) {
+            std::istringstream in(line.substr(7));
+            std::string name;
+            double value;
+            if (in >> name >> value)
+                metrics.push_back({ name, value });
+        } else if (line.compare(0, 5, "done ") == 0) {
+            status = atoi(line.c_str() + 5);
+            return true;
+        }
+    }
+}
+
+static std::string timestamp()
+{
+    char buf[32];
+    const time_t now = time(nullptr);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    return buf;
+}
+
+static void report(const std::vector<std::string>& paths);
+
+// Run every workload in one configuration. Returns false if the configuration itself failed.
+static bool run_config(const Spec& spec, const BenchConfig& config, const std::string& results_path,
+                       std::ofstream& results)
+{
+    printf("Launching %s\n", config.name.c_str());
+    fflush(stdout);
+    const std::string log_path = results_path + "." + config.name + ".log";
+    const pid_t launch = start_command(expand(spec, config, config.launch), log_path);
+    if (launch < 0)
+        return false;
+
+    bool launch_exited = false;
+    const int fd = connect_agent(expand(spec, config, config.agent), launch, spec.boot_timeout, launch_exited);
+    bool ok = fd >= 0;
+    std::string hello;
+    LineChannel channel(fd);
+    if (ok && !spec.token.empty() && !channel.send("auth " + spec.token))
+        ok = false;
+    if (ok && (!channel.receive(hello, spec.timeout * 1000) || hello.compare(0, 6, "hello ") != 0)) {
+        fprintf(stderr, "Error: no response from %s agent%s%s\n", config.name.c_str(), hello.empty() ? "" : ": ",
+                hello.c_str());
+        ok = false;
+    }
+
+    if (ok) {
+        results << "agent " << config.name << " " << hello.substr(6) << std::endl;
+        printf("Connected to %s agent: %s\n", config.name.c_str(), hello.substr(6).c_str());
+
+        // The configurations should differ only in how they are run.
+        std::istringstream in(hello.substr(6));
+        std::string key, value;
+        while (in >> key >> value) {
+            if (key == "cpus" && value != std::to_string(spec.cpus))
+                fprintf(stderr, "Warning: %s has %s CPUs online, not %u\n", config.name.c_str(), value.c_str(), spec.cpus);
+        }
+    }
+
+    // Interleave the workloads, so that any drift over the run affects them all alike.
+    for (int run = -static_cast<int>(spec.warmup); ok && run < static_cast<int>(spec.repeat); run++) {
+        for (const Workload& workload : spec.workloads) {
+            const bool warmup = run < 0;
+            printf("%s %s %s %d\n", config.name.c_str(), workload.name.c_str(), warmup ? "warmup" : "run", warmup ? run + static_cast<int>(spec.warmup) + 1 : run + 1);
+            fflush(stdout);
+
+            std::string output;
+            std::vector<std::pair<std::string, double>> metrics;
+            int status;
+            const std::string request = workload.run.empty() ? "probe " + expand(spec, config, workload.probe)
+                : "exec " + expand(spec, config, workload.run);
+            if (!agent_request(channel, request, spec.timeout, output, metrics, status)) {
+                fprintf(stderr, "Error: %s %s timed out or lost its agent\n", config.name.c_str(), workload.name.c_str());
+                ok = false;
+                break;
+            }
+
+            std::string error;
+            if (status != 0)
+                error = "exit status " + std::to_string(status);
+            for (const BenchMetric& metric : workload.metrics) {
+                std::smatch match;
+                if (std::regex_search(output, match, metric.regex))
+                    metrics.push_back({ metric.name, strtod(match[1].str().c_str(), nullptr) });
+                else if (error.empty())
+                    error = "no match for " + metric.name;
+            }
+
+            if (!error.empty()) {
+                fprintf(stderr, "Error: %s %s failed (%s):\n%s", config.name.c_str(), workload.name.c_str(),
+                        error.c_str(), output.c_str());
+                if (!warmup)
+                    results << "error " << config.name << " " << workload.name << " " << run + 1 << " " << error << std::endl;
+            } else if (!warmup) {
+                for (const auto& [name, value] : metrics) {
+                    results << "result " << config.name << " " << workload.name << " " << name << " " << run + 1
+                            << " " << value << std::endl;
+                }
+            }
+        }
+    }
+
+    if (fd >= 0) {
+        std::string output;
+        std::vector<std::pair<std::string, double>> metrics;
+        int status;
+        const std::string shutdown = expand(spec, config, config.shutdown);
+        agent_request(channel, shutdown.empty() ? "quit" : "quit " + shutdown, 10, output, metrics, status);
+    }
+
+    if (!launch_exited)
+        finish_command(launch, LAUNCH_EXIT_TIMEOUT_MS);
+    if (!config.stop.empty()) {
+        const pid_t stop = start_command(expand(spec, config, config.stop), log_path);
+        if (stop < 0 || finish_command(stop, LAUNCH_EXIT_TIMEOUT_MS) != 0) {
+            fprintf(stderr, "Error: stop command for %s failed\n", config.name.c_str());
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static int run(int argc, const char* argv[])
+{
+    if (argc < 1)
+        usage("Spec path is required");
+
+    const char* spec_path = argv[0];
+    std::string results_path = "slicebench.results";
+    std::vector<std::string> only;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (++i >= argc)
+                usage();
+            results_path = argv[i];
+        } else if (strcmp(argv[i], "-only") == 0) {
+            if (++i >= argc)
+                usage();
+            std::istringstream names(argv[i]);
+            for (std::string name; std::getline(names, name, ',');)
+                only.push_back(name);
+        } else {
+            usage("Unrecognised option");
+        }
+    }
+
+    Spec spec;
+    if (!read_spec(spec_path, spec))
+        return 1;
+
+    for (const std::string& name : only) {
+        if (std::none_of(spec.configs.begin(), spec.configs.end(), [&](const BenchConfig& c) { return c.name == name; })) {
+            fprintf(stderr, "Error: no config %s in %s\n", name.c_str(), spec_path);
+            return 1;
+        }
+    }
+
+    std::ofstream results(results_path, std::ios::app);
+    if (!results.is_open()) {
+        perror("Failed to open results file");
+        return 1;
+    }
+
+    results.precision(12);
+
+    // Record enough to reproduce the run: the host, and the spec itself.
+    utsname uts;
+    uname(&uts);
+    results << "slicebench " << RESULTS_VERSION << std::endl
+            << "date " << timestamp() << std::endl
+            << "host " << uts.nodename << " " << uts.release << " " << uts.machine << std::endl;
+    for (const std::string& line : spec.lines)
+        results << "spec " << line << std::endl;
+
+    // An agent exiting early must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    bool ok = true;
+    for (const BenchConfig& config : spec.configs) {
+        if (only.empty() || std::find(only.begin(), only.end(), config.name) != only.end())
+            ok = run_config(spec, config, results_path, results) && ok;
+    }
+    results.close();
+
+    report({ results_path });
+    return ok ? 0 : 1;
+}
+
+//
+// Reports: for each workload and metric, summary statistics for each configuration, relative to
+// the first.
+//
+
+static void report(const std::vector<std::string>& paths)
+{
+    BenchResults results;
+    read_results(paths, results);
+    const auto& [configs, keys, values, errors] = results;
+
+    if (keys.empty() && errors.empty()) {
+        printf("No results\n");
+        return;
+    }
+
+    for (const auto& key : keys) {
+        const auto& [workload, metric] = key;
+        const auto& by_config = values.at(key);
+        const auto baseline = std::find_if(configs.begin(), configs.end(),
+                                           [&](const std::string& c) { return by_config.count(c); });
+
+        printf("\n%s %s (ratio of means to %s)\n", workload.c_str(), metric.c_str(), baseline->c_str());
+        printf("  %-12s %4s %12s %10s %6s %12s %12s %12s %8s\n", "config", "n", "mean", "95% CI", "cv%",
+               "median", "min", "max", "ratio");
+
+        const Summary base = summarise(by_config.at(*baseline), 0);
+        for (const std::string& config : configs) {
+            const auto it = by_config.find(config);
+            const auto failed = errors.find({ config, workload });
+            const Summary s = summarise(it == by_config.end() ? std::vector<double>() : it->second,
+                                        failed == errors.end() ? 0 : failed->second);
+            if (s.n == 0 && s.errors == 0)
+                continue;
+
+            printf("  %-12s %4zu %12.6g %10.3g %6.1f %12.6g %12.6g %12.6g %8.3f", config.c_str(), s.n, s.mean,
+                   s.ci95, s.mean != 0 ? 100 * s.sd / s.mean : 0.0, s.median, s.min, s.max,
+                   base.mean != 0 ? s.mean / base.mean : NAN);
+            if (s.errors)
+                printf("  (%zu failed)", s.errors);
+            printf("\n");
+        }
+    }
+
+    // Workloads that never succeeded have no metrics to show.
+    for (const auto& [failed, count] : errors) {
+        const auto& [config, workload] = failed;
+        if (std::none_of(keys.begin(), keys.end(), [&](const auto& key) { return key.first == workload; }))
+            printf("\n%s: no results (%zu failed in %s)\n", workload.c_str(), count, config.c_str());
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+        usage();
+
+    if (strcmp(argv[1], "run") == 0) {
+        return run(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "report") == 0) {
+        if (argc < 3)
+            usage("Results path is required");
+        report(std::vector<std::string>(argv + 2, argv + argc));
+        return 0;
+    } else if (strcmp(argv[1], "agent") == 0) {
+        return agent(argc - 2, argv + 2);
+    } else {
+        usage("Unrecognised command");
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef SLICEBENCH_H
+#define SLICEBENCH_H 1
+
+#include <cstddef>
+#include <map>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Spec files and results for slicebench (see slicebench.cpp), kept apart from the tool itself so
+// that they can be tested.
+
+//
+// Spec files. Each line is a keyword and its arguments; commands and patterns take the rest of
+// the line. Commands may refer to {cpus}, {mem}, {vf}, {config}, {self} (this executable), and
+// any variable defined with "set".
+//
+
+struct BenchConfig
+{
+    std::string name;
+    std::string launch;     // host command that starts the configuration
+    std::string agent;      // HOST:PORT of its agent
+    std::string shutdown;   // run by the agent as it quits, e.g. poweroff
+    std::string stop;       // host command run after the agent quits
+};
+
+struct BenchMetric
+{
+    std::string name;
+    std::string pattern;
+    std::regex regex;       // first capture is the value
+};
+
+struct Workload
+{
+    std::string name;
+    std::string run;        // command run by the agent, or
+    std::string probe;      // a built-in probe ("membw SIZE [THREADS]" or "memlat SIZE")
+    std::vector<BenchMetric> metrics;
+};
+
+struct Spec
+{
+    unsigned cpus = 0, mem_gb = 0, vf = 0;
+    unsigned repeat = 5, warmup = 1;
+    unsigned timeout = 600, boot_timeout = 600;     // seconds
+    std::string token;      // shared with the agents, read from the file named by "token"
+    std::map<std::string, std::string> vars;
+    std::vector<BenchConfig> configs;
+    std::vector<Workload> workloads;
+    std::vector<std::string> lines;
+};
+
+std::string trim(const std::string& s);
+
+bool read_token(const std::string& path, std::string& token);
+
+bool read_spec(const char* path, Spec& spec);
+
+std::string expand(const Spec& spec, const BenchConfig& config, const std::string& command);
+
+//
+// Results files: "result CONFIG WORKLOAD METRIC RUN VALUE" and "error CONFIG WORKLOAD RUN REASON"
+// lines, among others that describe the run.
+//
+
+struct BenchResults
+{
+    // Configurations, and (workload, metric) pairs, in the order they were run.
+    std::vector<std::string> configs;
+    std::vector<std::pair<std::string, std::string>> keys;
+    std::map<std::pair<std::string, std::string>, std::map<std::string, std::vector<double>>> values;
+    std::map<std::pair<std::string, std::string>, size_t> errors;     // by (config, workload)
+};
+
+bool read_results(const std::vector<std::string>& paths, BenchResults& results);
+
+struct Summary
+{
+    size_t n, errors;
+    double mean, sd, ci95, median, min, max;
+};
+
+double t_critical(size_t df);
+
+Summary summarise(std::vector<double> values, size_t errors);
+
+#endif
@@ -0,0 +1,385 @@
+// slicebundle: pack a kernel, initrd and ACPI tables into a boot bundle for runslice -bundle.
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+#include "runslice.h"
+
+static constexpr size_t CHUNK_SIZE = 0x100000;
+
+[[noreturn]] static void usage(const char* errmsg = nullptr)
+{
+    if (errmsg)
+        std::cerr << "Error: " << errmsg << std::endl;
+
+    std::cerr << "Usage: slicebundle create BUNDLE -kernel PATH [-initrd PATH] [-dsdt FILE] [-ssdt FILE]..." << std::endl
+        << "                          [-cmdline CMD]" << std::endl
+        << "       slicebundle info BUNDLE [-verify]" << std::endl
+        << std::endl
+        << "  create          Build a bundle from a Linux bzImage and the other boot files." << std::endl
+        << "  -kernel PATH    Kernel bzImage (must be relocatable and 64-bit). Required." << std::endl
+        << "  -initrd PATH    RAM disk image." << std::endl
+        << "  -dsdt FILE      ACPI DSDT AML file." << std::endl
+        << "  -ssdt FILE      Additional ACPI SSDT AML file. May be repeated." << std::endl
+        << "  -cmdline CMD    Base kernel command line (runslice appends its -cmdline)." << std::endl
+        << std::endl
+        << "  info            Print a bundle's layout and section digests." << std::endl
+        << "  -verify         Also check each section against its digest." << std::endl;
+
+    exit(1);
+}
+
+static bool file_size(const char* path, uint64_t& size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size = st.st_size;
+    return true;
+}
+
+// Copy size bytes from path (at src_offset) to the bundle (at dst_offset), hashing as we go.
+static bool copy_section(int out, const char* path, uint64_t src_offset, uint64_t size, uint64_t dst_offset, std::vector<Sha256*> hashes)
+{
+    AutoFd in = open(path, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    std::vector<char> buf(CHUNK_SIZE);
+    for (uint64_t done = 0; done < size; ) {
+        const size_t chunk = std::min<uint64_t>(size - done, CHUNK_SIZE);
+        if (pread(in, buf.data(), chunk, src_offset + done) != static_cast<ssize_t>(chunk)) {
+            fprintf(stderr, "Failed to read %s\n", path);
+            return false;
+        }
+        if (pwrite(out, buf.data(), chunk, dst_offset + done) != static_cast<ssize_t>(chunk)) {
+            perror("Failed to write bundle");
+            return false;
+        }
+        for (Sha256* hash : hashes)
+            hash->update(buf.data(), chunk);
+        done += chunk;
+    }
+
+    return true;
+}
+
+// The same checks load_linux() makes at launch, made once here instead.
+static bool read_kernel_header(const char* path, uint64_t file_size, setup_header& header, size_t& setup_size, std::string& version)
+{
+    static constexpr size_t header_offset = offsetof(boot_params, hdr);
+
+    AutoFd fd = open(path, O_RDONLY);
+    if (fd < 0 || file_size < header_offset + sizeof(header)
+        || pread(fd, &header, sizeof(header), header_offset) != sizeof(header)) {
+        std::cerr << "Failed to read kernel image header" << std::endl;
+        return false;
+    }
+
+    if (header.header != 0x53726448 || header.version < 0x20c || header.setup_sects == 0) {
+        std::cerr << "Invalid or too old kernel image" << std::endl;
+        return false;
+    }
+
+    if (!header.relocatable_kernel ||
+        !(header.xloadflags & (XLF_KERNEL_64 | XLF_CAN_BE_LOADED_ABOVE_4G))) {
+        std::cerr << "Kernel image is not relocatable" << std::endl;
+        return false;
+    }
+
+    setup_size = 512 * (header.setup_sects + 1);
+    if (setup_size >= file_size) {
+        std::cerr << "Invalid kernel image (file has been truncated)" << std::endl;
+        return false;
+    }
+
+    // The version is only needed to generate initrds (runslice -modules).
+    char buf[256] = {};
+    if (header.kernel_version == 0 || pread(fd, buf, sizeof(buf) - 1, header.kernel_version + 0x200) <= 0)
+        std::cerr << "Warning: kernel version not found; the bundle can't be used with -modules" << std::endl;
+    version.assign(buf, strcspn(buf, " "));
+
+    return true;
+}
+
+static bool check_acpi_table(const char* path, const char* signature)
+{
+    AutoFd fd = open(path, O_RDONLY);
+    uint64_t size;
+    if (fd < 0 || !file_size(path, size))
+        return false;
+
+    std::vector<uint8_t> table(size);
+    uint32_t length = 0;
+    if (size >= 36 && pread(fd, table.data(), size, 0) == static_cast<ssize_t>(size))
+        memcpy(&length, &table[4], sizeof(length));
+
+    uint8_t sum = 0;
+    for (uint8_t b : table)
+        sum += b;
+
+    if (size < 36 || memcmp(table.data(), signature, 4) != 0 || length != size || sum != 0) {
+        fprintf(stderr, "%s is not a valid %s table\n", path, signature);
+        return false;
+    }
+
+    return true;
+}
+
+static int create(int argc, const char* argv[])
+{
+    if (argc < 1)
+        usage("Bundle path is required");
+
+    const char* bundle_path = argv[0];
+    const char* kernel_path = nullptr;
+    const char* initrd_path = nullptr;
+    const char* dsdt_path = nullptr;
+    const char* cmdline = "";
+    std::vector<const char*> ssdt_paths;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-kernel") == 0) {
+            if (++i >= argc)
+                usage();
+            kernel_path = argv[i];
+        } else if (strcmp(argv[i], "-initrd") == 0) {
+            if (++i >= argc)
+                usage();
+            initrd_path = argv[i];
+        } else if (strcmp(argv[i], "-dsdt") == 0) {
+            if (++i >= argc)
+                usage();
+            dsdt_path = argv[i];
+        } else if (strcmp(argv[i], "-ssdt") == 0) {
+            if (++i >= argc)
+                usage();
+            ssdt_paths.push_back(argv[i]);
+        } else if (strcmp(argv[i], "-cmdline") == 0) {
+            if (++i >= argc)
+                usage();
+            cmdline = argv[i];
+        } else {
+            usage("Unrecognised option");
+        }
+    }
+
+    if (kernel_path == nullptr)
+        usage("Kernel image path is required");
+    if (strlen(cmdline) >= BUNDLE_CMDLINE_SIZE)
+        usage("Command line is too long");
+    if (ssdt_paths.size() + 4 > BUNDLE_MAX_SECTIONS)
+        usage("Too many SSDTs");
+
+    std::unique_ptr<bundle_header> header(new bundle_header());
+    memcpy(header->magic, BUNDLE_MAGIC, sizeof(header->magic));
+    header->version = BUNDLE_VERSION;
+    strcpy(header->cmdline, cmdline);
+
+    uint64_t kernel_size;
+    size_t setup_size;
+    std::string version;
+    if (!file_size(kernel_path, kernel_size)
+        || !read_kernel_header(kernel_path, kernel_size, header->setup, setup_size, version))
+        return 1;
+
+    if (version.size() >= sizeof(header->kernel_version)) {
+        std::cerr << "Kernel version is too long" << std::endl;
+        return 1;
+    }
+    strcpy(header->kernel_version, version.c_str());
+
+    // Lay out the sections, in the file and in slice memory.
+    struct Input
+    {
+        uint32_t type;
+        const char* path;
+        uint64_t offset;
+        uint64_t size;      // 0: to the end of the file
+    };
+    std::vector<Input> inputs = {
+        { BUNDLE_SETUP, kernel_path, 0, setup_size },
+        { BUNDLE_KERNEL, kernel_path, setup_size, 0 },
+    };
+    if (dsdt_path)
+        inputs.push_back({ BUNDLE_DSDT, dsdt_path, 0, 0 });
+    for (const char* path : ssdt_paths)
+        inputs.push_back({ BUNDLE_SSDT, path, 0, 0 });
+    if (initrd_path)
+        inputs.push_back({ BUNDLE_INITRD, initrd_path, 0, 0 });
+
+    if (dsdt_path && !check_acpi_table(dsdt_path, "DSDT"))
+        return 1;
+    for (const char* path : ssdt_paths)
+        if (!check_acpi_table(path, "SSDT"))
+            return 1;
+
+    header->boot_area_offset = ALIGN_UP(header->setup.init_size, 0x1000);
+    uint64_t file_offset = BUNDLE_ALIGN;
+    uint64_t table_offset = header->boot_area_offset + sizeof(boot_params);
+
+    for (const Input& input : inputs) {
+        bundle_section& section = header->sections[header->section_count++];
+        section.type = input.type;
+        section.file_offset = file_offset;
+
+        uint64_t size;
+        if (!file_size(input.path, size))
+            return 1;
+        section.size = input.size ? input.size : size - input.offset;
+
+        if (input.type == BUNDLE_SETUP) {
+            section.load_offset = BUNDLE_NOT_LOADED;
+        } else if (input.type == BUNDLE_KERNEL) {
+            section.load_offset = 0;
+        } else if (input.type == BUNDLE_DSDT || input.type == BUNDLE_SSDT) {
+            section.load_offset = table_offset;
+            table_offset = ALIGN_UP(table_offset + section.size, 8);
+        } else if (input.type == BUNDLE_INITRD) {
+            header->boot_area_size = ALIGN_UP(table_offset - header->boot_area_offset + BUNDLE_BOOT_SLACK, 0x1000);
+            section.load_offset = header->boot_area_offset + header->boot_area_size;
+        }
+
+        file_offset += ALIGN_UP(section.size, BUNDLE_ALIGN);
+    }
+
+    if (header->boot_area_size == 0)
+        header->boot_area_size = ALIGN_UP(table_offset - header->boot_area_offset + BUNDLE_BOOT_SLACK, 0x1000);
+
+    AutoFd out = open(bundle_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Failed to create bundle");
+        return 1;
+    }
+
+    Sha256 kernel_hash;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        bundle_section& section = header->sections[i];
+        Sha256 hash;
+        std::vector<Sha256*> hashes = { section.type == BUNDLE_KERNEL ? &kernel_hash : &hash };
+        if (section.type == BUNDLE_SETUP)
+            hashes.push_back(&kernel_hash);
+
+        if (!copy_section(out, inputs[i].path, inputs[i].offset, section.size, section.file_offset, hashes))
+            return 1;
+
+        const Sha256::Digest digest = hashes[0]->finish();
+        memcpy(section.sha256, digest.data(), digest.size());
+    }
+
+    // Pad the file to a whole page, so that the last section can be read with O_DIRECT.
+    if (pwrite(out, header.get(), sizeof(*header), 0) != sizeof(*header)
+        || ftruncate(out, file_offset) != 0) {
+        perror("Failed to write bundle");
+        return 1;
+    }
+
+    printf("Created %s: Linux %s, %u sections, %lu bytes\n", bundle_path,
+        header->kernel_version[0] ? header->kernel_version : "(unknown version)",
+        header->section_count, file_offset);
+
+    return 0;
+}
+
+static int info(int argc, const char* argv[])
+{
+    if (argc < 1)
+        usage("Bundle path is required");
+
+    const char* bundle_path = argv[0];
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-verify") == 0)
+            verify = true;
+        else
+            usage("Unrecognised option");
+    }
+
+    AutoFd fd = open(bundle_path, O_RDONLY);
+    std::unique_ptr<bundle_header> header(new bundle_header());
+    if (fd < 0 || pread(fd, header.get(), sizeof(*header), 0) != sizeof(*header)) {
+        perror("Failed to read bundle");
+        return 1;
+    }
+
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BUNDLE_VERSION
+        || header->section_count > BUNDLE_MAX_SECTIONS) {
+        std::cerr << "Invalid or unsupported bundle" << std::endl;
+        return 1;
+    }
+    header->cmdline[BUNDLE_CMDLINE_SIZE - 1] = '\0';
+    header->kernel_version[sizeof(header->kernel_version) - 1] = '\0';
+
+    printf("Bundle version %u\n", header->version);
+    printf("Kernel:       Linux %s (boot protocol %u.%02u)\n",
+        header->kernel_version[0] ? header->kernel_version : "(unknown version)",
+        header->setup.version >> 8, header->setup.version & 0xff);
+    printf("Alignment:    0x%x\n", header->setup.kernel_alignment);
+    printf("Boot area:    +0x%lx, 0x%lx bytes\n", header->boot_area_offset, header->boot_area_size);
+    printf("Command line: %s\n", header->cmdline);
+    printf("\n%-8s %12s %12s %12s  %s\n", "Section", "File offset", "Size", "Load offset", "SHA-256");
+
+    bool ok = true;
+    Sha256 kernel_hash;
+    std::vector<char> buf(CHUNK_SIZE);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        const bundle_section& section = header->sections[i];
+        const Sha256::Digest* expected = reinterpret_cast<const Sha256::Digest*>(section.sha256);
+        char load[32] = "-";
+        if (section.load_offset != BUNDLE_NOT_LOADED)
+            snprintf(load, sizeof(load), "%#lx", section.load_offset);
+
+        printf("%-8s %#12lx %#12lx %12s  %s", bundle_section_name(section.type), section.file_offset,
+            section.size, load, Sha256::to_hex(*expected).c_str());
+
+        if (verify) {
+            Sha256 section_hash;
+            Sha256& hash = section.type == BUNDLE_KERNEL ? kernel_hash : section_hash;
+            bool read_ok = true;
+            for (uint64_t done = 0; done < section.size && read_ok; ) {
+                const size_t chunk = std::min<uint64_t>(section.size - done, CHUNK_SIZE);
+                read_ok = pread(fd, buf.data(), chunk, section.file_offset + done) == static_cast<ssize_t>(chunk);
+                hash.update(buf.data(), chunk);
+                if (section.type == BUNDLE_SETUP)
+                    kernel_hash.update(buf.data(), chunk);
+                done += chunk;
+            }
+
+            const bool match = read_ok && hash.finish() == *expected;
+            printf("  %s", match ? "ok" : "MISMATCH");
+            ok = ok && match;
+        }
+
+        printf("\n");
+    }
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+        usage();
+
+    if (strcmp(argv[1], "create") == 0)
+        return create(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "info") == 0)
+        return info(argc - 2, argv + 2);
+    else
+        usage("Unrecognised command");
+}
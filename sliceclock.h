@@ -0,0 +1,83 @@
+#ifndef SLICECLOCK_H
+#define SLICECLOCK_H 1
+
+#include <x86intrin.h>
+#include <cstdint>
+
+// The shared clock page: a page of host memory, outside every slice's RAM, that runslice -clockd
+// keeps up to date with the parameters for converting the (invariant, machine-wide) TSC to
+// CLOCK_REALTIME. Every slice launched with -clock reads the same page, so their timestamps agree
+// to within the TSC's skew between CPUs. The page is reserved in each slice's E820 map, and its
+// address passed in a SETUP_SLICE_CLOCK setup_data node (as a slice_clock_info), which Linux
+// guests expose under /sys/kernel/boot_params/setup_data. Guests map it from /dev/mem.
+//
+// As with kvmclock, the fields are protected by a sequence count: the host makes seq odd while
+// it updates them, so a reader retries if seq was odd or changed while it read.
+
+constexpr char SLICE_CLOCK_MAGIC[8] = { 'S', 'L', 'C', 'L', 'O', 'C', 'K', 0 };
+constexpr uint32_t SLICE_CLOCK_VERSION = 1;
+constexpr uint64_t SLICE_CLOCK_PAGE_SIZE = 0x1000;
+
+constexpr uint8_t SLICE_CLOCK_TSC_STABLE = 1 << 0;    // the TSC is invariant
+
+struct slice_clock
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t seq;
+    uint64_t tsc_timestamp;     // TSC at the last update
+    uint64_t realtime_ns;       // CLOCK_REALTIME at tsc_timestamp, in ns since the epoch
+    uint32_t tsc_to_ns_mul;     // see slice_clock_scale()
+    int8_t tsc_shift;
+    uint8_t flags;
+    uint16_t reserved;
+    uint64_t tsc_hz;
+};
+
+struct slice_clock_info
+{
+    uint64_t address;           // physical address of the clock page
+    uint32_t size;
+    uint32_t version;
+};
+
+// Convert a TSC delta to ns, as kvmclock does: shift it, then multiply by a 32.32 fraction.
+static inline uint64_t slice_clock_scale(uint64_t delta, uint32_t mul, int8_t shift)
+{
+    if (shift < 0)
+        delta >>= -shift;
+    else
+        delta <<= shift;
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(delta) * mul) >> 32);
+}
+
+// Read CLOCK_REALTIME, in ns since the epoch, from a mapped clock page. Returns false if the host
+// has not yet published the page.
+static inline bool slice_clock_read(const volatile slice_clock* clock, uint64_t& ns)
+{
+    uint32_t seq;
+    uint64_t tsc_timestamp, realtime_ns, tsc;
+    uint32_t mul;
+    int8_t shift;
+
+    do {
+        seq = clock->seq;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        tsc_timestamp = clock->tsc_timestamp;
+        realtime_ns = clock->realtime_ns;
+        mul = clock->tsc_to_ns_mul;
+        shift = clock->tsc_shift;
+        _mm_lfence();   // don't read the TSC early
+        tsc = __rdtsc();
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != clock->seq);
+
+    if (seq == 0 || clock->version != SLICE_CLOCK_VERSION)
+        return false;
+
+    // A CPU's TSC may be a little behind the host CPU's that took the timestamp.
+    ns = realtime_ns + (tsc > tsc_timestamp ? slice_clock_scale(tsc - tsc_timestamp, mul, shift) : 0);
+    return true;
+}
+
+#endif
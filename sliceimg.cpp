@@ -0,0 +1,134 @@
+// sliceimg: build a golden slice root image once, then clone it onto per-slice namespaces.
+#include <fcntl.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#include "sliceimg.h"
+
+[[noreturn]] static void usage(const char* errmsg = nullptr)
+{
+    if (errmsg)
+        std::cerr << "Error: " << errmsg << std::endl;
+
+    std::cerr << "Usage: sliceimg golden IMAGE [-g GB] [-b BYTES]" << std::endl
+        << "       sliceimg clone IMAGE TARGET [-qd N] [-hostname NAME] [-seed DIR] [-assume-zeroed]" << std::endl
+        << "                                      [-force]" << std::endl
+        << std::endl
+        << "  golden          Create a sparse golden image file, and install it with mkimage.sh." << std::endl
+        << "  -g GB           Size of the golden image (default 16)." << std::endl
+        << "  -b BYTES        Sector size of the image's GPT: 512, or 4096 (the default, to match" << std::endl
+        << "                  namespaces made by mkns.sh). Clones need targets with this block size." << std::endl
+        << std::endl
+        << "  clone           Copy a golden image to a block device or file, then give the copy" << std::endl
+        << "                  a fresh filesystem UUID and (optionally) a cloud-init seed." << std::endl
+        << "  -qd N           Number of copy requests in flight (default 32)." << std::endl
+        << "  -hostname NAME  Write a NoCloud seed with this hostname and a new instance ID." << std::endl
+        << "  -seed DIR       Copy user-data/network-config from DIR into the NoCloud seed." << std::endl
+        << "  -assume-zeroed  Target is known to read as zeros (e.g. a new namespace), so holes" << std::endl
+        << "                  in the image are skipped entirely." << std::endl
+        << "  -force          Overwrite TARGET if it already exists (always needed for a device)." << std::endl;
+
+    exit(1);
+}
+
+static int make_golden(int argc, const char* argv[])
+{
+    if (argc < 1)
+        usage("Image path is required");
+
+    const char* image = argv[0];
+    uint64_t size_gb = 16;
+    uint32_t sector_size = 4096;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-g") == 0) {
+            if (++i >= argc)
+                usage();
+            size_gb = strtoul(argv[i], nullptr, 0);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            if (++i >= argc)
+                usage();
+            sector_size = strtoul(argv[i], nullptr, 0);
+            if (sector_size != 512 && sector_size != 4096)
+                usage("Sector size must be 512 or 4096");
+        } else {
+            usage("Unrecognised option");
+        }
+    }
+
+    {
+        AutoFd fd = open(image, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, size_gb << 30) != 0) {
+            perror("Failed to create golden image");
+            return 1;
+        }
+    }
+
+    // The loop device's block size becomes the sector size of the GPT that mkimage.sh writes.
+    LoopDevice loop;
+    if (!loop.attach(image, sector_size))
+        return 1;
+
+    printf("Installing golden image %s via %s (%u-byte sectors)\n", image, loop.path().c_str(), sector_size);
+
+    // mkimage.sh lives in the source directory, one level above the build directory
+    std::error_code err;
+    const std::filesystem::path exe = std::filesystem::read_symlink("/proc/self/exe", err);
+    const std::string mkimage = exe.parent_path().parent_path() / "mkimage.sh";
+    const std::string cmd = mkimage + " " + loop.path();
+    if (system(cmd.c_str()) != 0) {
+        fprintf(stderr, "Error: %s failed\n", cmd.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+static int clone(int argc, const char* argv[])
+{
+    if (argc < 2)
+        usage("Image and target paths are required");
+
+    const char* image = argv[0];
+    const char* target = argv[1];
+    CloneOptions options;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-qd") == 0) {
+            if (++i >= argc)
+                usage();
+            options.qd = std::max(1ul, strtoul(argv[i], nullptr, 0));
+        } else if (strcmp(argv[i], "-hostname") == 0) {
+            if (++i >= argc)
+                usage();
+            options.hostname = argv[i];
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            if (++i >= argc)
+                usage();
+            options.seed_dir = argv[i];
+        } else if (strcmp(argv[i], "-assume-zeroed") == 0) {
+            options.assume_zeroed = true;
+        } else if (strcmp(argv[i], "-force") == 0) {
+            options.force = true;
+        } else {
+            usage("Unrecognised option");
+        }
+    }
+
+    return clone_image(image, target, options) ? 0 : 1;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+        usage();
+
+    if (strcmp(argv[1], "golden") == 0)
+        return make_golden(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "clone") == 0)
+        return clone(argc - 2, argv + 2);
+    else
+        usage("Unrecognised command");
+}
@@ -0,0 +1,68 @@
+#ifndef SLICEIMG_H
+#define SLICEIMG_H 1
+
+#include <cstdint>
+#include <string>
+
+#include "runslice.h"
+
+// Golden image cloning for sliceimg (see sliceimg.cpp), kept apart from the tool itself so that it
+// can be tested on plain files.
+
+struct gpt_header
+{
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t partition_entry_lba;
+    uint32_t num_partition_entries;
+    uint32_t sizeof_partition_entry;
+    uint32_t partition_entry_array_crc32;
+} __attribute__((packed));
+
+struct gpt_entry
+{
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t starting_lba;
+    uint64_t ending_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+} __attribute__((packed));
+
+// Loop devices, used to install the golden image, and to mount clones that live in plain files.
+class LoopDevice
+{
+    AutoFd m_fd;
+    std::string m_path;
+
+public:
+    ~LoopDevice();
+
+    const std::string& path() const { return m_path; }
+
+    bool attach(const char* file, uint32_t sector_size);
+};
+
+struct CloneOptions
+{
+    unsigned qd = 32;                   // copy requests in flight
+    const char* hostname = nullptr;     // for a NoCloud seed
+    const char* seed_dir = nullptr;     // user-data etc. to copy into the seed
+    bool assume_zeroed = false;         // target reads as zeros, so holes need not be written
+    bool force = false;                 // overwrite an existing target
+};
+
+// The sector size of an image's GPT, from the position of its header (at LBA 1).
+bool get_gpt_sector_size(int fd, uint32_t& sector_size);
+
+bool clone_image(const char* image, const char* target, const CloneOptions& options);
+
+#endif
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "nvme.h"
+#include "runslice.h"
+
+static bool parse_mac(const char* str, uint64_t& mac)
+{
+    mac = 0;
+    for (int i = 0; i < 6; i++) {
+        char* end;
+        unsigned long byte = strtoul(str, &end, 16);
+        if (end == str || byte > 0xff || (i < 5 ? *end != ':' : *end != '\0'))
+            return false;
+        mac = mac << 8 | byte;
+        str = end + 1;
+    }
+
+    return true;
+}
+
+// Find the first child of a device's class directory (e.g. "net" or "nvme"), giving the name of
+// the interface or device node that the host driver created for it.
+static bool find_class_child(const std::string& sysfsdir, const char* cls, std::string& name)
+{
+    std::vector<std::string> names;
+    if (!list_host_dir(sysfsdir + "/" + cls, names) || names.empty())
+        return false;
+
+    name = names.front();
+    return true;
+}
+
+// Read the number of MSI-X vectors a device has, from the Table Size in its MSI-X capability.
+static bool read_msix_table_size(const std::string& addr, uint64_t& size)
+{
+    AutoFd fd = open(host_path("/sys/bus/pci/devices/" + addr + "/config").c_str(), O_RDONLY);
+    uint8_t config[256];
+    if (fd < 0 || pread(fd, config, sizeof(config), 0) != sizeof(config) || !(config[0x06] & 0x10))
+        return false;
+
+    // Walk the capability list, bounded in case it loops.
+    uint8_t ptr = config[0x34] & ~3;
+    for (int i = 0; i < 48 && ptr >= 0x40; i++, ptr = config[ptr + 1] & ~3) {
+        if (config[ptr] == 0x11) {
+            size = ((config[ptr + 2] | config[ptr + 3] << 8) & 0x7ff) + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Size a VF's RX/TX queues through its MSI-X vector count (one per queue pair, plus one for the
+// mailbox and other events), where the PF driver supports this. The VF must not be bound to a
+// driver.
+static bool set_vf_queues(const std::string& pf_sysfsdir, const std::string& vf_addr, unsigned queues)
+{
+    uint64_t total_msix;
+    if (!read_host_file(pf_sysfsdir + "/sriov_vf_total_msix", total_msix) || total_msix == 0) {
+        fprintf(stderr, "Warning: NIC does not support per-VF queue counts; using the driver default\n");
+        return true;
+    }
+
+    const std::string count_path = "/sys/bus/pci/devices/" + vf_addr + "/sriov_vf_msix_count";
+    const uint64_t count = std::min<uint64_t>(queues + 1, total_msix);
+    // sriov_vf_msix_count is write-only, so check the VF's MSI-X capability instead.
+    uint64_t actual = 0;
+    if (!unbind_pci_driver(vf_addr) || !write_host_file(count_path, std::to_string(count))
+        || !read_msix_table_size(vf_addr, actual) || actual != count)
+    {
+        fprintf(stderr, "Error: failed to set %lu MSI-X vectors for NIC VF %s\n", count, vf_addr.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "NIC VF %s: %lu queue pairs\n", vf_addr.c_str(), count - 1);
+    return true;
+}
+
+// Apply the rest of a slice's network profile to its VF, changing only what differs (so that
+// drivers lacking e.g. rate limits still work with the defaults), then read it back to check that
+// every setting took effect. Anything left by a previous slice on the VF is reset.
+static bool set_vf_profile(VfNetlink& netlink, int ifindex, unsigned vf, const uint8_t mac[6], const NicProfile& profile)
+{
+    NetlinkVfState state;
+    if (!netlink.get_vf(ifindex, vf, state))
+        return false;
+
+    if ((state.min_tx_rate != profile.min_tx_rate || state.max_tx_rate != profile.max_tx_rate)
+        && !netlink.set_vf_rate(ifindex, vf, profile.min_tx_rate, profile.max_tx_rate))
+        return false;
+
+    if ((state.vlan != profile.vlan || state.vlan_qos != profile.vlan_qos)
+        && !netlink.set_vf_vlan(ifindex, vf, profile.vlan, profile.vlan_qos))
+        return false;
+
+    // The slice must send only from its assigned MAC.
+    if (!state.spoofchk && !netlink.set_vf_spoofchk(ifindex, vf, true))
+        return false;
+
+    if (state.trust != profile.trust && !netlink.set_vf_trust(ifindex, vf, profile.trust))
+        return false;
+
+    if (!netlink.get_vf(ifindex, vf, state))
+        return false;
+
+    if (memcmp(state.mac, mac, sizeof(state.mac)) != 0 || state.min_tx_rate != profile.min_tx_rate
+        || state.max_tx_rate != profile.max_tx_rate || state.vlan != profile.vlan
+        || state.vlan_qos != profile.vlan_qos || !state.spoofchk || state.trust != profile.trust)
+    {
+        fprintf(stderr, "Error: NIC VF %u settings did not take effect (tx rate %u-%u, vlan %u/%u, "
+                        "spoofchk %d, trust %d)\n", vf, state.min_tx_rate, state.max_tx_rate, state.vlan,
+                        state.vlan_qos, state.spoofchk, state.trust);
+        return false;
+    }
+
+    return true;
+}
+
+// Create the VFs on an SR-IOV capable NIC (if not already done), and assign a MAC address to one
+// of them, derived from the base MAC and the (0-based) VF ID, along with the slice's network
+// profile. Returns the PCI address of the VF.
+bool setup_sriov_nic(VfNetlink& netlink, const char* pf_addr, unsigned vf, const char* mac_base,
+                     const NicProfile& profile, std::string& vf_addr)
+{
+    const std::string sysfsdir = std::string("/sys/bus/pci/devices/") + pf_addr;
+
+    uint64_t numvfs, totalvfs;
+    if (!read_host_file(sysfsdir + "/sriov_numvfs", numvfs)
+        || !read_host_file(sysfsdir + "/sriov_totalvfs", totalvfs)) {
+        fprintf(stderr, "Error: %s does not exist or does not support SR-IOV\n", pf_addr);
+        return false;
+    }
+
+    std::string ifname;
+    if (!find_class_child(sysfsdir, "net", ifname)) {
+        fprintf(stderr, "Error: %s is not a network interface\n", pf_addr);
+        return false;
+    }
+
+    uint64_t ifindex;
+    if (!read_host_file(sysfsdir + "/net/" + ifname + "/ifindex", ifindex)) {
+        fprintf(stderr, "Error: failed to find interface index of %s\n", ifname.c_str());
+        return false;
+    }
+
+    if (vf >= totalvfs) {
+        fprintf(stderr, "Error: %s has only %lu VFs\n", pf_addr, totalvfs);
+        return false;
+    }
+
+    if (numvfs == 0) {
+        // prevent probing of virtual function drivers, then create all the VFs
+        if (!write_host_file(sysfsdir + "/sriov_drivers_autoprobe", "0")
+            || !write_host_file(sysfsdir + "/sriov_numvfs", std::to_string(totalvfs)))
+            return false;
+    }
+
+    uint64_t mac_val;
+    if (mac_base == nullptr || !parse_mac(mac_base, mac_val)) {
+        fprintf(stderr, "Error: invalid base MAC address\n");
+        return false;
+    }
+
+    mac_val += vf;
+    uint8_t mac[6];
+    for (int i = 0; i < 6; i++)
+        mac[i] = mac_val >> (8 * (5 - i));
+
+    if (!netlink.set_vf_mac(ifindex, vf, mac) || !set_vf_profile(netlink, ifindex, vf, mac, profile))
+        return false;
+
+    if (!read_host_link(sysfsdir + "/virtfn" + std::to_string(vf), vf_addr)) {
+        fprintf(stderr, "Error: failed to find VF %u of %s\n", vf, pf_addr);
+        return false;
+    }
+
+    return profile.queues == 0 || set_vf_queues(sysfsdir, vf_addr, profile.queues);
+}
+
+// Ensure that a PCI device exists and is not bound to a host driver.
+bool unbind_pci_driver(const std::string& addr)
+{
+    const std::string sysfsdir = "/sys/bus/pci/devices/" + addr;
+
+    std::vector<std::string> names;
+    if (!list_host_dir(sysfsdir, names)) {
+        fprintf(stderr, "Error: device %s does not exist\n", addr.c_str());
+        return false;
+    }
+
+    std::string driver;
+    if (read_host_link(sysfsdir + "/driver", driver)) {
+        fprintf(stderr, "Unbinding PCI device %s from host driver %s\n", addr.c_str(), driver.c_str());
+        if (!write_host_file(sysfsdir + "/driver/unbind", addr))
+            return false;
+    }
+
+    return true;
+}
+
+// Setup SR-IOV VFs and detach all the devices to be assigned to a slice from host drivers. On
+// success, print the PCI addresses of the devices on stdout (all diagnostics go to stderr).
+bool prepare_devices(const Options& options)
+{
+    std::vector<std::string> devices(options.assign_devices.begin(), options.assign_devices.end());
+
+    if (options.nic_pf) {
+        VfNetlink netlink;
+        std::string vf_addr;
+        if (!setup_sriov_nic(netlink, options.nic_pf, options.sriov_vf, options.nic_mac_base, options.nic_profile, vf_addr))
+            return false;
+        devices.push_back(vf_addr);
+    }
+
+    if (options.nvme_pf) {
+        const std::string sysfsdir = std::string("/sys/bus/pci/devices/") + options.nvme_pf;
+        std::string nvme_dev;
+        if (!find_class_child(sysfsdir, "nvme", nvme_dev)) {
+            fprintf(stderr, "Error: %s is not an NVMe controller\n", options.nvme_pf);
+            return false;
+        }
+
+        std::unique_ptr<NvmeAdmin> nvme = open_nvme_admin(nvme_dev);
+        if (!nvme)
+            return false;
+
+        std::string vf_addr;
+        if (!setup_sriov_nvme(*nvme, options.nvme_pf, options.sriov_vf, options.nvme_slice_cpus, vf_addr))
+            return false;
+        devices.push_back(vf_addr);
+    }
+
+    for (const std::string& dev : devices) {
+        if (!unbind_pci_driver(dev))
+            return false;
+    }
+
+    for (size_t i = 0; i < devices.size(); i++)
+        std::cout << (i ? " " : "") << devices[i];
+    std::cout << std::endl;
+
+    return true;
+}
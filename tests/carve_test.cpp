@@ -0,0 +1,127 @@
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "runslice.h"
+
+// Exercise -carve against a fake sysfs tree (see -hostroot): a host with 1GiB of RAM at 4GiB in
+// 128MiB memory blocks, and hot-pluggable CPUs 1001-1003.
+
+static constexpr uint64_t GiB = 1ull << 30;
+static constexpr uint64_t BLOCK_SIZE = 128 << 20;
+
+static std::string root;
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void write_file(const std::string& path, const std::string& contents)
+{
+    const std::string full = root + path;
+    for (size_t slash = full.find('/', root.size() + 1); slash != std::string::npos; slash = full.find('/', slash + 1))
+        mkdir(full.substr(0, slash).c_str(), 0755);
+    std::ofstream(full) << contents << "\n";
+}
+
+static std::string read_file(const std::string& path)
+{
+    std::string value;
+    read_host_file(path, value);
+    return value;
+}
+
+static std::string block_file(uint64_t addr, const char* name)
+{
+    return "/sys/devices/system/memory/memory" + std::to_string(addr / BLOCK_SIZE) + "/" + name;
+}
+
+static void make_host()
+{
+    char dir[] = "/tmp/carve_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    root = dir;
+    set_host_root(dir);
+
+    write_file("/proc/iomem",
+               "00000000-00000fff : Reserved\n"
+               "00001000-0009ffff : System RAM\n"
+               "100000000-13fffffff : System RAM\n"
+               "  100000000-1007fffff : Kernel code\n"
+               "140000000-17fffffff : Reserved");
+    write_file("/sys/devices/system/memory/block_size_bytes", "8000000");
+    for (uint64_t addr = 4 * GiB; addr < 5 * GiB; addr += BLOCK_SIZE) {
+        write_file(block_file(addr, "online"), "1");
+        write_file(block_file(addr, "state"), "online");
+        write_file(block_file(addr, "valid_zones"), "Normal Movable");
+    }
+    for (uint32_t cpu = 1001; cpu <= 1003; cpu++)
+        write_file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/online", "1");
+}
+
+int main()
+{
+    make_host();
+
+    // Online RAM is refused; reserved memory, and memory the host doesn't have, are not RAM.
+    CHECK(!check_not_host_ram(4 * GiB, BLOCK_SIZE));
+    CHECK(!check_not_host_ram(5 * GiB - BLOCK_SIZE, 2 * BLOCK_SIZE));
+    CHECK(check_not_host_ram(5 * GiB, GiB));
+    CHECK(check_not_host_ram(6 * GiB, GiB));
+
+    // Carving offlines the blocks, after which they are no longer host RAM, although they are still
+    // System RAM in /proc/iomem.
+    CHECK(carve_host_resources({ 1001, 1002 }, { { 4 * GiB, 2 * BLOCK_SIZE } }));
+    CHECK(read_file(block_file(4 * GiB, "online")) == "0");
+    CHECK(read_file(block_file(4 * GiB + BLOCK_SIZE, "online")) == "0");
+    CHECK(read_file(block_file(4 * GiB + 2 * BLOCK_SIZE, "online")) == "1");
+    CHECK(read_file("/sys/devices/system/cpu/cpu1001/online") == "0");
+    CHECK(read_file("/sys/devices/system/cpu/cpu1002/online") == "0");
+    CHECK(read_file("/sys/devices/system/cpu/cpu1003/online") == "1");
+    CHECK(check_not_host_ram(4 * GiB, 2 * BLOCK_SIZE));
+    CHECK(!check_not_host_ram(4 * GiB, 3 * BLOCK_SIZE));
+
+    // Carving again is a no-op.
+    CHECK(carve_host_resources({ 1001 }, { { 4 * GiB, BLOCK_SIZE } }));
+
+    // Memory must be in whole blocks.
+    CHECK(!carve_host_resources({}, { { 4 * GiB + 2 * BLOCK_SIZE, BLOCK_SIZE / 2 } }));
+    CHECK(read_file(block_file(4 * GiB + 2 * BLOCK_SIZE, "online")) == "1");
+
+    // A CPU that can't be offlined rolls back the memory (as movable) and the other CPUs.
+    CHECK(!carve_host_resources({ 1003, 1004 }, { { 4 * GiB + 2 * BLOCK_SIZE, BLOCK_SIZE } }));
+    CHECK(read_file("/sys/devices/system/cpu/cpu1003/online") == "1");
+    CHECK(read_file(block_file(4 * GiB + 2 * BLOCK_SIZE, "state")) == "online_movable");
+
+    // The CPU we are running on is refused before anything is offlined.
+    const uint32_t self = sched_getcpu();
+    write_file("/sys/devices/system/cpu/cpu" + std::to_string(self) + "/online", "1");
+    CHECK(!carve_host_resources({ 1003, self }, {}));
+    CHECK(read_file("/sys/devices/system/cpu/cpu1003/online") == "1");
+
+    // Workers keep only the CPUs that are still online.
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(1001, &cpus);
+    CPU_SET(1003, &cpus);
+    remove_offline_cpus(cpus);
+    CHECK(!CPU_ISSET(1001, &cpus) && CPU_ISSET(1003, &cpus));
+
+    std::string cmd = "rm -rf " + root;
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "Warning: failed to remove %s\n", root.c_str());
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "slicebench.h"
+
+// Check slicebench's spec parser and its aggregation of results files.
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static std::string dir;
+
+static std::string write_file(const std::string& name, const std::string& contents)
+{
+    const std::string path = dir + "/" + name;
+    std::ofstream(path) << contents;
+    return path;
+}
+
+static bool parse(const std::string& contents, Spec& spec)
+{
+    spec = Spec();
+    return read_spec(write_file("spec", contents).c_str(), spec);
+}
+
+static bool near(double a, double b)
+{
+    return std::fabs(a - b) < 1e-9 * std::max(1.0, std::fabs(b));
+}
+
+static void test_spec()
+{
+    const std::string token_path = write_file("token", "  s3cret \nignored\n");
+    Spec spec;
+    CHECK(parse("# comment\n"
+                "cpus 4\n"
+                "mem 2\n"
+                "vf 1\n"
+                "repeat 3\n"
+                "warmup 0\n"
+                "token " + token_path + "\n"
+                "set guest 10.0.0.2\n"
+                "config native\n"
+                "    launch exec {self} agent -listen {guest}:7070 -c {cpus}\n"
+                "    agent {guest}:7070\n"
+                "config slice\n"
+                "    launch ./runslice.sh -c {cpus} -m {mem} -v {vf}\n"
+                "    agent {guest}:7070\n"
+                "    shutdown poweroff\n"
+                "\n"
+                "workload shell\n"
+                "    run echo ops: 12 {unknown}\n"
+                "    metric ops ops: ([0-9]+)\n"
+                "workload membw\n"
+                "    probe membw 64M {cpus}\n", spec));
+
+    CHECK(spec.cpus == 4 && spec.mem_gb == 2 && spec.vf == 1 && spec.repeat == 3 && spec.warmup == 0);
+    CHECK(spec.timeout == 600);
+    CHECK(spec.token == "s3cret");
+    CHECK(spec.lines.size() == 21);
+    CHECK(spec.configs.size() == 2 && spec.configs[1].name == "slice" && spec.configs[1].shutdown == "poweroff");
+    CHECK(spec.configs[0].shutdown.empty());
+    CHECK(spec.workloads.size() == 2 && spec.workloads[0].metrics.size() == 1);
+    CHECK(spec.workloads[1].probe == "membw 64M {cpus}" && spec.workloads[1].run.empty());
+
+    CHECK(expand(spec, spec.configs[1], spec.configs[1].launch) == "./runslice.sh -c 4 -m 2 -v 1");
+    CHECK(expand(spec, spec.configs[0], spec.configs[0].agent) == "10.0.0.2:7070");
+    CHECK(expand(spec, spec.configs[0], spec.workloads[0].run) == "echo ops: 12 {unknown}");
+    CHECK(expand(spec, spec.configs[0], "{config}") == "native");
+
+    std::smatch match;
+    const std::string output = "ops: 42\n";
+    CHECK(std::regex_search(output, match, spec.workloads[0].metrics[0].regex) && match[1] == "42");
+
+    // Errors.
+    const std::string config = "config a\n    launch true\n    agent localhost:1\n";
+    const std::string workload = "workload w\n    probe memlat 1M\n";
+    CHECK(parse(config + workload, spec));
+    CHECK(!parse("cpus four\n" + config + workload, spec));
+    CHECK(!parse("cpus\n" + config + workload, spec));
+    CHECK(!parse("launch true\n" + config + workload, spec));
+    CHECK(!parse("bogus 1\n" + config + workload, spec));
+    CHECK(!parse("token " + dir + "/missing\n" + config + workload, spec));
+    CHECK(!parse(config, spec));
+    CHECK(!parse(workload, spec));
+    CHECK(!parse("config a\n    launch true\n" + workload, spec));
+    CHECK(!parse(config + "workload w\n    run true\n", spec));
+    CHECK(!parse(config + "workload w\n    run true\n    metric x no_capture\n", spec));
+    CHECK(!parse(config + "workload w\n    run true\n    metric x ([0-9]\n", spec));
+    CHECK(!parse(config + "workload w\n    run true\n    probe memlat 1M\n", spec));
+    CHECK(!parse("repeat 0\n" + config + workload, spec));
+}
+
+static void test_results()
+{
+    const std::string first = write_file("first.results",
+        "slicebench 1\n"
+        "spec cpus 4\n"
+        "agent native host x cpus 4\n"
+        "result native fio iops 1 100\n"
+        "result native fio iops 2 110\n"
+        "result native fio iops 3 120\n"
+        "result native fio lat 1 5\n"
+        "error native tcp 1 exit status 1\n");
+    const std::string second = write_file("second.results",
+        "result slice fio iops 1 90\n"
+        "error slice fio 2 no match for iops\n"
+        "result slice fio iops 3 96\n"
+        "result vm fio iops 1 50\n"
+        "result garbled\n");
+
+    BenchResults results;
+    CHECK(read_results({ first, second }, results));
+    CHECK((results.configs == std::vector<std::string>{ "native", "slice", "vm" }));
+    CHECK(results.keys.size() == 2 && results.keys[0].second == "iops" && results.keys[1].second == "lat");
+    CHECK((results.values[{ "fio", "iops" }]["native"] == std::vector<double>{ 100, 110, 120 }));
+    CHECK((results.values[{ "fio", "iops" }]["slice"] == std::vector<double>{ 90, 96 }));
+    CHECK((results.errors[{ "slice", "fio" }] == 1 && results.errors[{ "native", "tcp" }] == 1));
+    CHECK(results.errors.size() == 2);
+
+    BenchResults missing;
+    CHECK(!read_results({ first, dir + "/missing.results" }, missing));
+    CHECK(missing.configs.size() == 1);
+
+    const Summary s = summarise({ 120, 100, 110 }, 2);
+    CHECK(s.n == 3 && s.errors == 2);
+    CHECK(near(s.mean, 110) && near(s.median, 110) && near(s.min, 100) && near(s.max, 120));
+    CHECK(near(s.sd, 10));
+    CHECK(near(s.ci95, 4.303 * 10 / std::sqrt(3)));
+
+    const Summary even = summarise({ 4, 1, 3, 2 }, 0);
+    CHECK(near(even.median, 2.5));
+
+    const Summary one = summarise({ 7 }, 0);
+    CHECK(one.n == 1 && near(one.mean, 7) && one.sd == 0 && std::isnan(one.ci95));
+
+    CHECK(summarise({}, 1).n == 0);
+    CHECK(near(t_critical(1), 12.706) && near(t_critical(30), 2.042) && near(t_critical(1000), 1.960));
+}
+
+int main()
+{
+    char tmp[] = "/tmp/slicebench_test.XXXXXX";
+    if (mkdtemp(tmp) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    dir = tmp;
+
+    test_spec();
+    test_results();
+
+    const std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "Warning: failed to remove %s\n", dir.c_str());
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "sliceimg.h"
+
+// Clone a small sparse image with a GPT and an ext4 superblock onto a plain file, with each
+// supported sector size.
+
+static constexpr uint64_t MiB = 1 << 20;
+
+static std::string dir;
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t crc(const void* data, size_t len, uint32_t poly)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t crc = ~0u;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+    }
+    return crc;
+}
+
+static uint32_t gpt_crc(const void* data, size_t len)
+{
+    return ~crc(data, len, 0xedb88320);
+}
+
+static uint32_t header_crc(gpt_header hdr)
+{
+    hdr.header_crc32 = 0;
+    return gpt_crc(&hdr, hdr.header_size);
+}
+
+static bool write_at(int fd, const void* data, size_t len, uint64_t offset)
+{
+    return pwrite(fd, data, len, offset) == static_cast<ssize_t>(len);
+}
+
+static std::vector<uint8_t> read_at(int fd, size_t len, uint64_t offset)
+{
+    std::vector<uint8_t> data(len);
+    if (pread(fd, data.data(), len, offset) != static_cast<ssize_t>(len))
+        data.clear();
+    return data;
+}
+
+// The image has a GPT with one partition at 1MiB, holding just an ext4 superblock. Then 64KiB of
+// zeros written at 1.5MiB, 1MiB of data at 2MiB, and one final sector of data at 4MiB, so that
+// the image doesn't end on an O_DIRECT block boundary when sectors are 512 bytes.
+static void make_image(const std::string& path, uint32_t ss, std::vector<uint8_t>& data)
+{
+    const uint64_t size = 4 * MiB + ss;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && ftruncate(fd, size) == 0);
+
+    std::vector<gpt_entry> entries(128);
+    memset(entries.data(), 0, entries.size() * sizeof(gpt_entry));
+    memset(entries[0].type_guid, 0x11, sizeof(entries[0].type_guid));
+    memset(entries[0].unique_guid, 0x22, sizeof(entries[0].unique_guid));
+    entries[0].starting_lba = MiB / ss;
+    entries[0].ending_lba = size / ss - 2;
+
+    gpt_header hdr = {};
+    memcpy(hdr.signature, "EFI PART", 8);
+    hdr.revision = 0x10000;
+    hdr.header_size = sizeof(hdr);
+    hdr.my_lba = 1;
+    hdr.alternate_lba = size / ss - 1;
+    hdr.first_usable_lba = 2 + entries.size() * sizeof(gpt_entry) / ss;
+    hdr.last_usable_lba = size / ss - 2;
+    memset(hdr.disk_guid, 0x33, sizeof(hdr.disk_guid));
+    hdr.partition_entry_lba = 2;
+    hdr.num_partition_entries = entries.size();
+    hdr.sizeof_partition_entry = sizeof(gpt_entry);
+    hdr.partition_entry_array_crc32 = gpt_crc(entries.data(), entries.size() * sizeof(gpt_entry));
+    hdr.header_crc32 = header_crc(hdr);
+    CHECK(write_at(fd, &hdr, sizeof(hdr), ss));
+    CHECK(write_at(fd, entries.data(), entries.size() * sizeof(gpt_entry), 2 * ss));
+
+    // metadata_csum and metadata_csum_seed
+    uint8_t sb[1024] = {};
+    const uint16_t magic = 0xef53;
+    const uint32_t incompat = 0x2000, ro_compat = 0x400;
+    memcpy(sb + 0x38, &magic, sizeof(magic));
+    memcpy(sb + 0x60, &incompat, sizeof(incompat));
+    memcpy(sb + 0x64, &ro_compat, sizeof(ro_compat));
+    memset(sb + 0x68, 0x44, 16);
+    const uint32_t checksum = crc(sb, 0x3fc, 0x82f63b78);
+    memcpy(sb + 0x3fc, &checksum, sizeof(checksum));
+    CHECK(write_at(fd, sb, sizeof(sb), MiB + 1024));
+
+    data.resize(MiB);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand();
+    CHECK(write_at(fd, data.data(), data.size(), 2 * MiB));
+
+    const std::vector<uint8_t> zeros(64 << 10, 0);
+    CHECK(write_at(fd, zeros.data(), zeros.size(), MiB + MiB / 2));
+
+    const std::vector<uint8_t> last(ss, 0xab);
+    CHECK(write_at(fd, last.data(), last.size(), 4 * MiB));
+
+    close(fd);
+}
+
+static void test_clone(uint32_t ss)
+{
+    const std::string image = dir + "/golden" + std::to_string(ss) + ".img";
+    const std::string target = dir + "/clone" + std::to_string(ss) + ".img";
+    std::vector<uint8_t> data;
+    make_image(image, ss, data);
+
+    int fd = open(image.c_str(), O_RDONLY);
+    uint32_t sector_size = 0;
+    CHECK(get_gpt_sector_size(fd, sector_size) && sector_size == ss);
+    const std::vector<uint8_t> old_sb = read_at(fd, 1024, MiB + 1024);
+    close(fd);
+
+    // The target is larger than the image, and exists, so needs -force.
+    const uint64_t target_size = 8 * MiB;
+    fd = open(target.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && ftruncate(fd, target_size) == 0);
+    close(fd);
+
+    CloneOptions options;
+    options.qd = 1;     // so that the last chunk reuses the buffer of the data before it
+    CHECK(!clone_image(image.c_str(), target.c_str(), options));
+    options.force = true;
+    CHECK(clone_image(image.c_str(), target.c_str(), options));
+
+    fd = open(target.c_str(), O_RDONLY);
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) == target_size);
+
+    // Data is copied; holes, and data that is all zeros, are left as holes.
+    CHECK(read_at(fd, MiB, 2 * MiB) == data);
+    CHECK(lseek(fd, MiB + (64 << 10), SEEK_DATA) == static_cast<off_t>(2 * MiB));
+    CHECK(lseek(fd, 3 * MiB, SEEK_DATA) == static_cast<off_t>(4 * MiB));
+
+    // The final partial block is padded with zeros, not whatever preceded it in the buffer.
+    CHECK(read_at(fd, ss, 4 * MiB) == std::vector<uint8_t>(ss, 0xab));
+    const std::vector<uint8_t> tail = read_at(fd, 4096, 4 * MiB + ss);
+    CHECK(tail == std::vector<uint8_t>(4096, 0));
+
+    // The primary GPT has a new disk GUID, and points to the backup at the end of the target.
+    const uint64_t last_lba = target_size / ss - 1;
+    const std::vector<uint8_t> primary = read_at(fd, sizeof(gpt_header), ss);
+    gpt_header hdr;
+    memcpy(&hdr, primary.data(), sizeof(hdr));
+    CHECK(memcmp(hdr.signature, "EFI PART", 8) == 0);
+    CHECK(memcmp(hdr.disk_guid, std::vector<uint8_t>(16, 0x33).data(), 16) != 0);
+    CHECK((hdr.disk_guid[6] & 0xf0) == 0x40);
+    CHECK(hdr.header_crc32 == header_crc(hdr));
+    CHECK(hdr.my_lba == 1 && hdr.alternate_lba == last_lba);
+
+    const size_t entries_size = hdr.num_partition_entries * sizeof(gpt_entry);
+    const uint64_t entries_sectors = (entries_size + ss - 1) / ss;
+    CHECK(hdr.last_usable_lba == last_lba - entries_sectors - 1);
+
+    gpt_header backup;
+    const std::vector<uint8_t> backup_sector = read_at(fd, sizeof(backup), last_lba * ss);
+    memcpy(&backup, backup_sector.data(), sizeof(backup));
+    CHECK(memcmp(backup.signature, "EFI PART", 8) == 0);
+    CHECK(backup.header_crc32 == header_crc(backup));
+    CHECK(backup.my_lba == last_lba && backup.alternate_lba == 1);
+    CHECK(backup.partition_entry_lba == last_lba - entries_sectors);
+    CHECK(memcmp(backup.disk_guid, hdr.disk_guid, sizeof(hdr.disk_guid)) == 0);
+
+    const std::vector<uint8_t> entries = read_at(fd, entries_size, 2 * ss);
+    CHECK(read_at(fd, entries_size, backup.partition_entry_lba * ss) == entries);
+    CHECK(gpt_crc(entries.data(), entries.size()) == hdr.partition_entry_array_crc32);
+
+    // The filesystem has a new UUID, and a valid superblock checksum.
+    const std::vector<uint8_t> sb = read_at(fd, 1024, MiB + 1024);
+    CHECK(sb.size() == 1024 && memcmp(sb.data() + 0x68, old_sb.data() + 0x68, 16) != 0);
+    CHECK(memcmp(sb.data(), old_sb.data(), 0x68) == 0);
+    uint32_t checksum;
+    memcpy(&checksum, sb.data() + 0x3fc, sizeof(checksum));
+    CHECK(checksum == crc(sb.data(), 0x3fc, 0x82f63b78));
+    close(fd);
+
+    // A new target is created at the size of the image.
+    const std::string fresh = dir + "/fresh" + std::to_string(ss) + ".img";
+    options.force = false;
+    CHECK(clone_image(image.c_str(), fresh.c_str(), options));
+    CHECK(stat(fresh.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) == 4 * MiB + ss);
+}
+
+int main()
+{
+    char tmp[] = "/tmp/sliceimg_test.XXXXXX";
+    if (mkdtemp(tmp) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    dir = tmp;
+
+    test_clone(512);
+    test_clone(4096);
+
+    const std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "Warning: failed to remove %s\n", dir.c_str());
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
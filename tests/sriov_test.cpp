@@ -0,0 +1,420 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "nvme.h"
+#include "runslice.h"
+
+// Exercise -prepare against a fake sysfs tree (see -hostroot), with mock NVMe admin commands and
+// rtnetlink requests: an NVMe PF at 01:00.0 with 4 VFs, and a NIC PF at 02:00.0 with 2 VFs.
+
+static const char* NVME_PF = "0000:01:00.0";
+static const char* NIC_PF = "0000:02:00.0";
+
+static std::string root;
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void make_dirs(const std::string& full)
+{
+    for (size_t slash = full.find('/', root.size() + 1); slash != std::string::npos; slash = full.find('/', slash + 1))
+        mkdir(full.substr(0, slash).c_str(), 0755);
+}
+
+static void write_file(const std::string& path, const std::string& contents)
+{
+    make_dirs(root + path);
+    std::ofstream(root + path) << contents;
+}
+
+static void write_link(const std::string& path, const std::string& target)
+{
+    make_dirs(root + path);
+    unlink((root + path).c_str());
+    if (symlink(target.c_str(), (root + path).c_str()) != 0)
+        perror("symlink");
+}
+
+static std::string read_file(const std::string& path)
+{
+    std::string value;
+    read_host_file(path, value);
+    return value;
+}
+
+static std::string device_file(const std::string& addr, const char* name)
+{
+    return "/sys/bus/pci/devices/" + addr + "/" + name;
+}
+
+// A VF's config space, with a PCIe capability and then an MSI-X capability of the given size.
+static void write_config(const std::string& addr, unsigned msix_vectors)
+{
+    std::string config(256, '\0');
+    config[0x06] = 0x10;
+    config[0x34] = 0x40;
+    config[0x40] = 0x10;
+    config[0x41] = 0x70;
+    config[0x70] = 0x11;
+    config[0x72] = (msix_vectors - 1) & 0xff;
+    config[0x73] = (msix_vectors - 1) >> 8;
+    write_file(device_file(addr, "config"), config);
+}
+
+static void make_host()
+{
+    char dir[] = "/tmp/sriov_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    root = dir;
+    set_host_root(dir);
+
+    write_file(device_file(NVME_PF, "sriov_numvfs"), "0\n");
+    write_file(device_file(NVME_PF, "sriov_totalvfs"), "4\n");
+    write_file(device_file(NVME_PF, "sriov_drivers_autoprobe"), "1\n");
+    for (int i = 0; i < 4; i++) {
+        const std::string addr = "0000:01:00." + std::to_string(i + 1);
+        write_file(device_file(addr, "vendor"), "0x144d\n");
+        write_link(device_file(NVME_PF, ("virtfn" + std::to_string(i)).c_str()), "../" + addr);
+    }
+
+    write_file(device_file(NIC_PF, "sriov_numvfs"), "0\n");
+    write_file(device_file(NIC_PF, "sriov_totalvfs"), "2\n");
+    write_file(device_file(NIC_PF, "sriov_drivers_autoprobe"), "1\n");
+    write_file(device_file(NIC_PF, "sriov_vf_total_msix"), "64\n");
+    write_file(device_file(NIC_PF, "net/eth0/ifindex"), "7\n");
+    for (int i = 0; i < 2; i++) {
+        const std::string addr = "0000:02:00." + std::to_string(i + 2);
+        write_file(device_file(addr, "sriov_vf_msix_count"), "0\n");
+        write_config(addr, 5);
+        write_link(device_file(NIC_PF, ("virtfn" + std::to_string(i)).c_str()), "../" + addr);
+        write_link(device_file(addr, "driver"), "../../drivers/iavf");
+    }
+    write_file("/sys/bus/pci/drivers/iavf/unbind", "");
+}
+
+//
+// NVMe
+//
+
+// A primary controller with 64 flexible VQ and VI resources for its secondaries, which come online
+// only once they have an admin and an I/O queue, and an interrupt.
+class MockNvme : public NvmeAdmin
+{
+public:
+    nvme_primary_ctrl_caps caps = {};
+    std::vector<nvme_secondary_ctrl_entry> secondaries;
+    std::vector<std::tuple<uint16_t, uint8_t, uint8_t, uint16_t>> virt_mgmt_cmds;   // (scid, action, type, count)
+
+    MockNvme()
+    {
+        caps.vqfrt = 66;
+        caps.vqrfap = 2;
+        caps.vqfrsm = 32;
+        caps.vqgran = 1;
+        caps.vifrt = 64;
+        caps.vifrsm = 32;
+        caps.vigran = 1;
+        for (uint16_t i = 0; i < 4; i++) {
+            nvme_secondary_ctrl_entry ctrl = {};
+            ctrl.scid = i + 1;
+            ctrl.vfn = i + 1;
+            secondaries.push_back(ctrl);
+        }
+    }
+
+    nvme_secondary_ctrl_entry& secondary(unsigned vf) { return secondaries[vf]; }
+
+    size_t assignments() const
+    {
+        size_t n = 0;
+        for (const auto& cmd : virt_mgmt_cmds)
+            n += std::get<1>(cmd) == NVME_VIRT_MGMT_ACT_SECONDARY_ASSIGN;
+        return n;
+    }
+
+    bool admin_command(nvme_admin_cmd& cmd) override
+    {
+        if (cmd.opcode == NVME_ADMIN_IDENTIFY && (cmd.cdw10 & 0xff) == NVME_ID_CNS_PRIMARY_CTRL_CAPS) {
+            memcpy(reinterpret_cast<void*>(cmd.addr), &caps, sizeof(caps));
+            return true;
+        } else if (cmd.opcode == NVME_ADMIN_IDENTIFY && (cmd.cdw10 & 0xff) == NVME_ID_CNS_SECONDARY_CTRL_LIST) {
+            nvme_secondary_ctrl_list* list = reinterpret_cast<nvme_secondary_ctrl_list*>(cmd.addr);
+            for (const nvme_secondary_ctrl_entry& ctrl : secondaries) {
+                if (ctrl.scid >= cmd.cdw10 >> 16 && list->num < std::size(list->entries))
+                    list->entries[list->num++] = ctrl;
+            }
+            return true;
+        } else if (cmd.opcode != NVME_ADMIN_VIRT_MGMT) {
+            return false;
+        }
+
+        const uint16_t scid = cmd.cdw10 >> 16;
+        const uint8_t type = cmd.cdw10 >> 8 & 0x7;
+        const uint8_t action = cmd.cdw10 & 0xf;
+        virt_mgmt_cmds.push_back({ scid, action, type, cmd.cdw11 });
+        if (scid == 0 || scid > secondaries.size())
+            return false;
+
+        nvme_secondary_ctrl_entry& ctrl = secondaries[scid - 1];
+        switch (action) {
+        case NVME_VIRT_MGMT_ACT_SECONDARY_ASSIGN:
+            if (ctrl.scs & 1)
+                return false;
+            (type == NVME_VIRT_MGMT_RT_VQ ? ctrl.nvq : ctrl.nvi) = cmd.cdw11;
+            return true;
+        case NVME_VIRT_MGMT_ACT_SECONDARY_ONLINE:
+            if (ctrl.nvq < 2 || ctrl.nvi < 1)
+                return false;
+            ctrl.scs |= 1;
+            return true;
+        case NVME_VIRT_MGMT_ACT_SECONDARY_OFFLINE:
+            ctrl.scs &= ~1;
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+static void test_nvme()
+{
+    MockNvme nvme;
+    std::string vf_addr;
+
+    // Creating the VFs splits the resources between the slices given, and no others.
+    CHECK(setup_sriov_nvme(nvme, NVME_PF, 0, { 4, 2 }, vf_addr));
+    CHECK(vf_addr == "0000:01:00.1");
+    CHECK(read_file(device_file(NVME_PF, "sriov_drivers_autoprobe")) == "0");
+    CHECK(read_file(device_file(NVME_PF, "sriov_numvfs")) == "4");
+    CHECK(nvme.secondary(0).nvq == 5 && nvme.secondary(0).nvi == 4);
+    CHECK(nvme.secondary(1).nvq == 3 && nvme.secondary(1).nvi == 2);
+    CHECK(nvme.secondary(2).nvq == 0 && nvme.secondary(3).nvq == 0);
+    CHECK(nvme.secondary(0).scs == 1 && nvme.secondary(1).scs == 0);
+    CHECK(nvme.virt_mgmt_cmds.back() == std::make_tuple(uint16_t(1), NVME_VIRT_MGMT_ACT_SECONDARY_ONLINE, uint8_t(0), uint16_t(0)));
+
+    // While a secondary is online, the split is kept, and the next one only brought online.
+    const size_t assigned = nvme.assignments();
+    CHECK(setup_sriov_nvme(nvme, NVME_PF, 1, { 2, 6 }, vf_addr));
+    CHECK(vf_addr == "0000:01:00.2");
+    CHECK(nvme.assignments() == assigned);
+    CHECK(nvme.secondary(1).scs == 1 && nvme.secondary(1).nvq == 3);
+
+    // Once none is online, the VFs are recreated with a new split.
+    nvme.secondary(0).scs = nvme.secondary(1).scs = 0;
+    CHECK(setup_sriov_nvme(nvme, NVME_PF, 1, { 2, 6 }, vf_addr));
+    CHECK(nvme.assignments() > assigned);
+    CHECK(nvme.secondary(0).nvq == 3 && nvme.secondary(1).nvq == 7);
+    CHECK(nvme.secondary(0).nvi == 2 && nvme.secondary(1).nvi == 6);
+    CHECK(nvme.secondary(1).scs == 1);
+    CHECK(read_file(device_file(NVME_PF, "sriov_numvfs")) == "4");
+
+    // Without CPU counts, an existing split is kept even with no secondary online, and a VF without
+    // resources can't come online.
+    nvme.secondary(1).scs = 0;
+    CHECK(!setup_sriov_nvme(nvme, NVME_PF, 3, {}, vf_addr));
+    CHECK(nvme.secondary(3).scs == 0);
+
+    CHECK(!setup_sriov_nvme(nvme, NVME_PF, 4, {}, vf_addr));
+    CHECK(!setup_sriov_nvme(nvme, "0000:09:00.0", 0, {}, vf_addr));
+}
+
+// The resource split on its own: pools of VQ (vqfrt less vqrfap) and VI resources, per-secondary
+// maximums and granularities, and the CPU counts of the slices.
+static void test_plan()
+{
+    struct Case
+    {
+        const char* name;
+        uint32_t vqfrt;
+        uint16_t vqrfap, vqfrsm, vqgran;
+        uint32_t vifrt;
+        uint16_t vifrsm, vigran;
+        std::vector<unsigned> cpus;
+        bool ok;
+        std::vector<uint16_t> nvq, nvi;
+    };
+    const Case cases[] = {
+        { "uneven CPU counts", 13, 2, 32, 1, 6, 32, 1, { 7, 3, 1 }, true, { 6, 3, 2 }, { 3, 2, 1 } },
+        { "enough for all", 64, 2, 32, 1, 64, 32, 1, { 7, 3, 1 }, true, { 8, 4, 2 }, { 7, 3, 1 } },
+        { "VQ pool below minimums", 7, 2, 32, 1, 64, 32, 1, { 1, 1, 1 }, false, {}, {} },
+        { "VI pool below minimums", 64, 2, 32, 1, 2, 32, 1, { 1, 1, 1 }, false, {}, {} },
+        { "primary keeps all VQs", 2, 4, 32, 1, 64, 32, 1, { 1 }, false, {}, {} },
+        { "per-secondary maximum", 64, 0, 4, 1, 64, 3, 1, { 8, 1 }, true, { 4, 2 }, { 3, 1 } },
+        { "maximum below minimum", 64, 0, 1, 1, 64, 32, 1, { 1 }, false, {}, {} },
+        { "granularity", 64, 0, 32, 4, 64, 6, 2, { 8, 1 }, true, { 12, 4 }, { 6, 2 } },
+        { "even split", 30, 0, 32, 1, 64, 32, 1, { 0, 0, 0, 0 }, true, { 8, 8, 7, 7 }, { 16, 16, 16, 16 } },
+    };
+
+    for (const Case& c : cases) {
+        nvme_primary_ctrl_caps caps = {};
+        caps.vqfrt = c.vqfrt;
+        caps.vqrfap = c.vqrfap;
+        caps.vqfrsm = c.vqfrsm;
+        caps.vqgran = c.vqgran;
+        caps.vifrt = c.vifrt;
+        caps.vifrsm = c.vifrsm;
+        caps.vigran = c.vigran;
+
+        std::vector<NvmeSlicePlan> plan;
+        for (unsigned i = 0; i < c.cpus.size(); i++)
+            plan.push_back({ static_cast<uint16_t>(i + 1), i, c.cpus[i], 0, 0 });
+
+        const bool ok = plan_nvme_resources(caps, plan);
+        std::vector<uint16_t> nvq, nvi;
+        for (const NvmeSlicePlan& slice : plan) {
+            nvq.push_back(slice.nvq);
+            nvi.push_back(slice.nvi);
+        }
+        if (ok != c.ok || (ok && (nvq != c.nvq || nvi != c.nvi))) {
+            fprintf(stderr, "plan case '%s' failed\n", c.name);
+            failures++;
+        }
+    }
+
+    // One I/O queue per CPU, limited by the queues (less the admin queue) and vectors assigned.
+    CHECK((NvmeSlicePlan{ 1, 0, 4, 5, 4 }.io_queues() == 4));
+    CHECK((NvmeSlicePlan{ 1, 0, 4, 3, 4 }.io_queues() == 2));
+    CHECK((NvmeSlicePlan{ 1, 0, 4, 5, 3 }.io_queues() == 3));
+    CHECK((NvmeSlicePlan{ 1, 0, 0, 9, 6 }.io_queues() == 6));
+}
+
+//
+// NIC
+//
+
+// A PF whose driver applies VF settings, except optionally trust.
+class MockNetlink : public VfNetlink
+{
+public:
+    std::map<uint32_t, NetlinkVfState> vfs;
+    int ifindex = 0;
+    bool ignore_trust = false;
+
+    bool set_vf_mac(int index, uint32_t vf, const uint8_t mac[6]) override
+    {
+        ifindex = index;
+        memcpy(vfs[vf].mac, mac, sizeof(vfs[vf].mac));
+        return true;
+    }
+
+    bool set_vf_rate(int, uint32_t vf, uint32_t min_tx_rate, uint32_t max_tx_rate) override
+    {
+        vfs[vf].min_tx_rate = min_tx_rate;
+        vfs[vf].max_tx_rate = max_tx_rate;
+        return true;
+    }
+
+    bool set_vf_vlan(int, uint32_t vf, uint32_t vlan, uint32_t qos) override
+    {
+        vfs[vf].vlan = vlan;
+        vfs[vf].vlan_qos = qos;
+        return true;
+    }
+
+    bool set_vf_spoofchk(int, uint32_t vf, bool on) override
+    {
+        vfs[vf].spoofchk = on;
+        return true;
+    }
+
+    bool set_vf_trust(int, uint32_t vf, bool on) override
+    {
+        vfs[vf].trust = on && !ignore_trust;
+        return true;
+    }
+
+    bool get_vf(int, uint32_t vf, NetlinkVfState& state) override
+    {
+        state = vfs[vf];
+        return true;
+    }
+};
+
+static void test_nic()
+{
+    MockNetlink netlink;
+    NicProfile profile;
+    profile.max_tx_rate = 1000;
+    profile.vlan = 5;
+    profile.trust = true;
+    profile.queues = 4;
+    std::string vf_addr;
+
+    CHECK(setup_sriov_nic(netlink, NIC_PF, 1, "02:00:00:00:10:00", profile, vf_addr));
+    CHECK(vf_addr == "0000:02:00.3");
+    CHECK(netlink.ifindex == 7);
+    CHECK(read_file(device_file(NIC_PF, "sriov_drivers_autoprobe")) == "0");
+    CHECK(read_file(device_file(NIC_PF, "sriov_numvfs")) == "2");
+
+    const uint8_t mac[6] = { 0x02, 0, 0, 0, 0x10, 0x01 };
+    const NetlinkVfState& state = netlink.vfs[1];
+    CHECK(memcmp(state.mac, mac, sizeof(mac)) == 0);
+    CHECK(state.max_tx_rate == 1000 && state.min_tx_rate == 0);
+    CHECK(state.vlan == 5 && state.spoofchk && state.trust);
+
+    // Queue pairs are sized through the MSI-X vectors, checked in config space, with the VF
+    // unbound from its driver first.
+    CHECK(read_file(device_file(vf_addr, "sriov_vf_msix_count")) == "5");
+    CHECK(read_file("/sys/bus/pci/drivers/iavf/unbind") == vf_addr);
+
+    profile.queues = 8;
+    CHECK(!setup_sriov_nic(netlink, NIC_PF, 1, "02:00:00:00:10:00", profile, vf_addr));
+    profile.queues = 0;
+
+    // Settings that don't take effect are an error.
+    netlink.ignore_trust = true;
+    CHECK(!setup_sriov_nic(netlink, NIC_PF, 0, "02:00:00:00:10:00", profile, vf_addr));
+    netlink.ignore_trust = false;
+    CHECK(setup_sriov_nic(netlink, NIC_PF, 0, "02:00:00:00:10:00", profile, vf_addr));
+    CHECK(vf_addr == "0000:02:00.2");
+
+    CHECK(!setup_sriov_nic(netlink, NIC_PF, 0, "02:00:00:00:10", profile, vf_addr));
+    CHECK(!setup_sriov_nic(netlink, NIC_PF, 2, "02:00:00:00:10:00", profile, vf_addr));
+    CHECK(!setup_sriov_nic(netlink, NVME_PF, 0, "02:00:00:00:10:00", profile, vf_addr));
+}
+
+static void test_unbind()
+{
+    write_file("/sys/bus/pci/drivers/iavf/unbind", "");
+    CHECK(unbind_pci_driver("0000:02:00.2"));
+    CHECK(read_file("/sys/bus/pci/drivers/iavf/unbind") == "0000:02:00.2");
+
+    // A device without a driver is left alone; a missing device is an error.
+    CHECK(unbind_pci_driver("0000:01:00.1"));
+    CHECK(!unbind_pci_driver("0000:09:00.0"));
+}
+
+int main()
+{
+    make_host();
+
+    test_plan();
+    test_nvme();
+    test_nic();
+    test_unbind();
+
+    std::string cmd = "rm -rf " + root;
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "Warning: failed to remove %s\n", root.c_str());
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
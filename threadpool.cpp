@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned threads, const cpu_set_t& cpus)
+{
+    for (unsigned i = 0; i < std::max(threads, 1u); i++)
+        m_queues.push_back(std::make_unique<Queue>());
+
+    for (unsigned i = 0; i < threads; i++)
+        m_workers.emplace_back(&ThreadPool::worker, this, i, cpus);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_idle_lock);
+        m_stopping = true;
+    }
+    m_idle.notify_all();
+
+    for (std::thread& t : m_workers)
+        t.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    Queue& queue = *m_queues[m_next_queue++ % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_idle_lock);
+        m_pending++;
+    }
+    m_idle.notify_one();
+}
+
+// Take the oldest task from our own queue, or else steal one from another. Tasks are taken in
+// roughly the order they were queued, so callers waiting on them in order rarely wait long.
+bool ThreadPool::take(size_t home, std::function<void()>& task)
+{
+    for (size_t i = 0; i < m_queues.size(); i++) {
+        Queue& queue = *m_queues[(home + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        m_pending--;
+        return true;
+    }
+
+    return false;
+}
+
+bool ThreadPool::run_one()
+{
+    std::function<void()> task;
+    if (!take(m_next_queue.load(), task))
+        return false;
+
+    task();
+    return true;
+}
+
+void ThreadPool::worker(size_t index, cpu_set_t cpus)
+{
+    // Threads inherit the pinning of the thread that created them; workers may run anywhere the
+    // host lets us.
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        perror("Warning: failed to set worker thread affinity");
+
+    for (;;) {
+        std::function<void()> task;
+        if (take(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_idle_lock);
+        m_idle.wait(lock, [this] { return m_stopping || m_pending > 0; });
+        if (m_stopping && m_pending == 0)
+            return;
+    }
+}
+
+bool ThreadPool::parallel_for(size_t count, const std::function<bool(size_t)>& fn)
+{
+    struct State
+    {
+        std::atomic<size_t> remaining;
+        std::atomic<bool> ok{true};
+        std::mutex lock;
+        std::condition_variable done;
+    };
+
+    auto state = std::make_shared<State>();
+    state->remaining = count;
+
+    for (size_t i = 0; i < count; i++) {
+        submit([state, &fn, i] {
+            if (!fn(i))
+                state->ok = false;
+
+            if (--state->remaining == 0) {
+                std::lock_guard<std::mutex> lock(state->lock);
+                state->done.notify_all();
+            }
+        });
+    }
+
+    // Help out until our tasks are all running, then wait for the stragglers.
+    while (state->remaining > 0) {
+        if (!run_one()) {
+            std::unique_lock<std::mutex> lock(state->lock);
+            state->done.wait(lock, [&state] { return state->remaining == 0; });
+        }
+    }
+
+    return state->ok;
+}
+
+static std::unique_ptr<ThreadPool> pool;
+
+void start_thread_pool(unsigned threads, const cpu_set_t& cpus)
+{
+    printf("Using %u worker threads\n", threads);
+    pool = std::make_unique<ThreadPool>(threads, cpus);
+}
+
+ThreadPool& thread_pool()
+{
+    // Until started (e.g. when preparing devices), the pool has no workers and runs tasks inline.
+    if (!pool) {
+        cpu_set_t none;
+        CPU_ZERO(&none);
+        pool = std::make_unique<ThreadPool>(0, none);
+    }
+
+    return *pool;
+}
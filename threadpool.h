@@ -0,0 +1,59 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H 1
+
+#include <sched.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool for the bulk of launch work (loading, hashing and scrubbing slice
+// RAM) on the host's cores. Tasks are spread across per-worker queues, and each worker steals
+// from the others' queues when its own runs dry. Threads waiting on the pool run queued tasks
+// themselves, so a pool with no workers degenerates to running everything inline.
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned threads, const cpu_set_t& cpus);
+    ~ThreadPool();
+
+    unsigned size() const { return m_workers.size(); }
+
+    void submit(std::function<void()> task);
+
+    // Run one queued task on the calling thread, if there is one.
+    bool run_one();
+
+    // Call fn(i) for each i in [0, count) across the pool, including the calling thread.
+    // Returns false if any call did.
+    bool parallel_for(size_t count, const std::function<bool(size_t)>& fn);
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<size_t> m_next_queue{0};
+    std::atomic<size_t> m_pending{0};
+    std::mutex m_idle_lock;
+    std::condition_variable m_idle;
+    bool m_stopping = false;
+
+    bool take(size_t home, std::function<void()>& task);
+    void worker(size_t index, cpu_set_t cpus);
+};
+
+// The pool shared by all of runslice, started once the host CPU is pinned.
+void start_thread_pool(unsigned threads, const cpu_set_t& cpus);
+ThreadPool& thread_pool();
+
+#endif